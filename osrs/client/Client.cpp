@@ -1,76 +1,58 @@
 #include "game.h"
 
+/// The client drains and applies network messages on a dedicated thread, so a burst of messages (like the
+/// roster on join, or a backlog after a stall) never lands on the render thread. The network thread owns the
+/// authoritative copy of the remote world and publishes snapshots through a triple buffer; the render thread
+/// swaps in the newest one once per frame and overlays its own locally simulated player on top.
+
 class OSRS : public tfg::net::client_interface<GameMsg>
 {
 public:
+	~OSRS()
+	{
+		StopNetworkThread();
+	}
+
+	// Keep our session in sPath, so after a restart of the client or the server we come back as the same player,
+	// with the progress the server saved for it. Must be called before OnUserCreate()
+	void RememberSession(const std::string& sPath)
+	{
+		m_sSessionPath = sPath;
+
+		std::ifstream file(sPath);
+		uint32_t nID = 0;
+		uint64_t nToken = 0;
+		if (file >> nID >> nToken && nID != 0 && nToken != 0)
+		{
+			m_worldState.nLocalID = nID;
+			m_nSessionToken = nToken;
+			std::cout << "Resuming session of player " << nID << " from " << sPath << "\n";
+		}
+	}
+
 	bool OnUserCreate()
 	{
 		if (!init()) { return false; }
 
+		// Connect while the assets are still decoding, the handshake runs on the network thread in the meantime
 		// Change hostname to match server address
-		if (Connect("127.0.0.1", 60000)) { return true; }
+		bool bConnected = Connect("127.0.0.1", 60000);
+
+		if (!finishLoading()) { return false; }
 
-		return false;
+		StartNetworkThread();
+		return bConnected;
 	}
 
 	bool OnUserUpdate(float deltaTime)
 	{
-		// Check for incoming network messages
-		if (IsConnected())
+		TFG_TRACE_SCOPE("OnUserUpdate");
+
+		// Pick up the latest world state from the network thread
 		{
-			while (!Incoming().empty())
-			{
-				auto msg = Incoming().pop_front().msg;
-				switch (msg.header.id)
-				{
-					case(GameMsg::Client_Accepted):
-					{
-						std::cout << "Server accepted client - Welcome!\n";
-						tfg::net::message<GameMsg> msg;
-						msg.header.id = GameMsg::Client_RegisterWithServer;
-						descPlayer.vPos = { 60.0f, 200.0f };
-						descPlayer.fMiningSpeed = 1.0f;
-						descPlayer.nOreCount = 0;
-						msg << descPlayer;
-						Send(msg);
-						break;
-					}
-					case(GameMsg::Client_AssignID):
-					{
-						// Server is assigning us OUR id
-						msg >> nPlayerID;
-						std::cout << "Assigned Client ID = " << nPlayerID << "\n";
-						break;
-					}
-					case(GameMsg::Game_AddPlayer):
-					{
-						sPlayerDescription desc;
-						msg >> desc;
-						mapObjects.insert_or_assign(desc.nUniqueID, desc);
-
-						if (desc.nUniqueID == nPlayerID)
-						{
-							// Now we exist in game world
-							bWaitingForConnection = false;
-						}
-						break;
-					}
-					case(GameMsg::Game_RemovePlayer):
-					{
-						uint32_t nRemovalID = 0;
-						msg >> nRemovalID;
-						mapObjects.erase(nRemovalID);
-						break;
-					}
-					case(GameMsg::Game_UpdatePlayer):
-					{
-						sPlayerDescription desc;
-						msg >> desc;
-						mapObjects.insert_or_assign(desc.nUniqueID, desc);
-						break;
-					}
-				}
-			}
+			ScopedFrameTimer networkTimer(frameStats, FrameMetric::Network);
+			TFG_TRACE_SCOPE("SyncWorld");
+			SyncWorld();
 		}
 
 		// Wait for connection text until connection is successful
@@ -80,25 +62,573 @@ public:
 			return true;
 		}
 
-		handleEvents();
-		shopLogic();
-		rockMining(deltaTime);
-		playerMovement();
-		updateClientObjects(deltaTime);
-		render();
+		{
+			ScopedFrameTimer updateTimer(frameStats, FrameMetric::Update);
+			{
+				TFG_TRACE_SCOPE("handleEvents");
+				handleEvents();
+			}
+			{
+				TFG_TRACE_SCOPE("shopLogic");
+				shopLogic();
+			}
+			{
+				TFG_TRACE_SCOPE("rockMining");
+				rockMining(deltaTime);
+			}
+			{
+				TFG_TRACE_SCOPE("playerMovement");
+				playerMovement();
+			}
+			{
+				TFG_TRACE_SCOPE("updateClientObjects");
+				updateClientObjects(deltaTime);
+			}
+		}
+		{
+			TFG_TRACE_SCOPE("render");
+			render();
+		}
 
 		// Send player description
 		tfg::net::message<GameMsg> msg;
 		msg.header.id = GameMsg::Game_UpdatePlayer;
 		msg << mapObjects[nPlayerID];
 		Send(msg);
-		return true;
+		return !quitRequested;
+	}
+
+	void StartNetworkThread()
+	{
+		m_bNetworkRunning = true;
+		m_threadNetwork = std::thread([this]() { TFG_TRACE_THREAD("network"); NetworkThread(); });
+	}
+
+	void StopNetworkThread()
+	{
+		m_bNetworkRunning = false;
+		if (m_threadNetwork.joinable())
+			m_threadNetwork.join();
+	}
+
+	// Swap in the newest snapshot, keeping our own locally simulated player
+	void SyncWorld()
+	{
+		if (!m_world.acquire())
+			return;
+
+		sWorldState& snapshot = m_world.front();
+		nPlayerID = snapshot.nLocalID;
+
+		bool bHasSelf = !bWaitingForConnection && mapObjects.count(nPlayerID);
+		sPlayerDescription self = bHasSelf ? mapObjects[nPlayerID] : sPlayerDescription();
+
+		// The snapshot buffer is ours until the next acquire, so swapping is enough and nothing is copied here
+		mapObjects.swap(snapshot.players);
+		if (bHasSelf)
+			mapObjects[nPlayerID] = self;
+
+		// Remote players keep moving between snapshots, see updateClientObjects(), so putting them back where the last
+		// update had them would rubber-band them. Ease them towards it instead, unless they're too far off to catch up
+		for (auto& player : mapObjects)
+		{
+			auto previous = snapshot.players.find(player.first);
+			if (player.first == nPlayerID || previous == snapshot.players.end())
+				continue;
+
+			sVector2 vOffset = player.second.vPos - previous->second.vPos;
+			if (vOffset.mag2() < SNAPSHOT_SNAP_DISTANCE * SNAPSHOT_SNAP_DISTANCE)
+				player.second.vPos = previous->second.vPos + vOffset * SNAPSHOT_BLEND;
+		}
+
+		if (snapshot.nRosterVersion != m_nSeenRosterVersion)
+		{
+			m_nSeenRosterVersion = snapshot.nRosterVersion;
+			leaderboard.swap(snapshot.leaderboard);
+			nRosterVersion++;
+		}
+
+		if (snapshot.nChunkVersion != m_nSeenChunkVersion)
+		{
+			m_nSeenChunkVersion = snapshot.nChunkVersion;
+			worldInfo = snapshot.info;
+			mapChunks.swap(snapshot.chunks);
+			nChunkVersion++;
+		}
+
+		if (bWaitingForConnection && nPlayerID != 0 && mapObjects.count(nPlayerID))
+		{
+			// Now we exist in game world
+			bWaitingForConnection = false;
+			double joinMs = (SDL_GetPerformanceCounter() - startupTicks) * 1000.0 / SDL_GetPerformanceFrequency();
+			std::cout << "Joined world " << joinMs << " ms after startup\n";
+		}
 	}
+
+	// Tell the server we're leaving for good, so it doesn't keep our player around waiting for us to come back
+	void LeaveServer()
+	{
+		tfg::net::message<GameMsg> msg;
+		msg.header.id = GameMsg::Client_UnregisterWithServer;
+		Send(msg);
+	}
+
+	// What compression saved us on the way in, what it cost, and what was turned away. Once the network thread has stopped
+	void PrintNetworkStats()
+	{
+		if (m_connection)
+			std::cout << "[NET] Decompressed " << m_connection->GetDecompressionStats().summary() << "\n";
+		std::cout << "[NET] Messages " << m_statsDispatch.summary() << "\n";
+	}
+
+private:
+	void NetworkThread()
+	{
+		while (m_bNetworkRunning)
+		{
+			// Wake up regularly even without traffic so we can shut down and publish pending changes
+			if (Incoming().wait_for(std::chrono::milliseconds(2)))
+			{
+				while (!Incoming().empty())
+				{
+					auto msg = Incoming().pop_front().msg;
+					TFG_TRACE_SCOPE_ID("ApplyMessage", uint32_t(msg.header.id));
+					ApplyMessage(msg);
+				}
+				m_tLastReceive = std::chrono::steady_clock::now();
+			}
+
+			ResumeIfDisconnected();
+
+			// Publish at most one snapshot per rendered frame: while the last one hasn't been picked up yet
+			// we keep applying messages and hand over everything at once later
+			if (m_bWorldChanged && !m_world.pending())
+			{
+				m_world.back() = m_worldState;
+				m_world.publish();
+				m_bWorldChanged = false;
+			}
+		}
+	}
+
+	// The server sends at least a heartbeat every couple of seconds, so a long silence means the connection is dead
+	// even if the socket hasn't noticed. Once we have a session, reconnect and resume it, backing off while that fails
+	void ResumeIfDisconnected()
+	{
+		auto tNow = std::chrono::steady_clock::now();
+		if (m_nSessionToken == 0 || tNow < m_tNextReconnect)
+			return;
+		if (IsConnected() && tNow - m_tLastReceive < SILENCE_TIMEOUT)
+			return;
+
+		std::cout << "Connection lost, reconnecting\n";
+		Reconnect();
+		m_tLastReceive = tNow;
+		m_tNextReconnect = tNow + m_reconnectBackoff;
+		m_reconnectBackoff = std::min<std::chrono::steady_clock::duration>(m_reconnectBackoff * 2, RECONNECT_BACKOFF_MAX);
+	}
+
+	void ApplyMessage(tfg::net::message<GameMsg>& msg)
+	{
+		// Checked against the payloads in common.h first, so no handler reads past the end of a body
+		m_statsDispatch.record(Dispatcher::dispatch(*this, msg));
+	}
+
+private:
+	// Message handlers, picked by Dispatcher
+	using Dispatcher = tfg::net::message_dispatcher<GameMsg, OSRS>;
+	friend Dispatcher;
+
+	void Handle(GameMsgID<GameMsg::Client_Accepted>, tfg::net::message<GameMsg>& msgAccepted)
+	{
+		std::cout << "Server accepted client - Welcome!\n";
+
+		// Ask for whatever the server offers that we support
+		uint32_t nServerCapabilities = 0;
+		if (msgAccepted.body.size() >= sizeof(uint32_t))
+			msgAccepted >> nServerCapabilities;
+
+		tfg::net::message<GameMsg> msg;
+		msg.header.id = GameMsg::Client_RegisterWithServer;
+		descPlayer.vPos = { 60.0f, 200.0f };
+		descPlayer.fMiningSpeed = 1.0f;
+		descPlayer.nOreCount = 0;
+		msg << uint32_t(nServerCapabilities & tfg::net::CAPABILITY_COMPRESSION);
+		msg << descPlayer;
+
+		// Coming back after losing the connection: the same message with our session on top, so the
+		// server can still register us from scratch if it doesn't know the session anymore
+		if (m_nSessionToken != 0)
+		{
+			msg.header.id = GameMsg::Client_ResumeSession;
+			msg << m_nSessionToken;
+			msg << m_worldState.nLocalID;
+		}
+		Send(msg);
+	}
+
+	void Handle(GameMsgID<GameMsg::Server_Heartbeat>)
+	{
+		// Let the server know we're still here, even while we have nothing else to send
+		tfg::net::message<GameMsg> msg;
+		msg.header.id = GameMsg::Server_Heartbeat;
+		Send(msg);
+	}
+
+	void Handle(GameMsgID<GameMsg::Game_RosterVersion>, const uint64_t& nVersion)
+	{
+		// Messages are applied in order, so we have everything the server sent before this. Telling it lets a resumed
+		// session be sent only what changed since
+		tfg::net::message<GameMsg> msg;
+		msg.header.id = GameMsg::Game_RosterVersion;
+		msg << nVersion;
+		Send(msg);
+	}
+
+	void Handle(GameMsgID<GameMsg::Client_Redirect>, const sNodeAddress& target)
+	{
+		// Our player moved to another node of the cluster, which is waiting for us to resume our session there
+		sNodeAddress address = target;
+		address.sHost[sizeof(address.sHost) - 1] = '\0';
+		std::cout << "Moving to " << address.sHost << ":" << address.nPort << "\n";
+		Reconnect(address.sHost, address.nPort);
+		m_tLastReceive = std::chrono::steady_clock::now();
+	}
+
+	void Handle(GameMsgID<GameMsg::Client_AssignID>, tfg::net::message<GameMsg>& msg)
+	{
+		// Server is assigning us OUR id, and the token to resume our session with
+		uint32_t nID = 0;
+		msg >> nID;
+		if (msg.body.size() >= sizeof(uint64_t))
+			msg >> m_nSessionToken;
+
+		// Our session couldn't be resumed, so whatever we knew about the room is stale
+		if (m_worldState.nLocalID != 0 && m_worldState.nLocalID != nID)
+			m_worldState.players.clear();
+
+		m_worldState.nLocalID = nID;
+		m_reconnectBackoff = RECONNECT_BACKOFF_MIN;
+		std::cout << "Assigned Client ID = " << m_worldState.nLocalID << "\n";
+		m_bWorldChanged = true;
+
+		if (!m_sSessionPath.empty())
+		{
+			std::ofstream file(m_sSessionPath, std::ios::trunc);
+			file << nID << " " << m_nSessionToken << "\n";
+			if (!file)
+				std::cerr << "Failed to write the session to " << m_sSessionPath << std::endl;
+		}
+	}
+
+	void Handle(GameMsgID<GameMsg::Game_AddPlayer>, const sPlayerDescription& desc)
+	{
+		m_worldState.Apply(desc);
+		m_bWorldChanged = true;
+	}
+
+	void Handle(GameMsgID<GameMsg::Game_UpdatePlayer>, const sPlayerDescription& desc)
+	{
+		// Updates travel in a lower priority lane than removals, so one can arrive after its player is gone.
+		// Only players we were told about are updated, or a removed player would come back
+		if (m_worldState.Update(desc))
+			m_bWorldChanged = true;
+	}
+
+	void Handle(GameMsgID<GameMsg::Game_RosterSnapshot>, tfg::net::message<GameMsg>& msg)
+	{
+		// Everyone in the room when we joined: the player count, then that many players
+		uint32_t nPlayers = 0;
+		msg >> nPlayers;
+		if (msg.body.size() != size_t(nPlayers) * sizeof(sPlayerDescription))
+			return;
+
+		for (uint32_t i = 0; i < nPlayers; i++)
+		{
+			sPlayerDescription desc;
+			msg >> desc;
+			m_worldState.Apply(desc);
+		}
+		m_bWorldChanged = true;
+	}
+
+	void Handle(GameMsgID<GameMsg::Game_RosterDelta>, tfg::net::message<GameMsg>& msg)
+	{
+		// What changed in the room while we were away: a reset flag, the changed players and the removed IDs.
+		// The counts are checked against what is left of the body before anything is applied
+		uint8_t bReset = 0;
+		uint32_t nChanged = 0, nRemoved = 0;
+		msg >> bReset >> nChanged;
+		if (msg.body.size() < size_t(nChanged) * sizeof(sPlayerDescription) + sizeof(uint32_t))
+			return;
+		size_t nRemovedAt = msg.body.size() - size_t(nChanged) * sizeof(sPlayerDescription) - sizeof(uint32_t);
+		std::memcpy(&nRemoved, msg.body.data() + nRemovedAt, sizeof(uint32_t));
+		if (nRemovedAt != size_t(nRemoved) * sizeof(uint32_t))
+			return;
+
+		if (bReset)
+			m_worldState.players.clear();
+
+		for (uint32_t i = 0; i < nChanged; i++)
+		{
+			sPlayerDescription desc;
+			msg >> desc;
+			m_worldState.Apply(desc);
+		}
+
+		msg >> nRemoved;
+		for (uint32_t i = 0; i < nRemoved; i++)
+		{
+			uint32_t nRemovalID = 0;
+			msg >> nRemovalID;
+			m_worldState.Remove(nRemovalID);
+		}
+		m_bWorldChanged = true;
+	}
+
+	void Handle(GameMsgID<GameMsg::Game_RemovePlayer>, const uint32_t& nRemovalID)
+	{
+		m_worldState.Remove(nRemovalID);
+		m_bWorldChanged = true;
+	}
+
+	void Handle(GameMsgID<GameMsg::Game_Leaderboard>, tfg::net::message<GameMsg>& msg)
+	{
+		uint32_t nEntries = 0;
+		msg >> nEntries;
+		if (msg.body.size() != size_t(nEntries) * sizeof(sLeaderboardEntry))
+			return;
+
+		m_worldState.leaderboard.resize(nEntries);
+		for (auto& entry : m_worldState.leaderboard)
+			msg >> entry;
+		m_worldState.nRosterVersion++;
+		m_bWorldChanged = true;
+	}
+
+	void Handle(GameMsgID<GameMsg::Game_WorldInfo>, const sWorldInfo& info)
+	{
+		// The server starts streaming the world over, the chunks around our player follow
+		m_worldState.info = info;
+		m_worldState.chunks.clear();
+		m_worldState.nChunkVersion++;
+		m_bWorldChanged = true;
+	}
+
+	void Handle(GameMsgID<GameMsg::Game_ChunkData>, tfg::net::message<GameMsg>& msg)
+	{
+		auto chunk = std::make_shared<sChunk>();
+		if (!ReadChunk(msg, *chunk))
+			return;
+
+		m_worldState.chunks[chunk->coord.Key()] = std::move(chunk);
+		m_worldState.nChunkVersion++;
+		m_bWorldChanged = true;
+	}
+
+	void Handle(GameMsgID<GameMsg::Game_ChunkEvict>, const sChunkCoord& coord)
+	{
+		if (m_worldState.chunks.erase(coord.Key()))
+		{
+			m_worldState.nChunkVersion++;
+			m_bWorldChanged = true;
+		}
+	}
+
+	std::thread m_threadNetwork;
+	std::atomic<bool> m_bNetworkRunning = false;
+
+	// Only touched by the network thread
+	sWorldState m_worldState;
+	bool m_bWorldChanged = false;
+	tfg::net::dispatch_stats m_statsDispatch;
+
+	tfg::net::triple_buffer<sWorldState> m_world;
+	uint64_t m_nSeenRosterVersion = 0;
+	uint64_t m_nSeenChunkVersion = 0;
+
+	// How much of the way to where the snapshot has a remote player it is moved per snapshot, see SyncWorld()
+	static constexpr float SNAPSHOT_BLEND = 0.25f;
+	static constexpr float SNAPSHOT_SNAP_DISTANCE = float(PLAYER_SIZE * 4);
+
+	// Session resume, only touched by the network thread
+	static constexpr std::chrono::seconds SILENCE_TIMEOUT{ 5 };
+	static constexpr std::chrono::milliseconds RECONNECT_BACKOFF_MIN{ 250 };
+	static constexpr std::chrono::seconds RECONNECT_BACKOFF_MAX{ 4 };
+	uint64_t m_nSessionToken = 0;
+	std::string m_sSessionPath;
+	std::chrono::steady_clock::time_point m_tLastReceive = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::time_point m_tNextReconnect;
+	std::chrono::steady_clock::duration m_reconnectBackoff = RECONNECT_BACKOFF_MIN;
 };
 
+/// Renders nPlayers synthetic players without a server connection and reports draw calls and frame time.
+/// Frames are not capped so the numbers reflect the cost of simulating and rendering the scene.
+/// The players are fed through the client's incoming queue and network thread exactly like server messages.
+/// With nFloodRate > 0 another thread keeps pushing player updates at that many messages per second, which
+/// should leave the render frame time flat since all of them are applied off the render thread.
+int runBenchmark(int nPlayers, int nFrames = 2000, int nFloodRate = 0)
+{
+	OSRS demo;
+	if (!init() || !finishLoading())
+	{
+		std::cerr << "Failed to initialize benchmark" << std::endl;
+		return 1;
+	}
+
+	// rand() isn't safe to call from the flood thread while the game thread uses it, so each gets its own generator
+	auto randomPlayer = [](std::mt19937& rng, uint32_t nUniqueID)
+	{
+		sPlayerDescription desc;
+		desc.nUniqueID = nUniqueID;
+		desc.nColor = { uint8_t(rng() % 256), uint8_t(rng() % 256), uint8_t(rng() % 256) };
+		desc.vPos = { float(BLOCK_SIZE + rng() % (WINDOW_WIDTH - 2 * BLOCK_SIZE - PLAYER_SIZE)), float(BLOCK_SIZE + rng() % (WINDOW_HEIGHT - 2 * BLOCK_SIZE - PLAYER_SIZE)) };
+		desc.vVel = { float(int(rng() % 401) - 200), float(int(rng() % 401) - 200) };
+		desc.nOreCount = rng() % 1000;
+		return desc;
+	};
+
+	auto pushMessage = [&demo](GameMsg id, const auto& payload)
+	{
+		tfg::net::message<GameMsg> msg;
+		msg.header.id = id;
+		msg << payload;
+		demo.Incoming().push_back({ nullptr, msg });
+	};
+
+	// Same sequence a real join produces: our ID, every player in the room, then the world around us, which is
+	// all of the classic one
+	pushMessage(GameMsg::Client_AssignID, uint32_t(10000));
+	std::mt19937 rngRoster(1);
+	RosterSnapshot roster;
+	for (int i = 0; i < nPlayers; i++)
+		roster.Set(randomPlayer(rngRoster, 10000 + i));
+	demo.Incoming().push_back({ nullptr, roster.Message() });
+
+	WorldMap world;
+	pushMessage(GameMsg::Game_WorldInfo, world.Info());
+	for (int32_t cy = 0; cy < world.Info().nChunksY; cy++)
+		for (int32_t cx = 0; cx < world.Info().nChunksX; cx++)
+			demo.Incoming().push_back({ nullptr, ChunkMessage(world.Generate({ cx, cy })) });
+	demo.StartNetworkThread();
+
+	std::atomic<bool> bFlooding = nFloodRate > 0;
+	std::atomic<uint64_t> nFloodSent = 0;
+	std::thread threadFlood([&]()
+	{
+		std::mt19937 rngFlood(2);
+		auto start = std::chrono::steady_clock::now();
+		while (bFlooding)
+		{
+			// Top up to the target rate, then yield for a millisecond
+			double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			while (nFloodSent < uint64_t(elapsed * nFloodRate))
+			{
+				pushMessage(GameMsg::Game_UpdatePlayer, randomPlayer(rngFlood, 10001 + rngFlood() % std::max(1, nPlayers - 1)));
+				nFloodSent++;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	});
+
+	std::cout << "Benchmarking " << nPlayers << " players for " << nFrames << " frames";
+	if (nFloodRate > 0)
+		std::cout << " while flooding " << nFloodRate << " messages/s";
+	std::cout << "...\n";
+
+	// Uncapped, so the frame histogram measures pure simulation and render cost
+	FramePacer pacer(frameStats, 0.0);
+	uint64_t totalDrawCalls = 0;
+	int nRenderedFrames = 0;
+	auto benchStart = std::chrono::steady_clock::now();
+
+	for (int frame = 1; frame <= nFrames && !quitRequested; frame++)
+	{
+		float deltaTime = pacer.BeginFrame();
+
+		// Keep the synthetic players wandering around
+		if (frame % 60 == 0)
+			for (auto& object : mapObjects)
+				if (object.first != nPlayerID)
+					object.second.vVel = { float(rand() % 401 - 200), float(rand() % 401 - 200) };
+
+		demo.OnUserUpdate(deltaTime);
+		if (bWaitingForConnection)
+			continue;
+
+		totalDrawCalls += frameDrawCalls;
+		nRenderedFrames++;
+
+		if (frame % 100 == 0)
+		{
+			std::string windowTitle = "O.S.R.S | Benchmark " + std::to_string(frame) + "/" + std::to_string(nFrames) +
+				" | Draw calls: " + std::to_string(frameDrawCalls) + " | Quads: " + std::to_string(frameQuads);
+			SDL_SetWindowTitle(window, windowTitle.c_str());
+		}
+	}
+
+	double benchSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - benchStart).count();
+	bFlooding = false;
+	threadFlood.join();
+	demo.StopNetworkThread();
+
+	std::cout << "Players: " << mapObjects.size()
+		<< " | Frame p50/p99/max: " << frameStats.Summary(FrameMetric::Frame) << " ms"
+		<< " | Sync p50/p99/max: " << frameStats.Summary(FrameMetric::Network) << " ms"
+		<< " | Render p50/p99/max: " << frameStats.Summary(FrameMetric::Render) << " ms"
+		<< " | Draw calls/frame: " << double(totalDrawCalls) / std::max(1, nRenderedFrames)
+		<< " | Quads/frame: " << frameQuads;
+	if (nFloodRate > 0)
+		std::cout << " | Flooded: " << nFloodSent / benchSeconds << " messages/s";
+	std::cout << "\n";
+
+	close();
+	return 0;
+}
+
 int main(int argc, char* args[])
 {
+	// Usage: client [--fps <rate>] [--vsync] [--stats-file <path>] [--trace-file <path>] [--session-file <path>] [--no-archive] | client --bench <players> [frames] [--flood <messages/s>]
+	double targetFPS = 144.0;
+	bool bVsync = false;
+	std::string statsPath = "frame_stats.csv";
+	std::string tracePath = "client_trace.json";
+	std::string sessionPath;
+
+	int benchPlayers = 0, benchFrames = 2000, floodRate = 0;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = args[i];
+		if (arg == "--bench" && i + 1 < argc)
+		{
+			benchPlayers = std::stoi(args[++i]);
+			if (i + 1 < argc && args[i + 1][0] != '-')
+				benchFrames = std::stoi(args[++i]);
+		}
+		else if (arg == "--flood" && i + 1 < argc)
+			floodRate = std::stoi(args[++i]);
+		else if (arg == "--fps" && i + 1 < argc)
+			targetFPS = std::stod(args[++i]);
+		else if (arg == "--vsync")
+			bVsync = true;
+		else if (arg == "--stats-file" && i + 1 < argc)
+			statsPath = args[++i];
+		else if (arg == "--trace-file" && i + 1 < argc)
+			tracePath = args[++i];
+		else if (arg == "--session-file" && i + 1 < argc)
+			sessionPath = args[++i];
+		else if (arg == "--no-archive")
+			useAssetArchive = false;
+	}
+
+	if (benchPlayers > 0)
+		return runBenchmark(benchPlayers, benchFrames, floodRate);
+
 	OSRS demo;
+	TFG_TRACE_THREAD("render");
+	if (!sessionPath.empty())
+		demo.RememberSession(sessionPath);
 
 	if (!demo.OnUserCreate())
 	{
@@ -106,39 +636,55 @@ int main(int argc, char* args[])
 		return 1;
 	}
 
-	bool quit = false;
-	Uint32 lastTime = SDL_GetTicks();
-	int frameCount = 0;
-
-	const int FPS = 144;
-	const int frameDelay = 1000 / FPS;
+	FramePacer pacer(frameStats, targetFPS);
+	if (bVsync && !pacer.EnableVsync(renderer))
+	{
+		std::cerr << "Failed to enable vsync, falling back to the frame pacer! SDL Error: " << SDL_GetError() << std::endl;
+	}
 
+	bool quit = false;
 	while (!quit)
 	{
-		Uint32 frameStart = SDL_GetTicks();
+		float deltaTime = pacer.BeginFrame();
 
-		Uint32 currentTime = SDL_GetTicks();
-		float deltaTime = (currentTime - lastTime) / 1000.0f;
-		lastTime = currentTime;
+		quit = !demo.OnUserUpdate(deltaTime);
 
-		demo.OnUserUpdate(deltaTime);
+		pacer.EndFrame();
 
-		Uint32 frameTime = SDL_GetTicks() - frameStart;
+		// Show frame statistics as p50/p99/max in milliseconds
+		if (pacer.FrameCount() % 100 == 0)
+		{
+			const RollingHistogram& frameTimes = frameStats.Get(FrameMetric::Frame);
+			float averageFPS = frameTimes.Mean() > 0.0 ? float(1000.0 / frameTimes.Mean()) : 0.0f;
+			std::string windowTitle = "O.S.R.S | FPS: " + std::to_string(static_cast<int>(averageFPS + 0.5f)) +
+				" | Frame " + frameStats.Summary(FrameMetric::Frame) +
+				" | Net " + frameStats.Summary(FrameMetric::Network) +
+				" | Update " + frameStats.Summary(FrameMetric::Update) +
+				" | Render " + frameStats.Summary(FrameMetric::Render);
+			SDL_SetWindowTitle(window, windowTitle.c_str());
+		}
 
-		if (frameDelay > frameTime)
+		// F12 dumps the current frame statistics
+		if (frameStatsDumpRequested)
 		{
-			SDL_Delay(frameDelay - frameTime);
+			frameStatsDumpRequested = false;
+			if (frameStats.Dump(statsPath))
+				std::cout << "Frame statistics written to " << statsPath << "\n";
+			else
+				std::cerr << "Failed to write frame statistics to " << statsPath << std::endl;
 		}
 
-		// Calculate FPS
-		frameCount++;
-		if (frameCount % 100 == 0)
+		// F11 dumps the trace zones of every thread, for builds with TFG_ENABLE_TRACING
+		if (traceDumpRequested)
 		{
-			float averageFPS = 1000.0f / (SDL_GetTicks() - lastTime);
-			std::string windowTitle = "O.S.R.S | FPS: " + std::to_string(static_cast<int>(averageFPS));
-			SDL_SetWindowTitle(window, windowTitle.c_str());
+			traceDumpRequested = false;
+			if (tfg::net::trace_export(tracePath))
+				std::cout << "Trace written to " << tracePath << "\n";
 		}
 	}
+	demo.LeaveServer();
+	demo.StopNetworkThread();
+	demo.PrintNetworkStats();
 	close();
 	return 0;
-}
\ No newline at end of file
+}
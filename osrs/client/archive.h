@@ -0,0 +1,252 @@
+#pragma once
+#include <SDL.h>
+#include <SDL_mixer.h>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/// <summary>
+/// The asset archive holds every file in the media folder, packed by the packer (osrs/packer/Packer.cpp) so the
+/// client opens one file instead of one per asset and decodes nothing at startup:
+///  - Images are decoded ahead of time and stored as ARCHIVE_PIXEL_FORMAT pixels, which renderers take as they are.
+///  - Sounds are converted ahead of time to the format the client opens the mixer with, AUDIO_FREQUENCY,
+///    MIX_DEFAULT_FORMAT and AUDIO_CHANNELS, and are played straight from the archive.
+///  - Anything else, like the font, is stored as it is.
+/// The client maps the archive into memory, so only the pages of the assets it touches are ever read, and surfaces and
+/// sounds point into the mapping instead of being copied out of it.
+/// Layout: an sArchiveHeader, nEntries sArchiveEntry, then the data of every entry at its offset, each aligned to
+/// ARCHIVE_ALIGNMENT. Everything is in the byte order of the machine that packed it, the magic tells if it isn't ours.
+/// </summary>
+
+constexpr uint32_t ARCHIVE_MAGIC = 0x4152534F; // "OSRA"
+constexpr uint32_t ARCHIVE_VERSION = 1;
+constexpr uint64_t ARCHIVE_ALIGNMENT = 64;
+constexpr size_t ARCHIVE_NAME_SIZE = 64;
+const Uint32 ARCHIVE_PIXEL_FORMAT = SDL_PIXELFORMAT_ARGB8888;
+
+// Looked for in the media folder
+const char* const ARCHIVE_FILE_NAME = "assets.osra";
+
+// What the client opens the audio device with
+constexpr int AUDIO_FREQUENCY = 44100;
+constexpr int AUDIO_CHANNELS = 2;
+
+enum class ArchiveEntryType : uint32_t
+{
+    Image,
+    Sound,
+    Raw
+};
+
+struct sArchiveHeader
+{
+    uint32_t nMagic = ARCHIVE_MAGIC;
+    uint32_t nVersion = ARCHIVE_VERSION;
+    uint32_t nEntries = 0;
+    uint32_t nPixelFormat = ARCHIVE_PIXEL_FORMAT;
+
+    // Format of every sound in the archive
+    uint32_t nAudioFrequency = AUDIO_FREQUENCY;
+    uint16_t nAudioFormat = MIX_DEFAULT_FORMAT;
+    uint16_t nAudioChannels = AUDIO_CHANNELS;
+};
+
+struct sArchiveEntry
+{
+    // Path relative to the media folder with forward slashes, like "sound/stone1.wav". Null terminated
+    char sName[ARCHIVE_NAME_SIZE] = {};
+    ArchiveEntryType nType = ArchiveEntryType::Raw;
+
+    // Images only, in pixels and bytes
+    uint32_t nWidth = 0;
+    uint32_t nHeight = 0;
+    uint32_t nPitch = 0;
+
+    // From the start of the archive
+    uint64_t nOffset = 0;
+    uint64_t nSize = 0;
+};
+
+/// A read only view of a whole file, mapped rather than read. Pages are loaded as they are first touched
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile()
+    {
+        Close();
+    }
+
+    bool Open(const std::string& path)
+    {
+        Close();
+#ifdef _WIN32
+        m_hFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (m_hFile == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(m_hFile, &size) || size.QuadPart == 0)
+        {
+            Close();
+            return false;
+        }
+
+        m_hMapping = CreateFileMappingA(m_hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        m_pData = m_hMapping ? static_cast<const uint8_t*>(MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+        m_nSize = size_t(size.QuadPart);
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0)
+        {
+            close(fd);
+            return false;
+        }
+
+        // The mapping stays valid after the descriptor is closed
+        void* pData = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        m_pData = pData != MAP_FAILED ? static_cast<const uint8_t*>(pData) : nullptr;
+        m_nSize = size_t(info.st_size);
+#endif
+        if (m_pData == nullptr)
+        {
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    void Close()
+    {
+#ifdef _WIN32
+        if (m_pData) UnmapViewOfFile(m_pData);
+        if (m_hMapping) CloseHandle(m_hMapping);
+        if (m_hFile != INVALID_HANDLE_VALUE) CloseHandle(m_hFile);
+        m_hMapping = nullptr;
+        m_hFile = INVALID_HANDLE_VALUE;
+#else
+        if (m_pData) munmap(const_cast<uint8_t*>(m_pData), m_nSize);
+#endif
+        m_pData = nullptr;
+        m_nSize = 0;
+    }
+
+    const uint8_t* Data() const
+    {
+        return m_pData;
+    }
+
+    size_t Size() const
+    {
+        return m_nSize;
+    }
+
+private:
+    const uint8_t* m_pData = nullptr;
+    size_t m_nSize = 0;
+#ifdef _WIN32
+    HANDLE m_hFile = INVALID_HANDLE_VALUE;
+    HANDLE m_hMapping = nullptr;
+#endif
+};
+
+/// A mapped archive. Entries are checked to lie within the file when it is opened, so their data can be used as is
+class AssetArchive
+{
+public:
+    // Returns false if the file doesn't exist or isn't an archive this client understands
+    bool Open(const std::string& path)
+    {
+        if (!m_file.Open(path))
+            return false;
+
+        if (m_file.Size() < sizeof(sArchiveHeader))
+            return Fail();
+        std::memcpy(&m_header, m_file.Data(), sizeof(sArchiveHeader));
+        if (m_header.nMagic != ARCHIVE_MAGIC || m_header.nVersion != ARCHIVE_VERSION || m_header.nPixelFormat != ARCHIVE_PIXEL_FORMAT)
+            return Fail();
+        if (m_header.nEntries > (m_file.Size() - sizeof(sArchiveHeader)) / sizeof(sArchiveEntry))
+            return Fail();
+
+        m_pEntries = reinterpret_cast<const sArchiveEntry*>(m_file.Data() + sizeof(sArchiveHeader));
+        for (uint32_t i = 0; i < m_header.nEntries; i++)
+        {
+            const sArchiveEntry& entry = m_pEntries[i];
+            if (entry.sName[ARCHIVE_NAME_SIZE - 1] != '\0' || entry.nOffset > m_file.Size() || entry.nSize > m_file.Size() - entry.nOffset)
+                return Fail();
+            // SDL takes the size of an image as ints and reads nWidth pixels from each row, so rows must hold them
+            if (entry.nType == ArchiveEntryType::Image && (uint64_t(entry.nPitch) * entry.nHeight > entry.nSize ||
+                uint64_t(entry.nPitch) < uint64_t(entry.nWidth) * SDL_BYTESPERPIXEL(ARCHIVE_PIXEL_FORMAT) || entry.nPitch > uint32_t(INT32_MAX) ||
+                entry.nHeight > uint32_t(INT32_MAX)))
+                return Fail();
+        }
+        return true;
+    }
+
+    bool IsOpen() const
+    {
+        return m_pEntries != nullptr;
+    }
+
+    // Linear, there are only a handful of entries and each is looked up once
+    const sArchiveEntry* Find(const std::string& name) const
+    {
+        for (uint32_t i = 0; IsOpen() && i < m_header.nEntries; i++)
+            if (name == m_pEntries[i].sName)
+                return &m_pEntries[i];
+        return nullptr;
+    }
+
+    const uint8_t* Data(const sArchiveEntry& entry) const
+    {
+        return m_file.Data() + entry.nOffset;
+    }
+
+    const sArchiveHeader& Header() const
+    {
+        return m_header;
+    }
+
+    size_t Size() const
+    {
+        return m_file.Size();
+    }
+
+    void Close()
+    {
+        m_file.Close();
+        m_pEntries = nullptr;
+    }
+
+private:
+    bool Fail()
+    {
+        Close();
+        return false;
+    }
+
+    MappedFile m_file;
+    sArchiveHeader m_header;
+    const sArchiveEntry* m_pEntries = nullptr;
+};
@@ -0,0 +1,375 @@
+#pragma once
+#include <SDL.h>
+#include <SDL_image.h>
+#include <SDL_mixer.h>
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "archive.h"
+
+#ifdef __linux__
+#include <sys/resource.h>
+#endif
+
+/// <summary>
+/// The asset manager decodes images and sounds in parallel on worker threads and keeps them resident for the
+/// lifetime of the client. Assets are requested up front and referred to through handles, so gameplay code never
+/// touches the disk after startup.
+/// Assets are named by their path within the media folder. If the folder has an asset archive (see archive.h), they
+/// come from the mapped archive instead, already decoded, and only assets missing from it are loaded from their files.
+/// Decoding (IMG_Load, Mix_LoadWAV) is safe to run off the main thread, but textures have to be created on the
+/// thread that owns the renderer, so images are uploaded once all workers have finished in Finish().
+/// </summary>
+
+// Bytes the process has had read from disk so far, including pages of mapped files. Only Linux tells, elsewhere it is 0
+inline uint64_t processDiskReads()
+{
+#ifdef __linux__
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        return uint64_t(usage.ru_inblock) * 512;
+#endif
+    return 0;
+}
+
+using AssetHandle = uint32_t;
+const AssetHandle INVALID_ASSET = static_cast<AssetHandle>(-1);
+
+class AssetManager
+{
+public:
+    AssetManager() = default;
+    AssetManager(const AssetManager&) = delete;
+
+    ~AssetManager()
+    {
+        Clear();
+    }
+
+public:
+    // Where assets are loaded from, and whether to use the archive there if it has one. Must be called before any request
+    void UseDirectory(const std::string& directory, bool bArchive)
+    {
+        m_nOpenTicks = SDL_GetPerformanceCounter();
+        m_sDirectory = directory;
+        m_archive.Close();
+        if (bArchive && m_archive.Open(directory + ARCHIVE_FILE_NAME))
+            std::cout << "[ASSETS] Mapped " << m_archive.Header().nEntries << " assets from " << directory + ARCHIVE_FILE_NAME << "\n";
+        else if (bArchive)
+            std::cout << "[ASSETS] No usable archive at " << directory + ARCHIVE_FILE_NAME << ", loading files\n";
+    }
+
+    // Queue an image to be decoded. If bKeepSurface is set the decoded surface is kept after upload (e.g. window icons)
+    AssetHandle RequestImage(const std::string& path, bool bKeepSurface = false)
+    {
+        return Request(path, AssetType::Image, bKeepSurface);
+    }
+
+    // Queue a sound to be decoded and converted to the mixer's output format
+    AssetHandle RequestSound(const std::string& path)
+    {
+        return Request(path, AssetType::Sound, false);
+    }
+
+    // Start decoding every queued asset. The audio device must already be open, since sounds are converted to its format
+    void Start()
+    {
+        int nFrequency = 0, nChannels = 0;
+        Uint16 nFormat = 0;
+        Mix_QuerySpec(&nFrequency, &nFormat, &nChannels);
+        m_deviceAudio = { nFrequency, nFormat, nChannels };
+
+        size_t nThreads = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), m_vAssets.size()));
+        m_nNextAsset = 0;
+        m_nStartTicks = SDL_GetPerformanceCounter();
+
+        for (size_t i = 0; i < nThreads; i++)
+            m_vWorkers.emplace_back([this]() { DecodeWorker(); });
+    }
+
+    // Wait for the workers and upload decoded images. Must be called on the render thread
+    bool Finish(SDL_Renderer* renderer)
+    {
+        for (auto& worker : m_vWorkers)
+            if (worker.joinable())
+                worker.join();
+        m_vWorkers.clear();
+
+        double fDecodeMs = (SDL_GetPerformanceCounter() - m_nStartTicks) * 1000.0 / SDL_GetPerformanceFrequency();
+
+        bool bSuccess = true;
+        for (auto& asset : m_vAssets)
+        {
+            if (!asset.bLoaded)
+            {
+                std::cerr << "Failed to load asset " << asset.sPath << "! Error: " << asset.sError << std::endl;
+                bSuccess = false;
+                continue;
+            }
+
+            if (asset.nType == AssetType::Image && asset.pTexture == nullptr)
+            {
+                asset.pTexture = SDL_CreateTextureFromSurface(renderer, asset.pSurface);
+                if (asset.pTexture == nullptr)
+                {
+                    std::cerr << "Unable to create texture from " << asset.sPath << "! SDL Error: " << SDL_GetError() << std::endl;
+                    bSuccess = false;
+                }
+
+                if (!asset.bKeepSurface)
+                {
+                    SDL_FreeSurface(asset.pSurface);
+                    asset.pSurface = nullptr;
+                }
+            }
+        }
+
+        size_t nArchived = std::count_if(m_vAssets.begin(), m_vAssets.end(), [](const sAsset& asset) { return asset.bArchived; });
+        std::cout << "[ASSETS] Loaded " << m_vAssets.size() << " assets on " << m_nThreadsUsed << " threads in " << fDecodeMs << " ms, "
+            << nArchived << " from the archive and " << m_vAssets.size() - nArchived << " from " << m_nFileBytes / 1024 << " KB of files\n";
+        m_fLoadMs = (SDL_GetPerformanceCounter() - m_nOpenTicks) * 1000.0 / SDL_GetPerformanceFrequency();
+        return bSuccess;
+    }
+
+    // The render device was reset, which took every texture with it. Images whose surface wasn't kept are decoded
+    // again, which from the archive only means pointing at it again. Must be called on the render thread
+    bool RecreateTextures(SDL_Renderer* renderer)
+    {
+        bool bSuccess = true;
+        for (auto& asset : m_vAssets)
+        {
+            if (asset.nType != AssetType::Image || !asset.bLoaded)
+                continue;
+
+            if (asset.pTexture)
+            {
+                SDL_DestroyTexture(asset.pTexture);
+                asset.pTexture = nullptr;
+            }
+
+            SDL_Surface* pSurface = asset.pSurface;
+            if (pSurface == nullptr)
+            {
+                const sArchiveEntry* entry = m_archive.Find(asset.sPath);
+                if (entry == nullptr)
+                    pSurface = IMG_Load((m_sDirectory + asset.sPath).c_str());
+                else if (entry->nType == ArchiveEntryType::Image)
+                    pSurface = SDL_CreateRGBSurfaceWithFormatFrom(const_cast<Uint8*>(m_archive.Data(*entry)), int(entry->nWidth), int(entry->nHeight), 32,
+                        int(entry->nPitch), ARCHIVE_PIXEL_FORMAT);
+            }
+
+            if (pSurface != nullptr)
+                asset.pTexture = SDL_CreateTextureFromSurface(renderer, pSurface);
+            if (asset.pTexture == nullptr)
+            {
+                std::cerr << "Unable to recreate texture from " << asset.sPath << "! SDL Error: " << SDL_GetError() << std::endl;
+                bSuccess = false;
+            }
+
+            if (pSurface != asset.pSurface)
+                SDL_FreeSurface(pSurface);
+        }
+        return bSuccess;
+    }
+
+    // Any other file, like the font, from the archive if it is there. The caller closes it, and must be done with it
+    // before Clear()
+    SDL_RWops* OpenFile(const std::string& name)
+    {
+        if (const sArchiveEntry* entry = m_archive.Find(name))
+            return SDL_RWFromConstMem(m_archive.Data(*entry), int(entry->nSize));
+
+        CountFileBytes(name);
+        return SDL_RWFromFile((m_sDirectory + name).c_str(), "rb");
+    }
+
+    bool UsesArchive() const
+    {
+        return m_archive.IsOpen();
+    }
+
+    // From UseDirectory() until Finish() had every image uploaded, so it covers mapping the archive or reading the files
+    double LoadMs() const
+    {
+        return m_fLoadMs;
+    }
+
+    SDL_Texture* Texture(AssetHandle handle) const
+    {
+        return handle < m_vAssets.size() ? m_vAssets[handle].pTexture : nullptr;
+    }
+
+    SDL_Surface* Surface(AssetHandle handle) const
+    {
+        return handle < m_vAssets.size() ? m_vAssets[handle].pSurface : nullptr;
+    }
+
+    Mix_Chunk* Sound(AssetHandle handle) const
+    {
+        return handle < m_vAssets.size() ? m_vAssets[handle].pChunk : nullptr;
+    }
+
+    // Release every asset. Must be called before the renderer and the audio device are destroyed
+    void Clear()
+    {
+        for (auto& worker : m_vWorkers)
+            if (worker.joinable())
+                worker.join();
+        m_vWorkers.clear();
+
+        for (auto& asset : m_vAssets)
+        {
+            if (asset.pTexture) SDL_DestroyTexture(asset.pTexture);
+            if (asset.pSurface) SDL_FreeSurface(asset.pSurface);
+            if (asset.pChunk) Mix_FreeChunk(asset.pChunk);
+        }
+        m_vAssets.clear();
+
+        // Only once nothing points into it anymore
+        m_archive.Close();
+    }
+
+private:
+    enum class AssetType
+    {
+        Image,
+        Sound
+    };
+
+    struct sAsset
+    {
+        std::string sPath;
+        AssetType nType = AssetType::Image;
+        bool bKeepSurface = false;
+
+        // Written by exactly one worker, read after the workers are joined
+        bool bLoaded = false;
+        bool bArchived = false;
+        std::string sError;
+        SDL_Surface* pSurface = nullptr;
+        SDL_Texture* pTexture = nullptr;
+        Mix_Chunk* pChunk = nullptr;
+    };
+
+    AssetHandle Request(const std::string& path, AssetType type, bool bKeepSurface)
+    {
+        sAsset asset;
+        asset.sPath = path;
+        asset.nType = type;
+        asset.bKeepSurface = bKeepSurface;
+        m_vAssets.push_back(std::move(asset));
+        return static_cast<AssetHandle>(m_vAssets.size() - 1);
+    }
+
+    // Each worker claims the next undecoded asset until none are left
+    void DecodeWorker()
+    {
+        m_nThreadsUsed++;
+
+        size_t i;
+        while ((i = m_nNextAsset++) < m_vAssets.size())
+        {
+            sAsset& asset = m_vAssets[i];
+            if (const sArchiveEntry* entry = m_archive.Find(asset.sPath))
+            {
+                asset.bArchived = true;
+                LoadArchived(asset, *entry);
+                continue;
+            }
+
+            std::string path = m_sDirectory + asset.sPath;
+            CountFileBytes(asset.sPath);
+            if (asset.nType == AssetType::Image)
+            {
+                asset.pSurface = IMG_Load(path.c_str());
+                asset.bLoaded = asset.pSurface != nullptr;
+                if (!asset.bLoaded) asset.sError = IMG_GetError();
+            }
+            else
+            {
+                asset.pChunk = Mix_LoadWAV(path.c_str());
+                asset.bLoaded = asset.pChunk != nullptr;
+                if (!asset.bLoaded) asset.sError = Mix_GetError();
+            }
+        }
+    }
+
+    // Surfaces and sounds point into the mapped archive, which SDL and the mixer only ever read from
+    void LoadArchived(sAsset& asset, const sArchiveEntry& entry)
+    {
+        Uint8* pData = const_cast<Uint8*>(m_archive.Data(entry));
+        if (asset.nType == AssetType::Image)
+        {
+            if (entry.nType == ArchiveEntryType::Image)
+                asset.pSurface = SDL_CreateRGBSurfaceWithFormatFrom(pData, int(entry.nWidth), int(entry.nHeight), 32, int(entry.nPitch), ARCHIVE_PIXEL_FORMAT);
+            asset.bLoaded = asset.pSurface != nullptr;
+            if (!asset.bLoaded) asset.sError = entry.nType == ArchiveEntryType::Image ? SDL_GetError() : "Not an image in the archive";
+            return;
+        }
+
+        if (entry.nType != ArchiveEntryType::Sound)
+        {
+            asset.sError = "Not a sound in the archive";
+            return;
+        }
+
+        const sArchiveHeader& header = m_archive.Header();
+        if (m_deviceAudio.nFrequency == int(header.nAudioFrequency) && m_deviceAudio.nFormat == header.nAudioFormat && m_deviceAudio.nChannels == int(header.nAudioChannels))
+        {
+            asset.pChunk = Mix_QuickLoad_RAW(pData, Uint32(entry.nSize));
+        }
+        else
+        {
+            // The device didn't open with the format the archive was packed for, so convert a copy the chunk owns
+            SDL_AudioCVT cvt;
+            if (SDL_BuildAudioCVT(&cvt, header.nAudioFormat, Uint8(header.nAudioChannels), int(header.nAudioFrequency),
+                m_deviceAudio.nFormat, Uint8(m_deviceAudio.nChannels), m_deviceAudio.nFrequency) >= 0)
+            {
+                cvt.len = int(entry.nSize);
+                cvt.buf = static_cast<Uint8*>(SDL_malloc(size_t(cvt.len) * size_t(std::max(1, cvt.len_mult))));
+                if (cvt.buf != nullptr)
+                {
+                    std::memcpy(cvt.buf, pData, entry.nSize);
+                    if (SDL_ConvertAudio(&cvt) == 0 && (asset.pChunk = Mix_QuickLoad_RAW(cvt.buf, Uint32(cvt.len_cvt))) != nullptr)
+                        asset.pChunk->allocated = 1;
+                    else
+                        SDL_free(cvt.buf);
+                }
+            }
+        }
+        asset.bLoaded = asset.pChunk != nullptr;
+        if (!asset.bLoaded) asset.sError = Mix_GetError();
+    }
+
+    void CountFileBytes(const std::string& name)
+    {
+        std::error_code error;
+        uintmax_t nSize = std::filesystem::file_size(m_sDirectory + name, error);
+        if (!error)
+            m_nFileBytes += uint64_t(nSize);
+    }
+
+private:
+    struct sAudioFormat
+    {
+        int nFrequency = 0;
+        Uint16 nFormat = 0;
+        int nChannels = 0;
+    };
+
+    std::string m_sDirectory;
+    AssetArchive m_archive;
+    sAudioFormat m_deviceAudio;
+    std::atomic<uint64_t> m_nFileBytes = 0;
+    std::vector<sAsset> m_vAssets;
+    std::vector<std::thread> m_vWorkers;
+    std::atomic<size_t> m_nNextAsset = 0;
+    std::atomic<size_t> m_nThreadsUsed = 0;
+    Uint64 m_nStartTicks = 0;
+    Uint64 m_nOpenTicks = 0;
+    double m_fLoadMs = 0.0;
+};
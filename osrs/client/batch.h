@@ -0,0 +1,105 @@
+#pragma once
+#include <SDL.h>
+#include <cstdint>
+#include <vector>
+
+/// <summary>
+/// The sprite batch collects every textured quad drawn during a frame and submits them with SDL_RenderGeometry.
+/// Consecutive quads that share a texture go into the same vertex array, so a frame full of glyphs and players
+/// drawn from the glyph atlas becomes a single draw call instead of one SDL_RenderCopy per quad.
+/// Each vertex carries its own color, which replaces per-draw texture color modulation for tinting.
+/// Submission order is preserved: a new batch starts whenever the texture changes, and Flush() must be called
+/// before switching render targets or presenting.
+/// </summary>
+
+class SpriteBatch
+{
+public:
+    // Queue a quad. A null source rectangle uses the whole texture
+    void Draw(SDL_Texture* texture, const SDL_Rect* src, const SDL_Rect& dst, SDL_Color color = { 255, 255, 255, 255 })
+    {
+        if (texture == nullptr)
+            return;
+
+        if (m_nActive == 0 || m_vBatches[m_nActive - 1].texture != texture)
+            BeginBatch(texture);
+
+        sBatch& batch = m_vBatches[m_nActive - 1];
+
+        float u0 = 0.0f, v0 = 0.0f, u1 = 1.0f, v1 = 1.0f;
+        if (src != nullptr && batch.w > 0 && batch.h > 0)
+        {
+            u0 = static_cast<float>(src->x) / batch.w;
+            v0 = static_cast<float>(src->y) / batch.h;
+            u1 = static_cast<float>(src->x + src->w) / batch.w;
+            v1 = static_cast<float>(src->y + src->h) / batch.h;
+        }
+
+        float x0 = static_cast<float>(dst.x), y0 = static_cast<float>(dst.y);
+        float x1 = static_cast<float>(dst.x + dst.w), y1 = static_cast<float>(dst.y + dst.h);
+
+        int nBase = static_cast<int>(batch.vertices.size());
+        batch.vertices.push_back({ { x0, y0 }, color, { u0, v0 } });
+        batch.vertices.push_back({ { x1, y0 }, color, { u1, v0 } });
+        batch.vertices.push_back({ { x1, y1 }, color, { u1, v1 } });
+        batch.vertices.push_back({ { x0, y1 }, color, { u0, v1 } });
+
+        batch.indices.insert(batch.indices.end(), { nBase, nBase + 1, nBase + 2, nBase, nBase + 2, nBase + 3 });
+        m_nQuads++;
+    }
+
+    // Submit every queued batch to the current render target
+    void Flush(SDL_Renderer* renderer)
+    {
+        for (size_t i = 0; i < m_nActive; i++)
+        {
+            sBatch& batch = m_vBatches[i];
+            SDL_RenderGeometry(renderer, batch.texture, batch.vertices.data(), static_cast<int>(batch.vertices.size()),
+                batch.indices.data(), static_cast<int>(batch.indices.size()));
+            m_nDrawCalls++;
+
+            // Keep the allocations around for the next frame
+            batch.vertices.clear();
+            batch.indices.clear();
+        }
+        m_nActive = 0;
+    }
+
+    // Draw calls and quads submitted since the last call to ResetStats()
+    uint32_t DrawCalls() const { return m_nDrawCalls; }
+    uint32_t Quads() const { return m_nQuads; }
+
+    void ResetStats()
+    {
+        m_nDrawCalls = 0;
+        m_nQuads = 0;
+    }
+
+private:
+    struct sBatch
+    {
+        SDL_Texture* texture = nullptr;
+        int w = 0;
+        int h = 0;
+        std::vector<SDL_Vertex> vertices;
+        std::vector<int> indices;
+    };
+
+    void BeginBatch(SDL_Texture* texture)
+    {
+        if (m_nActive == m_vBatches.size())
+            m_vBatches.emplace_back();
+
+        sBatch& batch = m_vBatches[m_nActive++];
+        batch.texture = texture;
+        SDL_QueryTexture(texture, nullptr, nullptr, &batch.w, &batch.h);
+    }
+
+private:
+    // Batches are reused between frames, only the first m_nActive hold quads for the current frame
+    std::vector<sBatch> m_vBatches;
+    size_t m_nActive = 0;
+
+    uint32_t m_nDrawCalls = 0;
+    uint32_t m_nQuads = 0;
+};
@@ -4,9 +4,15 @@
 #include <SDL_image.h>
 #include <SDL_mixer.h>
 #include <iostream>
+#include <memory>
+#include <random>
 #include <string>
 #include <unordered_map>
 #include "../server/common.h"
+#include "../server/world.h"
+#include "assets.h"
+#include "batch.h"
+#include "pacer.h"
 
 #pragma region Variables
 const int WINDOW_WIDTH = 640;
@@ -15,10 +21,12 @@ const int PLAYER_SIZE = 20;
 const int BLOCK_SIZE = 20;
 const float PLAYER_SPEED = 200.0f;
 const Uint8* currentKeyStates;
-const char* iconPath = "../../../media/icon.png";
-const std::string shopImagePath = "../../../media/shop.png";
-const std::string scoreboardImagePath = "../../../media/scoreboard.png";
-const std::string fontPath = "../../../media/Ac437_IBM_VGA_9x8.ttf";
+// Assets are named by their path within the media folder, see assets.h
+const std::string mediaPath = "../../../media/";
+const std::string iconPath = "icon.png";
+const std::string shopImagePath = "shop.png";
+const std::string scoreboardImagePath = "scoreboard.png";
+const std::string fontPath = "Ac437_IBM_VGA_9x8.ttf";
 const std::unordered_map<int, float> SHOP_SPEEDS = {
     {1, 10.0f},
     {2, 31.4159f},
@@ -33,15 +41,37 @@ const std::unordered_map<int, int> SHOP_COSTS = {
     {4, 4090},
     {5, 100000}
 };
-const SDL_Rect rockRect = { (WINDOW_WIDTH / 2) - (BLOCK_SIZE / 2) - 5, (WINDOW_HEIGHT / 2) - (BLOCK_SIZE / 2) - 5, BLOCK_SIZE + 10, BLOCK_SIZE + 10 };
-const SDL_Rect shopRect = { 70 - 5, 30 - 5, 100 + 10, 20 + 10 };
+// How close to a rock or shop a player has to be to use it
+const int TOUCH_MARGIN = 5;
 const SDL_Rect scoreboardRect = { WINDOW_WIDTH / 4, WINDOW_HEIGHT / 4, WINDOW_WIDTH / 2, WINDOW_HEIGHT / 2 };
 
 SDL_Rect playerRect = { WINDOW_WIDTH / 2 - PLAYER_SIZE / 2 - 60, WINDOW_HEIGHT / 2 - PLAYER_SIZE / 2, PLAYER_SIZE, PLAYER_SIZE };
 SDL_Window* window = NULL;
 SDL_Renderer* renderer = NULL;
 TTF_Font* font = NULL;
-SDL_Texture* shopImageTexture = NULL;
+SDL_Texture* glyphAtlasTexture = NULL;
+std::unordered_map<Uint16, SDL_Rect> glyphAtlasRects;
+SpriteBatch spriteBatch;
+uint32_t frameDrawCalls = 0;
+uint32_t frameQuads = 0;
+FrameStats frameStats;
+bool frameStatsDumpRequested = false;
+bool traceDumpRequested = false;
+
+// A full-window render target that is only redrawn when the inputs it depends on change
+struct RenderLayer
+{
+    SDL_Texture* texture = NULL;
+    bool dirty = true;
+    bool unsupported = false;
+};
+RenderLayer worldLayer;
+RenderLayer hudLayer;
+RenderLayer scoreboardLayer;
+uint32_t hudLayerOreCount = 0;
+SDL_Point worldLayerCamera = { 0, 0 };
+uint64_t worldLayerChunkVersion = 0;
+uint64_t scoreboardLayerVersion = 0;
 Mix_Chunk* miningSound = nullptr;
 Mix_Chunk* oreObtainedSound1 = nullptr;
 Mix_Chunk* oreObtainedSound2 = nullptr;
@@ -53,18 +83,26 @@ Mix_Chunk* shopCloseSound = nullptr;
 Mix_Chunk* haggleSound1 = nullptr;
 Mix_Chunk* haggleSound2 = nullptr;
 Mix_Chunk* haggleSound3 = nullptr;
+AssetManager assets;
+AssetHandle iconImage = INVALID_ASSET;
+AssetHandle shopImage = INVALID_ASSET;
+AssetHandle scoreboardImage = INVALID_ASSET;
+std::vector<AssetHandle> soundHandles;
+Uint64 startupTicks = 0;
+uint64_t startupDiskReads = 0;
+bool useAssetArchive = true;
 const std::vector<std::pair<Mix_Chunk*&, std::string>> soundFiles = {
-    {miningSound, "../../../media/sound/breakingStone.wav"},
-    {oreObtainedSound1, "../../../media/sound/stone1.wav"},
-    {oreObtainedSound2, "../../../media/sound/stone2.wav"},
-    {oreObtainedSound3, "../../../media/sound/stone3.wav"},
-    {oreObtainedSound4, "../../../media/sound/stone4.wav"},
-    {levelupSound, "../../../media/sound/levelup.wav"},
-    {shopOpenSound, "../../../media/sound/chestopen.wav"},
-    {shopCloseSound, "../../../media/sound/chestclosed.wav"},
-    {haggleSound1, "../../../media/sound/haggle1.wav"},
-    {haggleSound2, "../../../media/sound/haggle2.wav"},
-    {haggleSound3, "../../../media/sound/haggle3.wav"}
+    {miningSound, "sound/breakingStone.wav"},
+    {oreObtainedSound1, "sound/stone1.wav"},
+    {oreObtainedSound2, "sound/stone2.wav"},
+    {oreObtainedSound3, "sound/stone3.wav"},
+    {oreObtainedSound4, "sound/stone4.wav"},
+    {levelupSound, "sound/levelup.wav"},
+    {shopOpenSound, "sound/chestopen.wav"},
+    {shopCloseSound, "sound/chestclosed.wav"},
+    {haggleSound1, "sound/haggle1.wav"},
+    {haggleSound2, "sound/haggle2.wav"},
+    {haggleSound3, "sound/haggle3.wav"}
 };
 
 bool shopOpen = false;
@@ -75,10 +113,58 @@ bool key3Pressed = false;
 bool key4Pressed = false;
 bool key5Pressed = false;
 bool bWaitingForConnection = true;
+bool quitRequested = false;
+
+/// Everything the network thread knows about the world. It is built up by applying server messages and
+/// published to the render thread as a whole snapshot once per frame.
+struct sWorldState
+{
+    std::unordered_map<uint32_t, sPlayerDescription> players;
+    uint32_t nLocalID = 0;
+
+    // Top players as last pushed by the server, and a version bumped every time a new list arrives
+    std::vector<sLeaderboardEntry> leaderboard;
+    uint64_t nRosterVersion = 1;
+
+    // The chunks the server streamed to us, see server/world.h, and a version bumped whenever they change.
+    // Chunks are never modified once received, so snapshots share them instead of copying their tiles
+    sWorldInfo info;
+    std::unordered_map<uint64_t, std::shared_ptr<const sChunk>> chunks;
+    uint64_t nChunkVersion = 1;
+
+    void Apply(const sPlayerDescription& desc)
+    {
+        players.insert_or_assign(desc.nUniqueID, desc);
+    }
+
+    // Like Apply, but only for players already known. Returns whether there was one
+    bool Update(const sPlayerDescription& desc)
+    {
+        auto it = players.find(desc.nUniqueID);
+        if (it == players.end())
+            return false;
+        it->second = desc;
+        return true;
+    }
 
+    void Remove(uint32_t nUniqueID)
+    {
+        players.erase(nUniqueID);
+    }
+};
+
+// Render thread copy of the world, swapped in from the network thread's snapshots
 std::unordered_map<uint32_t, sPlayerDescription> mapObjects;
+std::vector<sLeaderboardEntry> leaderboard;
 uint32_t nPlayerID = 0;
+uint64_t nRosterVersion = 1;
 sPlayerDescription descPlayer;
+sWorldInfo worldInfo;
+std::unordered_map<uint64_t, std::shared_ptr<const sChunk>> mapChunks;
+uint64_t nChunkVersion = 1;
+
+// Top left corner of the window in world pixels
+SDL_Point camera = { 0, 0 };
 #pragma endregion
 
 #pragma region Helper Methods
@@ -90,26 +176,6 @@ bool AABB(const SDL_Rect& rectA, const SDL_Rect& rectB)
         rectA.y + rectA.h > rectB.y;
 }
 
-SDL_Texture* loadTexture(const std::string& path)
-{
-    SDL_Texture* newTexture = NULL;
-    SDL_Surface* loadedSurface = IMG_Load(path.c_str());
-    if (loadedSurface == NULL)
-    {
-        std::cerr << "Unable to load image " << path << "! SDL_image Error: " << IMG_GetError() << std::endl;
-    }
-    else
-    {
-        newTexture = SDL_CreateTextureFromSurface(renderer, loadedSurface);
-        if (newTexture == NULL)
-        {
-            std::cerr << "Unable to create texture from " << path << "! SDL Error: " << SDL_GetError() << std::endl;
-        }
-        SDL_FreeSurface(loadedSurface);
-    }
-    return newTexture;
-}
-
 SDL_Color colorToSDLColor(const Color& color)
 {
     SDL_Color sdlColor;
@@ -127,60 +193,228 @@ SDL_Point getTextSize(const std::string& text)
     return { textWidth, textHeight };
 }
 
-void renderChar(Uint16 unicodeValue, SDL_Rect rect, Color color = { 255, 255, 255 })
+int worldWidth()
 {
-    SDL_Color sdlColor = colorToSDLColor(color);
-    SDL_Surface* textSurface = TTF_RenderGlyph_Solid(font, unicodeValue, sdlColor);
-    if (textSurface == nullptr)
+    return worldInfo.nChunksX * CHUNK_SIZE;
+}
+
+int worldHeight()
+{
+    return worldInfo.nChunksY * CHUNK_SIZE;
+}
+
+int floorDiv(int value, int divisor)
+{
+    return value >= 0 ? value / divisor : -((-value + divisor - 1) / divisor);
+}
+
+SDL_Rect objectRect(const sWorldObject& object, int margin = 0)
+{
+    return { object.x - margin, object.y - margin, object.w + 2 * margin, object.h + 2 * margin };
+}
+
+/// Calls visit for every loaded chunk that rect overlaps, and those up and left of them, since objects can reach
+/// into the chunks right of and below their own. Stops and returns true as soon as visit does.
+template<typename Visit>
+bool anyChunkNear(const SDL_Rect& rect, Visit visit)
+{
+    int firstX = floorDiv(rect.x, CHUNK_SIZE) - 1, lastX = floorDiv(rect.x + rect.w - 1, CHUNK_SIZE);
+    int firstY = floorDiv(rect.y, CHUNK_SIZE) - 1, lastY = floorDiv(rect.y + rect.h - 1, CHUNK_SIZE);
+    for (int cy = std::max(firstY, 0); cy <= std::min(lastY, worldInfo.nChunksY - 1); cy++)
     {
-        std::cerr << "Failed to render char! SDL_ttf Error: " << TTF_GetError() << std::endl;
-        return;
+        for (int cx = std::max(firstX, 0); cx <= std::min(lastX, worldInfo.nChunksX - 1); cx++)
+        {
+            auto it = mapChunks.find(sChunkCoord{ cx, cy }.Key());
+            if (it != mapChunks.end() && visit(*it->second))
+                return true;
+        }
     }
+    return false;
+}
 
-    SDL_Texture* textTexture = SDL_CreateTextureFromSurface(renderer, textSurface);
-    if (textTexture == nullptr)
+// Whether rect overlaps a wall tile or an object in the chunks we have
+bool worldBlocked(const SDL_Rect& rect)
+{
+    return anyChunkNear(rect, [&](const sChunk& chunk)
     {
-        std::cerr << "Failed to create texture from surface! SDL Error: " << SDL_GetError() << std::endl;
-        SDL_FreeSurface(textSurface);
-        return;
-    }
+        for (const auto& object : chunk.objects)
+            if (AABB(rect, objectRect(object)))
+                return true;
+
+        for (int ty = 0; ty < CHUNK_TILES; ty++)
+            for (int tx = 0; tx < CHUNK_TILES; tx++)
+                if (chunk.Tile(tx, ty) == TileType::Wall &&
+                    AABB(rect, { chunk.coord.x * CHUNK_SIZE + tx * TILE_SIZE, chunk.coord.y * CHUNK_SIZE + ty * TILE_SIZE, TILE_SIZE, TILE_SIZE }))
+                    return true;
+        return false;
+    });
+}
 
-    SDL_RenderCopy(renderer, textTexture, NULL, &rect);
-    SDL_FreeSurface(textSurface);
-    SDL_DestroyTexture(textTexture);
+bool touchingObject(const SDL_Rect& rect, WorldObjectType type)
+{
+    return anyChunkNear(rect, [&](const sChunk& chunk)
+    {
+        for (const auto& object : chunk.objects)
+            if (object.nType == type && AABB(rect, objectRect(object, TOUCH_MARGIN)))
+                return true;
+        return false;
+    });
 }
 
-void renderText(const std::string& text, SDL_Rect rect, Color color = { 255, 255, 255 })
+// Unicode code points of the 256 CP437 glyphs, indexed by their CP437 code
+const Uint16 CP437_TO_UNICODE[256] = {
+    0x0000, 0x263A, 0x263B, 0x2665, 0x2666, 0x2663, 0x2660, 0x2022, 0x25D8, 0x25CB, 0x25D9, 0x2642, 0x2640, 0x266A, 0x266B, 0x263C,
+    0x25BA, 0x25C4, 0x2195, 0x203C, 0x00B6, 0x00A7, 0x25AC, 0x21A8, 0x2191, 0x2193, 0x2192, 0x2190, 0x221F, 0x2194, 0x25B2, 0x25BC,
+    0x0020, 0x0021, 0x0022, 0x0023, 0x0024, 0x0025, 0x0026, 0x0027, 0x0028, 0x0029, 0x002A, 0x002B, 0x002C, 0x002D, 0x002E, 0x002F,
+    0x0030, 0x0031, 0x0032, 0x0033, 0x0034, 0x0035, 0x0036, 0x0037, 0x0038, 0x0039, 0x003A, 0x003B, 0x003C, 0x003D, 0x003E, 0x003F,
+    0x0040, 0x0041, 0x0042, 0x0043, 0x0044, 0x0045, 0x0046, 0x0047, 0x0048, 0x0049, 0x004A, 0x004B, 0x004C, 0x004D, 0x004E, 0x004F,
+    0x0050, 0x0051, 0x0052, 0x0053, 0x0054, 0x0055, 0x0056, 0x0057, 0x0058, 0x0059, 0x005A, 0x005B, 0x005C, 0x005D, 0x005E, 0x005F,
+    0x0060, 0x0061, 0x0062, 0x0063, 0x0064, 0x0065, 0x0066, 0x0067, 0x0068, 0x0069, 0x006A, 0x006B, 0x006C, 0x006D, 0x006E, 0x006F,
+    0x0070, 0x0071, 0x0072, 0x0073, 0x0074, 0x0075, 0x0076, 0x0077, 0x0078, 0x0079, 0x007A, 0x007B, 0x007C, 0x007D, 0x007E, 0x2302,
+    0x00C7, 0x00FC, 0x00E9, 0x00E2, 0x00E4, 0x00E0, 0x00E5, 0x00E7, 0x00EA, 0x00EB, 0x00E8, 0x00EF, 0x00EE, 0x00EC, 0x00C4, 0x00C5,
+    0x00C9, 0x00E6, 0x00C6, 0x00F4, 0x00F6, 0x00F2, 0x00FB, 0x00F9, 0x00FF, 0x00D6, 0x00DC, 0x00A2, 0x00A3, 0x00A5, 0x20A7, 0x0192,
+    0x00E1, 0x00ED, 0x00F3, 0x00FA, 0x00F1, 0x00D1, 0x00AA, 0x00BA, 0x00BF, 0x2310, 0x00AC, 0x00BD, 0x00BC, 0x00A1, 0x00AB, 0x00BB,
+    0x2591, 0x2592, 0x2593, 0x2502, 0x2524, 0x2561, 0x2562, 0x2556, 0x2555, 0x2563, 0x2551, 0x2557, 0x255D, 0x255C, 0x255B, 0x2510,
+    0x2514, 0x2534, 0x252C, 0x251C, 0x2500, 0x253C, 0x255E, 0x255F, 0x255A, 0x2554, 0x2569, 0x2566, 0x2560, 0x2550, 0x256C, 0x2567,
+    0x2568, 0x2564, 0x2565, 0x2559, 0x2558, 0x2552, 0x2553, 0x256B, 0x256A, 0x2518, 0x250C, 0x2588, 0x2584, 0x258C, 0x2590, 0x2580,
+    0x03B1, 0x00DF, 0x0393, 0x03C0, 0x03A3, 0x03C3, 0x00B5, 0x03C4, 0x03A6, 0x0398, 0x03A9, 0x03B4, 0x221E, 0x03C6, 0x03B5, 0x2229,
+    0x2261, 0x00B1, 0x2265, 0x2264, 0x2320, 0x2321, 0x00F7, 0x2248, 0x00B0, 0x2219, 0x00B7, 0x221A, 0x207F, 0x00B2, 0x25A0, 0x00A0
+};
+
+/// Renders every CP437 glyph once in white and packs them into a single texture.
+/// The raw control codes 0x01-0x1F are also added, since some world glyphs are drawn with them directly.
+/// Glyphs are then tinted with per-vertex colors in the sprite batch instead of being re-rendered in each color,
+/// so drawing text no longer creates and destroys surfaces and textures every frame.
+bool buildGlyphAtlas()
 {
-    SDL_Color textColor = colorToSDLColor(color);
-    SDL_Surface* textSurface = TTF_RenderText_Solid(font, text.c_str(), textColor);
-    if (textSurface == nullptr)
+    const int atlasWidth = 512;
+    const SDL_Color white = { 255, 255, 255, 255 };
+
+    std::vector<Uint16> codePoints(std::begin(CP437_TO_UNICODE) + 1, std::end(CP437_TO_UNICODE));
+    for (Uint16 c = 0x01; c < 0x20; ++c)
+        codePoints.push_back(c);
+
+    // Render every glyph and lay them out in rows
+    std::vector<std::pair<Uint16, SDL_Surface*>> glyphs;
+    int x = 0, y = 0, rowHeight = 0;
+    for (Uint16 codePoint : codePoints)
     {
-        std::cerr << "Failed to render text surface! SDL_ttf Error: " << TTF_GetError() << std::endl;
-        return;
+        if (glyphAtlasRects.count(codePoint))
+            continue;
+
+        SDL_Surface* glyphSurface = TTF_RenderGlyph_Solid(font, codePoint, white);
+        if (glyphSurface == nullptr)
+            continue;
+
+        if (x + glyphSurface->w > atlasWidth)
+        {
+            x = 0;
+            y += rowHeight;
+            rowHeight = 0;
+        }
+
+        glyphAtlasRects[codePoint] = { x, y, glyphSurface->w, glyphSurface->h };
+        glyphs.emplace_back(codePoint, glyphSurface);
+        x += glyphSurface->w;
+        rowHeight = std::max(rowHeight, glyphSurface->h);
     }
 
-    SDL_Texture* textTexture = SDL_CreateTextureFromSurface(renderer, textSurface);
-    if (textTexture == nullptr)
+    SDL_Surface* atlasSurface = SDL_CreateRGBSurfaceWithFormat(0, atlasWidth, y + rowHeight, 32, SDL_PIXELFORMAT_RGBA32);
+    if (atlasSurface == nullptr)
+    {
+        std::cerr << "Failed to create glyph atlas surface! SDL Error: " << SDL_GetError() << std::endl;
+        for (auto& glyph : glyphs)
+            SDL_FreeSurface(glyph.second);
+        return false;
+    }
+    SDL_FillRect(atlasSurface, NULL, SDL_MapRGBA(atlasSurface->format, 0, 0, 0, SDL_ALPHA_TRANSPARENT));
+
+    // Solid glyphs are color keyed, so only the glyph pixels are copied over the transparent background
+    for (auto& glyph : glyphs)
+    {
+        SDL_Rect destRect = glyphAtlasRects[glyph.first];
+        SDL_BlitSurface(glyph.second, NULL, atlasSurface, &destRect);
+        SDL_FreeSurface(glyph.second);
+    }
+
+    glyphAtlasTexture = SDL_CreateTextureFromSurface(renderer, atlasSurface);
+    SDL_FreeSurface(atlasSurface);
+    if (glyphAtlasTexture == nullptr)
+    {
+        std::cerr << "Failed to create glyph atlas texture! SDL Error: " << SDL_GetError() << std::endl;
+        return false;
+    }
+    SDL_SetTextureBlendMode(glyphAtlasTexture, SDL_BLENDMODE_BLEND);
+    return true;
+}
+
+const SDL_Rect* findGlyph(Uint16 unicodeValue)
+{
+    auto it = glyphAtlasRects.find(unicodeValue);
+    if (it == glyphAtlasRects.end())
     {
-        std::cerr << "Failed to create texture from surface! SDL Error: " << SDL_GetError() << std::endl;
-        SDL_FreeSurface(textSurface);
+        // Fall back to a question mark for anything the atlas doesn't cover
+        it = glyphAtlasRects.find('?');
+        if (it == glyphAtlasRects.end())
+            return nullptr;
+    }
+    return &it->second;
+}
+
+void renderChar(Uint16 unicodeValue, SDL_Rect rect, Color color = { 255, 255, 255 })
+{
+    const SDL_Rect* glyphRect = findGlyph(unicodeValue);
+    if (glyphRect == nullptr)
         return;
+
+    spriteBatch.Draw(glyphAtlasTexture, glyphRect, rect, colorToSDLColor(color));
+}
+
+void renderText(const std::string& text, SDL_Rect rect, Color color = { 255, 255, 255 })
+{
+    // Lay the glyphs out at their natural size first, then stretch the whole line into rect
+    // the same way a single rendered text surface would have been
+    int textWidth = 0;
+    for (unsigned char c : text)
+    {
+        const SDL_Rect* glyphRect = findGlyph(c);
+        if (glyphRect != nullptr)
+            textWidth += glyphRect->w;
     }
 
-    int textWidth = textSurface->w;
-    int textHeight = textSurface->h;
-    SDL_Rect destRect = { rect.x, rect.y, rect.w, rect.h };
+    int textHeight = TTF_FontHeight(font);
+    if (textWidth == 0 || textHeight == 0)
+        return;
+
+    float scaleX = static_cast<float>(rect.w) / textWidth;
+    float scaleY = static_cast<float>(rect.h) / textHeight;
 
-    SDL_RenderCopy(renderer, textTexture, NULL, &destRect);
-    SDL_FreeSurface(textSurface);
-    SDL_DestroyTexture(textTexture);
+    SDL_Color sdlColor = colorToSDLColor(color);
+    int penX = 0;
+    for (unsigned char c : text)
+    {
+        const SDL_Rect* glyphRect = findGlyph(c);
+        if (glyphRect == nullptr)
+            continue;
+
+        int x0 = rect.x + static_cast<int>(penX * scaleX + 0.5f);
+        int x1 = rect.x + static_cast<int>((penX + glyphRect->w) * scaleX + 0.5f);
+        SDL_Rect destRect = { x0, rect.y, x1 - x0, static_cast<int>(glyphRect->h * scaleY + 0.5f) };
+        spriteBatch.Draw(glyphAtlasTexture, glyphRect, destRect, sdlColor);
+        penX += glyphRect->w;
+    }
 }
 #pragma endregion
 
 #pragma region Init/Close
+/// Starts up SDL and kicks off decoding of every image and sound on worker threads.
+/// The font and glyph atlas are prepared on this thread while the workers run, and the caller is free to
+/// start connecting to the server before calling finishLoading(), so none of these steps wait on each other.
 bool init()
 {
+    startupTicks = SDL_GetPerformanceCounter();
+    startupDiskReads = processDiskReads();
+
     if (SDL_Init(SDL_INIT_VIDEO) < 0)
     {
         std::cerr << "SDL could not initialize! SDL_Error: " << SDL_GetError() << std::endl;
@@ -194,20 +428,33 @@ bool init()
         return false;
     }
 
-    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_TARGETTEXTURE);
     if (renderer == NULL)
     {
         std::cerr << "Renderer could not be created! SDL_Error: " << SDL_GetError() << std::endl;
         return false;
     }
 
-    SDL_Surface* iconSurface = IMG_Load(iconPath);
-    if (iconSurface == NULL)
+    if (!(IMG_Init(IMG_INIT_PNG) & IMG_INIT_PNG))
     {
-        std::cerr << "Failed to load icon image! SDL_Error: " << SDL_GetError() << std::endl;
+        std::cerr << "SDL_image could not initialize! SDL_image Error: " << IMG_GetError() << std::endl;
         return false;
     }
-    SDL_SetWindowIcon(window, iconSurface);
+
+    // The audio device has to be open before sounds are decoded, as they are converted to its format
+    if (Mix_OpenAudio(AUDIO_FREQUENCY, MIX_DEFAULT_FORMAT, AUDIO_CHANNELS, 2048) < 0)
+    {
+        std::cerr << "SDL_mixer could not initialize! SDL_mixer Error: " << Mix_GetError() << std::endl;
+        return false;
+    }
+
+    assets.UseDirectory(mediaPath, useAssetArchive);
+    iconImage = assets.RequestImage(iconPath, true);
+    shopImage = assets.RequestImage(shopImagePath);
+    scoreboardImage = assets.RequestImage(scoreboardImagePath);
+    for (const auto& soundFile : soundFiles)
+        soundHandles.push_back(assets.RequestSound(soundFile.second));
+    assets.Start();
 
     if (TTF_Init() == -1)
     {
@@ -215,43 +462,36 @@ bool init()
         return false;
     }
 
-    font = TTF_OpenFont(fontPath.c_str(), BLOCK_SIZE);
+    font = TTF_OpenFontRW(assets.OpenFile(fontPath), 1, BLOCK_SIZE);
     if (font == nullptr)
     {
         std::cerr << "Failed to load font! SDL_ttf Error: " << TTF_GetError() << std::endl;
         return false;
     }
 
-    if (!(IMG_Init(IMG_INIT_PNG) & IMG_INIT_PNG))
+    if (!buildGlyphAtlas())
     {
-        std::cerr << "SDL_image could not initialize! SDL_image Error: " << IMG_GetError() << std::endl;
         return false;
     }
 
-    if (Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 2048) < 0)
+    // Seed the random number generator
+    srand(static_cast<unsigned int>(time(nullptr)));
+
+    return true;
+}
+
+// Waits for the asset workers, uploads the decoded images and hands the sounds out to gameplay code
+bool finishLoading()
+{
+    if (!assets.Finish(renderer))
     {
-        std::cerr << "SDL_mixer could not initialize! SDL_mixer Error: " << Mix_GetError() << std::endl;
         return false;
     }
 
-    auto loadSound = [&](Mix_Chunk*& sound, const std::string& path)
-    {
-        sound = Mix_LoadWAV(path.c_str());
-        if (sound == nullptr)
-        {
-            std::cerr << "Failed to load sound effect: " << path << "! SDL_mixer Error: " << Mix_GetError() << std::endl;
-            return false;
-        }
-        return true;
-    };
+    SDL_SetWindowIcon(window, assets.Surface(iconImage));
 
-    for (const auto& soundFile : soundFiles)
-    {
-        if (!loadSound(soundFile.first, soundFile.second))
-        {
-            return false;
-        }
-    }
+    for (size_t i = 0; i < soundFiles.size(); i++)
+        soundFiles[i].first = assets.Sound(soundHandles[i]);
 
     Mix_VolumeChunk(miningSound, MIX_MAX_VOLUME / 1.5f); // 66% volume
     Mix_VolumeChunk(oreObtainedSound1, MIX_MAX_VOLUME / 5); // 20% volume
@@ -265,32 +505,24 @@ bool init()
     Mix_VolumeChunk(haggleSound2, MIX_MAX_VOLUME / 5); // 20% volume
     Mix_VolumeChunk(haggleSound3, MIX_MAX_VOLUME / 5); // 20% volume
 
-    // Seed the random number generator
-    srand(static_cast<unsigned int>(time(nullptr)));
-
+    double startupMs = (SDL_GetPerformanceCounter() - startupTicks) * 1000.0 / SDL_GetPerformanceFrequency();
+    // One line to compare runs with and without --no-archive by
+    std::cout << "[CLIENT] Startup finished in " << startupMs << " ms, assets from " << (assets.UsesArchive() ? "the archive" : "loose files")
+        << " in " << assets.LoadMs() << " ms, " << (processDiskReads() - startupDiskReads) / 1024 << " KB read from disk\n";
     return true;
 }
 
-void close()
+void destroyTexture(SDL_Texture*& texture)
 {
-    auto destroyTexture = [](SDL_Texture*& texture)
+    if (texture != NULL)
     {
-        if (texture != NULL)
-        {
-            SDL_DestroyTexture(texture);
-            texture = NULL;
-        }
-    };
-
-    auto freeSound = [](Mix_Chunk*& sound)
-    {
-        if (sound != NULL)
-        {
-            Mix_FreeChunk(sound);
-            sound = NULL;
-        }
-    };
+        SDL_DestroyTexture(texture);
+        texture = NULL;
+    }
+}
 
+void close()
+{
     auto closeFont = [](TTF_Font*& font)
     {
         if (font != NULL)
@@ -300,25 +532,23 @@ void close()
         }
     };
 
-    // Destroy shop image texture
-    destroyTexture(shopImageTexture);
-
-    // Free loaded sound effects
-    freeSound(miningSound);
-    freeSound(oreObtainedSound1);
-    freeSound(oreObtainedSound2);
-    freeSound(oreObtainedSound3);
-    freeSound(oreObtainedSound4);
-    freeSound(levelupSound);
-    freeSound(shopOpenSound);
-    freeSound(shopCloseSound);
-    freeSound(haggleSound1);
-    freeSound(haggleSound2);
-    freeSound(haggleSound3);
-
-    // Close the font
+    // Destroy glyph atlas texture
+    destroyTexture(glyphAtlasTexture);
+    glyphAtlasRects.clear();
+
+    // Destroy cached render layers
+    destroyTexture(worldLayer.texture);
+    destroyTexture(hudLayer.texture);
+    destroyTexture(scoreboardLayer.texture);
+
+    // Close the font, which may be reading from the asset archive
     closeFont(font);
 
+    // Free every image and sound effect owned by the asset manager
+    for (const auto& soundFile : soundFiles)
+        soundFile.first = nullptr;
+    assets.Clear();
+
     // Destroy the renderer
     if (renderer != NULL)
     {
@@ -342,41 +572,143 @@ void close()
 #pragma endregion
 
 #pragma region Rendering
-void renderWorld()
+/// Brings a layer up to date and composites it over the current frame.
+/// The draw callback only runs when the layer is dirty, so a static layer costs a single copy per frame.
+/// If the renderer can't provide render targets, the layer is drawn straight to the screen every frame instead.
+template<typename DrawFunc>
+void compositeLayer(RenderLayer& layer, DrawFunc draw)
 {
-    // Borders
-    for (int x = 0; x < WINDOW_WIDTH; x += BLOCK_SIZE)
-        renderChar(0x2593, { x, 0, BLOCK_SIZE, BLOCK_SIZE });
+    if (layer.texture == NULL && !layer.unsupported)
+    {
+        layer.texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, WINDOW_WIDTH, WINDOW_HEIGHT);
+        if (layer.texture == NULL)
+        {
+            std::cerr << "Failed to create render layer, drawing directly! SDL Error: " << SDL_GetError() << std::endl;
+            layer.unsupported = true;
+        }
+        else
+        {
+            SDL_SetTextureBlendMode(layer.texture, SDL_BLENDMODE_BLEND);
+            layer.dirty = true;
+        }
+    }
 
-    for (int x = 0; x < WINDOW_WIDTH; x += BLOCK_SIZE)
-        renderChar(0x2593, { x, WINDOW_HEIGHT - BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE });
+    if (layer.unsupported)
+    {
+        draw();
+        return;
+    }
 
-    for (int y = 0; y < WINDOW_HEIGHT; y += BLOCK_SIZE)
-        renderChar(0x2593, { 0, y, BLOCK_SIZE, BLOCK_SIZE });
+    if (layer.dirty)
+    {
+        // Whatever was queued so far belongs to the screen, so submit it before switching targets
+        spriteBatch.Flush(renderer);
+        SDL_SetRenderTarget(renderer, layer.texture);
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+        SDL_RenderClear(renderer);
+        draw();
+        spriteBatch.Flush(renderer);
+        SDL_SetRenderTarget(renderer, NULL);
+        layer.dirty = false;
+    }
 
-    for (int y = 0; y < WINDOW_HEIGHT; y += BLOCK_SIZE)
-        renderChar(0x2593, { WINDOW_WIDTH - BLOCK_SIZE, y, BLOCK_SIZE, BLOCK_SIZE });
+    spriteBatch.Draw(layer.texture, NULL, { 0, 0, WINDOW_WIDTH, WINDOW_HEIGHT });
+}
 
-    // Shop
-    renderChar(0x2502, { 60, 20, BLOCK_SIZE, BLOCK_SIZE });
-    renderChar(0x2502, { 70, 20, BLOCK_SIZE, BLOCK_SIZE });
-    renderChar(0x01, { 100, 20, BLOCK_SIZE, BLOCK_SIZE });
-    renderChar(0x2502, { 150, 20, BLOCK_SIZE, BLOCK_SIZE });
-    renderChar(0x2502, { 160, 20, BLOCK_SIZE, BLOCK_SIZE });
+void invalidateLayers()
+{
+    worldLayer.dirty = true;
+    hudLayer.dirty = true;
+    scoreboardLayer.dirty = true;
+}
+
+/// The render device was lost and every texture with it. The layers are recreated by compositeLayer() once they
+/// are NULL, and the glyph atlas and images are built again from the font and the asset sources.
+bool recreateTextures()
+{
+    destroyTexture(worldLayer.texture);
+    destroyTexture(hudLayer.texture);
+    destroyTexture(scoreboardLayer.texture);
+    invalidateLayers();
+
+    destroyTexture(glyphAtlasTexture);
+    glyphAtlasRects.clear();
+    bool success = buildGlyphAtlas();
+    return assets.RecreateTextures(renderer) && success;
+}
+
+// Keep our player in the middle of the window, without showing anything past the edges of the world. A world
+// smaller than the window is centered in it
+void updateCamera()
+{
+    const sVector2& vPos = mapObjects[nPlayerID].vPos;
+    auto follow = [](float position, int worldSize, int windowSize)
+    {
+        if (worldSize <= windowSize)
+            return (worldSize - windowSize) / 2;
+        return std::clamp(int(position) + PLAYER_SIZE / 2 - windowSize / 2, 0, worldSize - windowSize);
+    };
+    camera = { follow(vPos.x, worldWidth(), WINDOW_WIDTH), follow(vPos.y, worldHeight(), WINDOW_HEIGHT) };
+}
 
-    renderChar(0x2514, { 60, 40, BLOCK_SIZE, BLOCK_SIZE });
-    renderChar(0x2514, { 70, 30, BLOCK_SIZE, BLOCK_SIZE });
-    renderChar(0x2518, { 150, 30, BLOCK_SIZE, BLOCK_SIZE });
-    renderChar(0x2518, { 160, 40, BLOCK_SIZE, BLOCK_SIZE });
+// Where a world rect ends up in the window
+SDL_Rect toScreen(const SDL_Rect& rect)
+{
+    return { rect.x - camera.x, rect.y - camera.y, rect.w, rect.h };
+}
 
-    for (int x = 80; x < 160; x += BLOCK_SIZE)
-        renderChar(0x2500, { x, 30, BLOCK_SIZE, BLOCK_SIZE });
+// Glyphs drawn outside the object's own rect, like the shop's walls, stay within this much of it
+const int OBJECT_OVERHANG = 10;
 
-    for (int x = 80; x < 160; x += BLOCK_SIZE)
-        renderChar(0x2500, { x, 40, BLOCK_SIZE, BLOCK_SIZE });
+void renderObject(const sWorldObject& object)
+{
+    int x = object.x - camera.x, y = object.y - camera.y;
+    if (object.nType == WorldObjectType::Rock)
+    {
+        renderChar(0x1E, { x, y, BLOCK_SIZE, BLOCK_SIZE });
+        return;
+    }
+
+    // Shop
+    renderChar(0x2502, { x - 10, y - 10, BLOCK_SIZE, BLOCK_SIZE });
+    renderChar(0x2502, { x, y - 10, BLOCK_SIZE, BLOCK_SIZE });
+    renderChar(0x01, { x + 30, y - 10, BLOCK_SIZE, BLOCK_SIZE });
+    renderChar(0x2502, { x + object.w - 20, y - 10, BLOCK_SIZE, BLOCK_SIZE });
+    renderChar(0x2502, { x + object.w - 10, y - 10, BLOCK_SIZE, BLOCK_SIZE });
+
+    renderChar(0x2514, { x - 10, y + 10, BLOCK_SIZE, BLOCK_SIZE });
+    renderChar(0x2514, { x, y, BLOCK_SIZE, BLOCK_SIZE });
+    renderChar(0x2518, { x + object.w - 20, y, BLOCK_SIZE, BLOCK_SIZE });
+    renderChar(0x2518, { x + object.w - 10, y + 10, BLOCK_SIZE, BLOCK_SIZE });
+
+    for (int dx = 10; dx < object.w - 10; dx += BLOCK_SIZE)
+        renderChar(0x2500, { x + dx, y, BLOCK_SIZE, BLOCK_SIZE });
+
+    for (int dx = 10; dx < object.w - 10; dx += BLOCK_SIZE)
+        renderChar(0x2500, { x + dx, y + 10, BLOCK_SIZE, BLOCK_SIZE });
+}
+
+// Only what is in view is drawn, so the cost depends on the window and not on how big the world is
+void renderWorld()
+{
+    const SDL_Rect view = { camera.x, camera.y, WINDOW_WIDTH, WINDOW_HEIGHT };
+    anyChunkNear(view, [&](const sChunk& chunk)
+    {
+        for (int ty = 0; ty < CHUNK_TILES; ty++)
+        {
+            for (int tx = 0; tx < CHUNK_TILES; tx++)
+            {
+                SDL_Rect tileRect = { chunk.coord.x * CHUNK_SIZE + tx * TILE_SIZE, chunk.coord.y * CHUNK_SIZE + ty * TILE_SIZE, TILE_SIZE, TILE_SIZE };
+                if (chunk.Tile(tx, ty) == TileType::Wall && AABB(view, tileRect))
+                    renderChar(0x2593, toScreen(tileRect));
+            }
+        }
 
-    // Rock
-    renderChar(0x1E, { (WINDOW_WIDTH / 2) - (BLOCK_SIZE / 2), (WINDOW_HEIGHT / 2) - (BLOCK_SIZE / 2), BLOCK_SIZE, BLOCK_SIZE });
+        for (const auto& object : chunk.objects)
+            if (AABB(view, objectRect(object, OBJECT_OVERHANG)))
+                renderObject(object);
+        return false;
+    });
 }
 
 void renderOreCounter(uint32_t oreCount)
@@ -387,83 +719,102 @@ void renderOreCounter(uint32_t oreCount)
     renderText(oreText, rect);
 }
 
-void renderScoreboard(const std::unordered_map<uint32_t, sPlayerDescription>& mapObjects)
+// The rows come straight from the server's top list, already ranked, so there is nothing to sort here
+void renderScoreboard(const std::vector<sLeaderboardEntry>& entries)
 {
-    static SDL_Texture* scoreboardTexture = loadTexture(scoreboardImagePath);
+    SDL_Texture* scoreboardTexture = assets.Texture(scoreboardImage);
     if (scoreboardTexture == nullptr)
     {
         std::cerr << "Failed to load scoreboard image!" << std::endl;
         return;
     }
 
-    SDL_RenderCopy(renderer, scoreboardTexture, NULL, &scoreboardRect);
-
-    std::vector<std::pair<uint32_t, sPlayerDescription>> players(mapObjects.begin(), mapObjects.end());
-    std::sort(players.begin(), players.end(), [](const auto& a, const auto& b) {
-        if (a.second.nOreCount == b.second.nOreCount)
-        {
-            // Order by ID if ore count is the same
-            return a.first < b.first;
-        }
-        // Otherwise, order by ore count
-        return a.second.nOreCount > b.second.nOreCount;
-    });
+    spriteBatch.Draw(scoreboardTexture, NULL, scoreboardRect);
 
-    int displayCount = std::min(static_cast<int>(players.size()), 5);
+    int displayCount = std::min(static_cast<int>(entries.size()), 5);
 
     for (int i = 0; i < displayCount; ++i)
     {
-        const auto& player = players[i];
-        SDL_Color playerColor = colorToSDLColor(player.second.nColor);
+        const auto& entry = entries[i];
         SDL_Rect charRect = { scoreboardRect.x + 20, scoreboardRect.y + 20 + i * 40, BLOCK_SIZE, BLOCK_SIZE };
 
         // Render player character
-        renderChar(0x263A, charRect, player.second.nColor);
+        renderChar(0x263A, charRect, entry.nColor);
 
         // Render player ID
-        std::string idText = std::to_string(player.first);
+        std::string idText = std::to_string(entry.nUniqueID);
         int idTextWidth = idText.length() * BLOCK_SIZE;
         SDL_Rect idRect = { charRect.x + 50, charRect.y, idTextWidth, BLOCK_SIZE };
-        renderText(idText, idRect, player.second.nColor);
+        renderText(idText, idRect, entry.nColor);
 
         // Render player ore count
-        std::string oreText = std::to_string(player.second.nOreCount);
+        std::string oreText = std::to_string(entry.nOreCount);
         int oreTextWidth = oreText.length() * BLOCK_SIZE;
         SDL_Rect oreRect = { scoreboardRect.x + scoreboardRect.w - oreTextWidth - 20, charRect.y, oreTextWidth, BLOCK_SIZE };
-        renderText(oreText, oreRect, player.second.nColor);
+        renderText(oreText, oreRect, entry.nColor);
     }
 }
 
 void render()
 {
+    ScopedFrameTimer renderTimer(frameStats, FrameMetric::Render);
+    spriteBatch.ResetStats();
+
     // Clear render
     SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
     SDL_RenderClear(renderer);
     SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
 
-    // Render world elements
-    renderWorld();
-    renderOreCounter(mapObjects[nPlayerID].nOreCount);
+    // The world is only redrawn when the camera moves or chunks arrive or are evicted
+    updateCamera();
+    if (camera.x != worldLayerCamera.x || camera.y != worldLayerCamera.y || nChunkVersion != worldLayerChunkVersion)
+    {
+        worldLayerCamera = camera;
+        worldLayerChunkVersion = nChunkVersion;
+        worldLayer.dirty = true;
+    }
+    compositeLayer(worldLayer, renderWorld);
 
-    // Render objects of all clients
+    // The ore counter is only redrawn when our ore count changes
+    uint32_t oreCount = mapObjects[nPlayerID].nOreCount;
+    if (oreCount != hudLayerOreCount)
+    {
+        hudLayerOreCount = oreCount;
+        hudLayer.dirty = true;
+    }
+    compositeLayer(hudLayer, [oreCount]() { renderOreCounter(oreCount); });
+
+    // Render objects of all clients in view
+    const SDL_Rect view = { camera.x, camera.y, WINDOW_WIDTH, WINDOW_HEIGHT };
     for (auto& object : mapObjects)
     {
         // Render players
-        renderChar(0x01, { (int)object.second.vPos.x, (int)object.second.vPos.y, BLOCK_SIZE, BLOCK_SIZE }, object.second.nColor);
+        SDL_Rect playerRect = { (int)object.second.vPos.x, (int)object.second.vPos.y, BLOCK_SIZE, BLOCK_SIZE };
+        if (AABB(view, playerRect))
+            renderChar(0x01, toScreen(playerRect), object.second.nColor);
     }
 
     // Render image if shop is open
-    if (shopOpen && shopImageTexture != NULL)
+    if (shopOpen)
     {
-        SDL_RenderCopy(renderer, shopImageTexture, NULL, NULL);
+        spriteBatch.Draw(assets.Texture(shopImage), NULL, { 0, 0, WINDOW_WIDTH, WINDOW_HEIGHT });
     }
 
-    // Render scoreboard if shop isn't open
+    // Render scoreboard if shop isn't open, only redrawing its rows when the roster has changed
     if (!shopOpen && currentKeyStates[SDL_SCANCODE_TAB])
     {
-        renderScoreboard(mapObjects);
+        if (nRosterVersion != scoreboardLayerVersion)
+        {
+            scoreboardLayerVersion = nRosterVersion;
+            scoreboardLayer.dirty = true;
+        }
+        compositeLayer(scoreboardLayer, []() { renderScoreboard(leaderboard); });
     }
+    spriteBatch.Flush(renderer);
     SDL_RenderPresent(renderer);
+
+    frameDrawCalls = spriteBatch.DrawCalls();
+    frameQuads = spriteBatch.Quads();
 }
 #pragma endregion
 
@@ -476,6 +827,7 @@ void waitForConnection()
     SDL_Point textSize = getTextSize(waitingText);
     SDL_Rect rect = { (WINDOW_WIDTH - textSize.x) / 2, (WINDOW_HEIGHT - textSize.y) / 2, textSize.x, textSize.y };
     renderText("Waiting for connection...", rect);
+    spriteBatch.Flush(renderer);
     SDL_RenderPresent(renderer);
 }
 
@@ -486,8 +838,29 @@ void handleEvents()
     {
         if (event.type == SDL_QUIT)
         {
-            close();
-            exit(0);
+            // The main loop shuts the network thread down before closing SDL
+            quitRequested = true;
+        }
+        else if (event.type == SDL_RENDER_TARGETS_RESET)
+        {
+            // The contents of render targets were lost, so every cached layer has to be redrawn
+            invalidateLayers();
+        }
+        else if (event.type == SDL_RENDER_DEVICE_RESET)
+        {
+            // The textures themselves are gone, not just what was drawn into them
+            if (!recreateTextures())
+                std::cerr << "Some textures could not be recreated after the render device was reset" << std::endl;
+        }
+        else if (event.type == SDL_KEYDOWN && event.key.keysym.scancode == SDL_SCANCODE_F12 && !event.key.repeat)
+        {
+            // Picked up by the main loop, which knows where to write the frame statistics
+            frameStatsDumpRequested = true;
+        }
+        else if (event.type == SDL_KEYDOWN && event.key.keysym.scancode == SDL_SCANCODE_F11 && !event.key.repeat)
+        {
+            // Same for the trace, see networking/trace.h
+            traceDumpRequested = true;
         }
     }
 
@@ -506,22 +879,20 @@ void shopLogic()
         {
             // Close the shop if it's already open
             shopOpen = false;
-            SDL_DestroyTexture(shopImageTexture);
-            shopImageTexture = nullptr;
             Mix_PlayChannel(-1, shopCloseSound, 0);
         }
         else
         {
             // Check if the player is touching the shop
-            if (AABB(playerRect, shopRect))
+            if (touchingObject(playerRect, WorldObjectType::Shop))
             {
-                shopOpen = true;
-                shopImageTexture = loadTexture(shopImagePath);
+                // The shop image stays resident, so opening the shop is only a flag flip and a sound
+                TFG_TRACE_SCOPE("openShop");
+                shopOpen = assets.Texture(shopImage) != nullptr;
                 Mix_PlayChannel(-1, shopOpenSound, 0);
-                if (shopImageTexture == nullptr)
+                if (!shopOpen)
                 {
                     std::cerr << "Failed to load shop image!" << std::endl;
-                    shopOpen = false;
                 }
             }
         }
@@ -571,7 +942,7 @@ void rockMining(float deltaTime)
     static bool isMining = false;
     static float accumulatedTime = 0.0f;
 
-    if (currentKeyStates[SDL_SCANCODE_SPACE] && AABB(playerRect, rockRect))
+    if (currentKeyStates[SDL_SCANCODE_SPACE] && touchingObject(playerRect, WorldObjectType::Rock))
     {
         accumulatedTime += deltaTime;
 
@@ -638,26 +1009,23 @@ void updateClientObjects(float deltaTime)
     {
         sVector2 vPotentialPosition = object.second.vPos + object.second.vVel * deltaTime;
 
+        // Never past the wall around the world, even where its chunks haven't arrived yet
         if (vPotentialPosition.x < BLOCK_SIZE)
             vPotentialPosition.x = BLOCK_SIZE;
 
-        if (vPotentialPosition.x > WINDOW_WIDTH - BLOCK_SIZE - PLAYER_SIZE)
-            vPotentialPosition.x = WINDOW_WIDTH - BLOCK_SIZE - PLAYER_SIZE;
+        if (vPotentialPosition.x > worldWidth() - BLOCK_SIZE - PLAYER_SIZE)
+            vPotentialPosition.x = worldWidth() - BLOCK_SIZE - PLAYER_SIZE;
 
         if (vPotentialPosition.y < BLOCK_SIZE)
             vPotentialPosition.y = BLOCK_SIZE;
 
-        if (vPotentialPosition.y > WINDOW_HEIGHT - BLOCK_SIZE - PLAYER_SIZE)
-            vPotentialPosition.y = WINDOW_HEIGHT - BLOCK_SIZE - PLAYER_SIZE;
-
-        // Shop and rock collision detection
-        SDL_Rect shopRect = { 70, 30, 100, 20 };
-        SDL_Rect rockRect = { (WINDOW_WIDTH / 2) - (BLOCK_SIZE / 2), (WINDOW_HEIGHT / 2) - (BLOCK_SIZE / 2), BLOCK_SIZE, BLOCK_SIZE };
+        if (vPotentialPosition.y > worldHeight() - BLOCK_SIZE - PLAYER_SIZE)
+            vPotentialPosition.y = worldHeight() - BLOCK_SIZE - PLAYER_SIZE;
 
-        if (!AABB({ static_cast<int>(vPotentialPosition.x), static_cast<int>(vPotentialPosition.y), playerRect.w, playerRect.h }, shopRect) &&
-            !AABB({ static_cast<int>(vPotentialPosition.x), static_cast<int>(vPotentialPosition.y), playerRect.w, playerRect.h }, rockRect)) {
+        // Shop, rock and wall collision detection, against the chunks we have
+        if (!worldBlocked({ static_cast<int>(vPotentialPosition.x), static_cast<int>(vPotentialPosition.y), playerRect.w, playerRect.h })) {
             object.second.vPos = vPotentialPosition;
         }
     }
 }
-#pragma endregion
\ No newline at end of file
+#pragma endregion
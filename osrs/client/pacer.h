@@ -0,0 +1,292 @@
+#pragma once
+#include <SDL.h>
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+/// <summary>
+/// Frame pacing and frame-time statistics for the client main loop.
+/// The pacer uses SDL's high-resolution performance counter instead of millisecond ticks, so a 144 FPS target
+/// really waits 6.94 ms instead of 6. It sleeps with SDL_Delay until it is close to the deadline and spins for
+/// the rest, since sleeping alone oversleeps by the OS scheduler granularity. Deadlines advance by exactly one
+/// period each frame so rounding errors don't accumulate into drift.
+/// In vsync mode presenting already blocks on the display, so the pacer only measures.
+/// </summary>
+
+// Rolling window of samples with a fixed-resolution histogram for cheap percentile queries
+class RollingHistogram
+{
+public:
+    static constexpr size_t WINDOW = 1024;
+    static constexpr double BUCKET_MS = 0.05;
+    static constexpr size_t BUCKETS = 2000; // Covers 0-100 ms, anything above lands in the last bucket
+
+    void Add(double ms)
+    {
+        if (m_nCount == WINDOW)
+        {
+            // Evict the oldest sample before overwriting it
+            m_vBuckets[Bucket(m_vSamples[m_nNext])]--;
+            m_fSum -= m_vSamples[m_nNext];
+        }
+        else
+        {
+            m_nCount++;
+        }
+
+        m_vSamples[m_nNext] = ms;
+        m_vBuckets[Bucket(ms)]++;
+        m_fSum += ms;
+        m_nNext = (m_nNext + 1) % WINDOW;
+    }
+
+    // Upper edge of the bucket containing the requested percentile (0-100)
+    double Percentile(double p) const
+    {
+        if (m_nCount == 0)
+            return 0.0;
+
+        size_t nTarget = static_cast<size_t>(p / 100.0 * (m_nCount - 1)) + 1;
+        size_t nSeen = 0;
+        for (size_t i = 0; i < BUCKETS; i++)
+        {
+            nSeen += m_vBuckets[i];
+            if (nSeen >= nTarget)
+                return (i + 1) * BUCKET_MS;
+        }
+        return BUCKETS * BUCKET_MS;
+    }
+
+    double Max() const
+    {
+        double fMax = 0.0;
+        for (size_t i = 0; i < m_nCount; i++)
+            fMax = std::max(fMax, m_vSamples[i]);
+        return fMax;
+    }
+
+    double Mean() const
+    {
+        return m_nCount > 0 ? m_fSum / m_nCount : 0.0;
+    }
+
+    size_t Count() const
+    {
+        return m_nCount;
+    }
+
+    // Samples in the window, oldest first
+    std::vector<double> Samples() const
+    {
+        std::vector<double> vOut;
+        size_t nStart = m_nCount == WINDOW ? m_nNext : 0;
+        for (size_t i = 0; i < m_nCount; i++)
+            vOut.push_back(m_vSamples[(nStart + i) % WINDOW]);
+        return vOut;
+    }
+
+private:
+    static size_t Bucket(double ms)
+    {
+        if (ms <= 0.0)
+            return 0;
+        return std::min(BUCKETS - 1, static_cast<size_t>(ms / BUCKET_MS));
+    }
+
+private:
+    std::array<double, WINDOW> m_vSamples{};
+    std::array<uint16_t, BUCKETS> m_vBuckets{};
+    size_t m_nCount = 0;
+    size_t m_nNext = 0;
+    double m_fSum = 0.0;
+};
+
+enum class FrameMetric
+{
+    Frame,
+    Network,
+    Update,
+    Render,
+    Count
+};
+
+// One rolling histogram per phase of the frame
+class FrameStats
+{
+public:
+    void Record(FrameMetric metric, double ms)
+    {
+        m_vHistograms[size_t(metric)].Add(ms);
+    }
+
+    const RollingHistogram& Get(FrameMetric metric) const
+    {
+        return m_vHistograms[size_t(metric)];
+    }
+
+    // Compact "p50/p99/max" summary of a metric, in milliseconds
+    std::string Summary(FrameMetric metric) const
+    {
+        const RollingHistogram& h = Get(metric);
+        char text[64];
+        snprintf(text, sizeof(text), "%.2f/%.2f/%.2f", h.Percentile(50), h.Percentile(99), h.Max());
+        return text;
+    }
+
+    // Write percentiles and the raw samples of every metric to a file
+    bool Dump(const std::string& path) const
+    {
+        std::ofstream file(path);
+        if (!file)
+            return false;
+
+        file << "metric,count,mean_ms,p50_ms,p90_ms,p99_ms,max_ms\n";
+        for (size_t i = 0; i < size_t(FrameMetric::Count); i++)
+        {
+            const RollingHistogram& h = m_vHistograms[i];
+            file << Name(FrameMetric(i)) << "," << h.Count() << "," << h.Mean() << "," << h.Percentile(50) << ","
+                << h.Percentile(90) << "," << h.Percentile(99) << "," << h.Max() << "\n";
+        }
+
+        file << "\nmetric,samples_ms\n";
+        for (size_t i = 0; i < size_t(FrameMetric::Count); i++)
+        {
+            file << Name(FrameMetric(i));
+            for (double ms : m_vHistograms[i].Samples())
+                file << "," << ms;
+            file << "\n";
+        }
+        return true;
+    }
+
+    static const char* Name(FrameMetric metric)
+    {
+        switch (metric)
+        {
+            case FrameMetric::Frame: return "frame";
+            case FrameMetric::Network: return "network";
+            case FrameMetric::Update: return "update";
+            case FrameMetric::Render: return "render";
+            default: return "unknown";
+        }
+    }
+
+private:
+    std::array<RollingHistogram, size_t(FrameMetric::Count)> m_vHistograms;
+};
+
+// Measures the time between two points with the performance counter
+class ScopedFrameTimer
+{
+public:
+    ScopedFrameTimer(FrameStats& stats, FrameMetric metric) : m_stats(stats), m_nMetric(metric), m_nStart(SDL_GetPerformanceCounter())
+    {
+    }
+
+    ~ScopedFrameTimer()
+    {
+        m_stats.Record(m_nMetric, (SDL_GetPerformanceCounter() - m_nStart) * 1000.0 / SDL_GetPerformanceFrequency());
+    }
+
+private:
+    FrameStats& m_stats;
+    FrameMetric m_nMetric;
+    Uint64 m_nStart;
+};
+
+class FramePacer
+{
+public:
+    FramePacer(FrameStats& stats, double fTargetFPS = 144.0) : m_stats(stats)
+    {
+        m_nFrequency = SDL_GetPerformanceFrequency();
+        SetTargetRate(fTargetFPS);
+        SetSpinThreshold(2.0);
+        m_nLastFrame = SDL_GetPerformanceCounter();
+        m_nDeadline = m_nLastFrame;
+    }
+
+public:
+    // A target of 0 or less leaves the frame rate uncapped
+    void SetTargetRate(double fTargetFPS)
+    {
+        m_nPeriod = fTargetFPS > 0.0 ? static_cast<Uint64>(m_nFrequency / fTargetFPS) : 0;
+    }
+
+    // Let SDL_RenderPresent block on the display instead of sleeping, pacing to the display refresh rate
+    bool EnableVsync(SDL_Renderer* renderer)
+    {
+        if (SDL_RenderSetVSync(renderer, 1) != 0)
+            return false;
+        m_bVsync = true;
+        return true;
+    }
+
+    // How long to sleep before spinning. Should be a bit larger than the OS sleep granularity
+    void SetSpinThreshold(double ms)
+    {
+        m_nSpinThreshold = static_cast<Uint64>(ms / 1000.0 * m_nFrequency);
+    }
+
+    // Start a new frame, returning the time since the previous frame started in seconds
+    float BeginFrame()
+    {
+        Uint64 nNow = SDL_GetPerformanceCounter();
+        Uint64 nElapsed = nNow - m_nLastFrame;
+        m_nLastFrame = nNow;
+
+        if (m_nFrames > 0)
+            m_stats.Record(FrameMetric::Frame, nElapsed * 1000.0 / m_nFrequency);
+        m_nFrames++;
+
+        return static_cast<float>(double(nElapsed) / m_nFrequency);
+    }
+
+    // Wait until it is time to start the next frame
+    void EndFrame()
+    {
+        if (m_bVsync || m_nPeriod == 0)
+            return;
+
+        m_nDeadline += m_nPeriod;
+
+        // If we fell more than a frame behind, don't try to catch up with a burst of short frames
+        Uint64 nNow = SDL_GetPerformanceCounter();
+        if (nNow > m_nDeadline + m_nPeriod)
+        {
+            m_nDeadline = nNow;
+            return;
+        }
+
+        // Coarse sleep while the deadline is comfortably far away
+        while (m_nDeadline > nNow && m_nDeadline - nNow > m_nSpinThreshold)
+        {
+            Uint64 nSleepMs = (m_nDeadline - nNow - m_nSpinThreshold) * 1000 / m_nFrequency;
+            SDL_Delay(static_cast<Uint32>(std::max<Uint64>(1, nSleepMs)));
+            nNow = SDL_GetPerformanceCounter();
+        }
+
+        // Spin for the remainder to hit the deadline precisely
+        while (SDL_GetPerformanceCounter() < m_nDeadline)
+        {
+        }
+    }
+
+    uint64_t FrameCount() const
+    {
+        return m_nFrames;
+    }
+
+private:
+    FrameStats& m_stats;
+    Uint64 m_nFrequency = 1;
+    Uint64 m_nPeriod = 0;
+    Uint64 m_nSpinThreshold = 0;
+    Uint64 m_nLastFrame = 0;
+    Uint64 m_nDeadline = 0;
+    uint64_t m_nFrames = 0;
+    bool m_bVsync = false;
+};
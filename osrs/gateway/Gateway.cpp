@@ -0,0 +1,366 @@
+#include "../server/common.h"
+
+/// <summary>
+/// Gateway process in front of a game server started with --gateway-key, see networking/gateway.h.
+/// Clients connect to the gateway exactly like they would to the server. The gateway does the handshake, the
+/// heartbeats and the flood protection, and keeps a few long-lived connections to the server, the upstreams,
+/// that carry the messages of all its clients. Each client is pinned to one upstream for as long as it is
+/// connected, so its messages stay in order, and broadcasts arrive once per upstream and are fanned out here.
+/// Upstreams that drop are reconnected, and the clients they carried are disconnected, so they resume their
+/// sessions like after any other dropped connection.
+/// </summary>
+
+class Gateway : public tfg::net::server_interface<GameMsg>
+{
+public:
+	Gateway(uint16_t nPort, const std::string& sServerHost, uint16_t nServerPort, size_t nUpstreams, uint64_t nKey)
+		: tfg::net::server_interface<GameMsg>(nPort), m_sServerHost(sServerHost), m_nServerPort(nServerPort), m_nKey(nKey)
+	{
+		ConfigureClientTimeouts(*this);
+		SetRateLimits(ClientRateLimits());
+		m_vUpstreams.resize(std::max<size_t>(nUpstreams, 1));
+
+		SchedulePeriodic("upstreams", UPSTREAM_POLL_INTERVAL, [this]() { PollUpstreams(); });
+		SchedulePeriodic("stats", STATS_INTERVAL, [this]() { ReportStats(); });
+	}
+
+private:
+	struct sUpstream
+	{
+		std::shared_ptr<tfg::net::connection<GameMsg>> link;
+		bool bReady = false;
+		std::chrono::steady_clock::time_point tNextAttempt;
+
+		// Clients carried by this upstream, by tag
+		std::unordered_map<uint32_t, std::shared_ptr<tfg::net::connection<GameMsg>>> mapClients;
+	};
+
+	static constexpr std::chrono::milliseconds UPSTREAM_POLL_INTERVAL{ 100 };
+	static constexpr std::chrono::seconds UPSTREAM_RECONNECT_INTERVAL{ 1 };
+	static constexpr std::chrono::seconds STATS_INTERVAL{ 10 };
+
+	std::string m_sServerHost;
+	uint16_t m_nServerPort = 0;
+	uint64_t m_nKey = 0;
+
+	std::vector<sUpstream> m_vUpstreams;
+
+	// Which upstream each client was pinned to, by tag. The tag is the client's connection ID at the gateway
+	std::unordered_map<uint32_t, size_t> m_mapClientUpstream;
+
+	uint64_t m_nForwarded = 0, m_nDelivered = 0, m_nBroadcasts = 0, m_nFannedOut = 0, m_nRefused = 0;
+	uint64_t m_nReported = 0;
+	size_t m_nReportedClients = 0;
+
+	// Open an upstream connection for every slot that has none, and give up on the ones that died
+	void PollUpstreams()
+	{
+		auto tNow = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < m_vUpstreams.size(); i++)
+		{
+			sUpstream& upstream = m_vUpstreams[i];
+
+			// One that isn't linked by the time the next attempt is due never will be, a failed connect can leave it hanging
+			if (upstream.link && (upstream.bReady ? !upstream.link->IsConnected() : tNow >= upstream.tNextAttempt))
+				DropUpstream(i);
+
+			if (upstream.link || tNow < upstream.tNextAttempt)
+				continue;
+
+			upstream.tNextAttempt = tNow + UPSTREAM_RECONNECT_INTERVAL;
+			try
+			{
+				asio::ip::tcp::resolver resolver(m_asioContext);
+				auto endpoints = resolver.resolve(m_sServerHost, std::to_string(m_nServerPort));
+				upstream.link = std::make_shared<tfg::net::connection<GameMsg>>(tfg::net::connection<GameMsg>::owner::client,
+					m_asioContext, asio::ip::tcp::socket(m_asioContext), m_qMessagesIn);
+				upstream.link->ConnectToServer(endpoints);
+			}
+			catch (std::exception& e)
+			{
+				std::cerr << "[GATEWAY] Unable to reach " << m_sServerHost << ":" << m_nServerPort << ": " << e.what() << "\n";
+			}
+		}
+	}
+
+	void DropUpstream(size_t nUpstream)
+	{
+		sUpstream& upstream = m_vUpstreams[nUpstream];
+		if (upstream.bReady)
+			std::cout << "[GATEWAY] Upstream " << nUpstream << " lost, dropping " << upstream.mapClients.size() << " clients\n";
+
+		upstream.link->Disconnect();
+		upstream.link.reset();
+		upstream.bReady = false;
+
+		// Their OnClientDisconnect() has nowhere to report to any more
+		auto mapClients = std::move(upstream.mapClients);
+		upstream.mapClients.clear();
+		for (auto& client : mapClients)
+		{
+			m_mapClientUpstream.erase(client.first);
+			client.second->Disconnect();
+		}
+	}
+
+	// The upstream a message came in on, if it did
+	sUpstream* FindUpstream(const std::shared_ptr<tfg::net::connection<GameMsg>>& client)
+	{
+		for (auto& upstream : m_vUpstreams)
+		{
+			if (upstream.link && upstream.link == client)
+				return &upstream;
+		}
+		return nullptr;
+	}
+
+	// Pin a new client to an upstream, spreading them by tag and skipping upstreams that aren't ready
+	void AssignUpstream(std::shared_ptr<tfg::net::connection<GameMsg>> client)
+	{
+		uint32_t nTag = client->GetID();
+		if (m_mapClientUpstream.count(nTag))
+			return;
+
+		for (size_t i = 0; i < m_vUpstreams.size(); i++)
+		{
+			size_t nUpstream = (nTag + i) % m_vUpstreams.size();
+			sUpstream& upstream = m_vUpstreams[nUpstream];
+			if (!upstream.bReady || !upstream.link->IsConnected())
+				continue;
+
+			upstream.mapClients[nTag] = client;
+			m_mapClientUpstream[nTag] = nUpstream;
+
+			tfg::net::message<GameMsg> msg;
+			msg.header.id = GameMsg::Gateway_Connected;
+			msg << nTag;
+			upstream.link->Send(msg);
+			return;
+		}
+
+		// Nowhere to send it, the client will try again
+		m_nRefused++;
+		client->Disconnect();
+	}
+
+	void OnUpstreamMessage(sUpstream& upstream, tfg::net::message<GameMsg>& msg)
+	{
+		switch (msg.header.id)
+		{
+			case GameMsg::Client_Accepted:
+			{
+				tfg::net::message<GameMsg> msgHello;
+				msgHello.header.id = GameMsg::Gateway_Hello;
+				msgHello << m_nKey;
+				upstream.link->Send(msgHello);
+				break;
+			}
+
+			// The server took us on as a gateway
+			case GameMsg::Gateway_Hello:
+			{
+				upstream.bReady = true;
+				std::cout << "[GATEWAY] Upstream linked to " << m_sServerHost << ":" << m_nServerPort << "\n";
+				break;
+			}
+
+			case GameMsg::Server_Heartbeat:
+			{
+				upstream.link->Send(msg);
+				break;
+			}
+
+			case GameMsg::Gateway_Deliver:
+			case GameMsg::Gateway_Broadcast:
+			{
+				uint32_t nTag = 0;
+				tfg::net::message<GameMsg> inner;
+				if (!tfg::net::unwrap_message(msg, nTag, inner))
+				{
+					std::cout << "[GATEWAY] Malformed frame from upstream\n";
+					break;
+				}
+
+				if (msg.header.id == GameMsg::Gateway_Deliver)
+				{
+					auto it = upstream.mapClients.find(nTag);
+					if (it != upstream.mapClients.end())
+					{
+						it->second->Send(inner);
+						m_nDelivered++;
+					}
+				}
+				else
+				{
+					// Tagged with the client that must not get it, if any
+					for (auto& client : upstream.mapClients)
+					{
+						if (client.first != nTag && client.second->IsConnected())
+							client.second->Send(inner);
+					}
+					m_nBroadcasts++;
+					m_nFannedOut += upstream.mapClients.size();
+				}
+				break;
+			}
+
+			case GameMsg::Gateway_Close:
+			{
+				uint32_t nTag = 0;
+				msg >> nTag;
+				auto it = upstream.mapClients.find(nTag);
+				if (it != upstream.mapClients.end())
+					it->second->Disconnect();
+				break;
+			}
+
+			default:
+				break;
+		}
+	}
+
+	// Log what went through, only when something did
+	void ReportStats()
+	{
+		uint64_t nTotal = m_nForwarded + m_nDelivered + m_nBroadcasts + m_nRefused;
+		if (nTotal == m_nReported && m_mapClientUpstream.size() == m_nReportedClients)
+			return;
+
+		size_t nReady = std::count_if(m_vUpstreams.begin(), m_vUpstreams.end(), [](const sUpstream& upstream) { return upstream.bReady; });
+		std::cout << "[GATEWAY] " << m_mapClientUpstream.size() << " clients on " << nReady << " of " << m_vUpstreams.size() << " upstreams, "
+			<< m_nForwarded << " forwarded, " << m_nDelivered << " delivered, " << m_nBroadcasts << " broadcasts fanned out to "
+			<< m_nFannedOut << " clients, " << m_nRefused << " refused\n";
+		std::cout << "[SCHEDULER] " << GetSchedulerSummary() << "\n";
+		m_nReported = nTotal;
+		m_nReportedClients = m_mapClientUpstream.size();
+	}
+
+protected:
+	bool OnClientConnect(std::shared_ptr<tfg::net::connection<GameMsg>> client) override
+	{
+		return true;
+	}
+
+	// Called on the asio thread, so the client is pinned to an upstream once the game thread gets to it
+	void OnClientValidated(std::shared_ptr<tfg::net::connection<GameMsg>> client) override
+	{
+		tfg::net::message<GameMsg> msg;
+		msg.header.id = GameMsg::Gateway_Connected;
+		InjectMessage(client, msg);
+	}
+
+	void OnClientDisconnect(std::shared_ptr<tfg::net::connection<GameMsg>> client) override
+	{
+		if (!client)
+			return;
+
+		auto it = m_mapClientUpstream.find(client->GetID());
+		if (it == m_mapClientUpstream.end())
+			return;
+
+		sUpstream& upstream = m_vUpstreams[it->second];
+		upstream.mapClients.erase(it->first);
+		if (upstream.link && upstream.link->IsConnected())
+		{
+			tfg::net::message<GameMsg> msg;
+			msg.header.id = GameMsg::Gateway_Disconnected;
+			msg << it->first;
+			upstream.link->Send(msg);
+		}
+		m_mapClientUpstream.erase(it);
+	}
+
+	void OnMessage(std::shared_ptr<tfg::net::connection<GameMsg>> client, tfg::net::message<GameMsg>& msg) override
+	{
+		if (sUpstream* upstream = FindUpstream(client))
+		{
+			OnUpstreamMessage(*upstream, msg);
+			return;
+		}
+
+		switch (msg.header.id)
+		{
+			// Heartbeats are between the client and us
+			case GameMsg::Server_Heartbeat:
+				break;
+
+			// Only the one injected by OnClientValidated() comes first, anything a client sends later is ignored
+			case GameMsg::Gateway_Connected:
+				AssignUpstream(client);
+				break;
+
+			case GameMsg::Gateway_Hello:
+			case GameMsg::Gateway_Disconnected:
+			case GameMsg::Gateway_Forward:
+			case GameMsg::Gateway_Deliver:
+			case GameMsg::Gateway_Broadcast:
+			case GameMsg::Gateway_Close:
+				break;
+
+			default:
+			{
+				auto it = m_mapClientUpstream.find(client->GetID());
+				if (it == m_mapClientUpstream.end())
+					break;
+
+				sUpstream& upstream = m_vUpstreams[it->second];
+				upstream.link->Send(tfg::net::wrap_message(GameMsg::Gateway_Forward, it->first, msg));
+				m_nForwarded++;
+				break;
+			}
+		}
+	}
+};
+
+int main(int argc, char* args[])
+{
+	// Usage: gateway [--port <port>] [--server <host:port>] [--upstreams <count>] --gateway-key <number>
+	uint16_t nPort = 60100;
+	std::string sServerHost = "127.0.0.1";
+	uint16_t nServerPort = 60000;
+	size_t nUpstreams = 2;
+	uint64_t nKey = 0;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = args[i];
+		if (arg == "--port" && i + 1 < argc)
+			nPort = uint16_t(std::stoi(args[++i]));
+		else if (arg == "--server" && i + 1 < argc)
+		{
+			std::string sServer = args[++i];
+			size_t nColon = sServer.rfind(':');
+			if (nColon == std::string::npos || nColon == 0 || nColon + 1 == sServer.size())
+			{
+				std::cerr << "Expected --server host:port\n";
+				return 1;
+			}
+			sServerHost = sServer.substr(0, nColon);
+			nServerPort = uint16_t(std::stoi(sServer.substr(nColon + 1)));
+		}
+		else if (arg == "--upstreams" && i + 1 < argc)
+			nUpstreams = std::stoul(args[++i]);
+		else if (arg == "--gateway-key" && i + 1 < argc)
+			nKey = std::stoull(args[++i]);
+	}
+
+	// The server turns away gateways without a key, see networking/gateway.h
+	if (nKey == 0)
+	{
+		std::cerr << "--gateway-key is required, other than 0 and the same as the server's\n";
+		return 1;
+	}
+
+	Gateway gateway(nPort, sServerHost, nServerPort, nUpstreams, nKey);
+	if (!gateway.Start())
+		return 1;
+
+	// Messages are handled for at most this long at a time, so upstreams are looked after on time under load
+	constexpr std::chrono::milliseconds UPDATE_BUDGET{ 5 };
+
+	while (1)
+	{
+		gateway.Update(std::chrono::steady_clock::time_point::max(), UPDATE_BUDGET);
+	}
+	return 0;
+}
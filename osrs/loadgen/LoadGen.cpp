@@ -0,0 +1,419 @@
+#include "../server/common.h"
+
+/// <summary>
+/// Headless load generator: connects many bot clients to a running server and measures how long joining takes.
+/// All bots share one asio context and one thread instead of a context and thread per client, so a single
+/// process can hold thousands of connections. The context must stay single threaded, since connection
+/// handlers are not synchronised with each other. Each bot has its own incoming queue, polled from main.
+/// A bot joins like the real client does: it answers Client_Accepted with Client_RegisterWithServer, and counts
+/// as joined once it has both its ID and the roster. Join latency is measured from sending the registration,
+/// and reported overall and per group of joins, since the later joins see the most players.
+/// With --blip, some bots drop their connection once everyone has joined and come back right away, resuming their
+/// session like the real client does, and the time until they are back in the room is reported too.
+/// Against a cluster, bots follow redirects to other nodes by resuming their session there, and the time from the
+/// redirect until they are in the new node's room is reported as hand-off latency.
+/// The longest time each bot went without hearing from the server after joining is reported as well, which is what a
+/// hot restart of the server during --hold should keep short, without any bot losing its connection.
+/// </summary>
+
+struct sBot
+{
+	tfg::net::tsqueue<tfg::net::owned_message<GameMsg>> qMessagesIn;
+	std::unique_ptr<tfg::net::connection<GameMsg>> connection;
+
+	uint32_t nID = 0;
+	uint64_t nToken = 0;
+	bool bAssigned = false;
+	bool bRegistered = false;
+	bool bHasRoster = false;
+	bool bJoined = false;
+	size_t nJoinOrder = 0;
+	size_t nRosterSize = 0;
+
+	std::chrono::steady_clock::time_point tRegister;
+	std::chrono::steady_clock::time_point tNextUpdate;
+	double fJoinMs = 0.0;
+	sPlayerDescription desc;
+
+	// Since joining
+	std::chrono::steady_clock::time_point tLastMessage;
+	double fLongestSilenceMs = 0.0;
+
+	// Reconnecting after a blip
+	bool bReconnecting = false;
+	std::chrono::steady_clock::time_point tReconnect;
+	double fReconnectMs = 0.0;
+
+	// Moving to another cluster node after a redirect
+	bool bMoving = false;
+	std::chrono::steady_clock::time_point tRedirect;
+};
+
+// How long after the last join the blip happens
+static constexpr std::chrono::seconds BLIP_DELAY{ 3 };
+
+static double Percentile(std::vector<double> vSamples, double p)
+{
+	if (vSamples.empty())
+		return 0.0;
+	std::sort(vSamples.begin(), vSamples.end());
+	return vSamples[static_cast<size_t>(p / 100.0 * (vSamples.size() - 1))];
+}
+
+int main(int argc, char* args[])
+{
+	// Usage: loadgen [--host <address>] [--port <port>] [--bots <count>] [--join-rate <bots/s>] [--update-hz <rate>] [--hold <seconds>] [--blip <bots>] [--no-resume] [--no-compression]
+	std::string host = "127.0.0.1";
+	uint16_t port = 60000;
+	int nBots = 1000, nJoinRate = 200;
+	int nBlip = 0;
+	double fUpdateHz = 0.0, fHoldSeconds = 0.0;
+	bool bCompression = true, bResume = true;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = args[i];
+		if (arg == "--host" && i + 1 < argc)
+			host = args[++i];
+		else if (arg == "--port" && i + 1 < argc)
+			port = uint16_t(std::stoi(args[++i]));
+		else if (arg == "--bots" && i + 1 < argc)
+			nBots = std::max(1, std::stoi(args[++i]));
+		else if (arg == "--join-rate" && i + 1 < argc)
+			nJoinRate = std::max(1, std::stoi(args[++i]));
+		else if (arg == "--update-hz" && i + 1 < argc)
+			fUpdateHz = std::stod(args[++i]);
+		else if (arg == "--hold" && i + 1 < argc)
+			fHoldSeconds = std::stod(args[++i]);
+		else if (arg == "--blip" && i + 1 < argc)
+			nBlip = std::max(0, std::stoi(args[++i]));
+		else if (arg == "--no-resume")
+			bResume = false;
+		else if (arg == "--no-compression")
+			bCompression = false;
+	}
+
+	asio::io_context context;
+	auto work = asio::make_work_guard(context);
+	std::thread threadContext([&context]() { context.run(); });
+
+	asio::ip::tcp::resolver resolver(context);
+	asio::ip::tcp::resolver::results_type endpoints;
+	try
+	{
+		endpoints = resolver.resolve(host, std::to_string(port));
+	}
+	catch (std::exception& e)
+	{
+		std::cerr << "Unable to resolve " << host << ": " << e.what() << "\n";
+		return 1;
+	}
+
+	std::vector<std::unique_ptr<sBot>> vBots;
+	vBots.reserve(nBots);
+
+	// Connections dropped by a blip may still have handlers pending on the context, so they are kept until the end
+	std::vector<std::unique_ptr<tfg::net::connection<GameMsg>>> vDroppedConnections;
+	size_t nBlipped = 0, nReconnected = 0;
+	uint64_t nBlipMessages = 0, nBlipBytes = 0;
+
+	// Cluster nodes bots were redirected to, resolved once each
+	std::unordered_map<std::string, asio::ip::tcp::resolver::results_type> mapNodeEndpoints;
+	std::vector<double> vHandOffMs;
+	size_t nRedirectFailures = 0;
+
+	auto tStart = std::chrono::steady_clock::now();
+	auto tLastProgress = tStart;
+	auto updatePeriod = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(fUpdateHz > 0.0 ? 1.0 / fUpdateHz : 0.0));
+	size_t nJoined = 0, nLastJoined = 0;
+	auto tLastJoin = tStart;
+	auto holdPeriod = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(fHoldSeconds));
+
+	std::cout << "[LOADGEN] Connecting " << nBots << " bots to " << host << ":" << port << " at " << nJoinRate << " bots/s\n";
+
+	// Once everyone has joined, optionally keep the bots sending updates for a while
+	while (nJoined < size_t(nBots) || (nBlip > 0 && nBlipped == 0) || nReconnected < nBlipped || std::chrono::steady_clock::now() - tLastJoin < holdPeriod)
+	{
+		auto tNow = std::chrono::steady_clock::now();
+
+		// Once everyone is in and things have settled, drop some connections and reconnect straight away
+		if (nBlip > 0 && nBlipped == 0 && nJoined == size_t(nBots) && tNow - tLastJoin >= BLIP_DELAY)
+		{
+			for (auto& bot : vBots)
+			{
+				if (nBlipped == size_t(nBlip))
+					break;
+
+				bot->connection->Disconnect();
+				vDroppedConnections.push_back(std::move(bot->connection));
+				bot->connection = std::make_unique<tfg::net::connection<GameMsg>>(tfg::net::connection<GameMsg>::owner::client,
+					context, asio::ip::tcp::socket(context), bot->qMessagesIn);
+				bot->connection->ConnectToServer(endpoints);
+				bot->bReconnecting = true;
+				bot->bAssigned = false;
+				bot->bHasRoster = false;
+				bot->tReconnect = tNow;
+				nBlipped++;
+			}
+			std::cout << "[LOADGEN] Dropped " << nBlipped << " connections, reconnecting " << (bResume ? "with" : "without") << " session resume\n";
+		}
+
+		// Connect new bots at the requested rate
+		size_t nDue = std::min<size_t>(nBots, size_t(std::chrono::duration<double>(tNow - tStart).count() * nJoinRate) + 1);
+		while (vBots.size() < nDue)
+		{
+			auto bot = std::make_unique<sBot>();
+			bot->connection = std::make_unique<tfg::net::connection<GameMsg>>(tfg::net::connection<GameMsg>::owner::client,
+				context, asio::ip::tcp::socket(context), bot->qMessagesIn);
+			bot->connection->ConnectToServer(endpoints);
+			vBots.push_back(std::move(bot));
+		}
+
+		bool bIdle = true;
+		for (auto& bot : vBots)
+		{
+			while (!bot->qMessagesIn.empty())
+			{
+				bIdle = false;
+				auto msg = bot->qMessagesIn.pop_front().msg;
+				if (bot->bJoined)
+				{
+					auto tMessage = std::chrono::steady_clock::now();
+					bot->fLongestSilenceMs = std::max(bot->fLongestSilenceMs, std::chrono::duration<double, std::milli>(tMessage - bot->tLastMessage).count());
+					bot->tLastMessage = tMessage;
+				}
+				if (nReconnected < nBlipped)
+				{
+					nBlipMessages++;
+					nBlipBytes += msg.size();
+				}
+
+				switch (msg.header.id)
+				{
+					case GameMsg::Client_Accepted:
+					{
+						uint32_t nServerCapabilities = 0;
+						if (msg.body.size() >= sizeof(uint32_t))
+							msg >> nServerCapabilities;
+
+						tfg::net::message<GameMsg> msgRegister;
+						msgRegister.header.id = GameMsg::Client_RegisterWithServer;
+						bot->desc.vPos = { 60.0f, 200.0f };
+						msgRegister << uint32_t(bCompression ? nServerCapabilities & tfg::net::CAPABILITY_COMPRESSION : 0);
+						msgRegister << bot->desc;
+						if ((bot->bReconnecting || bot->bMoving) && bResume && bot->nToken != 0)
+						{
+							msgRegister.header.id = GameMsg::Client_ResumeSession;
+							msgRegister << bot->nToken;
+							msgRegister << bot->nID;
+						}
+						bot->tRegister = std::chrono::steady_clock::now();
+						bot->bRegistered = true;
+						bot->connection->Send(msgRegister);
+						break;
+					}
+					case GameMsg::Client_AssignID:
+						msg >> bot->nID;
+						if (msg.body.size() >= sizeof(uint64_t))
+							msg >> bot->nToken;
+						bot->desc.nUniqueID = bot->nID;
+						bot->bAssigned = true;
+						break;
+					case GameMsg::Game_RosterDelta:
+						bot->bHasRoster = true;
+						break;
+					case GameMsg::Game_RosterSnapshot:
+					{
+						uint32_t nPlayers = 0;
+						msg >> nPlayers;
+						bot->nRosterSize = nPlayers;
+						bot->bHasRoster = true;
+						break;
+					}
+					case GameMsg::Server_Heartbeat:
+					{
+						tfg::net::message<GameMsg> msgReply;
+						msgReply.header.id = GameMsg::Server_Heartbeat;
+						bot->connection->Send(msgReply);
+						break;
+					}
+					case GameMsg::Game_RosterVersion:
+					{
+						// Bots apply nothing, so everything before this is as applied as it gets
+						tfg::net::message<GameMsg> msgReply;
+						msgReply.header.id = GameMsg::Game_RosterVersion;
+						uint64_t nVersion = 0;
+						msg >> nVersion;
+						msgReply << nVersion;
+						bot->connection->Send(msgReply);
+						break;
+					}
+					case GameMsg::Client_Redirect:
+					{
+						sNodeAddress address;
+						msg >> address;
+						address.sHost[sizeof(address.sHost) - 1] = '\0';
+						std::string sNode = std::string(address.sHost) + ":" + std::to_string(address.nPort);
+
+						auto it = mapNodeEndpoints.find(sNode);
+						if (it == mapNodeEndpoints.end())
+						{
+							try
+							{
+								it = mapNodeEndpoints.emplace(sNode, resolver.resolve(address.sHost, std::to_string(address.nPort))).first;
+							}
+							catch (std::exception& e)
+							{
+								std::cerr << "Unable to resolve " << sNode << ": " << e.what() << "\n";
+								nRedirectFailures++;
+								break;
+							}
+						}
+
+						bot->connection->Disconnect();
+						vDroppedConnections.push_back(std::move(bot->connection));
+						bot->connection = std::make_unique<tfg::net::connection<GameMsg>>(tfg::net::connection<GameMsg>::owner::client,
+							context, asio::ip::tcp::socket(context), bot->qMessagesIn);
+						bot->connection->ConnectToServer(it->second);
+						bot->bMoving = true;
+						bot->bAssigned = false;
+						bot->bHasRoster = false;
+						bot->tRedirect = std::chrono::steady_clock::now();
+						break;
+					}
+					default:
+						break;
+				}
+
+				if (bot->bMoving && bot->bAssigned && bot->bHasRoster)
+				{
+					bot->bMoving = false;
+					bot->tNextUpdate = std::chrono::steady_clock::now();
+					vHandOffMs.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - bot->tRedirect).count());
+				}
+
+				if (bot->bReconnecting && bot->bAssigned && bot->bHasRoster)
+				{
+					bot->bReconnecting = false;
+					bot->fReconnectMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - bot->tReconnect).count();
+					nReconnected++;
+				}
+
+				if (!bot->bJoined && bot->bRegistered && bot->bAssigned && bot->bHasRoster)
+				{
+					bot->bJoined = true;
+					bot->nJoinOrder = nJoined++;
+					bot->fJoinMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - bot->tRegister).count();
+					bot->tNextUpdate = std::chrono::steady_clock::now();
+					bot->tLastMessage = bot->tNextUpdate;
+				}
+			}
+
+			// Joined bots keep the server busy with position updates, like real clients do
+			if (bot->bJoined && !bot->bReconnecting && !bot->bMoving && fUpdateHz > 0.0 && tNow >= bot->tNextUpdate)
+			{
+				tfg::net::message<GameMsg> msgUpdate;
+				msgUpdate.header.id = GameMsg::Game_UpdatePlayer;
+				bot->desc.vPos.x = 60.0f + float(rand() % 400);
+				msgUpdate << bot->desc;
+				bot->connection->Send(msgUpdate);
+				bot->tNextUpdate += updatePeriod;
+			}
+		}
+
+		if (tNow - tLastProgress > std::chrono::seconds(1))
+		{
+			size_t nConnected = std::count_if(vBots.begin(), vBots.end(), [](const auto& bot) { return bot->connection->IsConnected(); });
+			std::cout << "[LOADGEN] " << vBots.size() << " started, " << nConnected << " connected, " << nJoined << " joined\n";
+			tLastProgress = tNow;
+		}
+
+		// Bots whose connection failed will never join, so don't wait for them forever
+		if (nJoined != nLastJoined)
+		{
+			nLastJoined = nJoined;
+			tLastJoin = tNow;
+		}
+		else if ((nJoined < size_t(nBots) || nReconnected < nBlipped) && vBots.size() == size_t(nBots) && tNow - tLastJoin > std::chrono::seconds(10))
+		{
+			std::cerr << "[LOADGEN] No joins for 10 s, giving up. Is the open file limit high enough?\n";
+			break;
+		}
+
+		if (bIdle)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	std::vector<double> vJoinMs;
+	for (auto& bot : vBots)
+		if (bot->bJoined)
+			vJoinMs.push_back(bot->fJoinMs);
+
+	size_t nStillConnected = std::count_if(vBots.begin(), vBots.end(), [](const auto& bot) { return bot->connection->IsConnected(); });
+	std::cout << "[LOADGEN] " << vJoinMs.size() << " of " << nBots << " bots joined, " << nStillConnected << " still connected, join latency p50/p99/max "
+		<< Percentile(vJoinMs, 50) << "/" << Percentile(vJoinMs, 99) << "/" << Percentile(vJoinMs, 100) << " ms\n";
+
+	std::vector<double> vSilenceMs;
+	for (auto& bot : vBots)
+		if (bot->bJoined)
+			vSilenceMs.push_back(bot->fLongestSilenceMs);
+	std::cout << "[LOADGEN] Longest silence per bot after joining p50/p99/max " << Percentile(vSilenceMs, 50) << "/" << Percentile(vSilenceMs, 99)
+		<< "/" << Percentile(vSilenceMs, 100) << " ms\n";
+
+	if (nBlipped > 0)
+	{
+		std::vector<double> vReconnectMs;
+		for (auto& bot : vBots)
+			if (bot->fReconnectMs > 0.0)
+				vReconnectMs.push_back(bot->fReconnectMs);
+
+		std::cout << "[LOADGEN] " << vReconnectMs.size() << " of " << nBlipped << " bots back after a blip, reconnect latency p50/p99/max "
+			<< Percentile(vReconnectMs, 50) << "/" << Percentile(vReconnectMs, 99) << "/" << Percentile(vReconnectMs, 100) << " ms, "
+			<< nBlipMessages << " messages (" << nBlipBytes << " bytes) received by all bots meanwhile\n";
+	}
+
+	if (!vHandOffMs.empty() || nRedirectFailures > 0)
+	{
+		std::cout << "[LOADGEN] " << vHandOffMs.size() << " hand-offs to other cluster nodes, " << nRedirectFailures << " failed, latency p50/p99/max "
+			<< Percentile(vHandOffMs, 50) << "/" << Percentile(vHandOffMs, 99) << "/" << Percentile(vHandOffMs, 100) << " ms\n";
+	}
+
+	// Wire bytes received in compressed messages against their original size
+	uint64_t nCompressedMessages = 0, nWireBytes = 0, nOriginalBytes = 0, nDecompressNs = 0;
+	for (auto& bot : vBots)
+	{
+		const auto& stats = bot->connection->GetDecompressionStats();
+		nCompressedMessages += stats.nMessages;
+		nWireBytes += stats.nBytesIn;
+		nOriginalBytes += stats.nBytesOut;
+		nDecompressNs += stats.nNanoseconds;
+	}
+	std::cout << "[LOADGEN] Received " << nCompressedMessages << " compressed messages, " << nWireBytes << " bytes on the wire for "
+		<< nOriginalBytes << " bytes of messages, " << nDecompressNs / 1e6 << " ms decompressing\n";
+
+	// Later joins receive bigger rosters, so show how latency grows with the room size
+	size_t nGroup = std::max<size_t>(1, vJoinMs.size() / 10);
+	std::cout << "joins,roster_size,p50_ms,p99_ms,max_ms\n";
+	for (size_t nFirst = 0; nFirst < vJoinMs.size(); nFirst += nGroup)
+	{
+		std::vector<double> vGroup;
+		size_t nRoster = 0;
+		for (auto& bot : vBots)
+		{
+			if (bot->bJoined && bot->nJoinOrder >= nFirst && bot->nJoinOrder < nFirst + nGroup)
+			{
+				vGroup.push_back(bot->fJoinMs);
+				nRoster = std::max(nRoster, bot->nRosterSize);
+			}
+		}
+		std::cout << nFirst << "-" << nFirst + vGroup.size() - 1 << "," << nRoster << "," << Percentile(vGroup, 50) << ","
+			<< Percentile(vGroup, 99) << "," << Percentile(vGroup, 100) << "\n";
+	}
+
+	for (auto& bot : vBots)
+		bot->connection->Disconnect();
+	work.reset();
+	context.stop();
+	threadContext.join();
+	return 0;
+}
@@ -3,6 +3,7 @@
 #include "message.h"
 #include "tsqueue.h"
 #include "connection.h"
+#include "trace.h"
 
 /// <summary>
 /// Copyright 2018 - 2021 OneLoneCoder.com
@@ -39,6 +40,10 @@ namespace tfg
 					asio::ip::tcp::resolver resolver(m_context);
 					asio::ip::tcp::resolver::results_type endpoints = resolver.resolve(host, std::to_string(port));
 
+					std::scoped_lock lock(m_muxConnection);
+					m_sHost = host;
+					m_nPort = port;
+
 					// Create connection
 					m_connection = std::make_unique<connection<T>>(connection<T>::owner::client, m_context, asio::ip::tcp::socket(m_context), m_qMessagesIn);
 
@@ -46,7 +51,7 @@ namespace tfg
 					m_connection->ConnectToServer(endpoints);
 
 					// Start Context Thread
-					thrContext = std::thread([this]() { m_context.run(); });
+					thrContext = std::thread([this]() { TFG_TRACE_THREAD("client asio"); m_context.run(); });
 				}
 				catch (std::exception& e)
 				{
@@ -57,10 +62,40 @@ namespace tfg
 				return true;
 			}
 
+			// Drop the current connection, if any, and connect to the same server again with a new one.
+			// Other threads may keep calling Send() meanwhile, their messages are dropped until the new connection is up
+			bool Reconnect()
+			{
+				return Reconnect(m_sHost, m_nPort);
+			}
+
+			// Same as above, but the new connection goes to another server. The host is copied, it may be our own m_sHost
+			bool Reconnect(const std::string host, const uint16_t port)
+			{
+				{
+					std::scoped_lock lock(m_muxConnection);
+					if (m_connection)
+						m_connection->Disconnect();
+
+					m_context.stop();
+					if (thrContext.joinable())
+						thrContext.join();
+
+					// Let the old connection's handlers run to completion before it is destroyed
+					m_context.restart();
+					m_context.run();
+					m_context.restart();
+					m_connection.reset();
+				}
+
+				return Connect(host, port);
+			}
+
 			// Disconnect from server
 			void Disconnect()
 			{
-				if (IsConnected())
+				std::scoped_lock lock(m_muxConnection);
+				if (m_connection && m_connection->IsConnected())
 				{
 					m_connection->Disconnect();
 				}
@@ -77,6 +112,7 @@ namespace tfg
 			// Check if client is actually connected to a server
 			bool IsConnected()
 			{
+				std::scoped_lock lock(m_muxConnection);
 				if (m_connection)
 					return m_connection->IsConnected();
 				else
@@ -85,7 +121,8 @@ namespace tfg
 
 			void Send(const message<T>& msg)
 			{
-				if (IsConnected())
+				std::scoped_lock lock(m_muxConnection);
+				if (m_connection && m_connection->IsConnected())
 					m_connection->Send(msg);
 			}
 
@@ -108,6 +145,13 @@ namespace tfg
 			// The client has a single instance of a connection object, which handles data transfer
 			std::unique_ptr<connection<T>> m_connection;
 
+			// Guards m_connection, which Reconnect() replaces while other threads may be sending
+			std::mutex m_muxConnection;
+
+			// Where Connect() last went, for Reconnect()
+			std::string m_sHost;
+			uint16_t m_nPort = 0;
+
 		private:
 			// This is the thread safe queue of incoming messages from the server
 			tsqueue<owned_message<T>> m_qMessagesIn;
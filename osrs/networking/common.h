@@ -7,6 +7,7 @@
 #include <algorithm>
 #include <chrono>
 #include <cstdint>
+#include <functional>
 
 #ifdef _WIN32
 #define _WIN32_WINNT 0x0A00
@@ -0,0 +1,106 @@
+#pragma once
+#include "common.h"
+#include "message.h"
+#include "lz.h"
+#include <atomic>
+
+/// <summary>
+/// Per-message compression on top of the lz codec. A compressed message carries MESSAGE_COMPRESSED in its
+/// header flags and its body becomes the original body size followed by the compressed block. Messages are
+/// decompressed by the receiving connection before they reach the incoming queue, so handlers never see them.
+/// Compression is only worth it for big bodies, so only messages at or above a threshold are compressed, and
+/// the result is thrown away if it isn't smaller. Only peers that advertised CAPABILITY_COMPRESSION get
+/// compressed messages, and servers only accept them from such peers.
+/// The stats keep the CPU time spent next to the bytes saved, so the tradeoff can be judged.
+/// </summary>
+
+namespace tfg
+{
+	namespace net
+	{
+		struct compression_stats
+		{
+			std::atomic<uint64_t> nMessages = 0;
+			std::atomic<uint64_t> nSkipped = 0;
+			std::atomic<uint64_t> nBytesIn = 0;
+			std::atomic<uint64_t> nBytesOut = 0;
+			std::atomic<uint64_t> nNanoseconds = 0;
+
+			// e.g. "120 msgs (3 skipped), 480000 -> 52000 bytes (9.23x), 1.42 ms"
+			std::string summary() const
+			{
+				char text[160];
+				uint64_t nIn = nBytesIn, nOut = nBytesOut;
+				snprintf(text, sizeof(text), "%llu msgs (%llu skipped), %llu -> %llu bytes (%.2fx), %.2f ms",
+					(unsigned long long)nMessages.load(), (unsigned long long)nSkipped.load(), (unsigned long long)nIn,
+					(unsigned long long)nOut, nOut > 0 ? double(nIn) / nOut : 0.0, nNanoseconds / 1e6);
+				return text;
+			}
+		};
+
+		// Compress msg into out. Returns false, leaving out untouched, if that wouldn't make the message smaller
+		template<typename T>
+		bool compress_message(const message<T>& msg, message<T>& out, compression_stats& stats)
+		{
+			auto tStart = std::chrono::steady_clock::now();
+
+			std::vector<uint8_t> vBody(sizeof(uint32_t));
+			uint32_t nOriginalSize = uint32_t(msg.body.size());
+			std::memcpy(vBody.data(), &nOriginalSize, sizeof(nOriginalSize));
+			lz::compress(msg.body.data(), msg.body.size(), vBody);
+
+			stats.nNanoseconds += uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - tStart).count());
+
+			if (vBody.size() >= msg.body.size())
+			{
+				stats.nSkipped++;
+				return false;
+			}
+
+			out.header = msg.header;
+			out.header.flags |= MESSAGE_COMPRESSED;
+			out.body = std::move(vBody);
+			out.header.size = uint32_t(out.size());
+
+			stats.nMessages++;
+			stats.nBytesIn += msg.size();
+			stats.nBytesOut += out.size();
+			return true;
+		}
+
+		// Restore a compressed message in place. Returns false if the body is malformed, or if the message would be
+		// bigger than nMaxMessageSize once restored, header included, which is checked before anything is allocated
+		template<typename T>
+		bool decompress_message(message<T>& msg, compression_stats& stats, uint32_t nMaxMessageSize = 0)
+		{
+			if (msg.body.size() < sizeof(uint32_t))
+				return false;
+
+			auto tStart = std::chrono::steady_clock::now();
+			uint64_t nCompressedSize = msg.size();
+
+			uint32_t nOriginalSize = 0;
+			std::memcpy(&nOriginalSize, msg.body.data(), sizeof(nOriginalSize));
+
+			// A block can't expand more than 255 times, so don't let a bogus size make us allocate gigabytes
+			if (nOriginalSize > (msg.body.size() - sizeof(uint32_t)) * 255 + 16)
+				return false;
+			if (nMaxMessageSize > 0 && uint64_t(nOriginalSize) + sizeof(message_header<T>) > nMaxMessageSize)
+				return false;
+
+			std::vector<uint8_t> vBody(nOriginalSize);
+			if (!lz::decompress(msg.body.data() + sizeof(uint32_t), msg.body.size() - sizeof(uint32_t), vBody.data(), vBody.size()))
+				return false;
+
+			msg.body = std::move(vBody);
+			msg.header.flags &= ~MESSAGE_COMPRESSED;
+			msg.header.size = uint32_t(msg.size());
+
+			stats.nNanoseconds += uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - tStart).count());
+			stats.nMessages++;
+			stats.nBytesIn += nCompressedSize;
+			stats.nBytesOut += msg.size();
+			return true;
+		}
+	}
+}
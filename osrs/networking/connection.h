@@ -2,6 +2,13 @@
 #include "common.h"
 #include "tsqueue.h"
 #include "message.h"
+#include "compression.h"
+#include "ratelimit.h"
+#include "dispatch.h"
+#include "lanes.h"
+#include "flow.h"
+#include "trace.h"
+#include <unordered_map>
 
 /// <summary>
 /// Copyright 2018 - 2021 OneLoneCoder.com
@@ -29,9 +36,12 @@ namespace tfg
 			};
 
 			// The constructor specifies the owner, connects to a context, transfers the socket, and provides a reference to the incoming message queue.
-			connection(owner parent, asio::io_context& asioContext, asio::ip::tcp::socket socket, tsqueue<owned_message<T>>& qIn) : m_asioContext(asioContext), m_socket(std::move(socket)), m_qMessagesIn(qIn)
+			connection(owner parent, asio::io_context& asioContext, asio::ip::tcp::socket socket, tsqueue<owned_message<T>>& qIn) : m_socket(std::move(socket)), m_asioContext(asioContext), m_qMessagesIn(qIn), m_timerThrottle(asioContext)
 			{
 				m_nOwnerType = parent;
+				m_tCreated = std::chrono::steady_clock::now();
+				m_nLastReceive = m_tCreated.time_since_epoch().count();
+				m_nLastSend = m_tCreated.time_since_epoch().count();
 
 				// Construct validation check data
 				if (m_nOwnerType == owner::server)
@@ -50,6 +60,17 @@ namespace tfg
 				}
 			}
 
+			// Connection without a socket, used to drive a server from recorded traffic. It always reports itself as
+			// connected, and anything sent to it is counted and dropped instead of being written, unless it is relayed, see SetRelay()
+			connection(owner parent, asio::io_context& asioContext, tsqueue<owned_message<T>>& qIn, uint32_t uid) : m_socket(asioContext), m_asioContext(asioContext), m_qMessagesIn(qIn), m_timerThrottle(asioContext)
+			{
+				m_nOwnerType = parent;
+				m_bNullTransport = true;
+				id = uid;
+				m_bValidated = true;
+				m_tCreated = std::chrono::steady_clock::now();
+			}
+
 			virtual ~connection()
 			{
 
@@ -61,6 +82,12 @@ namespace tfg
 				return id;
 			}
 
+			// Let a connection take over the ID of an earlier one, like a client resuming its session
+			void SetID(uint32_t uid)
+			{
+				id = uid;
+			}
+
 		public:
 			void ConnectToClient(tfg::net::server_interface<T>* server, uint32_t uid = 0)
 			{
@@ -86,7 +113,7 @@ namespace tfg
 				{
 					// Request ASIO attempts to connect to an endpoint
 					asio::async_connect(m_socket, endpoints,
-						[this](std::error_code ec, asio::ip::tcp::endpoint endpoint)
+						[this, self = KeepAlive()](std::error_code ec, asio::ip::tcp::endpoint endpoint)
 						{
 							if (!ec)
 							{
@@ -99,112 +126,504 @@ namespace tfg
 
 			void Disconnect()
 			{
+				if (m_fnRelaySend)
+				{
+					if (!m_bRelayClosed)
+					{
+						m_bRelayClosed = true;
+						m_fnRelayClose();
+					}
+					return;
+				}
+
 				if (IsConnected())
-					asio::post(m_asioContext, [this]() { m_socket.close(); });
+					asio::post(m_asioContext, [this, self = KeepAlive()]() { m_socket.close(); });
 			}
 
 			bool IsConnected() const
 			{
-				return m_socket.is_open();
+				return m_bNullTransport ? !m_bRelayClosed : m_socket.is_open();
+			}
+
+			// Turn a null transport connection into one standing in for a client behind a gateway, see gateway.h.
+			// Messages sent to it are handed to fnSend and Disconnect() calls fnClose, both on the game thread
+			void SetRelay(std::function<void(const message<T>&)> fnSend, std::function<void()> fnClose)
+			{
+				m_fnRelaySend = std::move(fnSend);
+				m_fnRelayClose = std::move(fnClose);
+			}
+
+			bool IsRelayed() const
+			{
+				return bool(m_fnRelaySend);
+			}
+
+			// Check incoming messages against the server's limits. Must be called before the connection starts reading
+			void SetRateLimits(const rate_limits<T>& limits, rate_limit_stats& stats)
+			{
+				m_pLimits = &limits;
+				m_pLimitStats = &stats;
+				m_pRateLimiter = std::make_unique<rate_limiter<T>>(limits, stats);
+			}
+
+			// Stop checking incoming messages, for connections that carry the traffic of many clients. Takes effect
+			// before anything sent after this call goes out
+			void ClearRateLimits()
+			{
+				asio::post(m_asioContext,
+					[this, self = KeepAlive()]()
+					{
+						m_pRateLimiter.reset();
+						m_pLimits = nullptr;
+					});
+			}
+
+			// Server side connections are validated once the client has answered the handshake
+			bool IsValidated() const
+			{
+				return m_bValidated;
+			}
+
+			// Activity timestamps, used by the server to find idle and dead connections
+			std::chrono::steady_clock::time_point GetCreated() const
+			{
+				return m_tCreated;
+			}
+
+			std::chrono::steady_clock::time_point GetLastReceive() const
+			{
+				return std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(m_nLastReceive.load()));
+			}
+
+			std::chrono::steady_clock::time_point GetLastSend() const
+			{
+				return std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(m_nLastSend.load()));
+			}
+
+			// Whether server_interface::MessageAllClients() sends to this connection. Remote sides that aren't players,
+			// like the other nodes of a cluster, opt out. Game thread only
+			void SetBroadcastTarget(bool bBroadcast)
+			{
+				m_bBroadcastTarget = bBroadcast;
+			}
+
+			bool IsBroadcastTarget() const
+			{
+				return m_bBroadcastTarget;
+			}
+
+			// Whether the remote side can decompress messages. Set once it has advertised CAPABILITY_COMPRESSION
+			void EnableCompression(bool bEnable)
+			{
+				m_bCompression = bEnable;
+			}
+
+			bool IsCompressionEnabled() const
+			{
+				return m_bCompression;
+			}
+
+			// Compressed messages received on this connection
+			const compression_stats& GetDecompressionStats() const
+			{
+				return m_statsDecompression;
+			}
+
+			// Messages and bytes swallowed by a null transport connection
+			uint64_t GetDroppedMessages() const
+			{
+				return m_nDroppedMessages;
+			}
+
+			uint64_t GetDroppedBytes() const
+			{
+				return m_nDroppedBytes;
+			}
+
+			// Flow control for state messages, see flow.h. Must be called before the connection starts writing
+			void SetFlowControl(const flow_limits& limits, flow_stats& stats)
+			{
+				m_pFlowLimits = &limits;
+				m_pFlowStats = &stats;
+				m_tFlowAdapted = std::chrono::steady_clock::now();
+			}
+
+			// Stop flow control, for connections that carry the traffic of many clients. Game thread only
+			void ClearFlowControl()
+			{
+				m_pFlowLimits = nullptr;
+				m_nFlowStride = 1;
+			}
+
+			// Reconsider the stride. Called every adaptInterval by the owner, game thread only
+			void AdaptFlow()
+			{
+				const flow_limits* pLimits = m_pFlowLimits;
+				if (!pLimits)
+					return;
+
+				// What we have been handing to the socket lately, so we know whether twice as much would fit
+				auto tNow = std::chrono::steady_clock::now();
+				uint64_t nAccepted = m_nAcceptedBytes;
+				double fElapsed = std::chrono::duration<double>(tNow - m_tFlowAdapted).count();
+				double fDemand = fElapsed > 0.0 ? (nAccepted - m_nAcceptedBefore) / fElapsed : 0.0;
+				m_tFlowAdapted = tNow;
+				m_nAcceptedBefore = nAccepted;
+
+				// Coalescing keeps the queue short on its own, so many overwritten updates mean the link is behind too
+				uint64_t nKeyed = m_nKeyedMessages, nCoalesced = m_nCoalescedMessages;
+				uint64_t nKeyedRecently = nKeyed - m_nKeyedBefore, nCoalescedRecently = nCoalesced - m_nCoalescedBefore;
+				m_nKeyedBefore = nKeyed;
+				m_nCoalescedBefore = nCoalesced;
+
+				uint64_t nQueued = m_nQueuedBytes;
+				uint32_t nStride = m_nFlowStride;
+				if (nQueued > pLimits->nQueueHigh || nCoalescedRecently * FLOW_COALESCED_SHARE > nKeyedRecently)
+				{
+					m_nFlowCalm = 0;
+					if (nStride < pLimits->nMaxStride)
+						m_nFlowStride = nStride * 2;
+				}
+				else if (nQueued < pLimits->nQueueLow && nCoalescedRecently == 0 && nStride > 1)
+				{
+					// A throughput measured long ago may no longer hold, so after a while of short queues try anyway
+					uint64_t nRate = m_meterOut.rate();
+					if (nRate == 0 || fDemand * 2.0 < nRate * 0.75 || ++m_nFlowCalm >= FLOW_PROBE)
+					{
+						m_nFlowStride = nStride / 2;
+						m_nFlowCalm = 0;
+					}
+				}
+			}
+
+			// Send every stride-th state update, see flow.h
+			uint32_t GetFlowStride() const
+			{
+				return m_nFlowStride;
+			}
+
+			// Bytes handed to Send() that haven't been written yet
+			uint64_t GetQueuedBytes() const
+			{
+				return m_nQueuedBytes;
+			}
+
+			// Measured throughput in bytes per second, zero until the connection has had a backlog
+			uint64_t GetSendRate() const
+			{
+				return m_meterOut.rate();
 			}
 
 		public:
-			// Send a message, connections are one-to-one so no need to specifiy the target
-			void Send(const message<T>& msg)
+			// Send a message, connections are one-to-one so no need to specifiy the target. A non-zero nCoalesceKey
+			// marks a state message, which overwrites one with the same key that hasn't been written yet, see flow.h
+			void Send(const message<T>& msg, uint64_t nCoalesceKey = 0)
+			{
+				m_nLastSend = std::chrono::steady_clock::now().time_since_epoch().count();
+
+				if (m_fnRelaySend)
+				{
+					if (!m_bRelayClosed)
+						m_fnRelaySend(msg);
+					return;
+				}
+
+				if (m_bNullTransport)
+				{
+					m_nDroppedMessages++;
+					m_nDroppedBytes += msg.size();
+					return;
+				}
+
+				// A client that can't keep up even with coalescing and strides doesn't get to hold on to our memory
+				uint64_t nQueued = m_nQueuedBytes.fetch_add(msg.size()) + msg.size();
+				m_nAcceptedBytes += msg.size();
+				if (nCoalesceKey != 0)
+					m_nKeyedMessages++;
+				const flow_limits* pLimits = m_pFlowLimits;
+				if (pLimits && pLimits->nMaxQueuedBytes > 0 && nQueued > pLimits->nMaxQueuedBytes)
+				{
+					if (!m_bOverflowed.exchange(true))
+					{
+						std::cout << "[" << id << "] Send Queue Overflow (" << nQueued << " bytes).\n";
+						m_pFlowStats->nOverflows++;
+						Disconnect();
+					}
+					return;
+				}
+
+				asio::post(m_asioContext,
+					[this, self = KeepAlive(), msg, nCoalesceKey]() mutable
+					{
+						/// If a message is being written, the writer picks this one up when it gets to its lane.
+						/// Otherwise nothing is happening, so start writing straight away.
+
+						if (nCoalesceKey != 0)
+						{
+							auto it = m_mapCoalescing.find(nCoalesceKey);
+							if (it != m_mapCoalescing.end())
+							{
+								m_nQueuedBytes -= it->second->msg.size();
+								it->second->msg = std::move(msg);
+								m_nCoalescedMessages++;
+								if (m_pFlowStats)
+									m_pFlowStats->nCoalesced++;
+								return;
+							}
+						}
+
+						auto& lane = m_lanesOut[message_lanes<T>::lane(msg.header.id)];
+						lane.push_back({ std::move(msg), std::chrono::steady_clock::now(), nCoalesceKey });
+
+						// Elements of a deque stay where they are when others are added or removed at either end
+						if (nCoalesceKey != 0)
+							m_mapCoalescing[nCoalesceKey] = &lane.back();
+
+						if (!m_bWriting)
+						{
+							m_meterOut.start(std::chrono::steady_clock::now());
+							WriteNextMessage();
+						}
+					});
+			}
+
+			// Time spent in the outgoing lanes is added to stats. Must be called before the connection starts writing
+			void SetLaneStats(lane_stats<T>& stats)
+			{
+				m_pLaneStats = &stats;
+			}
+
+			// Hot restart, see restart.h. Once everything queued has been written, stop reading, keeping whatever part of
+			// a message was read already, see GetDetachedInput(). Then fnDetached(true) is called on the asio thread, or
+			// fnDetached(false) if the socket closed first. For server side connections of validated clients, which
+			// mustn't be sent anything after this
+			void Detach(std::function<void(bool)> fnDetached)
+			{
+				asio::post(m_asioContext,
+					[this, self = KeepAlive(), fnDetached = std::move(fnDetached)]() mutable
+					{
+						m_fnDetached = std::move(fnDetached);
+						if (!m_bWriting)
+							StopReading();
+					});
+			}
+
+			// Bytes of the message being received when the connection was detached. Only valid once detached
+			const std::vector<uint8_t>& GetDetachedInput() const
+			{
+				return m_vDetachedInput;
+			}
+
+			// Carry on reading as a validated connection, starting with vInput, the part of a message that was read
+			// before. Used after Detach() when the hand-over didn't happen, and on sockets taken over from another process
+			void Resume(std::vector<uint8_t> vInput)
 			{
 				asio::post(m_asioContext,
-					[this, msg]()
+					[this, self = KeepAlive(), vInput = std::move(vInput)]()
 					{
-						/// If the queue has a message in it, then we must 
-						/// assume that it is in the process of asynchronously being written.
-						/// Either way add the message to the queue to be output. If no messages
-						/// were available to be written, then start the process of writing the
-						/// message at the front of the queue.
-
-						bool bWritingMessage = !m_qMessagesOut.empty();
-						m_qMessagesOut.push_back(msg);
-						if (!bWritingMessage)
+						m_fnDetached = nullptr;
+						m_bReadStopped = false;
+						m_bValidated = true;
+						m_nLastReceive = std::chrono::steady_clock::now().time_since_epoch().count();
+
+						constexpr size_t nHeader = sizeof(message_header<T>);
+						if (vInput.size() < nHeader)
 						{
-							WriteHeader();
+							if (!vInput.empty())
+								std::memcpy(&m_msgTemporaryIn.header, vInput.data(), vInput.size());
+							ReadHeader(vInput.size());
+							return;
 						}
+
+						// Only messages with a body are ever cut short after their header
+						std::memcpy(&m_msgTemporaryIn.header, vInput.data(), nHeader);
+						size_t nBody = vInput.size() - nHeader;
+						if (m_msgTemporaryIn.header.size <= nHeader || nBody >= m_msgTemporaryIn.header.size - nHeader)
+						{
+							std::cout << "[" << id << "] Malformed Resumed Message.\n";
+							m_socket.close();
+							return;
+						}
+
+						m_msgTemporaryIn.body.resize(m_msgTemporaryIn.header.size - nHeader);
+						if (nBody > 0)
+							std::memcpy(m_msgTemporaryIn.body.data(), vInput.data() + nHeader, nBody);
+						ReadBody(nBody);
 					});
 			}
 
+			// The socket, so it can be passed to another process. Hot restart only
+			typename asio::ip::tcp::socket::native_handle_type GetNativeSocket()
+			{
+				return m_socket.native_handle();
+			}
+
 		private:
-			// Prime context to read a message header
-			void ReadHeader()
+			// Handlers hold on to this, so a server side connection lives until its last handler has run even if the
+			// server has already let go of it. Client side connections aren't owned by a shared_ptr, so this is empty
+			// for them and their owner has to keep them alive while the context runs
+			std::shared_ptr<connection<T>> KeepAlive()
 			{
-				asio::async_read(m_socket, asio::buffer(&m_msgTemporaryIn.header, sizeof(message_header<T>)),
-					[this](std::error_code ec, std::size_t length)
+				return this->weak_from_this().lock();
+			}
+
+			// Prime context to read a message header, nRead bytes of which have been read already
+			void ReadHeader(size_t nRead = 0)
+			{
+				uint8_t* pHeader = reinterpret_cast<uint8_t*>(&m_msgTemporaryIn.header);
+				if (m_bReadStopped)
+				{
+					m_vDetachedInput.assign(pHeader, pHeader + nRead);
+					FinishDetach(true);
+					return;
+				}
+
+				asio::async_read(m_socket, asio::buffer(pHeader + nRead, sizeof(message_header<T>) - nRead),
+					[this, self = KeepAlive(), nRead](std::error_code ec, std::size_t length)
 					{
+						TFG_TRACE_SCOPE("ReadHeader");
 						if (!ec)
 						{
+							// Refuse to allocate whatever size the peer claims
+							if (m_pLimits && m_pLimits->nMaxMessageSize > 0 && m_msgTemporaryIn.header.size > m_pLimits->nMaxMessageSize)
+							{
+								std::cout << "[" << id << "] Oversized Message (" << m_msgTemporaryIn.header.size << " bytes).\n";
+								m_pLimitStats->nOversized++;
+								CloseWhileReading();
+								return;
+							}
+
 							// We need to take into account that the message has the header and the body size
-							if (m_msgTemporaryIn.header.size > 8)
+							if (m_msgTemporaryIn.header.size > sizeof(message_header<T>))
 							{
-								m_msgTemporaryIn.body.resize(m_msgTemporaryIn.header.size - 8);
+								m_msgTemporaryIn.body.resize(m_msgTemporaryIn.header.size - sizeof(message_header<T>));
 								ReadBody();
 							}
 							else
 							{
+								// The buffer is reused, so drop the body of whatever message came before
+								m_msgTemporaryIn.body.clear();
 								AddToIncomingMessageQueue();
 							}
 						}
+						else if (m_bReadStopped)
+						{
+							// Cancelled by StopReading(), keep what did arrive
+							ReadHeader(nRead + length);
+						}
 						else
 						{
 							std::cout << "[" << id << "] Read Header Fail.\n";
-							m_socket.close();
+							CloseWhileReading();
 						}
 					});
 			}
 
-			// Prime context ready to read a message body
-			void ReadBody()
+			// Prime context ready to read a message body, nRead bytes of which have been read already
+			void ReadBody(size_t nRead = 0)
 			{
+				if (m_bReadStopped)
+				{
+					const uint8_t* pHeader = reinterpret_cast<const uint8_t*>(&m_msgTemporaryIn.header);
+					m_vDetachedInput.assign(pHeader, pHeader + sizeof(message_header<T>));
+					m_vDetachedInput.insert(m_vDetachedInput.end(), m_msgTemporaryIn.body.begin(), m_msgTemporaryIn.body.begin() + nRead);
+					FinishDetach(true);
+					return;
+				}
+
 				// If this method was called, a header has already been read, and that header requests we read a body.
 				// The space for that body has already been allocated in the temporary message object, so just wait for the bytes to arrive.
-				asio::async_read(m_socket, asio::buffer(m_msgTemporaryIn.body.data(), m_msgTemporaryIn.body.size()),
-					[this](std::error_code ec, std::size_t length)
+				asio::async_read(m_socket, asio::buffer(m_msgTemporaryIn.body.data() + nRead, m_msgTemporaryIn.body.size() - nRead),
+					[this, self = KeepAlive(), nRead](std::error_code ec, std::size_t length)
 					{
+						TFG_TRACE_SCOPE("ReadBody");
 						if (!ec)
 						{
 							// Add the whole message to incoming queue
 							AddToIncomingMessageQueue();
 						}
+						else if (m_bReadStopped)
+						{
+							ReadBody(nRead + length);
+						}
 						else
 						{
 							std::cout << "[" << id << "] Read Body Fail.\n";
-							m_socket.close();
+							CloseWhileReading();
 						}
 					});
 			}
 
+			// Take the next message to write from the lanes, see lanes.h
+			void WriteNextMessage()
+			{
+				size_t nLane = 0;
+				while (nLane < m_lanesOut.size() && m_lanesOut[nLane].empty())
+					nLane++;
+				if (nLane == m_lanesOut.size())
+				{
+					m_bWriting = false;
+					if (m_fnDetached)
+						StopReading();
+					return;
+				}
+
+				// Give a waiting lower lane its turn once enough messages have overtaken it
+				bool bLowerWaiting = false;
+				for (size_t i = nLane + 1; i < m_lanesOut.size() && !bLowerWaiting; i++)
+				{
+					if (!m_lanesOut[i].empty())
+					{
+						bLowerWaiting = true;
+						if (m_nLaneStreak >= LANE_BURST)
+						{
+							nLane = i;
+							m_nLaneStreak = 0;
+						}
+					}
+				}
+				m_nLaneStreak = bLowerWaiting ? m_nLaneStreak + 1 : 0;
+
+				if (m_pLaneStats)
+					m_pLaneStats->record(nLane, std::chrono::steady_clock::now() - m_lanesOut[nLane].front().tQueued);
+
+				if (m_lanesOut[nLane].front().nKey != 0)
+					m_mapCoalescing.erase(m_lanesOut[nLane].front().nKey);
+
+				m_msgOut = std::move(m_lanesOut[nLane].front().msg);
+				m_lanesOut[nLane].pop_front();
+				m_bWriting = true;
+				WriteHeader();
+			}
+
+			void MessageWritten()
+			{
+				m_nQueuedBytes -= m_msgOut.size();
+				m_meterOut.written(m_msgOut.size(), std::chrono::steady_clock::now());
+			}
+
 			// Prime context to write a message header
 			void WriteHeader()
 			{
-				// If this function is called, we know the outgoing message queue must have at least one message to send.
+				// If this function is called, we know there is a message to send.
 				// Allocate a transmission buffer to hold the message, and issue ASIO to send those bytes
-				asio::async_write(m_socket, asio::buffer(&m_qMessagesOut.front().header, sizeof(message_header<T>)),
-					[this](std::error_code ec, std::size_t length)
+				asio::async_write(m_socket, asio::buffer(&m_msgOut.header, sizeof(message_header<T>)),
+					[this, self = KeepAlive()](std::error_code ec, std::size_t length)
 					{
+						TFG_TRACE_SCOPE("WriteHeader");
 						if (!ec)
 						{
 							// No error, so check if the message header just sent also has a message body
-							if (m_qMessagesOut.front().body.size() > 0)
+							if (m_msgOut.body.size() > 0)
 							{
 								// It does, so issue the task to write the body bytes
 								WriteBody();
 							}
 							else
 							{
-								// It didnt, so we are done with this message. Remove it from the outgoing message queue
-								m_qMessagesOut.pop_front();
-
-								// If the queue is not empty, there are more messages to send
-								if (!m_qMessagesOut.empty())
-								{
-									WriteHeader();
-								}
+								// It didnt, so we are done with this message. Move on to the next one, if there is any
+								MessageWritten();
+								WriteNextMessage();
 							}
 						}
 						else
@@ -212,6 +631,7 @@ namespace tfg
 							// ASIO failed to write the message, so close the socket
 							std::cout << "[" << id << "] Write Header Fail.\n";
 							m_socket.close();
+							FinishDetach(false);
 						}
 					});
 			}
@@ -221,25 +641,22 @@ namespace tfg
 			{
 				// If this method was called, a header has just been sent, and that header indicated a body existed for this message.
 				// Fill a transmission buffer with the body data, and send it
-				asio::async_write(m_socket, asio::buffer(m_qMessagesOut.front().body.data(), m_qMessagesOut.front().body.size()),
-					[this](std::error_code ec, std::size_t length)
+				asio::async_write(m_socket, asio::buffer(m_msgOut.body.data(), m_msgOut.body.size()),
+					[this, self = KeepAlive()](std::error_code ec, std::size_t length)
 					{
+						TFG_TRACE_SCOPE("WriteBody");
 						if (!ec)
 						{
-							// Sending was successful, so we are done with the message
-							m_qMessagesOut.pop_front();
-
-							// If the queue still has messages in it, then issue the task to send the next message's header
-							if (!m_qMessagesOut.empty())
-							{
-								WriteHeader();
-							}
+							// Sending was successful, so we are done with the message. Move on to the next one, if there is any
+							MessageWritten();
+							WriteNextMessage();
 						}
 						else
 						{
 							// Sending failed, see WriteHeader() equivalent for description :P
 							std::cout << "[" << id << "] Write Body Fail.\n";
 							m_socket.close();
+							FinishDetach(false);
 						}
 					});
 			}
@@ -247,14 +664,114 @@ namespace tfg
 			// Once a full message is received, add it to the incoming queue
 			void AddToIncomingMessageQueue()
 			{
-				// Shove it in the queue, converting it to an "owned message", by initialising it with a shared pointer from this connection object
+				auto tReceived = std::chrono::steady_clock::now();
+				m_nLastReceive = tReceived.time_since_epoch().count();
+
+				// Compressed messages are restored here, so nothing past the connection has to know about compression. Clients
+				// only get to send them once they have said they can, and no bigger than the limit once restored
+				if (m_msgTemporaryIn.header.flags & MESSAGE_COMPRESSED)
+				{
+					if ((m_nOwnerType == owner::server && !m_bCompression) ||
+						!decompress_message(m_msgTemporaryIn, m_statsDecompression, m_pLimits ? m_pLimits->nMaxMessageSize : 0))
+					{
+						std::cout << "[" << id << "] Malformed Compressed Message.\n";
+						CloseWhileReading();
+						return;
+					}
+				}
+
+				std::chrono::steady_clock::duration throttle(0);
+				if (m_pRateLimiter)
+				{
+					// Nothing past the connection has a use for a type the application doesn't know, and the limiter
+					// would otherwise have to keep track of it
+					if (message_type_count<T> > 0 && size_t(m_msgTemporaryIn.header.id) >= message_type_count<T>)
+					{
+						std::cout << "[" << id << "] Unknown Message Type (" << size_t(m_msgTemporaryIn.header.id) << ").\n";
+						m_pLimitStats->nUnknown++;
+						CloseWhileReading();
+						return;
+					}
+
+					switch (m_pRateLimiter->check(m_msgTemporaryIn.header.id, m_msgTemporaryIn.size(), throttle))
+					{
+						case rate_limiter<T>::verdict::drop:
+							ReadHeader();
+							return;
+
+						case rate_limiter<T>::verdict::disconnect:
+							std::cout << "[" << id << "] Rate Limit Exceeded.\n";
+							CloseWhileReading();
+							return;
+
+						default:
+							break;
+					}
+				}
+
+				// Shove it in the queue, converting it to an "owned message", by initialising it with a shared pointer from this connection object.
+				// Client side connections only say where the message came from if a shared pointer owns them, like a gateway's upstream connections
 				if (m_nOwnerType == owner::server)
-					m_qMessagesIn.push_back({ this->shared_from_this(), m_msgTemporaryIn });
+					m_qMessagesIn.push_back({ this->shared_from_this(), m_msgTemporaryIn, tReceived });
 				else
-					m_qMessagesIn.push_back({ nullptr, m_msgTemporaryIn });
+					m_qMessagesIn.push_back({ this->weak_from_this().lock(), m_msgTemporaryIn, tReceived });
 
-				// Prime ASIO context to receive the next message
-				ReadHeader();
+				// Prime ASIO context to receive the next message, after a pause if the sender is being throttled
+				if (throttle.count() > 0 && !m_bReadStopped)
+				{
+					m_timerThrottle.expires_after(throttle);
+					m_timerThrottle.async_wait(
+						[this, self = KeepAlive()](std::error_code ec)
+						{
+							if (!ec || m_bReadStopped)
+								ReadHeader();
+						});
+				}
+				else
+				{
+					ReadHeader();
+				}
+			}
+
+			// Hot restart, see Detach(). Whichever read or throttle wait is pending ends early, and ReadHeader() or ReadBody()
+			// then keeps what was read and finishes detaching instead of reading on
+			void StopReading()
+			{
+				if (!m_socket.is_open())
+				{
+					FinishDetach(false);
+					return;
+				}
+
+				m_bReadStopped = true;
+				try
+				{
+					m_socket.cancel();
+					m_timerThrottle.cancel();
+				}
+				catch (std::exception&)
+				{
+					m_socket.close();
+					FinishDetach(false);
+				}
+			}
+
+			// Tell whoever is detaching the connection how it went, once
+			void FinishDetach(bool bDetached)
+			{
+				if (!m_fnDetached)
+					return;
+
+				auto fnDetached = std::move(m_fnDetached);
+				m_fnDetached = nullptr;
+				fnDetached(bDetached);
+			}
+
+			// Reading gave up on the connection
+			void CloseWhileReading()
+			{
+				m_socket.close();
+				FinishDetach(false);
 			}
 
 			// "Encrypt" data to validate clients with a handshake
@@ -271,7 +788,7 @@ namespace tfg
 			void WriteValidation()
 			{
 				asio::async_write(m_socket, asio::buffer(&m_nHandshakeOut, sizeof(uint64_t)),
-					[this](std::error_code ec, std::size_t length)
+					[this, self = KeepAlive()](std::error_code ec, std::size_t length)
 					{
 						if (!ec)
 						{
@@ -289,7 +806,7 @@ namespace tfg
 			void ReadValidation(tfg::net::server_interface<T>* server = nullptr)
 			{
 				asio::async_read(m_socket, asio::buffer(&m_nHandshakeIn, sizeof(uint64_t)),
-					[this, server](std::error_code ec, std::size_t length)
+					[this, self = KeepAlive(), server](std::error_code ec, std::size_t length)
 					{
 						if (!ec)
 						{
@@ -300,6 +817,8 @@ namespace tfg
 								{
 									// Client has provided valid solution, so allow it to connect properly
 									std::cout << "Client Validated" << std::endl;
+									m_bValidated = true;
+									m_nLastReceive = std::chrono::steady_clock::now().time_since_epoch().count();
 									server->OnClientValidated(this->shared_from_this());
 
 									// Sit waiting to receive data
@@ -336,8 +855,37 @@ namespace tfg
 			// This context is shared with the whole asio instance, we only want a single context for the server
 			asio::io_context& m_asioContext;
 
-			// This queue holds all messages to be sent to the remote side of this connection
-			tsqueue<message<T>> m_qMessagesOut;
+			// Messages to be sent to the remote side of this connection, one queue per priority lane, and the one being
+			// written. Only touched on the asio thread
+			struct sOutgoing
+			{
+				message<T> msg;
+				std::chrono::steady_clock::time_point tQueued;
+				uint64_t nKey = 0;
+			};
+
+			std::array<std::deque<sOutgoing>, message_lanes<T>::count> m_lanesOut;
+			std::unordered_map<uint64_t, sOutgoing*> m_mapCoalescing;
+			message<T> m_msgOut;
+			bool m_bWriting = false;
+			size_t m_nLaneStreak = 0;
+			lane_stats<T>* m_pLaneStats = nullptr;
+
+			// Flow control, see flow.h. The stride and its bookkeeping belong to the game thread
+			std::atomic<const flow_limits*> m_pFlowLimits = nullptr;
+			flow_stats* m_pFlowStats = nullptr;
+			flow_meter m_meterOut;
+			std::atomic<uint64_t> m_nQueuedBytes = 0;
+			std::atomic<uint64_t> m_nAcceptedBytes = 0;
+			std::atomic<uint64_t> m_nKeyedMessages = 0;
+			std::atomic<uint64_t> m_nCoalescedMessages = 0;
+			std::atomic<bool> m_bOverflowed = false;
+			uint32_t m_nFlowStride = 1;
+			uint64_t m_nAcceptedBefore = 0;
+			uint64_t m_nKeyedBefore = 0;
+			uint64_t m_nCoalescedBefore = 0;
+			uint32_t m_nFlowCalm = 0;
+			std::chrono::steady_clock::time_point m_tFlowAdapted;
 
 			// This queue holds all messages that have been received from the remote side of this connection
 			tsqueue<owned_message<T>>& m_qMessagesIn;
@@ -347,12 +895,45 @@ namespace tfg
 
 			// The owner decides how some of the connection behaves
 			owner m_nOwnerType = owner::server;
-			uint32_t id = 0;
+			std::atomic<uint32_t> id = 0;
 
 			// Handshake validation
 			uint64_t m_nHandshakeOut = 0;
 			uint64_t m_nHandshakeIn = 0;
 			uint64_t m_nHandshakeCheck = 0;
+
+			// Activity tracking. Timestamps are steady_clock ticks, so they can be atomics written from any thread
+			std::chrono::steady_clock::time_point m_tCreated;
+			std::atomic<int64_t> m_nLastReceive = 0;
+			std::atomic<int64_t> m_nLastSend = 0;
+			std::atomic<bool> m_bValidated = false;
+
+			bool m_bBroadcastTarget = true;
+
+			// Compression is negotiated by the application on the game thread, see compression.h, and checked on the asio thread
+			std::atomic<bool> m_bCompression = false;
+			compression_stats m_statsDecompression;
+
+			// Flood protection, only set on server side connections
+			const rate_limits<T>* m_pLimits = nullptr;
+			rate_limit_stats* m_pLimitStats = nullptr;
+			std::unique_ptr<rate_limiter<T>> m_pRateLimiter;
+			asio::steady_timer m_timerThrottle;
+
+			// Null transport connections have no socket, see the constructor above
+			bool m_bNullTransport = false;
+			uint64_t m_nDroppedMessages = 0;
+			uint64_t m_nDroppedBytes = 0;
+
+			// Hot restart, see Detach(). Only touched on the asio thread, and m_vDetachedInput by others once detached
+			std::function<void(bool)> m_fnDetached;
+			bool m_bReadStopped = false;
+			std::vector<uint8_t> m_vDetachedInput;
+
+			// Relayed connections are null transport connections whose messages go through a gateway, see SetRelay()
+			std::function<void(const message<T>&)> m_fnRelaySend;
+			std::function<void()> m_fnRelayClose;
+			bool m_bRelayClosed = false;
 		};
 	}
 }
\ No newline at end of file
@@ -0,0 +1,219 @@
+#pragma once
+#include "common.h"
+#include "message.h"
+#include <array>
+
+/// <summary>
+/// Typed message dispatch. The application says what the body of each message type looks like by specialising
+/// message_payload for its message enum, and handles a type by giving its handler class an overload of Handle()
+/// taking message_id of that type. message_dispatcher builds a table indexed by message ID at compile time, from
+/// the types that have both a payload and a handler overload, and checks every message against it before any
+/// handler runs: unknown IDs, types this side doesn't handle and bodies of the wrong size are turned away.
+///  - empty_payload: no body. Handled by Handle(message_id, args...)
+///  - fixed_payload<P>: the body is exactly one P, copied out without touching the message. Handled by
+///    Handle(message_id, args..., const P&)
+///  - variable_payload<Min, Max>: anything from Min to Max bytes, read by the handler as before. Handled by
+///    Handle(message_id, args..., message<T>&)
+/// Args are whatever the caller passes along, like the connection a message came from.
+/// The table has message_type_count<T> entries, which the application sets as well.
+/// </summary>
+
+namespace tfg
+{
+	namespace net
+	{
+		enum class payload_kind
+		{
+			unknown,
+			empty,
+			fixed,
+			variable,
+		};
+
+		struct unknown_payload
+		{
+			static constexpr payload_kind kind = payload_kind::unknown;
+			static constexpr size_t min_size = 0;
+			static constexpr size_t max_size = 0;
+		};
+
+		struct empty_payload
+		{
+			static constexpr payload_kind kind = payload_kind::empty;
+			static constexpr size_t min_size = 0;
+			static constexpr size_t max_size = 0;
+		};
+
+		template<typename P>
+		struct fixed_payload
+		{
+			static_assert(std::is_trivially_copyable<P>::value, "Fixed payloads are copied straight out of the body");
+
+			using type = P;
+			static constexpr payload_kind kind = payload_kind::fixed;
+			static constexpr size_t min_size = sizeof(P);
+			static constexpr size_t max_size = sizeof(P);
+		};
+
+		template<size_t Min, size_t Max = SIZE_MAX>
+		struct variable_payload
+		{
+			static_assert(Min <= Max);
+
+			static constexpr payload_kind kind = payload_kind::variable;
+			static constexpr size_t min_size = Min;
+			static constexpr size_t max_size = Max;
+		};
+
+		// What the body of message type ID looks like. Types without a specialisation are unknown
+		template<typename T, T ID>
+		struct message_payload : unknown_payload
+		{
+		};
+
+		// Number of message types, the IDs are expected to run from 0 to one less than this
+		template<typename T>
+		constexpr size_t message_type_count = 0;
+
+		// Selects the Handle() overload for message type ID
+		template<typename T, T ID>
+		using message_id = std::integral_constant<T, ID>;
+
+		enum class dispatch_result
+		{
+			handled,
+			unknown,
+			bad_size,
+		};
+
+		// Messages turned away by a dispatcher, for the thread that dispatches
+		struct dispatch_stats
+		{
+			uint64_t nHandled = 0;
+			uint64_t nUnknown = 0;
+			uint64_t nBadSize = 0;
+
+			void record(dispatch_result result)
+			{
+				if (result == dispatch_result::handled)
+					nHandled++;
+				else if (result == dispatch_result::unknown)
+					nUnknown++;
+				else
+					nBadSize++;
+			}
+
+			uint64_t rejected() const
+			{
+				return nUnknown + nBadSize;
+			}
+
+			// e.g. "120000 handled, 3 unknown, 1 bad size"
+			std::string summary() const
+			{
+				return std::to_string(nHandled) + " handled, " + std::to_string(nUnknown) + " unknown, " + std::to_string(nBadSize) + " bad size";
+			}
+		};
+
+		template<typename T, typename Handler, typename... Args>
+		class message_dispatcher
+		{
+		public:
+			// Check msg against the table and pass it to its handler if it passes
+			static dispatch_result dispatch(Handler& handler, message<T>& msg, Args... args)
+			{
+				size_t nIndex = size_t(msg.header.id);
+				if (nIndex >= s_table.size() || !s_table[nIndex].fn)
+					return dispatch_result::unknown;
+
+				const sEntry& entry = s_table[nIndex];
+				if (msg.body.size() < entry.nMinSize || msg.body.size() > entry.nMaxSize)
+					return dispatch_result::bad_size;
+
+				entry.fn(handler, msg, args...);
+				return dispatch_result::handled;
+			}
+
+			// Whether Handler handles message type ID, for static_asserts
+			template<T ID>
+			static constexpr bool handles()
+			{
+				return s_table[size_t(ID)].fn != nullptr;
+			}
+
+		private:
+			using thunk = void (*)(Handler&, message<T>&, Args...);
+
+			struct sEntry
+			{
+				size_t nMinSize = 0;
+				size_t nMaxSize = 0;
+				thunk fn = nullptr;
+			};
+
+			// Whether Handler has a Handle() overload for ID taking Extra after Args
+			template<typename Void, T ID, typename... Extra>
+			struct has_handler : std::false_type
+			{
+			};
+
+			template<T ID, typename... Extra>
+			struct has_handler<std::void_t<decltype(std::declval<Handler&>().Handle(message_id<T, ID>{}, std::declval<Args>()..., std::declval<Extra>()...))>, ID, Extra...> : std::true_type
+			{
+			};
+
+			template<T ID>
+			static constexpr bool is_handled()
+			{
+				using payload = message_payload<T, ID>;
+				if constexpr (payload::kind == payload_kind::empty)
+					return has_handler<void, ID>::value;
+				else if constexpr (payload::kind == payload_kind::fixed)
+					return has_handler<void, ID, const typename payload::type&>::value;
+				else if constexpr (payload::kind == payload_kind::variable)
+					return has_handler<void, ID, message<T>&>::value;
+				else
+					return false;
+			}
+
+			template<T ID>
+			static void invoke(Handler& handler, message<T>& msg, Args... args)
+			{
+				using payload = message_payload<T, ID>;
+				if constexpr (payload::kind == payload_kind::empty)
+					handler.Handle(message_id<T, ID>{}, args...);
+				else if constexpr (payload::kind == payload_kind::fixed)
+				{
+					// The size was checked, so the body is exactly one payload
+					typename payload::type data;
+					std::memcpy(&data, msg.body.data(), sizeof(data));
+					handler.Handle(message_id<T, ID>{}, args..., static_cast<const typename payload::type&>(data));
+				}
+				else
+					handler.Handle(message_id<T, ID>{}, args..., msg);
+			}
+
+			template<size_t I>
+			static constexpr sEntry make_entry()
+			{
+				constexpr T id = T(I);
+				if constexpr (is_handled<id>())
+				{
+					using payload = message_payload<T, id>;
+					return { payload::min_size, payload::max_size, &invoke<id> };
+				}
+				else
+					return {};
+			}
+
+			template<size_t... I>
+			static constexpr std::array<sEntry, sizeof...(I)> make_table(std::index_sequence<I...>)
+			{
+				return { { make_entry<I>()... } };
+			}
+
+			static_assert(message_type_count<T> > 0, "Set message_type_count for the message enum");
+			static constexpr std::array<sEntry, message_type_count<T>> s_table = make_table(std::make_index_sequence<message_type_count<T>>{});
+		};
+	}
+}
@@ -0,0 +1,98 @@
+#pragma once
+#include "common.h"
+#include <atomic>
+
+/// <summary>
+/// Flow control for state messages, the kind a newer message about the same thing makes worthless, like a
+/// player's position. They are sent with a coalescing key, and one still waiting in a connection's lanes is
+/// overwritten by the next message with its key instead of having it queued behind, so however slow a link
+/// is, it never holds more than one message per key.
+/// Each connection also measures how fast its socket takes bytes while a backlog is waiting, and keeps a
+/// stride: it is sent every stride-th state update. The stride doubles while more than nQueueHigh bytes are
+/// queued or more than one in FLOW_COALESCED_SHARE state messages is overwritten before it goes out, and halves
+/// again once fewer than nQueueLow bytes are queued, none was overwritten and the measured throughput has room
+/// for twice the rate. Which updates a stride lets through is up to the application, see flow_admits().
+/// A connection that queues more than nMaxQueuedBytes all the same is disconnected.
+/// </summary>
+
+namespace tfg
+{
+	namespace net
+	{
+		struct flow_limits
+		{
+			size_t nQueueHigh = 16 * 1024;
+			size_t nQueueLow = 2 * 1024;
+			uint32_t nMaxStride = 8;
+
+			// How often strides are reconsidered
+			std::chrono::steady_clock::duration adaptInterval = std::chrono::milliseconds(250);
+
+			// Zero never disconnects
+			size_t nMaxQueuedBytes = 0;
+		};
+
+		// Whether update nSequence of something goes out to a receiver with nStride. Adding nReceiver spreads the
+		// updates that do over the receivers, instead of sending all of them the same ones
+		inline bool flow_admits(uint64_t nSequence, uint32_t nReceiver, uint32_t nStride)
+		{
+			return nStride <= 1 || (nSequence + nReceiver) % nStride == 0;
+		}
+
+		// Backlogged time a throughput sample is taken over
+		constexpr std::chrono::milliseconds FLOW_SAMPLE{ 100 };
+
+		// One in this many state messages overwritten before going out counts as falling behind
+		constexpr uint64_t FLOW_COALESCED_SHARE = 8;
+
+		// Adapt intervals with short queues after which a stride is halved even if the throughput measured says
+		// it wouldn't fit, since that may have been long ago
+		constexpr uint32_t FLOW_PROBE = 8;
+
+		// How fast a connection's socket takes bytes, measured on the asio thread. Only stretches of at least
+		// FLOW_SAMPLE with a message always waiting count: a writer that catches up in less has no backlog to
+		// measure, and its link is faster than what we send anyway
+		class flow_meter
+		{
+		public:
+			// A write starts while nothing else is being written
+			void start(std::chrono::steady_clock::time_point tNow)
+			{
+				m_tStart = tNow;
+				m_nBytes = 0;
+			}
+
+			// A message of nBytes has been written
+			void written(size_t nBytes, std::chrono::steady_clock::time_point tNow)
+			{
+				m_nBytes += nBytes;
+				auto elapsed = tNow - m_tStart;
+				if (elapsed < FLOW_SAMPLE)
+					return;
+
+				double fSample = m_nBytes / std::chrono::duration<double>(elapsed).count();
+				double fRate = double(m_nRate.load(std::memory_order_relaxed));
+				m_nRate.store(uint64_t(fRate > 0.0 ? fRate * 0.75 + fSample * 0.25 : fSample), std::memory_order_relaxed);
+				start(tNow);
+			}
+
+			// Bytes per second, zero until there was a backlog to measure. Any thread
+			uint64_t rate() const
+			{
+				return m_nRate.load(std::memory_order_relaxed);
+			}
+
+		private:
+			std::chrono::steady_clock::time_point m_tStart;
+			uint64_t m_nBytes = 0;
+			std::atomic<uint64_t> m_nRate = 0;
+		};
+
+		// Shared by all connections of a server
+		struct flow_stats
+		{
+			std::atomic<uint64_t> nCoalesced = 0;
+			std::atomic<uint64_t> nOverflows = 0;
+		};
+	}
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include "common.h"
+#include "message.h"
+#include "secret.h"
+
+/// <summary>
+/// Gateways terminate client connections in front of a server, so the server holds a few long-lived upstream
+/// connections instead of one socket per player. A gateway does the handshake, heartbeats and flood protection
+/// for its clients and passes their messages on in frames tagged with the client's ID at the gateway:
+///  - connected / disconnected: a client came or went. The server stands a relayed connection in for it, which
+///    the application sees like any other client.
+///  - forward: a message from a client. deliver: a message for one. close: the server disconnected one.
+///  - broadcast: a message for every client of the gateway but the one tagged, sent once per upstream connection
+///    and fanned out by the gateway.
+/// An upstream connection becomes one with hello and the shared key, and the server answers hello once it is
+/// ready for frames. The key is never 0, and is compared in constant time, see secret.h.
+/// The message types are the application's, so the framework stays independent of any message enum.
+/// </summary>
+
+namespace tfg
+{
+	namespace net
+	{
+		template<typename T>
+		struct gateway_protocol
+		{
+			T hello{};
+			T connected{};
+			T disconnected{};
+			T forward{};
+			T deliver{};
+			T broadcast{};
+			T close{};
+
+			uint64_t nKey = 0;
+		};
+
+		// A frame carrying inner for the client tagged nTag: inner's body, its size and inner's header, then the tag
+		template<typename T>
+		message<T> wrap_message(T id, uint32_t nTag, const message<T>& inner)
+		{
+			message<T> frame;
+			frame.header.id = id;
+			frame.body.reserve(inner.body.size() + sizeof(uint32_t) + sizeof(message_header<T>) + sizeof(uint32_t));
+			frame.body = inner.body;
+			frame << uint32_t(inner.body.size());
+			frame << inner.header;
+			frame << nTag;
+			return frame;
+		}
+
+		// The reverse of wrap_message(). Returns false if the frame is malformed
+		template<typename T>
+		bool unwrap_message(message<T>& frame, uint32_t& nTag, message<T>& inner)
+		{
+			uint32_t nBodySize = 0;
+			if (frame.body.size() < sizeof(uint32_t) + sizeof(message_header<T>) + sizeof(uint32_t))
+				return false;
+
+			frame >> nTag >> inner.header >> nBodySize;
+			if (nBodySize != frame.body.size())
+				return false;
+
+			inner.body = std::move(frame.body);
+			inner.header.size = uint32_t(inner.size());
+			frame.body.clear();
+			frame.header.size = uint32_t(frame.size());
+			return true;
+		}
+	}
+}
@@ -0,0 +1,151 @@
+#pragma once
+#include "common.h"
+#include <cmath>
+#include <string>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#endif
+
+/// <summary>
+/// Tools for trading CPU for latency, used by the server's low latency mode, see low_latency_config:
+///  - socket_tuning: TCP_NODELAY, buffer sizes and SO_BUSY_POLL for accepted sockets. SO_BUSY_POLL has the
+///    kernel poll the device queue for that long on a read instead of waiting for an interrupt, and only exists
+///    on Linux. Raising it past net.core.busy_read usually needs CAP_NET_ADMIN.
+///  - pin_current_thread(): keeps the calling thread on one core, so it isn't migrated away from its caches.
+///    Linux only, elsewhere it reports that it didn't.
+///  - latency_stats: a histogram of how long messages waited between arriving and being handled.
+/// </summary>
+
+namespace tfg
+{
+	namespace net
+	{
+		// Zero leaves the system default
+		struct socket_tuning
+		{
+			bool bNoDelay = false;
+			int nSendBuffer = 0;
+			int nReceiveBuffer = 0;
+			int nBusyPollMicroseconds = 0;
+		};
+
+		struct low_latency_config
+		{
+			// Core the asio thread is pinned to, -1 leaves it to the scheduler
+			int nIOCore = -1;
+			socket_tuning sockets{ true };
+
+			// Waiting for messages spins for up to maxSpin before sleeping. Each wait that a message ends while
+			// spinning doubles how long the next one spins, each that spins in vain halves it, down to minSpin
+			std::chrono::microseconds minSpin{ 20 };
+			std::chrono::microseconds maxSpin{ 2000 };
+		};
+
+		// Returns the first option that couldn't be set, or nullptr if all of them were
+		inline const char* apply_socket_tuning(asio::ip::tcp::socket& socket, const socket_tuning& tuning)
+		{
+			const char* sOption = "TCP_NODELAY";
+			try
+			{
+				if (tuning.bNoDelay)
+					socket.set_option(asio::ip::tcp::no_delay(true));
+
+				sOption = "SO_SNDBUF";
+				if (tuning.nSendBuffer > 0)
+					socket.set_option(asio::socket_base::send_buffer_size(tuning.nSendBuffer));
+
+				sOption = "SO_RCVBUF";
+				if (tuning.nReceiveBuffer > 0)
+					socket.set_option(asio::socket_base::receive_buffer_size(tuning.nReceiveBuffer));
+			}
+			catch (std::exception&)
+			{
+				return sOption;
+			}
+
+			if (tuning.nBusyPollMicroseconds > 0)
+			{
+#if defined(__linux__) && defined(SO_BUSY_POLL)
+				int nBusyPoll = tuning.nBusyPollMicroseconds;
+				if (setsockopt(socket.native_handle(), SOL_SOCKET, SO_BUSY_POLL, &nBusyPoll, sizeof(nBusyPoll)) != 0)
+					return "SO_BUSY_POLL";
+#else
+				return "SO_BUSY_POLL";
+#endif
+			}
+			return nullptr;
+		}
+
+		// Returns false if the thread couldn't be pinned to nCore
+		inline bool pin_current_thread(int nCore)
+		{
+#ifdef __linux__
+			if (nCore < 0 || nCore >= CPU_SETSIZE)
+				return false;
+
+			cpu_set_t cores;
+			CPU_ZERO(&cores);
+			CPU_SET(nCore, &cores);
+			return pthread_setaffinity_np(pthread_self(), sizeof(cores), &cores) == 0;
+#else
+			return false;
+#endif
+		}
+
+		// Microsecond buckets up to LATENCY_BUCKETS, anything longer shares the last one. Game thread only
+		constexpr size_t LATENCY_BUCKETS = 10000;
+
+		class latency_stats
+		{
+		public:
+			void record(std::chrono::steady_clock::duration latency)
+			{
+				uint64_t nMicroseconds = uint64_t(std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::microseconds>(latency).count()));
+				m_vBuckets[std::min<uint64_t>(nMicroseconds, LATENCY_BUCKETS - 1)]++;
+				m_nMaxMicroseconds = std::max(m_nMaxMicroseconds, nMicroseconds);
+				m_nCount++;
+			}
+
+			uint64_t count() const
+			{
+				return m_nCount;
+			}
+
+			// Smallest latency in microseconds that fPercentile of the samples don't exceed
+			uint64_t percentile(double fPercentile) const
+			{
+				uint64_t nWanted = uint64_t(std::ceil(m_nCount * fPercentile / 100.0));
+				uint64_t nSeen = 0;
+				for (size_t i = 0; i < LATENCY_BUCKETS; i++)
+				{
+					nSeen += m_vBuckets[i];
+					if (nSeen >= nWanted && nSeen > 0)
+						return i == LATENCY_BUCKETS - 1 ? m_nMaxMicroseconds : i;
+				}
+				return 0;
+			}
+
+			// e.g. "90000 msgs, p50 12 p99 85 p99.9 410 max 2300 us"
+			std::string summary() const
+			{
+				return std::to_string(m_nCount) + " msgs, p50 " + std::to_string(percentile(50.0)) + " p99 " + std::to_string(percentile(99.0))
+					+ " p99.9 " + std::to_string(percentile(99.9)) + " max " + std::to_string(m_nMaxMicroseconds) + " us";
+			}
+
+			void reset()
+			{
+				std::fill(m_vBuckets.begin(), m_vBuckets.end(), 0);
+				m_nMaxMicroseconds = 0;
+				m_nCount = 0;
+			}
+
+		private:
+			std::vector<uint64_t> m_vBuckets = std::vector<uint64_t>(LATENCY_BUCKETS, 0);
+			uint64_t m_nMaxMicroseconds = 0;
+			uint64_t m_nCount = 0;
+		};
+	}
+}
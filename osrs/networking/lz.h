@@ -0,0 +1,186 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/// <summary>
+/// Small LZ77 codec producing the LZ4 block format: a sequence of tokens, each followed by literal bytes and
+/// a back reference of at least 4 bytes within the previous 64 KB. Matches are found with a single-entry hash
+/// table over 4 byte windows, which trades some ratio for speed. That suits our payloads: arrays of player
+/// descriptions where most bytes repeat at a fixed stride.
+/// The block format rules are kept (the last 5 bytes are literals, no match starts in the last 12 bytes),
+/// so any LZ4 block decoder can read the output. Decompression checks every length and offset against the
+/// buffers, since the input comes from the network.
+/// </summary>
+
+namespace tfg
+{
+	namespace net
+	{
+		namespace lz
+		{
+			constexpr size_t MIN_MATCH = 4;
+			constexpr size_t LAST_LITERALS = 5;
+			constexpr size_t MATCH_FIND_LIMIT = 12;
+			constexpr size_t MAX_OFFSET = 65535;
+			constexpr size_t HASH_BITS = 12;
+
+			// Worst case size of the output for nSize bytes of input
+			inline size_t bound(size_t nSize)
+			{
+				return nSize + nSize / 255 + 16;
+			}
+
+			inline uint32_t read32(const uint8_t* p)
+			{
+				uint32_t n;
+				std::memcpy(&n, p, sizeof(n));
+				return n;
+			}
+
+			inline uint32_t hash(uint32_t n)
+			{
+				return (n * 2654435761u) >> (32 - HASH_BITS);
+			}
+
+			inline void write_length(std::vector<uint8_t>& out, size_t nLength)
+			{
+				while (nLength >= 255)
+				{
+					out.push_back(255);
+					nLength -= 255;
+				}
+				out.push_back(uint8_t(nLength));
+			}
+
+			// One token: nLiterals bytes copied from pLiterals, then a match of nMatch bytes at nOffset (0 for the last token)
+			inline void write_sequence(std::vector<uint8_t>& out, const uint8_t* pLiterals, size_t nLiterals, size_t nOffset, size_t nMatch)
+			{
+				size_t nMatchCode = nMatch > 0 ? nMatch - MIN_MATCH : 0;
+				out.push_back(uint8_t((std::min<size_t>(nLiterals, 15) << 4) | std::min<size_t>(nMatchCode, 15)));
+				if (nLiterals >= 15)
+					write_length(out, nLiterals - 15);
+				out.insert(out.end(), pLiterals, pLiterals + nLiterals);
+
+				if (nMatch == 0)
+					return;
+
+				out.push_back(uint8_t(nOffset & 0xFF));
+				out.push_back(uint8_t(nOffset >> 8));
+				if (nMatchCode >= 15)
+					write_length(out, nMatchCode - 15);
+			}
+
+			// Append the compressed form of pSrc to out
+			inline void compress(const uint8_t* pSrc, size_t nSize, std::vector<uint8_t>& out)
+			{
+				out.reserve(out.size() + bound(nSize));
+
+				size_t nAnchor = 0;
+				if (nSize > MATCH_FIND_LIMIT)
+				{
+					// Positions are stored + 1 so 0 means empty
+					uint32_t table[1 << HASH_BITS] = {};
+					size_t nMatchStartLimit = nSize - MATCH_FIND_LIMIT;
+					size_t nMatchEndLimit = nSize - LAST_LITERALS;
+					size_t nMisses = 0;
+
+					size_t i = 0;
+					while (i < nMatchStartLimit)
+					{
+						uint32_t nSequence = read32(pSrc + i);
+						uint32_t& slot = table[hash(nSequence)];
+						size_t nCandidate = slot;
+						slot = uint32_t(i + 1);
+
+						if (nCandidate == 0 || i - (nCandidate - 1) > MAX_OFFSET || read32(pSrc + nCandidate - 1) != nSequence)
+						{
+							// Skip ahead faster through data that doesn't compress
+							i += 1 + (nMisses++ >> 6);
+							continue;
+						}
+						nMisses = 0;
+
+						size_t nRef = nCandidate - 1;
+						size_t nMatch = MIN_MATCH;
+						while (i + nMatch < nMatchEndLimit && pSrc[nRef + nMatch] == pSrc[i + nMatch])
+							nMatch++;
+
+						write_sequence(out, pSrc + nAnchor, i - nAnchor, i - nRef, nMatch);
+						i += nMatch;
+						nAnchor = i;
+					}
+				}
+
+				write_sequence(out, pSrc + nAnchor, nSize - nAnchor, 0, 0);
+			}
+
+			// Decompress exactly nDstSize bytes into pDst. Returns false on malformed input
+			inline bool decompress(const uint8_t* pSrc, size_t nSrcSize, uint8_t* pDst, size_t nDstSize)
+			{
+				size_t ip = 0, op = 0;
+				while (ip < nSrcSize)
+				{
+					uint8_t nToken = pSrc[ip++];
+
+					size_t nLiterals = nToken >> 4;
+					if (nLiterals == 15)
+					{
+						uint8_t n;
+						do
+						{
+							if (ip >= nSrcSize)
+								return false;
+							n = pSrc[ip++];
+							nLiterals += n;
+						} while (n == 255);
+					}
+
+					if (nLiterals > nSrcSize - ip || nLiterals > nDstSize - op)
+						return false;
+					if (nLiterals > 0)
+						std::memcpy(pDst + op, pSrc + ip, nLiterals);
+					ip += nLiterals;
+					op += nLiterals;
+
+					// The last sequence has no match
+					if (ip == nSrcSize)
+						break;
+
+					if (nSrcSize - ip < 2)
+						return false;
+					size_t nOffset = size_t(pSrc[ip]) | (size_t(pSrc[ip + 1]) << 8);
+					ip += 2;
+					if (nOffset == 0 || nOffset > op)
+						return false;
+
+					size_t nMatch = nToken & 0x0F;
+					if (nMatch == 15)
+					{
+						uint8_t n;
+						do
+						{
+							if (ip >= nSrcSize)
+								return false;
+							n = pSrc[ip++];
+							nMatch += n;
+						} while (n == 255);
+					}
+					nMatch += MIN_MATCH;
+
+					if (nMatch > nDstSize - op)
+						return false;
+
+					// Byte by byte, since the match may overlap the bytes it produces
+					const uint8_t* pMatch = pDst + op - nOffset;
+					for (size_t i = 0; i < nMatch; i++)
+						pDst[op + i] = pMatch[i];
+					op += nMatch;
+				}
+
+				return op == nDstSize;
+			}
+		}
+	}
+}
@@ -4,7 +4,7 @@
 /// <summary>
 /// Copyright 2018 - 2021 OneLoneCoder.com
 /// The messages have two components: Header and body.
-/// The header includes an id and the size of the entire message (including the header).
+/// The header includes an id, the size of the entire message (including the header) and flags describing the body encoding.
 /// The body is essentially the payload of the message. It can also be non-existent (0 bytes).
 /// Header is always sent first, as it has a fixed size.
 /// The id of the header uses an enum class to validate the accuracy of the headers at compile time.
@@ -18,11 +18,18 @@ namespace tfg
 {
 	namespace net
 	{
+		// Bits of message_header::flags, describing how the body is encoded on the wire
+		constexpr uint32_t MESSAGE_COMPRESSED = 0x1;
+
+		// Capabilities a peer can advertise while registering, see compression.h
+		constexpr uint32_t CAPABILITY_COMPRESSION = 0x1;
+
 		template <typename T>
 		struct message_header
 		{
 			T id{};
 			uint32_t size = 0;
+			uint32_t flags = 0;
 		};
 
 		template <typename T>
@@ -90,6 +97,9 @@ namespace tfg
 			std::shared_ptr<connection<T>> remote = nullptr;
 			message<T> msg;
 
+			// When the message was taken off the socket, or injected
+			std::chrono::steady_clock::time_point tReceived;
+
 			// Overload the << operator to enable printing owned_message<T> objects
 			friend std::ostream& operator<<(std::ostream& os, const owned_message<T>& msg)
 			{
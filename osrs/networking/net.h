@@ -1,7 +1,16 @@
 #pragma once
 #include "common.h"
 #include "tsqueue.h"
+#include "triplebuffer.h"
 #include "message.h"
 #include "client.h"
 #include "server.h"
+#include "recorder.h"
+#include "compression.h"
+#include "ratelimit.h"
+#include "lanes.h"
+#include "gateway.h"
+#include "secret.h"
+#include "dispatch.h"
+#include "trace.h"
 #include "connection.h"
\ No newline at end of file
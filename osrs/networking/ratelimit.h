@@ -0,0 +1,210 @@
+#pragma once
+#include "common.h"
+#include <atomic>
+#include <unordered_map>
+
+/// <summary>
+/// Flood protection for incoming messages. Every server side connection owns a pair of token buckets per message
+/// type with limits of its own, and one more pair shared by all other types, one counting messages and one counting
+/// bytes. Buckets refill continuously at the configured rate up to
+/// their burst size, and each incoming message takes one token from the first and its size from the second.
+/// What happens to a message that finds a bucket empty depends on the policy for its type:
+///  - drop: the message is discarded and the connection keeps reading.
+///  - throttle: the message is kept, but the connection stops reading until the buckets have refilled, so TCP
+///    pushes back on the sender instead of the server buffering its flood.
+///  - disconnect: the connection is closed.
+/// Limits are checked on the asio thread before a message reaches the incoming queue, so a flooding client
+/// costs the game thread nothing.
+/// </summary>
+
+namespace tfg
+{
+	namespace net
+	{
+		enum class rate_policy
+		{
+			drop,
+			throttle,
+			disconnect
+		};
+
+		// A rate of 0 leaves that dimension unlimited
+		struct rate_limit
+		{
+			double fMessagesPerSecond = 0.0;
+			double fMessageBurst = 0.0;
+			double fBytesPerSecond = 0.0;
+			double fByteBurst = 0.0;
+			rate_policy nPolicy = rate_policy::drop;
+		};
+
+		template<typename T>
+		struct rate_limits
+		{
+			// Used for message types without an entry of their own, which all share one pair of buckets
+			rate_limit defaults;
+			std::unordered_map<T, rate_limit> mapPerType;
+
+			// Largest message accepted, header included. Anything bigger closes the connection before the body is allocated
+			uint32_t nMaxMessageSize = 0;
+		};
+
+		// Shared by all connections of a server
+		struct rate_limit_stats
+		{
+			std::atomic<uint64_t> nDropped = 0;
+			std::atomic<uint64_t> nThrottled = 0;
+			std::atomic<uint64_t> nDisconnected = 0;
+			std::atomic<uint64_t> nOversized = 0;
+			std::atomic<uint64_t> nUnknown = 0;
+
+			uint64_t total() const
+			{
+				return nDropped + nThrottled + nDisconnected + nOversized + nUnknown;
+			}
+
+			std::string summary() const
+			{
+				return std::to_string(nDropped) + " dropped, " + std::to_string(nThrottled) + " throttled, "
+					+ std::to_string(nDisconnected) + " disconnected, " + std::to_string(nOversized) + " oversized, "
+					+ std::to_string(nUnknown) + " of unknown type";
+			}
+		};
+
+		class token_bucket
+		{
+		public:
+			void configure(double fRate, double fBurst)
+			{
+				m_fRate = fRate;
+				m_fBurst = std::max(fBurst, 1.0);
+				m_fTokens = m_fBurst;
+				m_tLast = std::chrono::steady_clock::now();
+			}
+
+			// Whether n tokens could be taken right now
+			bool available(double n, std::chrono::steady_clock::time_point tNow)
+			{
+				if (m_fRate <= 0.0)
+					return true;
+
+				refill(tNow);
+				return m_fTokens >= n;
+			}
+
+			// Take n tokens even if that leaves the bucket in debt, returning how long until it is out of debt
+			std::chrono::steady_clock::duration take(double n, std::chrono::steady_clock::time_point tNow)
+			{
+				if (m_fRate <= 0.0)
+					return std::chrono::steady_clock::duration(0);
+
+				refill(tNow);
+				m_fTokens -= n;
+				if (m_fTokens >= 0.0)
+					return std::chrono::steady_clock::duration(0);
+				return std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(-m_fTokens / m_fRate));
+			}
+
+		private:
+			void refill(std::chrono::steady_clock::time_point tNow)
+			{
+				m_fTokens = std::min(m_fBurst, m_fTokens + std::chrono::duration<double>(tNow - m_tLast).count() * m_fRate);
+				m_tLast = tNow;
+			}
+
+		private:
+			double m_fRate = 0.0;
+			double m_fBurst = 1.0;
+			double m_fTokens = 1.0;
+			std::chrono::steady_clock::time_point m_tLast;
+		};
+
+		// The buckets of one connection
+		template<typename T>
+		class rate_limiter
+		{
+		public:
+			enum class verdict
+			{
+				accept,
+				drop,
+				throttle,
+				disconnect
+			};
+
+			rate_limiter(const rate_limits<T>& limits, rate_limit_stats& stats) : m_limits(limits), m_stats(stats)
+			{
+				m_defaultBuckets.configure(m_limits.defaults);
+			}
+
+			// Decide what to do with an incoming message. With a throttle verdict the message is still accepted,
+			// and delay says how long to wait before reading the next one
+			verdict check(T id, size_t nBytes, std::chrono::steady_clock::duration& delay)
+			{
+				// Types without limits of their own share the default buckets, so cycling through types gains a sender nothing
+				const rate_limit* pLimit = &m_limits.defaults;
+				sBuckets* pBuckets = &m_defaultBuckets;
+				auto itLimit = m_limits.mapPerType.find(id);
+				if (itLimit != m_limits.mapPerType.end())
+				{
+					pLimit = &itLimit->second;
+					auto it = m_mapBuckets.find(id);
+					if (it == m_mapBuckets.end())
+					{
+						it = m_mapBuckets.emplace(id, sBuckets()).first;
+						it->second.configure(*pLimit);
+					}
+					pBuckets = &it->second;
+				}
+
+				auto tNow = std::chrono::steady_clock::now();
+				const rate_limit& limit = *pLimit;
+				sBuckets& buckets = *pBuckets;
+
+				if (limit.nPolicy == rate_policy::throttle)
+				{
+					delay = std::max(buckets.messages.take(1.0, tNow), buckets.bytes.take(double(nBytes), tNow));
+					if (delay.count() == 0)
+						return verdict::accept;
+					m_stats.nThrottled++;
+					return verdict::throttle;
+				}
+
+				// Only charge the buckets if both can take the message
+				if (buckets.messages.available(1.0, tNow) && buckets.bytes.available(double(nBytes), tNow))
+				{
+					buckets.messages.take(1.0, tNow);
+					buckets.bytes.take(double(nBytes), tNow);
+					return verdict::accept;
+				}
+
+				if (limit.nPolicy == rate_policy::disconnect)
+				{
+					m_stats.nDisconnected++;
+					return verdict::disconnect;
+				}
+
+				m_stats.nDropped++;
+				return verdict::drop;
+			}
+
+		private:
+			struct sBuckets
+			{
+				token_bucket messages;
+				token_bucket bytes;
+
+				void configure(const rate_limit& limit)
+				{
+					messages.configure(limit.fMessagesPerSecond, limit.fMessageBurst);
+					bytes.configure(limit.fBytesPerSecond, limit.fByteBurst);
+				}
+			};
+
+			const rate_limits<T>& m_limits;
+			rate_limit_stats& m_stats;
+			sBuckets m_defaultBuckets;
+			std::unordered_map<T, sBuckets> m_mapBuckets;
+		};
+	}
+}
@@ -0,0 +1,164 @@
+#pragma once
+#include "common.h"
+#include "message.h"
+#include <fstream>
+#include <string>
+
+/// <summary>
+/// Records incoming messages to a compact binary file so a session can be replayed against a server later.
+/// The file starts with a small header identifying the format and the size of a message header, followed by
+/// one record per message: the ID of the connection that sent it, the time since recording started in
+/// nanoseconds, the message header and the body, exactly as they arrived.
+/// The recorder runs on the thread that calls server_interface::Update(), so records appear in the order
+/// the server processed them. Writes go through the stream's buffer, which is flushed about once a second so a server that is killed
+/// loses at most the last second of a recording.
+/// </summary>
+
+namespace tfg
+{
+	namespace net
+	{
+		template<typename T>
+		struct recorded_message
+		{
+			uint32_t nConnectionID = 0;
+			uint64_t nTimestamp = 0;
+			message<T> msg;
+		};
+
+		template<typename T>
+		class message_recorder
+		{
+		public:
+			message_recorder() = default;
+			message_recorder(const message_recorder<T>&) = delete;
+			virtual ~message_recorder() { close(); }
+
+		public:
+			bool open(const std::string& sPath)
+			{
+				close();
+				m_file.open(sPath, std::ios::binary | std::ios::trunc);
+				if (!m_file)
+					return false;
+
+				uint32_t nHeaderSize = sizeof(message_header<T>);
+				m_file.write(reinterpret_cast<const char*>(&RECORDING_MAGIC), sizeof(RECORDING_MAGIC));
+				m_file.write(reinterpret_cast<const char*>(&nHeaderSize), sizeof(nHeaderSize));
+
+				m_tStart = std::chrono::steady_clock::now();
+				m_nMessages = 0;
+				m_nLastFlush = 0;
+				return true;
+			}
+
+			void close()
+			{
+				if (m_file.is_open())
+				{
+					m_file.flush();
+					m_file.close();
+				}
+			}
+
+			bool is_open() const
+			{
+				return m_file.is_open();
+			}
+
+			// Must be called before the message is handled, since handlers pop data out of the body
+			void write(uint32_t nConnectionID, const message<T>& msg)
+			{
+				uint64_t nTimestamp = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_tStart).count());
+				m_file.write(reinterpret_cast<const char*>(&nConnectionID), sizeof(nConnectionID));
+				m_file.write(reinterpret_cast<const char*>(&nTimestamp), sizeof(nTimestamp));
+				m_file.write(reinterpret_cast<const char*>(&msg.header), sizeof(message_header<T>));
+				if (!msg.body.empty())
+					m_file.write(reinterpret_cast<const char*>(msg.body.data()), msg.body.size());
+				m_nMessages++;
+
+				if (nTimestamp - m_nLastFlush > FLUSH_INTERVAL_NS)
+				{
+					m_file.flush();
+					m_nLastFlush = nTimestamp;
+				}
+			}
+
+			size_t count() const
+			{
+				return m_nMessages;
+			}
+
+		public:
+			static constexpr uint32_t RECORDING_MAGIC = 0x43455254; // "TREC"
+
+		private:
+			static constexpr uint64_t FLUSH_INTERVAL_NS = 1000000000;
+
+			std::ofstream m_file;
+			std::chrono::steady_clock::time_point m_tStart;
+			size_t m_nMessages = 0;
+			uint64_t m_nLastFlush = 0;
+		};
+
+		// Reads back a file written by message_recorder, one message at a time
+		template<typename T>
+		class message_playback
+		{
+		public:
+			bool open(const std::string& sPath)
+			{
+				m_file.open(sPath, std::ios::binary | std::ios::ate);
+				if (!m_file)
+					return false;
+				m_nFileSize = uint64_t(m_file.tellg());
+				m_file.seekg(0);
+
+				uint32_t nMagic = 0, nHeaderSize = 0;
+				m_file.read(reinterpret_cast<char*>(&nMagic), sizeof(nMagic));
+				m_file.read(reinterpret_cast<char*>(&nHeaderSize), sizeof(nHeaderSize));
+
+				// A recording made with a different message header layout can't be read back
+				return m_file && nMagic == message_recorder<T>::RECORDING_MAGIC && nHeaderSize == sizeof(message_header<T>);
+			}
+
+			// Returns false at the end of the file, or on a truncated or corrupt record, whose size claims more than is left
+			bool next(recorded_message<T>& record)
+			{
+				if (!m_file.read(reinterpret_cast<char*>(&record.nConnectionID), sizeof(record.nConnectionID)))
+				{
+					m_bTruncated = m_file.gcount() > 0;
+					return false;
+				}
+
+				m_bTruncated = true;
+				if (!m_file.read(reinterpret_cast<char*>(&record.nTimestamp), sizeof(record.nTimestamp)) ||
+					!m_file.read(reinterpret_cast<char*>(&record.msg.header), sizeof(message_header<T>)))
+					return false;
+
+				// Messages that never had data pushed into them leave the size at 0
+				size_t nBodySize = record.msg.header.size > sizeof(message_header<T>) ? record.msg.header.size - sizeof(message_header<T>) : 0;
+				uint64_t nRemaining = m_nFileSize - uint64_t(m_file.tellg());
+				if (nBodySize > nRemaining)
+					return false;
+				record.msg.body.resize(nBodySize);
+				if (!record.msg.body.empty() && !m_file.read(reinterpret_cast<char*>(record.msg.body.data()), record.msg.body.size()))
+					return false;
+
+				m_bTruncated = false;
+				return true;
+			}
+
+			// Whether next() stopped at a record it couldn't read completely, rather than at the end of the file
+			bool truncated() const
+			{
+				return m_bTruncated;
+			}
+
+		private:
+			std::ifstream m_file;
+			uint64_t m_nFileSize = 0;
+			bool m_bTruncated = false;
+		};
+	}
+}
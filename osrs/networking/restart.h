@@ -0,0 +1,408 @@
+#pragma once
+#include "common.h"
+#include <cstring>
+#include <string>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+/// <summary>
+/// Hot restart: a new server process takes over from a running one, and its clients notice no more than a stall.
+/// The running server waits for a successor on a Unix domain socket, see server_interface::ListenForSuccessor().
+/// A new server connects to it with restart_request(), and the running one stops accepting and reading, writes
+/// out what it had queued for its clients and sends back its state, followed by its listening socket and the
+/// sockets of its clients, passed as SCM_RIGHTS. The new server confirms once it has taken everything over, see
+/// server_interface::Inherit(), and only starts serving when the old one answers that confirmation, after which the
+/// old one exits. If the new server goes away or takes too long to confirm, the old one closes the channel and
+/// carries on as if nothing had happened, and the new one sees the channel close instead of an answer and exits.
+/// Either way exactly one of them serves the clients.
+/// The state is a message body, so the application adds its own with the usual operators, see OnSaveRestartState().
+/// POSIX only, elsewhere there is never anything to take over and listening for successors fails.
+/// </summary>
+
+namespace tfg
+{
+	namespace net
+	{
+		constexpr uint32_t RESTART_MAGIC = 0x54535248; // "HRST"
+		constexpr uint32_t RESTART_VERSION = 1;
+
+		// Sockets per SCM_RIGHTS message, below the kernel's limit of 253
+		constexpr size_t RESTART_SOCKETS_PER_MESSAGE = 200;
+
+		// How long either side waits for the other before giving up on the hand-over
+		constexpr std::chrono::seconds RESTART_IO_TIMEOUT{ 10 };
+
+		// More than this much state is a corrupt header
+		constexpr uint64_t RESTART_MAX_STATE = 1ull << 30;
+
+		// Sent by the new server to ask for a hand-over, and answered with a restart_header
+		struct restart_hello
+		{
+			uint32_t nMagic = RESTART_MAGIC;
+			uint32_t nVersion = RESTART_VERSION;
+		};
+
+		// nBytes of state follow, then nSockets sockets, the listening one first. Nothing follows if the version isn't
+		// the one asked for, or nSockets is zero because the running server is not handing over
+		struct restart_header
+		{
+			uint64_t nBytes = 0;
+			uint32_t nMagic = RESTART_MAGIC;
+			uint32_t nVersion = RESTART_VERSION;
+			uint32_t nSockets = 0;
+		};
+
+		// Sent by the new server once it has taken everything over, and answered by the old one with RESTART_GO once it
+		// has stopped serving for good
+		constexpr uint8_t RESTART_CONFIRM = 1;
+		constexpr uint8_t RESTART_GO = 2;
+
+		// One end of the Unix domain socket between the two servers, or the socket the running one waits on
+		class restart_channel
+		{
+		public:
+			restart_channel() = default;
+			restart_channel(const restart_channel&) = delete;
+			restart_channel& operator=(const restart_channel&) = delete;
+
+			~restart_channel()
+			{
+				close();
+			}
+
+			// Wait for successors at sPath, replacing whatever an earlier server left there. Only our user may connect
+			bool listen(const std::string& sPath)
+			{
+				close();
+#ifndef _WIN32
+				sockaddr_un address{};
+				if (!make_address(sPath, address))
+					return false;
+
+				m_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+				if (m_fd < 0)
+					return false;
+
+				::unlink(sPath.c_str());
+				if (::bind(m_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || ::chmod(sPath.c_str(), S_IRUSR | S_IWUSR) != 0 ||
+					::listen(m_fd, 1) != 0 || ::fcntl(m_fd, F_SETFL, ::fcntl(m_fd, F_GETFL) | O_NONBLOCK) != 0)
+				{
+					close();
+					return false;
+				}
+				return true;
+#else
+				return false;
+#endif
+			}
+
+			// Take a successor waiting on a listening channel, without blocking. Returns false if there is none
+			bool accept(restart_channel& peer)
+			{
+#ifndef _WIN32
+				int fd = ::accept(m_fd, nullptr, nullptr);
+				if (fd < 0)
+					return false;
+
+				// Accepted sockets don't inherit O_NONBLOCK on every system
+				::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+				peer.close();
+				peer.m_fd = fd;
+				peer.set_timeout(RESTART_IO_TIMEOUT);
+				return true;
+#else
+				return false;
+#endif
+			}
+
+			// Returns false if no server is waiting at sPath
+			bool connect(const std::string& sPath)
+			{
+				close();
+#ifndef _WIN32
+				sockaddr_un address{};
+				if (!make_address(sPath, address))
+					return false;
+
+				m_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+				if (m_fd < 0 || ::connect(m_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+				{
+					close();
+					return false;
+				}
+				set_timeout(RESTART_IO_TIMEOUT);
+				return true;
+#else
+				return false;
+#endif
+			}
+
+			// Blocking, for at most RESTART_IO_TIMEOUT at a time unless set_timeout() says otherwise. False if the other
+			// side went away or took too long
+			bool write(const void* pData, size_t nBytes)
+			{
+#ifndef _WIN32
+				const uint8_t* p = static_cast<const uint8_t*>(pData);
+				while (nBytes > 0)
+				{
+					ssize_t nWritten = ::send(m_fd, p, nBytes, SEND_FLAGS);
+					if (nWritten < 0 && errno == EINTR)
+						continue;
+					if (nWritten <= 0)
+						return false;
+					p += nWritten;
+					nBytes -= size_t(nWritten);
+				}
+				return true;
+#else
+				return false;
+#endif
+			}
+
+			bool read(void* pData, size_t nBytes)
+			{
+#ifndef _WIN32
+				uint8_t* p = static_cast<uint8_t*>(pData);
+				while (nBytes > 0)
+				{
+					ssize_t nRead = ::recv(m_fd, p, nBytes, 0);
+					if (nRead < 0 && errno == EINTR)
+						continue;
+					if (nRead <= 0)
+						return false;
+					p += nRead;
+					nBytes -= size_t(nRead);
+				}
+				return true;
+#else
+				return false;
+#endif
+			}
+
+			// Pass sockets to the other process, which gets its own descriptors for them. Ours stay open
+			bool write_sockets(const std::vector<int>& vSockets)
+			{
+#ifndef _WIN32
+				for (size_t nFirst = 0; nFirst < vSockets.size(); nFirst += RESTART_SOCKETS_PER_MESSAGE)
+				{
+					size_t nCount = std::min(RESTART_SOCKETS_PER_MESSAGE, vSockets.size() - nFirst);
+					std::vector<cmsghdr> vControl((CMSG_SPACE(nCount * sizeof(int)) + sizeof(cmsghdr) - 1) / sizeof(cmsghdr));
+
+					// Sockets travel with a byte of data, one batch per byte so the reader can't get two batches at once
+					uint8_t nByte = 0;
+					iovec data = { &nByte, 1 };
+					msghdr msg{};
+					msg.msg_iov = &data;
+					msg.msg_iovlen = 1;
+					msg.msg_control = vControl.data();
+					msg.msg_controllen = CMSG_SPACE(nCount * sizeof(int));
+
+					cmsghdr* pControl = CMSG_FIRSTHDR(&msg);
+					pControl->cmsg_level = SOL_SOCKET;
+					pControl->cmsg_type = SCM_RIGHTS;
+					pControl->cmsg_len = CMSG_LEN(nCount * sizeof(int));
+					std::memcpy(CMSG_DATA(pControl), vSockets.data() + nFirst, nCount * sizeof(int));
+
+					ssize_t nSent;
+					do
+						nSent = ::sendmsg(m_fd, &msg, SEND_FLAGS);
+					while (nSent < 0 && errno == EINTR);
+					if (nSent != 1)
+						return false;
+				}
+				return true;
+#else
+				return false;
+#endif
+			}
+
+			// Receive nCount sockets passed with write_sockets(). Any received before a failure are closed again
+			bool read_sockets(size_t nCount, std::vector<int>& vSockets)
+			{
+#ifndef _WIN32
+				vSockets.clear();
+				while (vSockets.size() < nCount)
+				{
+					size_t nBatch = std::min(RESTART_SOCKETS_PER_MESSAGE, nCount - vSockets.size());
+					std::vector<cmsghdr> vControl((CMSG_SPACE(nBatch * sizeof(int)) + sizeof(cmsghdr) - 1) / sizeof(cmsghdr));
+
+					uint8_t nByte = 0;
+					iovec data = { &nByte, 1 };
+					msghdr msg{};
+					msg.msg_iov = &data;
+					msg.msg_iovlen = 1;
+					msg.msg_control = vControl.data();
+					msg.msg_controllen = CMSG_SPACE(nBatch * sizeof(int));
+
+					ssize_t nRead;
+					do
+						nRead = ::recvmsg(m_fd, &msg, 0);
+					while (nRead < 0 && errno == EINTR);
+
+					size_t nBefore = vSockets.size();
+					if (nRead == 1)
+					{
+						for (cmsghdr* pControl = CMSG_FIRSTHDR(&msg); pControl; pControl = CMSG_NXTHDR(&msg, pControl))
+						{
+							if (pControl->cmsg_level != SOL_SOCKET || pControl->cmsg_type != SCM_RIGHTS)
+								continue;
+
+							size_t nReceived = (pControl->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+							for (size_t i = 0; i < nReceived; i++)
+							{
+								int fd = -1;
+								std::memcpy(&fd, CMSG_DATA(pControl) + i * sizeof(int), sizeof(int));
+								vSockets.push_back(fd);
+							}
+						}
+					}
+
+					if (nRead != 1 || (msg.msg_flags & MSG_CTRUNC) || vSockets.size() == nBefore || vSockets.size() > nCount)
+					{
+						for (int fd : vSockets)
+							::close(fd);
+						vSockets.clear();
+						return false;
+					}
+				}
+				return true;
+#else
+				return false;
+#endif
+			}
+
+			void close()
+			{
+#ifndef _WIN32
+				if (m_fd >= 0)
+					::close(m_fd);
+#endif
+				m_fd = -1;
+			}
+
+			bool is_open() const
+			{
+				return m_fd >= 0;
+			}
+
+			// How long each read or write may block from now on. Zero would mean forever, so it is at least a millisecond
+			void set_timeout(std::chrono::milliseconds timeout)
+			{
+#ifndef _WIN32
+				auto nMs = std::max<long long>(timeout.count(), 1);
+				timeval tv{};
+				tv.tv_sec = time_t(nMs / 1000);
+				tv.tv_usec = suseconds_t((nMs % 1000) * 1000);
+				::setsockopt(m_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+				::setsockopt(m_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+#endif
+			}
+
+		private:
+#ifndef _WIN32
+#ifdef MSG_NOSIGNAL
+			// A successor that went away is a failed write, not a SIGPIPE
+			static constexpr int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+			static constexpr int SEND_FLAGS = 0;
+#endif
+
+			static bool make_address(const std::string& sPath, sockaddr_un& address)
+			{
+				if (sPath.empty() || sPath.size() >= sizeof(address.sun_path))
+					return false;
+				address.sun_family = AF_UNIX;
+				std::memcpy(address.sun_path, sPath.c_str(), sPath.size() + 1);
+				return true;
+			}
+#endif
+
+			int m_fd = -1;
+		};
+
+		// What a new server got from the one it takes over from. Sockets nobody adopted are closed along with it,
+		// which doesn't disturb their clients as long as the old server still has them
+		struct restart_inheritance
+		{
+			restart_channel channel;
+			std::vector<uint8_t> vState;
+			std::vector<int> vSockets;
+
+			restart_inheritance() = default;
+			restart_inheritance(const restart_inheritance&) = delete;
+			restart_inheritance& operator=(const restart_inheritance&) = delete;
+
+			~restart_inheritance()
+			{
+#ifndef _WIN32
+				for (int fd : vSockets)
+				{
+					if (fd >= 0)
+						::close(fd);
+				}
+#endif
+			}
+
+			// Tell the old server we have everything and wait for it to stop serving. False if it is gone or gave up on
+			// us first, in which case it carries on serving, so we must not
+			bool confirm()
+			{
+				uint8_t nAnswer = 0;
+				bool bConfirmed = channel.write(&RESTART_CONFIRM, sizeof(RESTART_CONFIRM)) && channel.read(&nAnswer, sizeof(nAnswer)) &&
+					nAnswer == RESTART_GO;
+				channel.close();
+				return bConfirmed;
+			}
+		};
+
+		enum class restart_result
+		{
+			nothing_running,
+			inherited,
+			failed
+		};
+
+		// Ask the server waiting at sPath to hand over to us. Blocks until it has, which takes as long as it needs to
+		// write out what it had queued for its clients
+		inline restart_result restart_request(const std::string& sPath, restart_inheritance& inherited)
+		{
+			if (!inherited.channel.connect(sPath))
+				return restart_result::nothing_running;
+
+			restart_hello hello;
+			restart_header header;
+			if (!inherited.channel.write(&hello, sizeof(hello)) || !inherited.channel.read(&header, sizeof(header)))
+			{
+				std::cerr << "[RESTART] The running server didn't answer\n";
+				return restart_result::failed;
+			}
+
+			if (header.nMagic != RESTART_MAGIC || header.nVersion != RESTART_VERSION)
+			{
+				std::cerr << "[RESTART] The running server hands over with version " << header.nVersion << ", we take over version " << RESTART_VERSION << "\n";
+				return restart_result::failed;
+			}
+
+			if (header.nSockets == 0 || header.nBytes > RESTART_MAX_STATE)
+			{
+				std::cerr << "[RESTART] The running server refused to hand over\n";
+				return restart_result::failed;
+			}
+
+			inherited.vState.resize(size_t(header.nBytes));
+			if (!inherited.channel.read(inherited.vState.data(), inherited.vState.size()) || !inherited.channel.read_sockets(header.nSockets, inherited.vSockets))
+			{
+				std::cerr << "[RESTART] The running server went away while handing over\n";
+				return restart_result::failed;
+			}
+			return restart_result::inherited;
+		}
+	}
+}
@@ -0,0 +1,138 @@
+#pragma once
+#include "common.h"
+#include <functional>
+#include <string>
+
+/// <summary>
+/// Periodic tasks for the thread that calls server_interface::Update(). Tasks run at a fixed rate: each run is
+/// scheduled one interval after the previous one was due, not after it ran, so being a little late once does
+/// not push every later run back. A task that falls more than a whole interval behind skips the runs it missed
+/// instead of running them back to back.
+/// Update() sleeps no longer than until the next task is due and stops handling messages when its budget runs
+/// out, so how late a task runs is bounded by the message budget plus however long the tasks before it take.
+/// That lateness is measured per task.
+/// </summary>
+
+namespace tfg
+{
+	namespace net
+	{
+		class task_scheduler
+		{
+		public:
+			using clock = std::chrono::steady_clock;
+
+			// Run task every interval, the first time one interval from now. Returns an ID for cancel()
+			uint32_t schedule(const std::string& sName, clock::duration interval, std::function<void()> task)
+			{
+				sTask entry;
+				entry.nID = m_nNextID++;
+				entry.sName = sName;
+				entry.interval = std::max(interval, clock::duration(1));
+				entry.tDue = clock::now() + entry.interval;
+				entry.task = std::move(task);
+				m_vTasks.push_back(std::move(entry));
+				return m_vTasks.back().nID;
+			}
+
+			// Safe to call from within a task
+			void cancel(uint32_t nID)
+			{
+				for (auto& task : m_vTasks)
+				{
+					if (task.nID == nID)
+						task.bCancelled = true;
+				}
+			}
+
+			// When the next task is due, or time_point::max() if there is none
+			clock::time_point next_due() const
+			{
+				clock::time_point tNext = clock::time_point::max();
+				for (const auto& task : m_vTasks)
+				{
+					if (!task.bCancelled)
+						tNext = std::min(tNext, task.tDue);
+				}
+				return tNext;
+			}
+
+			// Run every task that is due, returning how many ran
+			size_t run_due()
+			{
+				size_t nRan = 0;
+
+				// By index, since tasks may schedule new ones
+				for (size_t i = 0; i < m_vTasks.size(); i++)
+				{
+					auto tNow = clock::now();
+					if (m_vTasks[i].bCancelled || m_vTasks[i].tDue > tNow)
+						continue;
+
+					sTask& task = m_vTasks[i];
+					uint64_t nLate = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(tNow - task.tDue).count());
+					task.nRuns++;
+					task.nLateNanoseconds += nLate;
+					task.nMaxLateNanoseconds = std::max(task.nMaxLateNanoseconds, nLate);
+
+					// Fixed rate, skipping whole intervals that have already gone by
+					auto nMissed = (tNow - task.tDue) / task.interval;
+					task.nSkipped += uint64_t(nMissed);
+					task.tDue += task.interval * (nMissed + 1);
+
+					// Copied, the task may add to m_vTasks and move the one we are running
+					auto fn = task.task;
+					fn();
+					nRan++;
+				}
+
+				m_vTasks.erase(std::remove_if(m_vTasks.begin(), m_vTasks.end(), [](const sTask& task) { return task.bCancelled; }), m_vTasks.end());
+				return nRan;
+			}
+
+			// Runs so far, across all tasks
+			uint64_t total() const
+			{
+				uint64_t nTotal = 0;
+				for (const auto& task : m_vTasks)
+					nTotal += task.nRuns;
+				return nTotal;
+			}
+
+			// e.g. "leaderboard 40 runs, late avg 0.12 max 1.50 ms | stats 1 runs, late avg 0.10 max 0.10 ms, 2 skipped"
+			std::string summary() const
+			{
+				std::string sSummary;
+				for (const auto& task : m_vTasks)
+				{
+					char text[160];
+					snprintf(text, sizeof(text), "%s%s %llu runs, late avg %.2f max %.2f ms", sSummary.empty() ? "" : " | ", task.sName.c_str(),
+						(unsigned long long)task.nRuns, task.nRuns > 0 ? task.nLateNanoseconds / 1e6 / task.nRuns : 0.0, task.nMaxLateNanoseconds / 1e6);
+					sSummary += text;
+					if (task.nSkipped > 0)
+						sSummary += ", " + std::to_string(task.nSkipped) + " skipped";
+				}
+				return sSummary;
+			}
+
+		private:
+			struct sTask
+			{
+				uint32_t nID = 0;
+				std::string sName;
+				clock::duration interval;
+				clock::time_point tDue;
+				std::function<void()> task;
+				bool bCancelled = false;
+
+				uint64_t nRuns = 0;
+				uint64_t nLateNanoseconds = 0;
+				uint64_t nMaxLateNanoseconds = 0;
+				uint64_t nSkipped = 0;
+			};
+
+			std::vector<sTask> m_vTasks;
+			uint32_t m_nNextID = 1;
+		};
+	}
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include "common.h"
+#include <random>
+
+/// <summary>
+/// Shared secrets, like the keys of gateways and cluster nodes and the tokens players resume their sessions with.
+/// Secrets are drawn from std::random_device, which is the system's CSPRNG on the platforms we build for, rather
+/// than from a seeded generator whose output gives its seed away. They are compared in constant time, so how long
+/// a wrong one takes to be turned away says nothing about how close it was.
+/// </summary>
+
+namespace tfg
+{
+	namespace net
+	{
+		// Never zero, which stands for no secret everywhere one is kept
+		inline uint64_t random_secret()
+		{
+			std::random_device device;
+			uint64_t nSecret = 0;
+			while (nSecret == 0)
+				nSecret = (uint64_t(device()) << 32) | uint64_t(device());
+			return nSecret;
+		}
+
+		// Compares every bit whatever the first difference
+		inline bool secrets_match(uint64_t nPresented, uint64_t nSecret)
+		{
+			volatile uint64_t nDifference = 0;
+			for (int nShift = 0; nShift < 64; nShift += 8)
+				nDifference = nDifference | (((nPresented ^ nSecret) >> nShift) & 0xFF);
+			return nDifference == 0;
+		}
+	}
+}
@@ -3,12 +3,33 @@
 #include "tsqueue.h"
 #include "message.h"
 #include "connection.h"
+#include "recorder.h"
+#include "timerwheel.h"
+#include "scheduler.h"
+#include "gateway.h"
+#include "trace.h"
+#include "lowlatency.h"
+#include "restart.h"
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
 
 /// <summary>
 /// Copyright 2018 - 2021 OneLoneCoder.com
 /// The server defines a template class server_interface for creating server instances.
 /// It implements methods for managing client connections, sending messages,
 /// and handling incoming message packets using a thread-safe queue.
+/// Connections are supervised by a timer wheel on the asio thread, which sends heartbeats, enforces the
+/// handshake and idle timeouts and hands dead connections back to the game thread to be removed.
+/// Periodic game thread work is registered with SchedulePeriodic() and run by Update(), see scheduler.h.
+/// In low latency mode the server spins rather than sleeps while waiting for messages, pins its asio thread and
+/// tunes client sockets, see lowlatency.h.
+/// State that a newer message makes worthless is sent with MessageAllClientsState(), which lets each client's
+/// link decide how much of it to take, see flow.h.
+/// Clients may also come through gateways, see gateway.h. Each one is represented by a relayed connection, so
+/// handlers can't tell them from clients connected directly.
+/// A new server process can take over the listening socket and the clients connected directly from a running one,
+/// see restart.h. Clients still in the handshake, gateways and their clients are disconnected instead.
 /// </summary>
 
 namespace tfg
@@ -19,7 +40,15 @@ namespace tfg
 		class server_interface
 		{
 		public:
-			server_interface(uint16_t port) : m_asioAcceptor(m_asioContext, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port))
+			// Listens on port once started, unless it took over a listening socket from another server, see Inherit()
+			server_interface(uint16_t port) : m_asioAcceptor(m_asioContext), m_nPort(port), m_bListen(true), m_timerMaintenance(m_asioContext)
+			{
+
+			}
+
+			// A server that doesn't listen on any port. Clients can only be added with AddNullConnection(),
+			// which is how recorded traffic is replayed against a server
+			server_interface() : m_asioAcceptor(m_asioContext), m_timerMaintenance(m_asioContext)
 			{
 
 			}
@@ -27,6 +56,10 @@ namespace tfg
 			virtual ~server_interface()
 			{
 				Stop();
+
+				// Sockets must go before the context they were made with, which is declared after these
+				m_qMessagesIn.clear();
+				m_deqConnections.clear();
 			}
 
 			// Start the server
@@ -44,10 +77,26 @@ namespace tfg
 					/// it some work it could close in some cases.
 					/// </summary>
 
-					WaitForClientConnection();
+					if (m_bListen)
+					{
+						if (!m_asioAcceptor.is_open())
+							m_asioAcceptor = asio::ip::tcp::acceptor(m_asioContext, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), m_nPort));
+						WaitForClientConnection();
+					}
+					ScheduleMaintenance();
+
+					if (m_bFlowControl)
+						m_scheduler.schedule("flow", m_flowLimits.adaptInterval, [this]() { AdaptFlows(); });
 
 					// Launch the asio context in its own thread
-					m_threadContext = std::thread([this]() { m_asioContext.run(); });
+					m_threadContext = std::thread(
+						[this]()
+						{
+							TFG_TRACE_THREAD("server asio");
+							if (m_bLowLatency && m_lowLatency.nIOCore >= 0 && !pin_current_thread(m_lowLatency.nIOCore))
+								std::cerr << "[SERVER] Unable to pin the asio thread to core " << m_lowLatency.nIOCore << "\n";
+							m_asioContext.run();
+						});
 				}
 				catch (std::exception& e)
 				{
@@ -81,11 +130,27 @@ namespace tfg
 				m_asioAcceptor.async_accept(
 					[this](std::error_code ec, asio::ip::tcp::socket socket)
 					{
+						// The listening socket belongs to a successor now, see HandOver(). A client accepted just before
+						// has to connect again
+						if (m_bRestarting)
+							return;
+
 						// Triggered by incoming connection request
 						if (!ec)
 						{
 							std::cout << "[SERVER] New Connection: " << socket.remote_endpoint() << "\n";
 
+							// Tuning is best effort, and what the system refuses it refuses for every socket, so say so once
+							if (m_bLowLatency)
+							{
+								const char* sFailed = apply_socket_tuning(socket, m_lowLatency.sockets);
+								if (sFailed && !m_bTuningWarned)
+								{
+									std::cerr << "[SERVER] Unable to set " << sFailed << " on client sockets\n";
+									m_bTuningWarned = true;
+								}
+							}
+
 							// Temporarily create a new connection to handle this client 
 							std::shared_ptr<connection<T>> newconn =
 								std::make_shared<connection<T>>(connection<T>::owner::server,
@@ -94,12 +159,19 @@ namespace tfg
 							// Give the server a chance to deny connection
 							if (OnClientConnect(newconn))
 							{
-								// Connection allowed, so add to container of new connections
-								m_deqConnections.push_back(std::move(newconn));
+								newconn->SetRateLimits(m_rateLimits, m_statsRateLimit);
+								newconn->SetLaneStats(m_statsLanes);
+								if (m_bFlowControl)
+									newconn->SetFlowControl(m_flowLimits, m_statsFlow);
 
 								// Issue a task to the connection's ASIO context to sit and wait for bytes to arrive
-								m_deqConnections.back()->ConnectToClient(this, nIDCounter++);
-								std::cout << "[" << m_deqConnections.back()->GetID() << "] Connection Approved\n";
+								newconn->ConnectToClient(this, nIDCounter++);
+								std::cout << "[" << newconn->GetID() << "] Connection Approved\n";
+
+								// Watch it from now on. The game thread owns the container of connections,
+								// so it picks the new connection up at the start of its next Update()
+								m_wheel.schedule(m_handshakeTimeout, newconn);
+								m_qNewConnections.push_back(std::move(newconn));
 							}
 							else
 							{
@@ -125,7 +197,11 @@ namespace tfg
 				// Check if client is legitimate...
 				if (client && client->IsConnected())
 				{
-					client->Send(msg);
+					message<T> msgCompressed;
+					if (ShouldCompress(client, msg) && compress_message(msg, msgCompressed, m_statsCompression))
+						client->Send(msgCompressed);
+					else
+						client->Send(msg);
 				}
 				else
 				{
@@ -141,17 +217,93 @@ namespace tfg
 
 			// Send a message to all clients
 			void MessageAllClients(const message<T>& msg, std::shared_ptr<connection<T>> pIgnoreClient = nullptr)
+			{
+				TFG_TRACE_SCOPE_ID("MessageAllClients", uint32_t(msg.header.id));
+				MessageClientsIf(msg, pIgnoreClient, 0, [](const std::shared_ptr<connection<T>>&) { return true; });
+			}
+
+			// Send update nSequence of the state keyed nKey to all clients whose stride admits it, see flow.h.
+			// fnStride(client) may stretch a client's stride further, like for things far away from it, or return 0 to leave
+			// the client out altogether, like for things it can't see. Clients behind a gateway get every update
+			template<typename StrideFn>
+			void MessageAllClientsState(const message<T>& msg, uint64_t nKey, uint64_t nSequence, std::shared_ptr<connection<T>> pIgnoreClient, StrideFn&& fnStride)
+			{
+				TFG_TRACE_SCOPE_ID("MessageAllClientsState", uint32_t(msg.header.id));
+				MessageClientsIf(msg, pIgnoreClient, nKey,
+					[&](const std::shared_ptr<connection<T>>& client)
+					{
+						uint32_t nFactor = fnStride(client);
+						if (nFactor == 0)
+							return false;
+
+						uint32_t nStride = client->GetFlowStride();
+						if (nStride > 1)
+							nStride *= nFactor;
+						return flow_admits(nSequence, client->GetID(), nStride);
+					});
+			}
+
+			// Flow control for the state clients are sent, see flow.h. Must be called before Start()
+			void SetFlowControl(const flow_limits& limits)
+			{
+				m_flowLimits = limits;
+				m_bFlowControl = true;
+			}
+
+			const flow_stats& GetFlowStats() const
+			{
+				return m_statsFlow;
+			}
+
+			// e.g. "stride 1: 40, 2: 3, 4: 1, 8: 0 clients, 12 KB queued". Game thread only
+			std::string GetFlowSummary() const
+			{
+				std::map<uint32_t, size_t> mapStrides;
+				for (uint32_t nStride = 1; nStride <= m_flowLimits.nMaxStride; nStride *= 2)
+					mapStrides[nStride] = 0;
+
+				uint64_t nQueued = 0;
+				for (const auto& client : m_deqConnections)
+				{
+					if (client && !client->IsRelayed())
+					{
+						mapStrides[client->GetFlowStride()]++;
+						nQueued += client->GetQueuedBytes();
+					}
+				}
+
+				std::string sSummary = "stride";
+				for (const auto& stride : mapStrides)
+					sSummary += (stride.first > 1 ? ", " : " ") + std::to_string(stride.first) + ": " + std::to_string(stride.second);
+				return sSummary + " clients, " + std::to_string(nQueued / 1024) + " KB queued";
+			}
+
+		private:
+			// Send msg to every connected broadcast target fnWants, compressed where it helps. A non-zero nKey coalesces
+			template<typename WantsFn>
+			void MessageClientsIf(const message<T>& msg, std::shared_ptr<connection<T>> pIgnoreClient, uint64_t nKey, WantsFn&& fnWants)
 			{
 				bool bInvalidClientExists = false;
 
+				// Compressed at most once, the first time a client that supports it needs it
+				message<T> msgCompressed;
+				bool bCompressionTried = false, bCompressed = false;
+
 				// Iterate through all clients in container
 				for (auto& client : m_deqConnections)
 				{
 					// Check if client is connected
 					if (client && client->IsConnected())
 					{
-						if (client != pIgnoreClient)
-							client->Send(msg);
+						if (client != pIgnoreClient && client->IsBroadcastTarget() && !client->IsRelayed() && fnWants(client))
+						{
+							if (ShouldCompress(client, msg) && !bCompressionTried)
+							{
+								bCompressed = compress_message(msg, msgCompressed, m_statsCompression);
+								bCompressionTried = true;
+							}
+							client->Send(bCompressed && client->IsCompressionEnabled() ? msgCompressed : msg, nKey);
+						}
 					}
 					else
 					{
@@ -168,25 +320,853 @@ namespace tfg
 				if (bInvalidClientExists)
 					m_deqConnections.erase(
 						std::remove(m_deqConnections.begin(), m_deqConnections.end(), nullptr), m_deqConnections.end());
+
+				// Clients behind a gateway get a single frame per upstream connection, and the gateway fans it out
+				if (!m_mapGateways.empty())
+				{
+					auto itIgnore = pIgnoreClient ? m_mapGatewayClients.find(pIgnoreClient) : m_mapGatewayClients.end();
+					for (auto& gateway : m_mapGateways)
+					{
+						if (gateway.second.mapClients.empty() || !gateway.first->IsConnected())
+							continue;
+
+						uint32_t nSkipTag = itIgnore != m_mapGatewayClients.end() && itIgnore->second.upstream == gateway.first ? itIgnore->second.nTag : 0;
+						gateway.first->Send(wrap_message(m_gatewayProtocol.broadcast, nSkipTag, msg));
+					}
+				}
+			}
+
+		public:
+			// Add a validated client without a socket, see connection's null transport constructor
+			std::shared_ptr<connection<T>> AddNullConnection(uint32_t uid)
+			{
+				auto newconn = std::make_shared<connection<T>>(connection<T>::owner::server, m_asioContext, m_qMessagesIn, uid);
+				if (!OnClientConnect(newconn))
+					return nullptr;
+
+				m_deqConnections.push_back(newconn);
+				OnClientValidated(newconn);
+				return newconn;
+			}
+
+			// Queue a message as if it had arrived from the given client
+			void InjectMessage(std::shared_ptr<connection<T>> client, const message<T>& msg)
+			{
+				m_qMessagesIn.push_back({ client, msg, std::chrono::steady_clock::now() });
+			}
+
+			// Write every message handled by Update() to a file, so the session can be replayed later
+			bool StartRecording(const std::string& sPath)
+			{
+				if (!m_recorder.open(sPath))
+				{
+					std::cerr << "[SERVER] Unable to record to " << sPath << "\n";
+					return false;
+				}
+				std::cout << "[SERVER] Recording to " << sPath << "\n";
+				return true;
+			}
+
+			void StopRecording()
+			{
+				if (m_recorder.is_open())
+				{
+					m_recorder.close();
+					std::cout << "[SERVER] Recorded " << m_recorder.count() << " messages\n";
+				}
+			}
+
+			// Offer compression to clients, for messages with at least nThreshold bytes of body
+			void SetCompression(bool bOffer, size_t nThreshold = 512)
+			{
+				m_bCompressionOffered = bOffer;
+				m_nCompressionThreshold = nThreshold;
+			}
+
+			bool IsCompressionOffered() const
+			{
+				return m_bCompressionOffered;
+			}
+
+			const compression_stats& GetCompressionStats() const
+			{
+				return m_statsCompression;
+			}
+
+			// Send nHeartbeatID to clients that haven't been sent anything for interval. Zero disables heartbeats
+			void SetHeartbeat(T nHeartbeatID, std::chrono::steady_clock::duration interval)
+			{
+				m_nHeartbeatID = nHeartbeatID;
+				m_heartbeatInterval = interval;
+			}
+
+			// Disconnect clients that don't complete the handshake in time, or stay silent for too long.
+			// An idle timeout of zero disables it
+			void SetTimeouts(std::chrono::steady_clock::duration handshake, std::chrono::steady_clock::duration idle)
+			{
+				m_handshakeTimeout = handshake;
+				m_idleTimeout = idle;
+			}
+
+			// Accept upstream connections from gateways speaking protocol, see gateway.h. Must be called before Start()
+			void EnableGateways(const gateway_protocol<T>& protocol)
+			{
+				m_gatewayProtocol = protocol;
+				m_bGateways = true;
+			}
+
+			size_t GetGatewayCount() const
+			{
+				return m_mapGateways.size();
+			}
+
+			size_t GetGatewayClientCount() const
+			{
+				return m_mapGatewayClients.size();
+			}
+
+			// Limits for messages from clients, see ratelimit.h. Must be set before Start()
+			void SetRateLimits(const rate_limits<T>& limits)
+			{
+				m_rateLimits = limits;
+			}
+
+			const rate_limit_stats& GetRateLimitStats() const
+			{
+				return m_statsRateLimit;
+			}
+
+			// How long outgoing messages waited in each priority lane, see lanes.h
+			const lane_stats<T>& GetLaneStats() const
+			{
+				return m_statsLanes;
 			}
 
-			// Force server to respond to incoming messages
+			// Force server to respond to incoming messages. With bWait, sleeps until a message arrives or a task is due
 			void Update(size_t nMaxMessages = -1, bool bWait = false)
 			{
-				// Wait until the client sends a message so that the server doesnt use 100% of the CPU core
-				if (bWait) m_qMessagesIn.wait();
+				auto tNow = std::chrono::steady_clock::now();
+				Update(bWait ? std::chrono::steady_clock::time_point::max() : tNow, std::chrono::steady_clock::duration::max(), nMaxMessages);
+			}
+
+			// Sleep until a message arrives, a scheduled task is due or tWaitUntil has passed. Then handle messages until
+			// there are none left, nMaxMessages have been handled or budget has been used up, and run the tasks that are due.
+			// Messages left over are handled by the next call, which does not sleep while there are any
+			void Update(std::chrono::steady_clock::time_point tWaitUntil, std::chrono::steady_clock::duration budget, size_t nMaxMessages = -1)
+			{
+				auto tWake = std::min(tWaitUntil, m_scheduler.next_due());
+				{
+					TFG_TRACE_SCOPE("Wait");
+					if (m_bLowLatency)
+						SpinThenWait(tWake);
+					else if (tWake == std::chrono::steady_clock::time_point::max())
+						m_qMessagesIn.wait();
+					else
+						m_qMessagesIn.wait_until(tWake);
+				}
+
+				TFG_TRACE_SCOPE("Update");
+				auto tStart = std::chrono::steady_clock::now();
+				auto tBudgetEnd = budget >= std::chrono::steady_clock::time_point::max() - tStart ? std::chrono::steady_clock::time_point::max() : tStart + budget;
+
+				// Take over connections accepted since the last update, and drop the ones found dead
+				while (!m_qNewConnections.empty())
+					m_deqConnections.push_back(m_qNewConnections.pop_front());
+				while (!m_qReapedConnections.empty())
+					RemoveConnection(m_qReapedConnections.pop_front());
+				if (!m_mapGateways.empty())
+					RemoveDeadGateways();
 
 				// Process as many messages as it can up to the specified value
 				size_t nMessageCount = 0;
 				while (nMessageCount < nMaxMessages && !m_qMessagesIn.empty())
 				{
+					auto tNow = std::chrono::steady_clock::now();
+					if (nMessageCount > 0 && tNow >= tBudgetEnd)
+						break;
+
 					// Grab the front message
 					auto msg = m_qMessagesIn.pop_front();
 
+					// Messages without a sender only wake us up, see ReapConnection()
+					if (!msg.remote)
+						continue;
+
+					// Frames from gateways become messages from their clients, or are handled right here
+					if (m_bGateways && !TranslateGatewayFrame(msg))
+						continue;
+
+					// Record before handling, since handlers consume the body
+					if (m_recorder.is_open())
+						m_recorder.write(msg.remote ? msg.remote->GetID() : 0, msg.msg);
+
+					m_statsLatency.record(tNow - msg.tReceived);
+
 					// Pass to message handler
+					TFG_TRACE_SCOPE_ID("OnMessage", uint32_t(msg.msg.header.id));
 					OnMessage(msg.remote, msg.msg);
 					nMessageCount++;
 				}
+
+				TFG_TRACE_SCOPE("Maintenance");
+				OnMaintenance();
+				m_scheduler.run_due();
+			}
+
+			// Spin rather than sleep while waiting for messages, pin the asio thread and tune client sockets, see
+			// lowlatency.h. Must be called before Start()
+			void SetLowLatency(const low_latency_config& config)
+			{
+				m_lowLatency = config;
+				m_spin = config.maxSpin;
+				m_bLowLatency = true;
+			}
+
+			bool IsLowLatency() const
+			{
+				return m_bLowLatency;
+			}
+
+			// How long handled messages waited between being received and handled, since the last reset. Game thread only
+			const latency_stats& GetLatencyStats() const
+			{
+				return m_statsLatency;
+			}
+
+			void ResetLatencyStats()
+			{
+				m_statsLatency.reset();
+			}
+
+			// Run task on the game thread every interval, from within Update(). Returns an ID for CancelPeriodic()
+			uint32_t SchedulePeriodic(const std::string& sName, std::chrono::steady_clock::duration interval, std::function<void()> task)
+			{
+				return m_scheduler.schedule(sName, interval, std::move(task));
+			}
+
+			void CancelPeriodic(uint32_t nID)
+			{
+				m_scheduler.cancel(nID);
+			}
+
+			// How late periodic tasks ran, see scheduler.h. Game thread only
+			std::string GetSchedulerSummary() const
+			{
+				return m_scheduler.summary();
+			}
+
+			// Hot restart, see restart.h. Hand over to a new server that connects to sPath, checked every RESTART_POLL_INTERVAL
+			bool ListenForSuccessor(const std::string& sPath)
+			{
+				if (!m_restartListener.listen(sPath))
+				{
+					std::cerr << "[RESTART] Unable to wait for successors at " << sPath << "\n";
+					return false;
+				}
+
+				m_scheduler.schedule("restart", RESTART_POLL_INTERVAL, [this]() { PollSuccessor(); });
+				std::cout << "[RESTART] Waiting for successors at " << sPath << "\n";
+				return true;
+			}
+
+			// Whether a successor has taken over, after which this server has nothing left to serve
+			bool IsReplaced() const
+			{
+				return m_bReplaced;
+			}
+
+			// Take over the listening socket, clients and state of the server we asked with restart_request(), and confirm.
+			// Must be called before Start(), which starts reading from the clients. Returns false if the state doesn't fit
+			// or the old server is gone, in which case it may still be serving and we must not
+			bool Inherit(restart_inheritance& inherited)
+			{
+				message<T> state;
+				state.body = std::move(inherited.vState);
+				size_t nStateBytes = state.body.size();
+				std::vector<int>& vSockets = inherited.vSockets;
+
+				uint32_t nIDs = 0, nClients = 0;
+				state >> nIDs >> nClients;
+				nIDCounter = std::max(nIDCounter.load(), nIDs);
+
+				std::vector<std::pair<std::shared_ptr<connection<T>>, std::vector<uint8_t>>> vInherited;
+				for (uint32_t i = 0; i < nClients; i++)
+				{
+					uint32_t nSocket = 0, nID = 0, nQueued = 0;
+					uint8_t bCompression = 0;
+					std::vector<uint8_t> vInput;
+					state >> nSocket >> nID >> bCompression;
+					if (nSocket == 0 || nSocket >= vSockets.size() || vSockets[nSocket] < 0 || !PopBytes(state, vInput))
+					{
+						std::cerr << "[RESTART] Malformed state\n";
+						return false;
+					}
+
+					asio::ip::tcp::socket socket(m_asioContext);
+					try
+					{
+						socket.assign(asio::ip::tcp::v4(), vSockets[nSocket]);
+						vSockets[nSocket] = -1;
+					}
+					catch (std::exception& e)
+					{
+						std::cerr << "[RESTART] Unable to take over the socket of " << nID << ": " << e.what() << "\n";
+						return false;
+					}
+
+					auto newconn = std::make_shared<connection<T>>(connection<T>::owner::server, m_asioContext, std::move(socket), m_qMessagesIn);
+					newconn->SetID(nID);
+					newconn->EnableCompression(bCompression != 0);
+					newconn->SetRateLimits(m_rateLimits, m_statsRateLimit);
+					newconn->SetLaneStats(m_statsLanes);
+					if (m_bFlowControl)
+						newconn->SetFlowControl(m_flowLimits, m_statsFlow);
+
+					// Messages the old server received but didn't get round to, handled first
+					state >> nQueued;
+					for (uint32_t j = 0; j < nQueued; j++)
+					{
+						message<T> msg;
+						state >> msg.header;
+						if (!PopBytes(state, msg.body))
+						{
+							std::cerr << "[RESTART] Malformed state\n";
+							return false;
+						}
+						InjectMessage(newconn, msg);
+					}
+
+					m_deqConnections.push_back(newconn);
+					m_wheel.schedule(REAP_INTERVAL, newconn);
+					vInherited.push_back({ newconn, std::move(vInput) });
+				}
+
+				if (!OnRestoreRestartState(state))
+					return false;
+
+				try
+				{
+					m_asioAcceptor.assign(asio::ip::tcp::v4(), vSockets[0]);
+					vSockets[0] = -1;
+				}
+				catch (std::exception& e)
+				{
+					std::cerr << "[RESTART] Unable to take over the listening socket: " << e.what() << "\n";
+					return false;
+				}
+
+				if (!inherited.confirm())
+				{
+					std::cerr << "[RESTART] The old server went away before we could confirm\n";
+					return false;
+				}
+
+				for (auto& client : vInherited)
+					client.first->Resume(std::move(client.second));
+				std::cout << "[RESTART] Took over " << vInherited.size() << " clients and " << nStateBytes << " bytes of state\n";
+				return true;
+			}
+
+		private:
+			// A gateway's clients by tag, see TranslateGatewayFrame()
+			struct sGateway
+			{
+				std::unordered_map<uint32_t, std::shared_ptr<connection<T>>> mapClients;
+			};
+
+			struct sGatewayClient
+			{
+				std::shared_ptr<connection<T>> upstream;
+				uint32_t nTag = 0;
+			};
+
+			// Low latency mode's wait, see low_latency_config
+			void SpinThenWait(std::chrono::steady_clock::time_point tWake)
+			{
+				if (!m_qMessagesIn.empty())
+					return;
+
+				auto tNow = std::chrono::steady_clock::now();
+				auto tSpinEnd = tWake - tNow > m_spin ? tNow + m_spin : tWake;
+				if (m_qMessagesIn.spin_until(tSpinEnd))
+				{
+					m_spin = std::min<std::chrono::steady_clock::duration>(m_spin * 2, m_lowLatency.maxSpin);
+					return;
+				}
+
+				// A task coming due doesn't say anything about how soon messages arrive
+				if (tSpinEnd == tWake)
+					return;
+
+				m_spin = std::max<std::chrono::steady_clock::duration>(m_spin / 2, m_lowLatency.minSpin);
+				if (tWake == std::chrono::steady_clock::time_point::max())
+					m_qMessagesIn.wait();
+				else
+					m_qMessagesIn.wait_until(tWake);
+			}
+
+			// ASYNC - Advance the timer wheel once per tick, checking the connections that are due
+			void ScheduleMaintenance()
+			{
+				m_timerMaintenance.expires_after(m_wheel.tick());
+				m_timerMaintenance.async_wait(
+					[this](std::error_code ec)
+					{
+						if (ec)
+							return;
+
+						m_wheel.advance([this](std::weak_ptr<connection<T>>& weak) { CheckConnection(weak); });
+						ScheduleMaintenance();
+					});
+			}
+
+			// Called on the asio thread when a connection comes due in the timer wheel
+			void CheckConnection(std::weak_ptr<connection<T>>& weak)
+			{
+				// Already removed by the game thread
+				auto client = weak.lock();
+				if (!client)
+					return;
+
+				auto tNow = std::chrono::steady_clock::now();
+				if (!client->IsConnected())
+				{
+					ReapConnection(client, "closed");
+					return;
+				}
+
+				if (!client->IsValidated())
+				{
+					if (tNow - client->GetCreated() >= m_handshakeTimeout)
+						ReapConnection(client, "handshake timeout");
+					else
+						m_wheel.schedule(client->GetCreated() + m_handshakeTimeout - tNow, weak);
+					return;
+				}
+
+				if (m_idleTimeout.count() > 0 && tNow - client->GetLastReceive() >= m_idleTimeout)
+				{
+					ReapConnection(client, "idle timeout");
+					return;
+				}
+
+				if (m_heartbeatInterval.count() > 0 && tNow - client->GetLastSend() >= m_heartbeatInterval)
+				{
+					message<T> msg;
+					msg.header.id = m_nHeartbeatID;
+					client->Send(msg);
+				}
+
+				// Come back when the next deadline is due, but at least every REAP_INTERVAL to notice closed sockets
+				auto tNext = tNow + REAP_INTERVAL;
+				if (m_idleTimeout.count() > 0)
+					tNext = std::min(tNext, client->GetLastReceive() + m_idleTimeout);
+				if (m_heartbeatInterval.count() > 0)
+					tNext = std::min(tNext, client->GetLastSend() + m_heartbeatInterval);
+				m_wheel.schedule(tNext - tNow, weak);
+			}
+
+			// Close a connection and hand it to the game thread, waking it up in case it is waiting for messages
+			void ReapConnection(std::shared_ptr<connection<T>> client, const char* sReason)
+			{
+				std::cout << "[" << client->GetID() << "] Reaped (" << sReason << ")\n";
+				client->Disconnect();
+				m_qReapedConnections.push_back(client);
+				m_qMessagesIn.push_back({ nullptr, {} });
+			}
+
+			// Remove a connection on the game thread, unless a failed send already did
+			void RemoveConnection(std::shared_ptr<connection<T>> client)
+			{
+				auto it = std::find(m_deqConnections.begin(), m_deqConnections.end(), client);
+				if (it == m_deqConnections.end())
+					return;
+
+				OnClientDisconnect(client);
+				m_deqConnections.erase(it);
+			}
+
+			// Handle a message that is part of the gateway protocol. Returns true if msg is now a message from a
+			// gateway's client, or was never a frame, and should be handled as usual
+			bool TranslateGatewayFrame(owned_message<T>& msg)
+			{
+				const auto& protocol = m_gatewayProtocol;
+				T id = msg.msg.header.id;
+
+				auto itGateway = m_mapGateways.find(msg.remote);
+				if (itGateway == m_mapGateways.end())
+				{
+					if (id == protocol.hello)
+					{
+						uint64_t nKey = 0;
+						bool bKeyed = msg.msg.body.size() == sizeof(uint64_t);
+						if (bKeyed)
+							msg.msg >> nKey;
+						if (!bKeyed || protocol.nKey == 0 || !secrets_match(nKey, protocol.nKey))
+						{
+							std::cout << "[" << msg.remote->GetID() << "] Rejected as a gateway\n";
+							msg.remote->Disconnect();
+							return false;
+						}
+
+						AddGateway(msg.remote);
+						return false;
+					}
+
+					// Only gateways speak for other clients
+					if (id == protocol.connected || id == protocol.disconnected || id == protocol.forward)
+					{
+						msg.remote->Disconnect();
+						return false;
+					}
+					return true;
+				}
+
+				sGateway& gateway = itGateway->second;
+				uint32_t nTag = 0;
+				if (id == protocol.forward)
+				{
+					message<T> inner;
+					if (!unwrap_message(msg.msg, nTag, inner))
+					{
+						std::cout << "[" << msg.remote->GetID() << "] Malformed gateway frame\n";
+						msg.remote->Disconnect();
+						return false;
+					}
+
+					// The client may be gone already
+					auto itClient = gateway.mapClients.find(nTag);
+					if (itClient == gateway.mapClients.end())
+						return false;
+
+					msg.remote = itClient->second;
+					msg.msg = std::move(inner);
+					return true;
+				}
+
+				if (id == protocol.connected && msg.msg.body.size() >= sizeof(uint32_t))
+				{
+					msg.msg >> nTag;
+					AddGatewayClient(msg.remote, gateway, nTag);
+				}
+				else if (id == protocol.disconnected && msg.msg.body.size() >= sizeof(uint32_t))
+				{
+					msg.msg >> nTag;
+					auto itClient = gateway.mapClients.find(nTag);
+					if (itClient != gateway.mapClients.end())
+						RemoveGatewayClient(gateway, itClient->second);
+				}
+
+				// Anything else a gateway sends, like heartbeat echoes, is for us and not for the application
+				return false;
+			}
+
+			void AddGateway(std::shared_ptr<connection<T>> upstream)
+			{
+				// Carries the traffic of many clients, which the gateway already limited
+				upstream->SetBroadcastTarget(false);
+				upstream->ClearRateLimits();
+				upstream->ClearFlowControl();
+				m_mapGateways[upstream];
+
+				// Answer once limits are off, so the gateway doesn't send frames before
+				message<T> msg;
+				msg.header.id = m_gatewayProtocol.hello;
+				upstream->Send(msg);
+				std::cout << "[" << upstream->GetID() << "] Gateway linked\n";
+			}
+
+			void AddGatewayClient(std::shared_ptr<connection<T>> upstream, sGateway& gateway, uint32_t nTag)
+			{
+				if (gateway.mapClients.count(nTag))
+					return;
+
+				auto client = std::make_shared<connection<T>>(connection<T>::owner::server, m_asioContext, m_qMessagesIn, nIDCounter++);
+				std::weak_ptr<connection<T>> weakUpstream = upstream;
+				T nDeliver = m_gatewayProtocol.deliver, nClose = m_gatewayProtocol.close;
+				client->SetRelay(
+					[weakUpstream, nTag, nDeliver](const message<T>& msg)
+					{
+						auto upstream = weakUpstream.lock();
+						if (upstream && upstream->IsConnected())
+							upstream->Send(wrap_message(nDeliver, nTag, msg));
+					},
+					[weakUpstream, nTag, nClose]()
+					{
+						auto upstream = weakUpstream.lock();
+						if (upstream && upstream->IsConnected())
+						{
+							message<T> msg;
+							msg.header.id = nClose;
+							msg << nTag;
+							upstream->Send(msg);
+						}
+					});
+
+				// Broadcasts reach it through the gateway's fan out instead
+				client->SetBroadcastTarget(false);
+
+				if (!OnClientConnect(client))
+				{
+					client->Disconnect();
+					return;
+				}
+
+				gateway.mapClients[nTag] = client;
+				m_mapGatewayClients[client] = { upstream, nTag };
+				m_deqConnections.push_back(client);
+				OnClientValidated(client);
+			}
+
+			void RemoveGatewayClient(sGateway& gateway, std::shared_ptr<connection<T>> client)
+			{
+				auto it = m_mapGatewayClients.find(client);
+				if (it == m_mapGatewayClients.end())
+					return;
+
+				gateway.mapClients.erase(it->second.nTag);
+				m_mapGatewayClients.erase(it);
+				client->Disconnect();
+				RemoveConnection(client);
+			}
+
+			void AdaptFlows()
+			{
+				for (auto& client : m_deqConnections)
+				{
+					if (client)
+						client->AdaptFlow();
+				}
+			}
+
+			// Hand over to a successor if one has connected, see restart.h
+			void PollSuccessor()
+			{
+				restart_channel successor;
+				if (!m_restartListener.accept(successor))
+					return;
+
+				// Runs on the game thread, so a successor that doesn't get on with it is dropped rather than waited for
+				successor.set_timeout(RESTART_HANDOVER_TIMEOUT);
+				restart_hello hello;
+				restart_header header;
+				if (!successor.read(&hello, sizeof(hello)) || hello.nMagic != RESTART_MAGIC)
+					return;
+
+				if (hello.nVersion != RESTART_VERSION)
+				{
+					std::cerr << "[RESTART] Successor takes over with version " << hello.nVersion << ", we hand over version " << RESTART_VERSION << "\n";
+					successor.write(&header, sizeof(header));
+					return;
+				}
+
+				HandOver(successor, header);
+			}
+
+			// Stop accepting and reading, send the successor our state and sockets, and stop serving once it confirms.
+			// Runs on the game thread, so nothing is handled or sent meanwhile, for at most RESTART_DRAIN_TIMEOUT and then
+			// RESTART_HANDOVER_TIMEOUT. If the successor goes away or doesn't confirm in time, carry on
+			void HandOver(restart_channel& successor, restart_header& header)
+			{
+				auto tStart = std::chrono::steady_clock::now();
+				std::cout << "[RESTART] Successor connected, handing over\n";
+
+				// Once every read has stopped the context has nothing left to wait for, and mustn't return before we carry on
+				auto work = asio::make_work_guard(m_asioContext);
+
+				// Nothing is reaped, sent heartbeats or accepted from now on
+				m_bRestarting = true;
+				asio::post(m_asioContext,
+					[this]()
+					{
+						m_timerMaintenance.cancel();
+						m_asioAcceptor.cancel();
+					});
+
+				while (!m_qNewConnections.empty())
+					m_deqConnections.push_back(m_qNewConnections.pop_front());
+				while (!m_qReapedConnections.empty())
+					RemoveConnection(m_qReapedConnections.pop_front());
+
+				// Gateways take their clients along, and reconnect to the successor like they would after any restart
+				while (!m_mapGateways.empty())
+				{
+					auto upstream = m_mapGateways.begin()->first;
+					auto mapClients = m_mapGateways.begin()->second.mapClients;
+					for (auto& client : mapClients)
+						RemoveGatewayClient(m_mapGateways.begin()->second, client.second);
+					m_mapGateways.erase(m_mapGateways.begin());
+					upstream->Disconnect();
+					RemoveConnection(upstream);
+				}
+
+				// Only players connected directly are handed over, which is everything else that broadcasts reach
+				m_qDetached.clear();
+				std::vector<std::shared_ptr<connection<T>>> vDropped;
+				size_t nDetaching = 0;
+				for (auto& client : m_deqConnections)
+				{
+					if (client && client->IsConnected() && client->IsValidated() && client->IsBroadcastTarget() && !client->IsRelayed())
+					{
+						client->Detach([this, client](bool bDetached) { m_qDetached.push_back({ client, bDetached }); });
+						nDetaching++;
+					}
+					else
+					{
+						vDropped.push_back(client);
+					}
+				}
+
+				// Clients get everything they were sent before the successor takes over, unless they are too slow to take it
+				std::unordered_set<std::shared_ptr<connection<T>>> setDetached;
+				auto tDeadline = tStart + RESTART_DRAIN_TIMEOUT;
+				while (nDetaching > 0 && m_qDetached.wait_until(tDeadline))
+				{
+					auto detached = m_qDetached.pop_front();
+					nDetaching--;
+					if (detached.second)
+						setDetached.insert(detached.first);
+				}
+
+				std::vector<std::shared_ptr<connection<T>>> vDetached;
+				for (auto& client : m_deqConnections)
+				{
+					if (setDetached.count(client))
+						vDetached.push_back(client);
+					else if (std::find(vDropped.begin(), vDropped.end(), client) == vDropped.end())
+						vDropped.push_back(client);
+				}
+				for (auto& client : vDropped)
+				{
+					if (client)
+						client->Disconnect();
+					RemoveConnection(client);
+				}
+
+				// Received but not handled yet, they go along with their connections
+				std::unordered_map<std::shared_ptr<connection<T>>, std::vector<message<T>>> mapQueued;
+				while (!m_qMessagesIn.empty())
+				{
+					auto msg = m_qMessagesIn.pop_front();
+					if (msg.remote && setDetached.count(msg.remote))
+						mapQueued[msg.remote].push_back(std::move(msg.msg));
+				}
+
+				// The application's state first, so the successor has the connections by the time it gets to it
+				message<T> state;
+				OnSaveRestartState(state);
+
+				std::vector<int> vSockets = { int(m_asioAcceptor.native_handle()) };
+				for (auto& client : vDetached)
+				{
+					auto& vQueued = mapQueued[client];
+					for (auto it = vQueued.rbegin(); it != vQueued.rend(); ++it)
+					{
+						PushBytes(state, it->body);
+						state << it->header;
+					}
+					state << uint32_t(vQueued.size());
+					PushBytes(state, client->GetDetachedInput());
+					state << uint8_t(client->IsCompressionEnabled());
+					state << client->GetID();
+					state << uint32_t(vSockets.size());
+					vSockets.push_back(int(client->GetNativeSocket()));
+				}
+				state << uint32_t(vDetached.size());
+				state << nIDCounter.load();
+
+				// Each step may only block for what is left of the budget, and none is taken once it is spent
+				auto tHandOverDeadline = std::chrono::steady_clock::now() + RESTART_HANDOVER_TIMEOUT;
+				auto remaining = [&successor, tHandOverDeadline]()
+				{
+					auto left = std::chrono::duration_cast<std::chrono::milliseconds>(tHandOverDeadline - std::chrono::steady_clock::now());
+					if (left.count() <= 0)
+						return false;
+					successor.set_timeout(left);
+					return true;
+				};
+
+				header.nBytes = state.body.size();
+				header.nSockets = uint32_t(vSockets.size());
+				uint8_t nConfirm = 0;
+				bool bConfirmed = remaining() && successor.write(&header, sizeof(header)) && remaining() && successor.write(state.body.data(), state.body.size()) &&
+					remaining() && successor.write_sockets(vSockets) && remaining() && successor.read(&nConfirm, sizeof(nConfirm)) && nConfirm == RESTART_CONFIRM;
+
+				// The successor only starts serving once it hears this, so once it is sent we must never resume. If it can't be
+				// sent the successor is gone, and without an answer it gives up when we close the channel
+				bool bHandedOver = bConfirmed && remaining() && successor.write(&RESTART_GO, sizeof(RESTART_GO));
+				successor.close();
+
+				double fMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - tStart).count();
+				if (bHandedOver)
+				{
+					std::cout << "[RESTART] Handed over " << vDetached.size() << " clients and " << state.body.size() << " bytes of state in " << fMs
+						<< " ms, " << vDropped.size() << " connections dropped\n";
+					m_bReplaced = true;
+					return;
+				}
+
+				// Nobody else reads from our sockets, so we can pick up where we left off
+				std::cerr << "[RESTART] Successor went away or didn't confirm in time after " << fMs << " ms, carrying on\n";
+				for (auto& client : vDetached)
+				{
+					for (auto& msg : mapQueued[client])
+						InjectMessage(client, msg);
+					client->Resume(client->GetDetachedInput());
+				}
+				m_bRestarting = false;
+				asio::post(m_asioContext,
+					[this]()
+					{
+						ScheduleMaintenance();
+						WaitForClientConnection();
+					});
+				OnRestartAborted();
+			}
+
+			// Byte strings in a message, after their size
+			static void PushBytes(message<T>& msg, const std::vector<uint8_t>& vBytes)
+			{
+				msg.body.insert(msg.body.end(), vBytes.begin(), vBytes.end());
+				msg << uint32_t(vBytes.size());
+			}
+
+			static bool PopBytes(message<T>& msg, std::vector<uint8_t>& vBytes)
+			{
+				uint32_t nBytes = 0;
+				msg >> nBytes;
+				if (nBytes > msg.body.size())
+					return false;
+
+				vBytes.assign(msg.body.end() - nBytes, msg.body.end());
+				msg.body.resize(msg.body.size() - nBytes);
+				msg.header.size = uint32_t(msg.size());
+				return true;
+			}
+
+			// A gateway whose upstream connection died takes the clients it carried along
+			void RemoveDeadGateways()
+			{
+				for (auto it = m_mapGateways.begin(); it != m_mapGateways.end();)
+				{
+					if (it->first->IsConnected())
+					{
+						++it;
+						continue;
+					}
+
+					std::cout << "[" << it->first->GetID() << "] Gateway lost, dropping " << it->second.mapClients.size() << " clients\n";
+					auto mapClients = it->second.mapClients;
+					for (auto& client : mapClients)
+						RemoveGatewayClient(it->second, client.second);
+					it = m_mapGateways.erase(it);
+				}
+			}
+
+		private:
+			bool ShouldCompress(const std::shared_ptr<connection<T>>& client, const message<T>& msg) const
+			{
+				return client->IsCompressionEnabled() && msg.body.size() >= m_nCompressionThreshold && !(msg.header.flags & MESSAGE_COMPRESSED);
 			}
 
 		protected:
@@ -195,6 +1175,17 @@ namespace tfg
 			virtual void OnClientDisconnect(std::shared_ptr<connection<T>> client) {}
 			virtual void OnMessage(std::shared_ptr<connection<T>> client, message<T>& msg) {}
 
+			// Called at the end of every Update(), after dead connections have been removed and messages handled
+			virtual void OnMaintenance() {}
+
+			// Hot restart, see restart.h. The application's part of the state handed to a successor, and taking it back in
+			// once the connections have been taken over. Returning false gives up on taking over
+			virtual void OnSaveRestartState(message<T>& state) {}
+			virtual bool OnRestoreRestartState(message<T>& state) { return true; }
+
+			// The successor went away after OnSaveRestartState(), so this server carries on
+			virtual void OnRestartAborted() {}
+
 		public:
 			virtual void OnClientValidated(std::shared_ptr<connection<T>> client) {}
 
@@ -211,9 +1202,66 @@ namespace tfg
 
 			// Handles new incoming connection attempts
 			asio::ip::tcp::acceptor m_asioAcceptor;
+			uint16_t m_nPort = 0;
+			bool m_bListen = false;
+
+			// Identifier of the clients. Connections through gateways get theirs on the game thread
+			std::atomic<uint32_t> nIDCounter = 10000;
+
+			// Connection supervision. Everything but the queues is only touched on the asio thread once started
+			static constexpr std::chrono::seconds REAP_INTERVAL{ 1 };
+			timer_wheel<std::weak_ptr<connection<T>>> m_wheel{ 512, std::chrono::milliseconds(100) };
+			asio::steady_timer m_timerMaintenance;
+			tsqueue<std::shared_ptr<connection<T>>> m_qNewConnections;
+			tsqueue<std::shared_ptr<connection<T>>> m_qReapedConnections;
+			T m_nHeartbeatID{};
+			std::chrono::steady_clock::duration m_heartbeatInterval{ 0 };
+			std::chrono::steady_clock::duration m_handshakeTimeout = std::chrono::seconds(5);
+			std::chrono::steady_clock::duration m_idleTimeout = std::chrono::seconds(30);
+
+			// Outgoing compression, see compression.h
+			bool m_bCompressionOffered = true;
+			size_t m_nCompressionThreshold = 512;
+			compression_stats m_statsCompression;
+
+			// Flood protection, see ratelimit.h. Unlimited unless configured
+			rate_limits<T> m_rateLimits;
+			rate_limit_stats m_statsRateLimit;
+
+			lane_stats<T> m_statsLanes;
+
+			// State flow control, see flow.h. Off unless configured
+			bool m_bFlowControl = false;
+			flow_limits m_flowLimits;
+			flow_stats m_statsFlow;
+
+			// Periodic tasks run by Update()
+			task_scheduler m_scheduler;
+
+			// Low latency mode, see lowlatency.h. m_bTuningWarned is only touched on the asio thread
+			bool m_bLowLatency = false;
+			low_latency_config m_lowLatency;
+			std::chrono::steady_clock::duration m_spin{ 0 };
+			bool m_bTuningWarned = false;
+			latency_stats m_statsLatency;
+
+			// Gateways by upstream connection, each with its clients by tag, and the other way round. Game thread only
+			bool m_bGateways = false;
+			gateway_protocol<T> m_gatewayProtocol;
+			std::unordered_map<std::shared_ptr<connection<T>>, sGateway> m_mapGateways;
+			std::unordered_map<std::shared_ptr<connection<T>>, sGatewayClient> m_mapGatewayClients;
+
+			// Optional recording of every handled message
+			message_recorder<T> m_recorder;
 
-			// Identifier of the clients
-			uint32_t nIDCounter = 10000;
+			// Hot restart, see restart.h. Clients have this long to take what we had queued for them before they are dropped
+			static constexpr std::chrono::milliseconds RESTART_POLL_INTERVAL{ 100 };
+			static constexpr std::chrono::milliseconds RESTART_DRAIN_TIMEOUT{ 500 };
+			static constexpr std::chrono::milliseconds RESTART_HANDOVER_TIMEOUT{ 1500 };
+			restart_channel m_restartListener;
+			std::atomic<bool> m_bRestarting = false;
+			bool m_bReplaced = false;
+			tsqueue<std::pair<std::shared_ptr<connection<T>>, bool>> m_qDetached;
 		};
 	}
 }
\ No newline at end of file
@@ -0,0 +1,85 @@
+#pragma once
+#include "common.h"
+
+/// <summary>
+/// Hashed timer wheel: a ring of slots advanced one slot per tick, where each slot holds the items due when the
+/// cursor reaches it. Delays longer than a full turn of the wheel are stored with a count of remaining turns.
+/// Scheduling is O(1), and each tick only touches the items in one slot, so checking thousands of connections
+/// for timeouts costs a little on every tick instead of a sweep over all of them.
+/// Not thread safe: the server only uses it from its asio context thread.
+/// </summary>
+
+namespace tfg
+{
+	namespace net
+	{
+		template<typename T>
+		class timer_wheel
+		{
+		public:
+			timer_wheel(size_t nSlots, std::chrono::steady_clock::duration tick) : m_vSlots(nSlots), m_tick(tick)
+			{
+			}
+
+		public:
+			// Fire item after at least delay (rounded up to a whole tick)
+			void schedule(std::chrono::steady_clock::duration delay, T item)
+			{
+				size_t nTicks = std::max<size_t>(1, size_t((delay + m_tick - std::chrono::steady_clock::duration(1)) / m_tick));
+				size_t nSlot = (m_nCursor + nTicks) % m_vSlots.size();
+				m_vSlots[nSlot].push_back({ (nTicks - 1) / m_vSlots.size(), std::move(item) });
+				m_nItems++;
+			}
+
+			// Move to the next slot, calling fn for every item that is now due. fn may schedule more items
+			template<typename F>
+			void advance(F&& fn)
+			{
+				m_nCursor = (m_nCursor + 1) % m_vSlots.size();
+
+				std::vector<sEntry> vDue;
+				auto& slot = m_vSlots[m_nCursor];
+				for (size_t i = 0; i < slot.size();)
+				{
+					if (slot[i].nRounds == 0)
+					{
+						vDue.push_back(std::move(slot[i]));
+						slot[i] = std::move(slot.back());
+						slot.pop_back();
+					}
+					else
+					{
+						slot[i].nRounds--;
+						i++;
+					}
+				}
+
+				m_nItems -= vDue.size();
+				for (auto& entry : vDue)
+					fn(entry.item);
+			}
+
+			std::chrono::steady_clock::duration tick() const
+			{
+				return m_tick;
+			}
+
+			size_t size() const
+			{
+				return m_nItems;
+			}
+
+		private:
+			struct sEntry
+			{
+				size_t nRounds;
+				T item;
+			};
+
+			std::vector<std::vector<sEntry>> m_vSlots;
+			std::chrono::steady_clock::duration m_tick;
+			size_t m_nCursor = 0;
+			size_t m_nItems = 0;
+		};
+	}
+}
@@ -0,0 +1,184 @@
+#pragma once
+#include "common.h"
+#include <array>
+#include <atomic>
+#include <fstream>
+#include <list>
+#include <string>
+
+/// <summary>
+/// Scoped trace zones, exported as Chrome trace-event JSON that Perfetto (ui.perfetto.dev) or chrome://tracing
+/// can open. A zone records when it started and how long it lasted on the thread that ran it, so stalls show up
+/// as gaps and long bars lined up across threads.
+/// Every thread writes to a ring buffer of its own, so recording takes no lock: the buffer keeps the last
+/// TRACE_RING_SIZE zones and overwrites the oldest. Buffers are created the first time a thread records a zone
+/// and live until the process exits, so a capture still has the zones of threads that have finished.
+/// Tracing is compiled in only with TFG_ENABLE_TRACING defined. Without it the TFG_TRACE macros expand to
+/// nothing and trace_export() just says so, so instrumented code costs nothing.
+///  - TFG_TRACE_SCOPE("name"): a zone until the end of the enclosing scope. Names must be string literals.
+///  - TFG_TRACE_SCOPE_ID("name", id): the same, shown as "name <id>", like one zone name per message type.
+///  - TFG_TRACE_THREAD("name"): how the calling thread is labelled in the capture.
+/// trace_export() can be called at any time from any thread. Zones being overwritten while it copies a buffer
+/// are left out rather than exported half written.
+/// </summary>
+
+namespace tfg
+{
+	namespace net
+	{
+		// Zones kept per thread, about 2 MB each
+		constexpr size_t TRACE_RING_SIZE = 65536;
+
+		struct trace_event
+		{
+			const char* sName = nullptr;
+			int64_t nID = -1;
+			uint64_t nStartNanoseconds = 0;
+			uint64_t nDurationNanoseconds = 0;
+		};
+
+		struct trace_ring
+		{
+			uint32_t nThread = 0;
+			std::atomic<const char*> sThreadName{ nullptr };
+
+			// Zones recorded so far. Slot nWritten % TRACE_RING_SIZE is written next
+			std::atomic<uint64_t> nWritten{ 0 };
+			std::array<trace_event, TRACE_RING_SIZE> events;
+		};
+
+		// Every thread's ring, guarded by mux. Rings are never removed, so pointers to them stay valid
+		struct trace_registry
+		{
+			std::mutex mux;
+			std::list<trace_ring> rings;
+			std::chrono::steady_clock::time_point tEpoch = std::chrono::steady_clock::now();
+
+			static trace_registry& get()
+			{
+				static trace_registry registry;
+				return registry;
+			}
+		};
+
+		inline uint64_t trace_now()
+		{
+			return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - trace_registry::get().tEpoch).count());
+		}
+
+		inline trace_ring& trace_thread_ring()
+		{
+			thread_local trace_ring* pRing = nullptr;
+			if (!pRing)
+			{
+				trace_registry& registry = trace_registry::get();
+				std::scoped_lock lock(registry.mux);
+				pRing = &registry.rings.emplace_back();
+				pRing->nThread = uint32_t(registry.rings.size());
+			}
+			return *pRing;
+		}
+
+		inline void trace_record(const char* sName, int64_t nID, uint64_t nStart, uint64_t nEnd)
+		{
+			trace_ring& ring = trace_thread_ring();
+			uint64_t nSlot = ring.nWritten.load(std::memory_order_relaxed);
+			trace_event& event = ring.events[nSlot % TRACE_RING_SIZE];
+			event.sName = sName;
+			event.nID = nID;
+			event.nStartNanoseconds = nStart;
+			event.nDurationNanoseconds = nEnd - nStart;
+			ring.nWritten.store(nSlot + 1, std::memory_order_release);
+		}
+
+		inline void trace_thread_name(const char* sName)
+		{
+			trace_thread_ring().sThreadName = sName;
+		}
+
+		class trace_zone
+		{
+		public:
+			explicit trace_zone(const char* sName, int64_t nID = -1) : m_sName(sName), m_nID(nID), m_nStart(trace_now())
+			{
+			}
+
+			~trace_zone()
+			{
+				trace_record(m_sName, m_nID, m_nStart, trace_now());
+			}
+
+			trace_zone(const trace_zone&) = delete;
+			trace_zone& operator=(const trace_zone&) = delete;
+
+		private:
+			const char* m_sName;
+			int64_t m_nID;
+			uint64_t m_nStart;
+		};
+
+		// Write every thread's zones to sPath as Chrome trace-event JSON. Returns false if it couldn't
+		inline bool trace_export(const std::string& sPath)
+		{
+#ifdef TFG_ENABLE_TRACING
+			std::ofstream file(sPath, std::ios::trunc);
+			if (!file)
+				return false;
+
+			file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+			bool bFirst = true;
+			auto separator = [&]() -> std::ofstream& { file << (bFirst ? "" : ",\n"); bFirst = false; return file; };
+
+			trace_registry& registry = trace_registry::get();
+			std::scoped_lock lock(registry.mux);
+			std::vector<trace_event> vEvents;
+			for (trace_ring& ring : registry.rings)
+			{
+				const char* sThreadName = ring.sThreadName;
+				separator() << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << ring.nThread
+					<< ",\"args\":{\"name\":\"" << (sThreadName ? sThreadName : "thread") << "\"}}";
+
+				// Copy what is there, then drop whatever the thread may have overwritten meanwhile
+				uint64_t nEnd = ring.nWritten.load(std::memory_order_acquire);
+				uint64_t nBegin = nEnd > TRACE_RING_SIZE ? nEnd - TRACE_RING_SIZE : 0;
+				vEvents.clear();
+				for (uint64_t i = nBegin; i < nEnd; i++)
+					vEvents.push_back(ring.events[i % TRACE_RING_SIZE]);
+
+				uint64_t nNow = ring.nWritten.load(std::memory_order_acquire);
+				uint64_t nValidFrom = nNow > TRACE_RING_SIZE ? nNow - TRACE_RING_SIZE + 1 : 0;
+
+				for (uint64_t i = std::max(nBegin, nValidFrom); i < nEnd; i++)
+				{
+					const trace_event& event = vEvents[i - nBegin];
+					separator() << "{\"name\":\"" << event.sName;
+					if (event.nID >= 0)
+						file << " " << event.nID;
+
+					char times[96];
+					snprintf(times, sizeof(times), "\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f", event.nStartNanoseconds / 1e3, event.nDurationNanoseconds / 1e3);
+					file << times << ",\"pid\":1,\"tid\":" << ring.nThread << "}";
+				}
+			}
+
+			file << "\n]}\n";
+			return bool(file);
+#else
+			std::cerr << "[TRACE] Not written to " << sPath << ", built without TFG_ENABLE_TRACING\n";
+			return false;
+#endif
+		}
+	}
+}
+
+#ifdef TFG_ENABLE_TRACING
+#define TFG_TRACE_CONCAT_INNER(a, b) a##b
+#define TFG_TRACE_CONCAT(a, b) TFG_TRACE_CONCAT_INNER(a, b)
+#define TFG_TRACE_SCOPE(name) tfg::net::trace_zone TFG_TRACE_CONCAT(traceZone, __LINE__)(name)
+#define TFG_TRACE_SCOPE_ID(name, id) tfg::net::trace_zone TFG_TRACE_CONCAT(traceZone, __LINE__)(name, int64_t(id))
+#define TFG_TRACE_THREAD(name) tfg::net::trace_thread_name(name)
+#else
+#define TFG_TRACE_SCOPE(name)
+#define TFG_TRACE_SCOPE_ID(name, id)
+#define TFG_TRACE_THREAD(name)
+#endif
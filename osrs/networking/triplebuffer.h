@@ -0,0 +1,72 @@
+#pragma once
+#include "common.h"
+#include <array>
+#include <atomic>
+
+/// <summary>
+/// Lock-free triple buffer for handing the latest version of some state from one producer thread to one consumer thread.
+/// The producer fills back() and calls publish(), the consumer calls acquire() and reads front(). The third buffer sits in
+/// the middle and is swapped atomically, so neither side ever waits on the other or sees a half written value.
+/// Intermediate versions are dropped if the producer publishes faster than the consumer acquires, which is exactly
+/// what we want for world state: only the newest snapshot matters.
+/// </summary>
+
+namespace tfg
+{
+	namespace net
+	{
+		template<typename T>
+		class triple_buffer
+		{
+		public:
+			triple_buffer() = default;
+			triple_buffer(const triple_buffer<T>&) = delete;
+
+		public:
+			// Producer: buffer to fill with the next version
+			T& back()
+			{
+				return m_buffers[m_nBack];
+			}
+
+			// Producer: make the back buffer visible to the consumer, the producer gets the old middle buffer to write next
+			void publish()
+			{
+				uint8_t nPrevious = m_nMiddle.exchange(m_nBack | FRESH, std::memory_order_acq_rel);
+				m_nBack = nPrevious & INDEX;
+			}
+
+			// Producer: true if the last published version hasn't been picked up yet
+			bool pending() const
+			{
+				return (m_nMiddle.load(std::memory_order_acquire) & FRESH) != 0;
+			}
+
+			// Consumer: swap in the newest published version, if there is one
+			bool acquire()
+			{
+				if ((m_nMiddle.load(std::memory_order_relaxed) & FRESH) == 0)
+					return false;
+
+				uint8_t nPrevious = m_nMiddle.exchange(m_nFront, std::memory_order_acq_rel);
+				m_nFront = nPrevious & INDEX;
+				return true;
+			}
+
+			// Consumer: the most recently acquired version
+			T& front()
+			{
+				return m_buffers[m_nFront];
+			}
+
+		protected:
+			static constexpr uint8_t INDEX = 0x3;
+			static constexpr uint8_t FRESH = 0x4;
+
+			std::array<T, 3> m_buffers;
+			uint8_t m_nBack = 0;
+			std::atomic<uint8_t> m_nMiddle = 1;
+			uint8_t m_nFront = 2;
+		};
+	}
+}
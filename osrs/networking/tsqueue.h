@@ -1,11 +1,17 @@
 #pragma once
 #include "common.h"
+#include <atomic>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 /// <summary>
 /// Copyright 2018 - 2021 OneLoneCoder.com
 /// Implements a thread-safe queue using locks for inter-thread communication.
 /// Provides methods for pushing, popping, and accessing items in the queue.
-/// Includes a condition variable to avoid busy-waiting when the queue is empty.
+/// Includes a condition variable to avoid busy-waiting when the queue is empty, and spin_until() for when
+/// busy-waiting is what the caller wants.
 /// </summary>
 
 namespace tfg
@@ -40,6 +46,7 @@ namespace tfg
 			{
 				std::lock_guard<std::mutex> lock(muxQueue);
 				deqQueue.emplace_back(std::move(item));
+				nCount.store(deqQueue.size(), std::memory_order_release);
 
 				// Notify the condition variable
 				std::unique_lock<std::mutex> ul(muxBlocking);
@@ -51,6 +58,7 @@ namespace tfg
 			{
 				std::lock_guard<std::mutex> lock(muxQueue);
 				deqQueue.emplace_front(std::move(item));
+				nCount.store(deqQueue.size(), std::memory_order_release);
 
 				// Notify the condition variable
 				std::unique_lock<std::mutex> ul(muxBlocking);
@@ -76,6 +84,7 @@ namespace tfg
 			{
 				std::lock_guard<std::mutex> lock(muxQueue);
 				deqQueue.clear();
+				nCount.store(0, std::memory_order_release);
 			}
 
 			// Remove and return item at front of queue
@@ -84,6 +93,7 @@ namespace tfg
 				std::lock_guard<std::mutex> lock(muxQueue);
 				auto t = std::move(deqQueue.front());
 				deqQueue.pop_front();
+				nCount.store(deqQueue.size(), std::memory_order_release);
 				return t;
 			}
 
@@ -93,6 +103,7 @@ namespace tfg
 				std::lock_guard<std::mutex> lock(muxQueue);
 				auto t = std::move(deqQueue.back());
 				deqQueue.pop_back();
+				nCount.store(deqQueue.size(), std::memory_order_release);
 				return t;
 			}
 
@@ -107,13 +118,59 @@ namespace tfg
 				while (empty())
 				{
 					std::unique_lock<std::mutex> ul(muxBlocking);
-					cvBlocking.wait(ul);
+					if (nCount.load(std::memory_order_acquire) == 0)
+						cvBlocking.wait(ul);
 				}
 			}
 
+			// Same as wait(), but gives up once the timeout has passed. Returns true if there is something in the queue
+			template<typename Rep, typename Period>
+			bool wait_for(const std::chrono::duration<Rep, Period>& timeout)
+			{
+				return wait_until(std::chrono::steady_clock::now() + timeout);
+			}
+
+			// Same as wait(), but gives up at the deadline. Returns true if there is something in the queue
+			bool wait_until(std::chrono::steady_clock::time_point deadline)
+			{
+				// Never lock muxQueue while holding muxBlocking, push_back() takes the locks the other way round.
+				// The count needs no lock, so the condition variable checks it itself, also after spurious wake-ups
+				std::unique_lock<std::mutex> ul(muxBlocking);
+				return cvBlocking.wait_until(ul, deadline, [this]() { return nCount.load(std::memory_order_acquire) > 0; });
+			}
+
+			// Busy-wait until something is queued or the deadline has passed, without taking a lock or giving up the
+			// core. Returns true if there is something in the queue
+			bool spin_until(std::chrono::steady_clock::time_point deadline)
+			{
+				while (nCount.load(std::memory_order_acquire) == 0)
+				{
+					if (std::chrono::steady_clock::now() >= deadline)
+						return false;
+					cpu_relax();
+				}
+				return true;
+			}
+
+		private:
+			// Tells the core we are spinning, which saves power and lets a sibling hyperthread run
+			static void cpu_relax()
+			{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+				_mm_pause();
+#elif defined(__x86_64__) || defined(__i386__)
+				__builtin_ia32_pause();
+#elif defined(__aarch64__)
+				asm volatile("yield");
+#endif
+			}
+
 		protected:
 			std::mutex muxQueue;
 			std::deque<T> deqQueue;
+
+			// deqQueue.size(), readable without muxQueue
+			std::atomic<size_t> nCount = 0;
 			std::condition_variable cvBlocking;
 			std::mutex muxBlocking;
 		};
@@ -0,0 +1,217 @@
+#include <SDL.h>
+#include <SDL_image.h>
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include "../client/archive.h"
+
+/// <summary>
+/// Packs a media folder into the asset archive the client maps at startup, see client/archive.h. Run it whenever
+/// the media changes: PNGs are decoded and converted to the archive's pixel format, WAVs to the format the client
+/// opens the mixer with, and anything else is copied as is. The archive is written next to the media unless told
+/// otherwise, which is where the client looks for it. Assets missing from the archive are still loaded from the
+/// folder, so a client keeps starting with an archive packed before an asset was added.
+/// </summary>
+
+struct sPacked
+{
+	sArchiveEntry entry;
+	std::vector<uint8_t> vData;
+};
+
+static bool PackImage(const std::filesystem::path& path, sPacked& packed)
+{
+	SDL_Surface* pLoaded = IMG_Load(path.string().c_str());
+	if (pLoaded == nullptr)
+	{
+		std::cerr << "Unable to decode " << path.string() << ": " << IMG_GetError() << "\n";
+		return false;
+	}
+
+	SDL_Surface* pConverted = SDL_ConvertSurfaceFormat(pLoaded, ARCHIVE_PIXEL_FORMAT, 0);
+	SDL_FreeSurface(pLoaded);
+	if (pConverted == nullptr)
+	{
+		std::cerr << "Unable to convert " << path.string() << ": " << SDL_GetError() << "\n";
+		return false;
+	}
+
+	// Rows are stored without the surface's padding
+	size_t nRowBytes = size_t(pConverted->w) * 4;
+	packed.entry.nType = ArchiveEntryType::Image;
+	packed.entry.nWidth = uint32_t(pConverted->w);
+	packed.entry.nHeight = uint32_t(pConverted->h);
+	packed.entry.nPitch = uint32_t(nRowBytes);
+	packed.vData.resize(nRowBytes * size_t(pConverted->h));
+
+	SDL_LockSurface(pConverted);
+	for (int y = 0; y < pConverted->h; y++)
+		std::memcpy(packed.vData.data() + size_t(y) * nRowBytes, static_cast<const uint8_t*>(pConverted->pixels) + size_t(y) * size_t(pConverted->pitch), nRowBytes);
+	SDL_UnlockSurface(pConverted);
+	SDL_FreeSurface(pConverted);
+	return true;
+}
+
+static bool PackSound(const std::filesystem::path& path, sPacked& packed)
+{
+	SDL_AudioSpec spec;
+	Uint8* pSamples = nullptr;
+	Uint32 nLength = 0;
+	if (SDL_LoadWAV(path.string().c_str(), &spec, &pSamples, &nLength) == nullptr)
+	{
+		std::cerr << "Unable to decode " << path.string() << ": " << SDL_GetError() << "\n";
+		return false;
+	}
+
+	SDL_AudioCVT cvt;
+	if (SDL_BuildAudioCVT(&cvt, spec.format, spec.channels, spec.freq, MIX_DEFAULT_FORMAT, Uint8(AUDIO_CHANNELS), AUDIO_FREQUENCY) < 0)
+	{
+		std::cerr << "Unable to convert " << path.string() << ": " << SDL_GetError() << "\n";
+		SDL_FreeWAV(pSamples);
+		return false;
+	}
+
+	// Converting happens in place, in a buffer big enough for the largest intermediate step
+	packed.vData.resize(size_t(nLength) * size_t(std::max(1, cvt.len_mult)));
+	std::memcpy(packed.vData.data(), pSamples, nLength);
+	SDL_FreeWAV(pSamples);
+
+	cvt.buf = packed.vData.data();
+	cvt.len = int(nLength);
+	cvt.len_cvt = int(nLength);
+	if (cvt.needed && SDL_ConvertAudio(&cvt) != 0)
+	{
+		std::cerr << "Unable to convert " << path.string() << ": " << SDL_GetError() << "\n";
+		return false;
+	}
+	packed.vData.resize(size_t(cvt.len_cvt));
+	packed.entry.nType = ArchiveEntryType::Sound;
+	return true;
+}
+
+static bool PackRaw(const std::filesystem::path& path, sPacked& packed)
+{
+	std::ifstream file(path, std::ios::binary);
+	packed.vData.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	if (!file.good() && !file.eof())
+	{
+		std::cerr << "Unable to read " << path.string() << "\n";
+		return false;
+	}
+	packed.entry.nType = ArchiveEntryType::Raw;
+	return true;
+}
+
+int main(int argc, char* args[])
+{
+	// Usage: packer <media folder> [--output <path>]
+	std::string mediaPath, outputPath;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = args[i];
+		if (arg == "--output" && i + 1 < argc)
+			outputPath = args[++i];
+		else
+			mediaPath = arg;
+	}
+
+	if (mediaPath.empty() || !std::filesystem::is_directory(mediaPath))
+	{
+		std::cerr << "Usage: packer <media folder> [--output <path>]\n";
+		return 1;
+	}
+	if (outputPath.empty())
+		outputPath = (std::filesystem::path(mediaPath) / ARCHIVE_FILE_NAME).string();
+
+	auto tStart = std::chrono::steady_clock::now();
+
+	// Sorted, so packing the same media twice gives the same archive. Archives, ours or left in there, aren't media
+	std::vector<std::filesystem::path> vFiles;
+	for (const auto& file : std::filesystem::recursive_directory_iterator(mediaPath))
+	{
+		std::string sExtension = file.path().extension().string();
+		if (file.is_regular_file() && file.path().filename() != ARCHIVE_FILE_NAME && sExtension != ".osra" && sExtension != ".tmp")
+			vFiles.push_back(file.path());
+	}
+	std::sort(vFiles.begin(), vFiles.end());
+
+	std::vector<sPacked> vPacked;
+	uint64_t nSourceBytes = 0;
+	for (const auto& path : vFiles)
+	{
+		std::string sName = std::filesystem::relative(path, mediaPath).generic_string();
+		if (sName.size() >= ARCHIVE_NAME_SIZE)
+		{
+			std::cerr << "Name too long for the archive: " << sName << "\n";
+			return 1;
+		}
+
+		sPacked packed;
+		std::string sExtension = path.extension().string();
+		std::transform(sExtension.begin(), sExtension.end(), sExtension.begin(), [](unsigned char c) { return char(std::tolower(c)); });
+		bool bPacked = sExtension == ".png" ? PackImage(path, packed) : sExtension == ".wav" ? PackSound(path, packed) : PackRaw(path, packed);
+		if (!bPacked)
+			return 1;
+
+		std::memcpy(packed.entry.sName, sName.c_str(), sName.size() + 1);
+		packed.entry.nSize = packed.vData.size();
+		nSourceBytes += std::filesystem::file_size(path);
+		vPacked.push_back(std::move(packed));
+	}
+
+	// Data starts after the header and the entries, every entry at the next multiple of ARCHIVE_ALIGNMENT
+	auto align = [](uint64_t nOffset) { return (nOffset + ARCHIVE_ALIGNMENT - 1) / ARCHIVE_ALIGNMENT * ARCHIVE_ALIGNMENT; };
+	sArchiveHeader header;
+	header.nEntries = uint32_t(vPacked.size());
+	uint64_t nOffset = sizeof(sArchiveHeader) + vPacked.size() * sizeof(sArchiveEntry);
+	for (auto& packed : vPacked)
+	{
+		nOffset = align(nOffset);
+		packed.entry.nOffset = nOffset;
+		nOffset += packed.entry.nSize;
+	}
+
+	// Written next to the target and renamed over it, so a client starting meanwhile never maps half an archive
+	std::string tempPath = outputPath + ".tmp";
+	{
+		std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		for (const auto& packed : vPacked)
+			file.write(reinterpret_cast<const char*>(&packed.entry), sizeof(packed.entry));
+
+		const char padding[ARCHIVE_ALIGNMENT] = {};
+		for (const auto& packed : vPacked)
+		{
+			file.write(padding, std::streamsize(packed.entry.nOffset - uint64_t(file.tellp())));
+			file.write(reinterpret_cast<const char*>(packed.vData.data()), std::streamsize(packed.vData.size()));
+		}
+
+		if (!file)
+		{
+			std::cerr << "Unable to write " << tempPath << "\n";
+			return 1;
+		}
+	}
+
+	std::error_code error;
+	std::filesystem::rename(tempPath, outputPath, error);
+	if (error)
+	{
+		std::cerr << "Unable to replace " << outputPath << ": " << error.message() << "\n";
+		return 1;
+	}
+
+	double fMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - tStart).count();
+	for (const auto& packed : vPacked)
+	{
+		const char* sType = packed.entry.nType == ArchiveEntryType::Image ? "image" : packed.entry.nType == ArchiveEntryType::Sound ? "sound" : "raw";
+		std::cout << "  " << packed.entry.sName << " (" << sType << ", " << packed.entry.nSize / 1024 << " KB)\n";
+	}
+	std::cout << "[PACKER] " << vPacked.size() << " assets from " << nSourceBytes / 1024 << " KB of files into " << nOffset / 1024
+		<< " KB at " << outputPath << " in " << fMs << " ms\n";
+	return 0;
+}
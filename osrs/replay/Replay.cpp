@@ -0,0 +1,129 @@
+#include <map>
+#include "../server/Server.h"
+
+/// <summary>
+/// Replays a recording made with "server --record <path>" against a Server that has no sockets.
+/// Every connection ID in the recording becomes a null transport connection the first time it appears, so
+/// handlers run exactly as they would for real clients, but everything they send is counted and dropped.
+/// Messages are fed one at a time, either as fast as possible or at the pace they were recorded at, and the
+/// time spent handling each one is reported per message type. Run it before and after changing OnMessage to
+/// compare the two against the same traffic.
+/// </summary>
+
+struct sHandlerStats
+{
+	std::vector<double> vSamples;
+	double fTotal = 0.0;
+};
+
+static double Percentile(std::vector<double>& vSamples, double p)
+{
+	if (vSamples.empty())
+		return 0.0;
+	size_t n = static_cast<size_t>(p / 100.0 * (vSamples.size() - 1));
+	std::nth_element(vSamples.begin(), vSamples.begin() + n, vSamples.end());
+	return vSamples[n];
+}
+
+int main(int argc, char* args[])
+{
+	// Usage: replay <recording> [--paced] [--repeat <count>]
+	std::string recordingPath;
+	bool bPaced = false;
+	int nRepeat = 1;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = args[i];
+		if (arg == "--paced")
+			bPaced = true;
+		else if (arg == "--repeat" && i + 1 < argc)
+			nRepeat = std::max(1, std::stoi(args[++i]));
+		else
+			recordingPath = arg;
+	}
+
+	if (recordingPath.empty())
+	{
+		std::cerr << "Usage: replay <recording> [--paced] [--repeat <count>]\n";
+		return 1;
+	}
+
+	// Load the whole recording up front so reading the file isn't part of the measurement
+	std::vector<tfg::net::recorded_message<GameMsg>> vRecording;
+	{
+		tfg::net::message_playback<GameMsg> playback;
+		if (!playback.open(recordingPath))
+		{
+			std::cerr << "Unable to open recording " << recordingPath << "\n";
+			return 1;
+		}
+
+		tfg::net::recorded_message<GameMsg> record;
+		while (playback.next(record))
+			vRecording.push_back(record);
+		if (playback.truncated())
+			std::cerr << "[REPLAY] " << recordingPath << " is truncated or corrupt after message " << vRecording.size() << ", replaying what came before\n";
+	}
+	std::cout << "[REPLAY] Loaded " << vRecording.size() << " messages from " << recordingPath << "\n";
+
+	std::map<int, sHandlerStats> mapStats;
+	size_t nMessages = 0;
+	uint64_t nDroppedMessages = 0, nDroppedBytes = 0;
+	double fHandlerTotal = 0.0, fElapsed = 0.0;
+
+	for (int nPass = 0; nPass < nRepeat; nPass++)
+	{
+		// Every pass starts from an empty server, with its saved progress kept out of the way
+		std::error_code ec;
+		std::filesystem::remove_all("replay_data", ec);
+		Server server("replay_data");
+
+		std::unordered_map<uint32_t, std::shared_ptr<tfg::net::connection<GameMsg>>> mapConnections;
+		auto tPassStart = std::chrono::steady_clock::now();
+
+		for (const auto& record : vRecording)
+		{
+			if (bPaced)
+				std::this_thread::sleep_until(tPassStart + std::chrono::nanoseconds(record.nTimestamp));
+
+			auto& client = mapConnections[record.nConnectionID];
+			if (!client)
+				client = server.AddNullConnection(record.nConnectionID);
+
+			server.InjectMessage(client, record.msg);
+
+			auto tHandler = std::chrono::steady_clock::now();
+			server.Update(1);
+			double fUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - tHandler).count();
+
+			sHandlerStats& stats = mapStats[int(record.msg.header.id)];
+			stats.vSamples.push_back(fUs);
+			stats.fTotal += fUs;
+			fHandlerTotal += fUs;
+			nMessages++;
+		}
+
+		fElapsed += std::chrono::duration<double>(std::chrono::steady_clock::now() - tPassStart).count();
+
+		for (const auto& connection : mapConnections)
+		{
+			nDroppedMessages += connection.second->GetDroppedMessages();
+			nDroppedBytes += connection.second->GetDroppedBytes();
+		}
+	}
+
+	std::cout << "[REPLAY] " << nMessages << " messages in " << fElapsed << " s (" << (fElapsed > 0.0 ? nMessages / fElapsed : 0.0)
+		<< " msgs/s, " << (fHandlerTotal > 0.0 ? nMessages / (fHandlerTotal / 1e6) : 0.0) << " msgs/s in handlers)\n";
+	std::cout << "[REPLAY] Handlers sent " << nDroppedMessages << " messages (" << nDroppedBytes << " bytes)\n";
+
+	std::cout << "msg_id,count,total_us,mean_us,p50_us,p99_us,max_us\n";
+	for (auto& entry : mapStats)
+	{
+		sHandlerStats& stats = entry.second;
+		double fMax = *std::max_element(stats.vSamples.begin(), stats.vSamples.end());
+		std::cout << entry.first << "," << stats.vSamples.size() << "," << stats.fTotal << "," << stats.fTotal / stats.vSamples.size() << ","
+			<< Percentile(stats.vSamples, 50) << "," << Percentile(stats.vSamples, 99) << "," << fMax << "\n";
+	}
+	return 0;
+}
@@ -1,156 +1,167 @@
-#pragma once
-#include <unordered_map>
-#include "common.h"
+#include <csignal>
+#include "Server.h"
 
-class Server : public tfg::net::server_interface<GameMsg>
+// Set by SIGUSR1, asking the main loop to write the trace
+static volatile std::sig_atomic_t g_bTraceRequested = 0;
+
+int main(int argc, char* args[])
 {
-public:
-	Server(uint16_t nPort) : tfg::net::server_interface<GameMsg>(nPort)
+	// Usage: server [--record <path>] [--no-compression] [--compress-threshold <bytes>] [--no-rate-limit]
+	//               [--cluster <host:port,host:port,...> --node <index> --cluster-key <number>] [--gateway-key <number>]
+	//               [--trace <path>] [--low-latency [--io-core <n>] [--game-core <n>] [--busy-poll <us>] [--socket-buffer <bytes>]]
+	//               [--world <chunks x>x<chunks y>] [--world-seed <number>] [--hot-restart <socket path>]
+	std::string recordPath, tracePath, restartPath;
+	bool bLowLatency = false;
+	int nGameCore = -1;
+	tfg::net::low_latency_config lowLatency;
+	sClusterConfig cluster;
+	sWorldInfo world;
+	bool bCompression = true, bRateLimit = true, bGateways = false;
+	uint64_t nGatewayKey = 0;
+	size_t nCompressThreshold = 512;
+
+	for (int i = 1; i < argc; i++)
 	{
-		InitializeColors();
-	}
-
-	std::unordered_map<uint32_t, sPlayerDescription> m_mapPlayerRoster;
-	std::vector<uint32_t> m_vGarbageIDs;
-
-private:
-	std::vector<Color> m_vAvailableColors;
-	std::unordered_map<uint32_t, Color> m_mapPlayerColors;
-
-	void InitializeColors() {
-		m_vAvailableColors = {
-			{255, 0, 0}, {0, 255, 0}, {0, 0, 255}, {255, 255, 0},
-			{255, 0, 255}, {0, 255, 255}, {128, 0, 0}, {0, 128, 0},
-			{0, 0, 128}, {128, 128, 0}, {128, 0, 128}, {0, 128, 128},
-			{192, 192, 192}, {128, 128, 128}, {64, 64, 64}
-		};
-	}
-
-	Color AssignColor() {
-		if (m_vAvailableColors.empty()) {
-			// Default to white if no colors are available
-			return { 255, 255, 255 };
+		std::string arg = args[i];
+		if (arg == "--record" && i + 1 < argc)
+			recordPath = args[++i];
+		else if (arg == "--no-compression")
+			bCompression = false;
+		else if (arg == "--compress-threshold" && i + 1 < argc)
+			nCompressThreshold = std::stoul(args[++i]);
+		else if (arg == "--no-rate-limit")
+			bRateLimit = false;
+		else if (arg == "--cluster" && i + 1 < argc)
+		{
+			if (!cluster.ParseNodes(args[++i]))
+			{
+				std::cerr << "Expected --cluster host:port,host:port,...\n";
+				return 1;
+			}
+		}
+		else if (arg == "--node" && i + 1 < argc)
+			cluster.nSelf = std::stoul(args[++i]);
+		else if (arg == "--cluster-key" && i + 1 < argc)
+			cluster.nKey = std::stoull(args[++i]);
+		else if (arg == "--trace" && i + 1 < argc)
+			tracePath = args[++i];
+		else if (arg == "--low-latency")
+			bLowLatency = true;
+		else if (arg == "--io-core" && i + 1 < argc)
+			lowLatency.nIOCore = std::stoi(args[++i]);
+		else if (arg == "--game-core" && i + 1 < argc)
+			nGameCore = std::stoi(args[++i]);
+		else if (arg == "--busy-poll" && i + 1 < argc)
+			lowLatency.sockets.nBusyPollMicroseconds = std::stoi(args[++i]);
+		else if (arg == "--socket-buffer" && i + 1 < argc)
+			lowLatency.sockets.nSendBuffer = lowLatency.sockets.nReceiveBuffer = std::stoi(args[++i]);
+		else if (arg == "--world" && i + 1 < argc)
+		{
+			std::string sSize = args[++i];
+			size_t nX = sSize.find('x');
+			if (nX == std::string::npos || nX == 0 || nX + 1 == sSize.size())
+			{
+				std::cerr << "Expected --world <chunks x>x<chunks y>\n";
+				return 1;
+			}
+			world.nChunksX = std::stoi(sSize.substr(0, nX));
+			world.nChunksY = std::stoi(sSize.substr(nX + 1));
+		}
+		else if (arg == "--world-seed" && i + 1 < argc)
+			world.nSeed = uint32_t(std::stoul(args[++i]));
+		else if (arg == "--hot-restart" && i + 1 < argc)
+			restartPath = args[++i];
+		else if (arg == "--gateway-key" && i + 1 < argc)
+		{
+			nGatewayKey = std::stoull(args[++i]);
+			bGateways = true;
 		}
-
-		// Shuffle available colors
-		std::random_shuffle(m_vAvailableColors.begin(), m_vAvailableColors.end());
-
-		// Take the last color from the shuffled list
-		Color color = m_vAvailableColors.back();
-		m_vAvailableColors.pop_back();
-
-		return color;
 	}
 
-	void ReleaseColor(Color color) {
-		m_vAvailableColors.push_back(color);
+	if (cluster.IsClustered() && (cluster.nSelf >= cluster.vNodes.size() || cluster.vNodes.size() > MAX_CLUSTER_NODES))
+	{
+		std::cerr << "--node must be one of the " << cluster.vNodes.size() << " nodes, and a cluster has at most " << MAX_CLUSTER_NODES << "\n";
+		return 1;
 	}
 
-protected:
-	bool OnClientConnect(std::shared_ptr<tfg::net::connection<GameMsg>> client) override
+	// Anyone who knows the key can hand players to us, so there is no default
+	if (cluster.IsClustered() && cluster.nKey == 0)
 	{
-		// Allow all 
-		return true;
+		std::cerr << "--cluster needs a --cluster-key other than 0, the same on every node\n";
+		return 1;
 	}
 
-	void OnClientValidated(std::shared_ptr<tfg::net::connection<GameMsg>> client) override
+	// Likewise anyone who knows the gateway key can speak for any client
+	if (bGateways && nGatewayKey == 0)
 	{
-		// Client passed validation check, so send them a message informing them they can continue to communicate
-		tfg::net::message<GameMsg> msg;
-		msg.header.id = GameMsg::Client_Accepted;
-		client->Send(msg);
+		std::cerr << "--gateway-key must be other than 0\n";
+		return 1;
 	}
 
-	void OnClientDisconnect(std::shared_ptr<tfg::net::connection<GameMsg>> client) override
+	if (world.nChunksX < 1 || world.nChunksY < 1 || world.nChunksX > MAX_WORLD_CHUNKS || world.nChunksY > MAX_WORLD_CHUNKS)
 	{
-		if (client)
-		{
-			if (m_mapPlayerRoster.find(client->GetID()) == m_mapPlayerRoster.end())
-			{
-				// Client never added to roster, so just let it disappear
-			}
-			else
-			{
-				auto& pd = m_mapPlayerRoster[client->GetID()];
-				std::cout << "[UNGRACEFUL REMOVAL]:" + std::to_string(pd.nUniqueID) + "\n";
-				ReleaseColor(pd.nColor);
-				m_mapPlayerRoster.erase(client->GetID());
-				m_vGarbageIDs.push_back(client->GetID());
-			}
-		}
+		std::cerr << "--world must be between 1x1 and " << MAX_WORLD_CHUNKS << "x" << MAX_WORLD_CHUNKS << " chunks\n";
+		return 1;
 	}
 
-	void OnMessage(std::shared_ptr<tfg::net::connection<GameMsg>> client, tfg::net::message<GameMsg>& msg) override
+	// Start server in port 60000, or on our own port in the cluster, with a data directory per node
+	uint16_t nPort = cluster.IsClustered() ? cluster.vNodes[cluster.nSelf].nPort : 60000;
+	std::string sDataDirectory = cluster.IsClustered() ? "osrs_data/node" + std::to_string(cluster.nSelf) : "osrs_data";
+	Server server(nPort, sDataDirectory);
+	server.SetWorld(world);
+	if (cluster.IsClustered())
+		server.JoinCluster(cluster);
+	if (bGateways)
+		server.EnableGateways(GatewayProtocol(nGatewayKey));
+	server.SetCompression(bCompression, nCompressThreshold);
+	if (!bRateLimit)
+		server.SetRateLimits({});
+	if (!recordPath.empty() && !server.StartRecording(recordPath))
+		return 1;
+	if (bLowLatency)
+		server.SetLowLatency(lowLatency);
+
+	// A server already running with the same --hot-restart path hands its clients over to us, see restart.h. It is stalled
+	// until we confirm, so everything that doesn't need its state, like the world, is set up before we ask. It saves its
+	// players' progress as it hands over, so that is loaded after
+	tfg::net::restart_inheritance inherited;
+	auto restart = restartPath.empty() ? tfg::net::restart_result::nothing_running : tfg::net::restart_request(restartPath, inherited);
+	if (restart == tfg::net::restart_result::failed)
+		return 1;
+	server.LoadProgress();
+	if (restart == tfg::net::restart_result::inherited && !server.Inherit(inherited))
+		return 1;
+	if (!server.Start())
+		return 1;
+	if (!restartPath.empty())
+		server.ListenForSuccessor(restartPath);
+	TFG_TRACE_THREAD("game");
+
+	if (bLowLatency && nGameCore >= 0 && !tfg::net::pin_current_thread(nGameCore))
+		std::cerr << "Unable to pin the game thread to core " << nGameCore << "\n";
+
+#ifdef SIGUSR1
+	// kill -USR1 <pid> writes the trace zones of every thread, for builds with TFG_ENABLE_TRACING
+	if (!tracePath.empty())
+		std::signal(SIGUSR1, [](int) { g_bTraceRequested = 1; });
+#endif
+
+	// Messages are handled for at most this long at a time, so periodic tasks still run on time under load
+	constexpr std::chrono::milliseconds UPDATE_BUDGET{ 5 };
+
+	// Until a successor takes over
+	while (!server.IsReplaced())
 	{
-		if (!m_vGarbageIDs.empty())
-		{
-			for (auto pid : m_vGarbageIDs)
-			{
-				tfg::net::message<GameMsg> m;
-				m.header.id = GameMsg::Game_RemovePlayer;
-				m << pid;
-				std::cout << "Removing " << pid << "\n";
-				MessageAllClients(m);
-			}
-			m_vGarbageIDs.clear();
-		}
+		// Sleeps until a client sends a message or a periodic task is due, so that the server doesn't use 100% of
+		// the CPU core. In low latency mode it spins for a while first
+		server.Update(std::chrono::steady_clock::time_point::max(), UPDATE_BUDGET);
 
-		switch (msg.header.id)
+		if (g_bTraceRequested)
 		{
-			case GameMsg::Client_RegisterWithServer:
-			{
-				sPlayerDescription desc;
-				msg >> desc;
-				desc.nUniqueID = client->GetID();
-				desc.nColor = AssignColor();
-				m_mapPlayerRoster.insert_or_assign(desc.nUniqueID, desc);
-
-				tfg::net::message<GameMsg> msgSendID;
-				msgSendID.header.id = GameMsg::Client_AssignID;
-				msgSendID << desc.nUniqueID;
-				MessageClient(client, msgSendID);
-
-				tfg::net::message<GameMsg> msgAddPlayer;
-				msgAddPlayer.header.id = GameMsg::Game_AddPlayer;
-				msgAddPlayer << desc;
-				MessageAllClients(msgAddPlayer);
-
-				for (const auto& player : m_mapPlayerRoster)
-				{
-					tfg::net::message<GameMsg> msgAddOtherPlayers;
-					msgAddOtherPlayers.header.id = GameMsg::Game_AddPlayer;
-					msgAddOtherPlayers << player.second;
-					MessageClient(client, msgAddOtherPlayers);
-				}
-				break;
-			}
-
-			case GameMsg::Client_UnregisterWithServer:
-			{
-				break;
-			}
-
-			case GameMsg::Game_UpdatePlayer:
-			{
-				// Simply bounce update to everyone except incoming client
-				MessageAllClients(msg, client);
-				break;
-			}
+			g_bTraceRequested = 0;
+			if (tfg::net::trace_export(tracePath))
+				std::cout << "[TRACE] Written to " << tracePath << "\n";
 		}
 	}
-};
-
-int main()
-{
-	// Start server in port 60000
-	Server server(60000);
-	server.Start();
-
-	while (1)
-	{
-		// If wait is set to true, the server will wait until client sends a message
-		// so that the server doesn't use 100% of the CPU core
-		server.Update(-1, true);
-	}
 	return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,1219 @@
+#pragma once
+#include <unordered_map>
+#include "common.h"
+#include "cluster.h"
+#include "world.h"
+#include "persistence.h"
+
+class Server : public tfg::net::server_interface<GameMsg>
+{
+public:
+	Server(uint16_t nPort, const std::string& sDataDirectory = "osrs_data")
+		: tfg::net::server_interface<GameMsg>(nPort), m_store(sDataDirectory)
+	{
+		InitializeColors();
+		ConfigureTimeouts();
+		ConfigureRateLimits();
+		ConfigureFlowControl();
+		SchedulePeriodicTasks();
+	}
+
+	// Load the progress saved by previous runs and start saving ours. Must be called after JoinCluster() and before Start(),
+	// and with hot restart only once the old server has handed over, since it saves its players' progress as it does
+	void LoadProgress()
+	{
+		// Never hand out an ID that already has progress saved from a previous run
+		m_mapSavedProgress = m_store.Recover();
+		for (const auto& saved : m_mapSavedProgress)
+		{
+			if (!m_cluster.IsClustered() || m_cluster.OwnsID(saved.first))
+				nIDCounter = std::max(nIDCounter.load(), saved.first + 1);
+		}
+		m_store.Start();
+	}
+
+	// The world players move in, see world.h. Must be called before JoinCluster() and Start()
+	void SetWorld(const sWorldInfo& info)
+	{
+		m_world = WorldMap(info);
+		std::cout << "[WORLD] " << info.nChunksX << "x" << info.nChunksY << " chunks, " << m_world.Width() << "x" << m_world.Height()
+			<< " pixels, seed " << info.nSeed << "\n";
+	}
+
+	// Become node cluster.nSelf of a cluster, see cluster.h. Must be called before Start()
+	void JoinCluster(const sClusterConfig& cluster)
+	{
+		m_cluster = cluster;
+		m_cluster.fWorldWidth = m_world.Width();
+		m_vNodeLinks.resize(cluster.vNodes.size());
+
+		// Hand out IDs from our own range only, past any we handed out before, see LoadProgress()
+		nIDCounter = m_cluster.FirstID();
+
+		SchedulePeriodic("cluster", NODE_POLL_INTERVAL, [this]() { PollNodeLinks(); ExpireHandOffs(); });
+
+		float fStrip = m_cluster.StripWidth();
+		std::cout << "[CLUSTER] Node " << m_cluster.nSelf << " of " << m_cluster.vNodes.size() << ", owning x from "
+			<< fStrip * m_cluster.nSelf << " to " << fStrip * (m_cluster.nSelf + 1) << "\n";
+	}
+
+	// Server without a listening socket, clients are added with AddNullConnection(). Used to replay recorded traffic
+	explicit Server(const std::string& sDataDirectory) : m_store(sDataDirectory)
+	{
+		InitializeColors();
+		ConfigureTimeouts();
+		ConfigureRateLimits();
+		ConfigureFlowControl();
+		SchedulePeriodicTasks();
+		LoadProgress();
+	}
+
+	std::unordered_map<uint32_t, sPlayerDescription> m_mapPlayerRoster;
+	std::vector<uint32_t> m_vGarbageIDs;
+
+	// The roster above, serialized and kept in sync so joining players get it in a single message
+	RosterSnapshot m_rosterSnapshot;
+
+private:
+	std::vector<Color> m_vAvailableColors;
+	std::unordered_map<uint32_t, Color> m_mapPlayerColors;
+
+	// Number of players shown on the scoreboard, and how often a changed top list is pushed at most
+	static constexpr size_t LEADERBOARD_SIZE = 5;
+	static constexpr std::chrono::milliseconds LEADERBOARD_INTERVAL{ 250 };
+
+	Leaderboard m_leaderboard;
+	bool m_bLeaderboardDirty = false;
+
+	static constexpr std::chrono::seconds STATS_INTERVAL{ 10 };
+	uint64_t m_nReportedCompressions = 0;
+	uint64_t m_nReportedLimits = 0;
+	uint64_t m_nReportedLanes = 0;
+	size_t m_nReportedGatewayClients = 0;
+
+	// Clients with a slow link are sent fewer updates of everyone, and fewer still of players further than
+	// FAR_DISTANCE from their own, see flow.h
+	static constexpr float FAR_DISTANCE = 240.0f;
+	static constexpr uint32_t FAR_STRIDE = 4;
+	static constexpr size_t MAX_QUEUED_BYTES = 4 * 1024 * 1024;
+	uint64_t m_nReportedFlow = 0;
+	std::string m_sReportedFlow;
+
+	// Chunks streamed to clients and evicted from them, see world.h
+	WorldMap m_world;
+	uint64_t m_nChunksSent = 0, m_nChunksEvicted = 0;
+	uint64_t m_nReportedChunks = 0;
+
+	// Messages OnMessage() turned away
+	tfg::net::dispatch_stats m_statsDispatch;
+	uint64_t m_nReportedRejections = 0;
+
+	// Progress is saved in the background. Everything saved, by previous runs and this one, is also kept here by
+	// player ID, so a client that comes back with the ID and token of a player nobody holds anymore gets its progress back
+	ProgressStore m_store;
+	std::unordered_map<uint32_t, sProgressRecord> m_mapSavedProgress;
+
+	// A player whose connection drops keeps their slot for RESUME_GRACE, so a client that reconnects in time with
+	// its token gets the same ID back and only the roster changes it missed, and nobody else notices
+	static constexpr std::chrono::seconds RESUME_GRACE{ 30 };
+	static constexpr std::chrono::seconds SESSION_SWEEP_INTERVAL{ 1 };
+
+	struct sSession
+	{
+		uint64_t nToken = 0;
+
+		// Null while suspended
+		std::shared_ptr<tfg::net::connection<GameMsg>> client;
+		std::chrono::steady_clock::time_point tSuspended;
+
+		// Roster version the client said it has applied, 0 until it first does, and the one we last sent it to echo,
+		// see Game_RosterVersion
+		uint64_t nSeenVersion = 0;
+		uint64_t nMarkedVersion = 0;
+
+		// Updates of the player sent on so far, which clients with a stride pick from, see flow.h
+		uint64_t nStateUpdates = 0;
+
+		// Chunks the client holds
+		ChunkInterest chunks;
+
+		// Node that handed the player to us, if one did, see MayHandOff()
+		size_t nHandedOffBy = SIZE_MAX;
+	};
+
+	std::unordered_map<uint32_t, sSession> m_mapSessions;
+	RosterChangeLog m_rosterChanges;
+
+	// Layout of what OnSaveRestartState() hands a successor
+	static constexpr uint32_t RESTART_STATE_VERSION = 2;
+
+	// Cluster mode, see cluster.h. Unused while there is only one node
+	static constexpr std::chrono::milliseconds NODE_POLL_INTERVAL{ 5 };
+	static constexpr std::chrono::seconds NODE_RECONNECT_INTERVAL{ 1 };
+	static constexpr std::chrono::seconds HANDOFF_TIMEOUT{ 2 };
+
+	sClusterConfig m_cluster;
+
+	// Our links to the other nodes, indexed by node. The one for ourselves stays empty
+	struct sNodeLink
+	{
+		std::unique_ptr<tfg::net::client_interface<GameMsg>> link;
+		bool bReady = false;
+		std::chrono::steady_clock::time_point tNextAttempt;
+	};
+
+	std::vector<sNodeLink> m_vNodeLinks;
+
+	// The other nodes' links to us, and which node each belongs to
+	std::unordered_map<std::shared_ptr<tfg::net::connection<GameMsg>>, size_t> m_mapPeers;
+
+	// Players offered to another node that hasn't accepted yet. They stay ours until it does
+	struct sHandOff
+	{
+		size_t nNode = 0;
+		std::chrono::steady_clock::time_point tStarted;
+	};
+
+	std::unordered_map<uint32_t, sHandOff> m_mapHandOffs;
+
+	// Players that moved to another node, kept for RESUME_GRACE so their clients are sent on if they come back here
+	struct sMoved
+	{
+		uint64_t nToken = 0;
+		size_t nNode = 0;
+		std::chrono::steady_clock::time_point tMoved;
+	};
+
+	std::unordered_map<uint32_t, sMoved> m_mapMoved;
+	uint64_t m_nHandOffsOut = 0, m_nHandOffsIn = 0, m_nHandOffsFailed = 0;
+	uint64_t m_nReportedHandOffs = 0;
+
+	// The same for clients connecting directly as for those behind a gateway, see common.h
+	void ConfigureTimeouts()
+	{
+		ConfigureClientTimeouts(*this);
+	}
+
+	void ConfigureRateLimits()
+	{
+		tfg::net::rate_limits<GameMsg> limits = ClientRateLimits();
+
+		// Gateways introduce themselves once, limits are lifted for them after
+		limits.mapPerType[GameMsg::Gateway_Hello] = { 1.0, 3.0, 0.0, 0.0, tfg::net::rate_policy::disconnect };
+
+		// Other nodes introduce themselves once, then may hand over players in bursts
+		limits.mapPerType[GameMsg::Node_Hello] = { 1.0, 3.0, 0.0, 0.0, tfg::net::rate_policy::disconnect };
+		limits.mapPerType[GameMsg::Node_HandOff] = { 2000.0, 500.0, 0.0, 0.0, tfg::net::rate_policy::drop };
+
+		SetRateLimits(limits);
+	}
+
+	void ConfigureFlowControl()
+	{
+		tfg::net::flow_limits limits;
+		limits.nMaxQueuedBytes = MAX_QUEUED_BYTES;
+		SetFlowControl(limits);
+	}
+
+	void InitializeColors() {
+		m_vAvailableColors = {
+			{255, 0, 0}, {0, 255, 0}, {0, 0, 255}, {255, 255, 0},
+			{255, 0, 255}, {0, 255, 255}, {128, 0, 0}, {0, 128, 0},
+			{0, 0, 128}, {128, 128, 0}, {128, 0, 128}, {0, 128, 128},
+			{192, 192, 192}, {128, 128, 128}, {64, 64, 64}
+		};
+	}
+
+	Color AssignColor() {
+		if (m_vAvailableColors.empty()) {
+			// Default to white if no colors are available
+			return { 255, 255, 255 };
+		}
+
+		// Shuffle available colors
+		std::random_shuffle(m_vAvailableColors.begin(), m_vAvailableColors.end());
+
+		// Take the last color from the shuffled list
+		Color color = m_vAvailableColors.back();
+		m_vAvailableColors.pop_back();
+
+		return color;
+	}
+
+	void ReleaseColor(Color color) {
+		// Players handed over from other nodes bring their color with them, so it may be available here already
+		for (const auto& available : m_vAvailableColors) {
+			if (available.r == color.r && available.g == color.g && available.b == color.b)
+				return;
+		}
+		m_vAvailableColors.push_back(color);
+	}
+
+	// Compact top list: entries are pushed from last to first so the client pops them in rank order
+	tfg::net::message<GameMsg> BuildLeaderboardMessage()
+	{
+		auto vTop = m_leaderboard.Top(LEADERBOARD_SIZE);
+
+		tfg::net::message<GameMsg> msg;
+		msg.header.id = GameMsg::Game_Leaderboard;
+		for (auto it = vTop.rbegin(); it != vTop.rend(); ++it)
+		{
+			sLeaderboardEntry entry;
+			entry.nUniqueID = it->first;
+			entry.nOreCount = it->second;
+			entry.nColor = m_mapPlayerRoster[it->first].nColor;
+			msg << entry;
+		}
+		msg << uint32_t(vTop.size());
+		return msg;
+	}
+
+	// Periodic work runs from Update() even when no messages arrive, see scheduler.h
+	void SchedulePeriodicTasks()
+	{
+		SchedulePeriodic("leaderboard", LEADERBOARD_INTERVAL, [this]() { FlushLeaderboard(); });
+		SchedulePeriodic("sessions", SESSION_SWEEP_INTERVAL, [this]() { SweepSessions(); BroadcastRemovals(); });
+		SchedulePeriodic("stats", STATS_INTERVAL, [this]() { ReportStats(); });
+	}
+
+	// Push the top list to everyone if it changed
+	void FlushLeaderboard()
+	{
+		if (m_bLeaderboardDirty)
+		{
+			MessageAllClients(BuildLeaderboardMessage());
+			m_bLeaderboardDirty = false;
+		}
+	}
+
+	// Log each subsystem's counters that changed since the last report, and if any did, how late the periodic tasks ran
+	void ReportStats()
+	{
+		bool bActive = false;
+
+		const auto& compression = GetCompressionStats();
+		if (compression.nMessages + compression.nSkipped != m_nReportedCompressions)
+		{
+			std::cout << "[COMPRESSION] " << compression.summary() << "\n";
+			m_nReportedCompressions = compression.nMessages + compression.nSkipped;
+			bActive = true;
+		}
+
+		const auto& limits = GetRateLimitStats();
+		if (limits.total() != m_nReportedLimits)
+		{
+			std::cout << "[RATE LIMIT] " << limits.summary() << "\n";
+			m_nReportedLimits = limits.total();
+			bActive = true;
+		}
+
+		const auto& lanes = GetLaneStats();
+		if (lanes.total() != m_nReportedLanes)
+		{
+			std::cout << "[LANES] " << lanes.summary() << "\n";
+			m_nReportedLanes = lanes.total();
+			bActive = true;
+		}
+
+		if (m_nHandOffsOut + m_nHandOffsIn + m_nHandOffsFailed != m_nReportedHandOffs)
+		{
+			size_t nLinked = std::count_if(m_vNodeLinks.begin(), m_vNodeLinks.end(), [](const sNodeLink& node) { return node.bReady; });
+			std::cout << "[CLUSTER] " << nLinked << " of " << m_vNodeLinks.size() - 1 << " nodes linked, " << m_nHandOffsOut << " players handed off, "
+				<< m_nHandOffsIn << " taken over, " << m_nHandOffsFailed << " hand-offs timed out\n";
+			m_nReportedHandOffs = m_nHandOffsOut + m_nHandOffsIn + m_nHandOffsFailed;
+			bActive = true;
+		}
+
+		if (m_nChunksSent + m_nChunksEvicted != m_nReportedChunks)
+		{
+			std::cout << "[WORLD] " << m_nChunksSent << " chunks streamed, " << m_nChunksEvicted << " evicted\n";
+			m_nReportedChunks = m_nChunksSent + m_nChunksEvicted;
+			bActive = true;
+		}
+
+		if (m_statsDispatch.rejected() != m_nReportedRejections)
+		{
+			std::cout << "[DISPATCH] " << m_statsDispatch.summary() << "\n";
+			m_nReportedRejections = m_statsDispatch.rejected();
+			bActive = true;
+		}
+
+		const auto& flow = GetFlowStats();
+		std::string sFlow = GetFlowSummary();
+		if (flow.nCoalesced + flow.nOverflows != m_nReportedFlow || sFlow != m_sReportedFlow)
+		{
+			std::cout << "[FLOW] " << sFlow << ", " << flow.nCoalesced << " updates coalesced, " << flow.nOverflows << " clients overflowed\n";
+			m_nReportedFlow = flow.nCoalesced + flow.nOverflows;
+			m_sReportedFlow = sFlow;
+			bActive = true;
+		}
+
+		// Every period on its own, so a bad spell isn't averaged away by the quiet ones around it
+		if (GetLatencyStats().count() > 0)
+		{
+			std::cout << "[LATENCY] Receive to handler " << GetLatencyStats().summary() << "\n";
+			ResetLatencyStats();
+			bActive = true;
+		}
+
+		if (GetGatewayClientCount() != m_nReportedGatewayClients)
+		{
+			std::cout << "[GATEWAY] " << GetGatewayCount() << " gateways linked, carrying " << GetGatewayClientCount() << " clients\n";
+			m_nReportedGatewayClients = GetGatewayClientCount();
+			bActive = true;
+		}
+
+		if (bActive)
+			std::cout << "[SCHEDULER] " << GetSchedulerSummary() << "\n";
+	}
+
+	// Add a new player to the room and hand its client the ID and token it can resume the session with. A player restored
+	// from saved progress keeps its token and starts with the saved ore count and mining speed
+	void RegisterPlayer(std::shared_ptr<tfg::net::connection<GameMsg>> client, tfg::net::message<GameMsg>& msg, const sProgressRecord* pSaved = nullptr)
+	{
+		sPlayerDescription desc;
+		msg >> desc;
+		desc.nUniqueID = client->GetID();
+		if (pSaved)
+		{
+			desc.nOreCount = pSaved->nOreCount;
+			desc.fMiningSpeed = pSaved->fMiningSpeed;
+		}
+
+		uint32_t nCapabilities = 0;
+		msg >> nCapabilities;
+		client->EnableCompression(IsCompressionOffered() && (nCapabilities & tfg::net::CAPABILITY_COMPRESSION));
+
+		desc.nColor = AssignColor();
+		m_mapPlayerRoster.insert_or_assign(desc.nUniqueID, desc);
+		m_rosterSnapshot.Set(desc);
+		m_rosterChanges.Changed(desc.nUniqueID);
+		m_bLeaderboardDirty |= m_leaderboard.Update(desc.nUniqueID, desc.nOreCount, LEADERBOARD_SIZE);
+
+		sSession& session = m_mapSessions[desc.nUniqueID];
+		session.nToken = pSaved ? pSaved->nToken : tfg::net::random_secret();
+		session.client = client;
+		session.nSeenVersion = session.nMarkedVersion = 0;
+		SaveProgress(desc.nUniqueID, session.nToken, desc.nOreCount, desc.fMiningSpeed);
+
+		// The token goes first, so clients that only know about the ID pop just that
+		tfg::net::message<GameMsg> msgSendID;
+		msgSendID.header.id = GameMsg::Client_AssignID;
+		msgSendID << session.nToken;
+		msgSendID << desc.nUniqueID;
+		MessageClient(client, msgSendID);
+
+		tfg::net::message<GameMsg> msgAddPlayer;
+		msgAddPlayer.header.id = GameMsg::Game_AddPlayer;
+		msgAddPlayer << desc;
+		MessageAllClients(msgAddPlayer);
+
+		// Everyone already in the room, including the new player, in one prebuilt message
+		MessageClient(client, m_rosterSnapshot.Message());
+		StreamWorld(client, session, desc.vPos, true);
+
+		// New players get the current top list straight away, everyone else on the next flush
+		MessageClient(client, BuildLeaderboardMessage());
+	}
+
+	// Reattach a client to its suspended (or not yet noticed dead) player. The rest of msg is a registration,
+	// used if the session can't be resumed
+	bool ResumePlayer(std::shared_ptr<tfg::net::connection<GameMsg>> client, uint32_t nUniqueID, uint64_t nToken, tfg::net::message<GameMsg>& msg)
+	{
+		auto it = m_mapSessions.find(nUniqueID);
+		if (it == m_mapSessions.end() || !tfg::net::secrets_match(nToken, it->second.nToken) || it->second.client == client)
+			return false;
+
+		sSession& session = it->second;
+		auto tNow = std::chrono::steady_clock::now();
+		if (session.client)
+		{
+			// The old connection hasn't been found dead yet, make sure it never speaks for this player again
+			session.client->Disconnect();
+			std::cout << "[RESUMED]:" << nUniqueID << " (replaced connection)\n";
+		}
+		else
+		{
+			std::cout << "[RESUMED]:" << nUniqueID << " after " << std::chrono::duration_cast<std::chrono::milliseconds>(tNow - session.tSuspended).count() << " ms\n";
+		}
+
+		// The description is only there for the fallback, the client carries on from the state we have
+		sPlayerDescription desc;
+		msg >> desc;
+		uint32_t nCapabilities = 0;
+		msg >> nCapabilities;
+		client->EnableCompression(IsCompressionOffered() && (nCapabilities & tfg::net::CAPABILITY_COMPRESSION));
+
+		client->SetID(nUniqueID);
+		session.client = client;
+
+		tfg::net::message<GameMsg> msgSendID;
+		msgSendID.header.id = GameMsg::Client_AssignID;
+		msgSendID << session.nToken;
+		msgSendID << nUniqueID;
+		MessageClient(client, msgSendID);
+
+		MessageClient(client, BuildRosterDelta(session.nSeenVersion));
+		MessageClient(client, BuildLeaderboardMessage());
+
+		// The client may have kept its chunks, but there is no telling which, so it is sent them all again
+		auto itPlayer = m_mapPlayerRoster.find(nUniqueID);
+		if (itPlayer != m_mapPlayerRoster.end())
+			StreamWorld(client, session, itPlayer->second.vPos, true);
+
+		// Whatever we asked the old connection to echo may never come back, so ask again
+		session.nMarkedVersion = 0;
+		return true;
+	}
+
+	// Bring back a player whose session is gone, after a restart or once its grace ran out, if the client still has its
+	// token. The rest of msg is a registration, used for everything but the saved progress
+	bool RestorePlayer(std::shared_ptr<tfg::net::connection<GameMsg>> client, uint32_t nUniqueID, uint64_t nToken, tfg::net::message<GameMsg>& msg)
+	{
+		auto it = m_mapSavedProgress.find(nUniqueID);
+		if (it == m_mapSavedProgress.end() || it->second.nToken == 0 || !tfg::net::secrets_match(nToken, it->second.nToken))
+			return false;
+
+		// Someone is still playing it, here or on its way in from another node
+		if (m_mapPlayerRoster.count(nUniqueID) || m_mapSessions.count(nUniqueID))
+			return false;
+
+		std::cout << "[RESTORED]:" << nUniqueID << " with " << it->second.nOreCount << " ore\n";
+		sProgressRecord saved = it->second;
+		client->SetID(nUniqueID);
+		RegisterPlayer(client, msg, &saved);
+		return true;
+	}
+
+	// Queue a change of progress for the store and remember it, see RestorePlayer()
+	void SaveProgress(uint32_t nUniqueID, uint64_t nToken, uint32_t nOreCount, float fMiningSpeed)
+	{
+		sProgressRecord& saved = m_mapSavedProgress[nUniqueID];
+		saved.nUniqueID = nUniqueID;
+		saved.nToken = nToken;
+		saved.nOreCount = nOreCount;
+		saved.fMiningSpeed = fMiningSpeed;
+		m_store.Record(nUniqueID, nToken, nOreCount, fMiningSpeed);
+	}
+
+	// Send the client the chunks that came into range of its player at vPos and evict those that went out of it. A reset
+	// starts the client over with the world info. Players are only kept up to date within range, see the Game_UpdatePlayer
+	// handler, so the client is also sent where the players in the chunks it is sent now are
+	void StreamWorld(const std::shared_ptr<tfg::net::connection<GameMsg>>& client, sSession& session, const sVector2& vPos, bool bReset)
+	{
+		if (bReset)
+		{
+			session.chunks.Reset();
+
+			tfg::net::message<GameMsg> msgInfo;
+			msgInfo.header.id = GameMsg::Game_WorldInfo;
+			msgInfo << m_world.Info();
+			MessageClient(client, msgInfo);
+		}
+
+		std::vector<sChunkCoord> vSend, vEvict;
+		if (!session.chunks.Move(m_world, vPos, vSend, vEvict))
+			return;
+
+		for (const auto& coord : vEvict)
+		{
+			tfg::net::message<GameMsg> msg;
+			msg.header.id = GameMsg::Game_ChunkEvict;
+			msg << coord;
+			MessageClient(client, msg);
+		}
+
+		std::unordered_set<uint64_t> setSent;
+		for (const auto& coord : vSend)
+		{
+			MessageClient(client, ChunkMessage(m_world.Generate(coord)));
+			setSent.insert(coord.Key());
+		}
+
+		// A reset comes with the whole roster already
+		if (!bReset)
+		{
+			for (const auto& player : m_mapPlayerRoster)
+			{
+				if (player.first != client->GetID() && setSent.count(m_world.ChunkAt(player.second.vPos).Key()))
+				{
+					tfg::net::message<GameMsg> msg;
+					msg.header.id = GameMsg::Game_UpdatePlayer;
+					msg << player.second;
+					MessageClient(client, msg);
+				}
+			}
+		}
+
+		m_nChunksSent += vSend.size();
+		m_nChunksEvicted += vEvict.size();
+	}
+
+	// Roster changes after nVersion: removed IDs and their count, changed players and their count, and whether the
+	// client must drop everything it has first because the log doesn't go back that far
+	tfg::net::message<GameMsg> BuildRosterDelta(uint64_t nVersion)
+	{
+		tfg::net::message<GameMsg> msg;
+		msg.header.id = GameMsg::Game_RosterDelta;
+
+		// Version 0 is a session handed over by another node, its client knows nothing about our roster
+		uint8_t bReset = nVersion == 0 || !m_rosterChanges.Covers(nVersion);
+		std::vector<uint32_t> vRemoved, vChanged;
+		if (bReset)
+		{
+			for (const auto& player : m_mapPlayerRoster)
+				vChanged.push_back(player.first);
+		}
+		else
+		{
+			vRemoved = m_rosterChanges.RemovedSince(nVersion);
+			vChanged = m_rosterChanges.ChangedSince(nVersion);
+		}
+
+		for (auto nRemovedID : vRemoved)
+			msg << nRemovedID;
+		msg << uint32_t(vRemoved.size());
+		for (auto nChangedID : vChanged)
+			msg << m_mapPlayerRoster[nChangedID];
+		msg << uint32_t(vChanged.size());
+		msg << bReset;
+		return msg;
+	}
+
+	// Remove a player for good, everyone is told on the next maintenance
+	void RemovePlayer(uint32_t nUniqueID)
+	{
+		auto it = m_mapPlayerRoster.find(nUniqueID);
+		if (it == m_mapPlayerRoster.end())
+			return;
+
+		ReleaseColor(it->second.nColor);
+		m_bLeaderboardDirty |= m_leaderboard.Remove(nUniqueID, LEADERBOARD_SIZE);
+		m_rosterSnapshot.Remove(nUniqueID);
+		m_rosterChanges.Removed(nUniqueID);
+		m_mapPlayerRoster.erase(it);
+		m_vGarbageIDs.push_back(nUniqueID);
+	}
+
+	// Remove players suspended for longer than RESUME_GRACE, forget roster changes every session has seen, and ask
+	// clients the roster changed for since we last asked which version they are at now
+	void SweepSessions()
+	{
+		auto tNow = std::chrono::steady_clock::now();
+
+		uint64_t nOldestSeen = m_rosterChanges.Version();
+		for (auto it = m_mapSessions.begin(); it != m_mapSessions.end();)
+		{
+			if (!it->second.client && tNow - it->second.tSuspended >= RESUME_GRACE)
+			{
+				uint32_t nUniqueID = it->first;
+				it = m_mapSessions.erase(it);
+				std::cout << "[UNGRACEFUL REMOVAL]:" << nUniqueID << "\n";
+				RemovePlayer(nUniqueID);
+				continue;
+			}
+
+			if (it->second.nSeenVersion != 0)
+				nOldestSeen = std::min(nOldestSeen, it->second.nSeenVersion);
+
+			if (it->second.client && it->second.nMarkedVersion != m_rosterChanges.Version())
+			{
+				it->second.nMarkedVersion = m_rosterChanges.Version();
+				tfg::net::message<GameMsg> msg;
+				msg.header.id = GameMsg::Game_RosterVersion;
+				msg << it->second.nMarkedVersion;
+				MessageClient(it->second.client, msg);
+			}
+			++it;
+		}
+		m_rosterChanges.Forget(nOldestSeen);
+
+		for (auto it = m_mapMoved.begin(); it != m_mapMoved.end();)
+		{
+			if (tNow - it->second.tMoved >= RESUME_GRACE)
+				it = m_mapMoved.erase(it);
+			else
+				++it;
+		}
+	}
+
+	// Keep the links to the other nodes up, and handle what they send back
+	void PollNodeLinks()
+	{
+		auto tNow = std::chrono::steady_clock::now();
+		for (size_t nNode = 0; nNode < m_vNodeLinks.size(); nNode++)
+		{
+			if (nNode == m_cluster.nSelf)
+				continue;
+
+			sNodeLink& node = m_vNodeLinks[nNode];
+			if (!node.link || !node.link->IsConnected())
+			{
+				if (node.bReady)
+					std::cout << "[CLUSTER] Lost link to node " << nNode << "\n";
+				node.bReady = false;
+
+				if (tNow >= node.tNextAttempt)
+				{
+					node.tNextAttempt = tNow + NODE_RECONNECT_INTERVAL;
+					if (!node.link)
+					{
+						node.link = std::make_unique<tfg::net::client_interface<GameMsg>>();
+						node.link->Connect(m_cluster.vNodes[nNode].sHost, m_cluster.vNodes[nNode].nPort);
+					}
+					else
+					{
+						node.link->Reconnect();
+					}
+				}
+			}
+
+			while (node.link && !node.link->Incoming().empty())
+			{
+				auto msg = node.link->Incoming().pop_front().msg;
+				switch (msg.header.id)
+				{
+					case GameMsg::Client_Accepted:
+					{
+						tfg::net::message<GameMsg> msgHello;
+						msgHello.header.id = GameMsg::Node_Hello;
+						msgHello << m_cluster.nKey;
+						msgHello << uint32_t(m_cluster.nSelf);
+						node.link->Send(msgHello);
+						node.bReady = true;
+						std::cout << "[CLUSTER] Linked to node " << nNode << "\n";
+						break;
+					}
+					case GameMsg::Server_Heartbeat:
+						node.link->Send(msg);
+						break;
+					case GameMsg::Node_HandOffAccepted:
+					{
+						uint32_t nUniqueID = 0;
+						msg >> nUniqueID;
+						CompleteHandOff(nUniqueID, nNode);
+						break;
+					}
+					default:
+						break;
+				}
+			}
+		}
+	}
+
+	// Offer a player that walked into another node's strip to that node
+	void HandOffIfMoved(const sPlayerDescription& desc)
+	{
+		if (!m_cluster.ShouldHandOff(desc.vPos.x) || m_mapHandOffs.count(desc.nUniqueID))
+			return;
+
+		auto itSession = m_mapSessions.find(desc.nUniqueID);
+		if (itSession == m_mapSessions.end() || !itSession->second.client)
+			return;
+
+		// While the link is down the player just stays here
+		size_t nNode = m_cluster.OwnerOf(desc.vPos.x);
+		sNodeLink& node = m_vNodeLinks[nNode];
+		if (!node.bReady || !node.link->IsConnected())
+			return;
+
+		tfg::net::message<GameMsg> msg;
+		msg.header.id = GameMsg::Node_HandOff;
+		msg << desc;
+		msg << itSession->second.nToken;
+		node.link->Send(msg);
+		m_mapHandOffs[desc.nUniqueID] = { nNode, std::chrono::steady_clock::now() };
+	}
+
+	// Take over a player from another node. It waits as a suspended session until its client reconnects here
+	void AcceptHandOff(std::shared_ptr<tfg::net::connection<GameMsg>> peer, tfg::net::message<GameMsg>& msg, size_t nNode)
+	{
+		uint64_t nToken = 0;
+		sPlayerDescription desc;
+		msg >> nToken >> desc;
+
+		if (!MayHandOff(desc.nUniqueID, nNode))
+		{
+			std::cout << "[HANDOFF REFUSED]:" << desc.nUniqueID << " from node " << nNode << "\n";
+			return;
+		}
+
+		m_mapMoved.erase(desc.nUniqueID);
+		m_mapPlayerRoster.insert_or_assign(desc.nUniqueID, desc);
+		m_rosterSnapshot.Set(desc);
+		m_rosterChanges.Changed(desc.nUniqueID);
+		m_bLeaderboardDirty |= m_leaderboard.Update(desc.nUniqueID, desc.nOreCount, LEADERBOARD_SIZE);
+		SaveProgress(desc.nUniqueID, nToken, desc.nOreCount, desc.fMiningSpeed);
+
+		// Any connection left over from an earlier stay here no longer speaks for the player
+		sSession& session = m_mapSessions[desc.nUniqueID];
+		session = sSession();
+		session.nToken = nToken;
+		session.tSuspended = std::chrono::steady_clock::now();
+		session.nHandedOffBy = nNode;
+
+		tfg::net::message<GameMsg> msgAddPlayer;
+		msgAddPlayer.header.id = GameMsg::Game_AddPlayer;
+		msgAddPlayer << desc;
+		MessageAllClients(msgAddPlayer);
+
+		tfg::net::message<GameMsg> msgAccepted;
+		msgAccepted.header.id = GameMsg::Node_HandOffAccepted;
+		msgAccepted << desc.nUniqueID;
+		MessageClient(peer, msgAccepted);
+
+		m_nHandOffsIn++;
+		std::cout << "[HANDOFF IN]:" << desc.nUniqueID << " from node " << nNode << "\n";
+	}
+
+	// Whether node nNode may give us the player with that ID. A player with a client attached here is ours until we hand
+	// it off. A suspended one can only be given to us again by the node that gave it to us, whose offer may have timed
+	// out after we accepted. IDs from our own range we never handed out can't be anyone's. Players keep their ID as
+	// they cross the strips, so one from the sender's range or a third node's may be passing through
+	bool MayHandOff(uint32_t nUniqueID, size_t nNode) const
+	{
+		auto it = m_mapSessions.find(nUniqueID);
+		if (it != m_mapSessions.end())
+			return !it->second.client && it->second.nHandedOffBy == nNode;
+
+		size_t nHome = m_cluster.HomeOf(nUniqueID);
+		if (nHome >= m_cluster.vNodes.size())
+			return false;
+		return nHome != m_cluster.nSelf || m_mapSavedProgress.count(nUniqueID);
+	}
+
+	// The other node has the player now, so send its client there and forget about it
+	void CompleteHandOff(uint32_t nUniqueID, size_t nNode)
+	{
+		auto it = m_mapHandOffs.find(nUniqueID);
+		if (it == m_mapHandOffs.end() || it->second.nNode != nNode)
+			return;
+		m_mapHandOffs.erase(it);
+
+		auto itSession = m_mapSessions.find(nUniqueID);
+		if (itSession != m_mapSessions.end())
+		{
+			m_mapMoved[nUniqueID] = { itSession->second.nToken, nNode, std::chrono::steady_clock::now() };
+			if (itSession->second.client)
+				Redirect(itSession->second.client, nNode);
+			m_mapSessions.erase(itSession);
+		}
+		RemovePlayer(nUniqueID);
+
+		m_nHandOffsOut++;
+		std::cout << "[HANDOFF OUT]:" << nUniqueID << " to node " << nNode << "\n";
+	}
+
+	// Give up on hand-offs the other node never answered, the player stays and is offered again when it next moves
+	void ExpireHandOffs()
+	{
+		auto tNow = std::chrono::steady_clock::now();
+		for (auto it = m_mapHandOffs.begin(); it != m_mapHandOffs.end();)
+		{
+			if (tNow - it->second.tStarted >= HANDOFF_TIMEOUT)
+			{
+				std::cout << "[HANDOFF FAILED]:" << it->first << " to node " << it->second.nNode << "\n";
+				m_nHandOffsFailed++;
+				it = m_mapHandOffs.erase(it);
+			}
+			else
+			{
+				++it;
+			}
+		}
+	}
+
+	void Redirect(std::shared_ptr<tfg::net::connection<GameMsg>> client, size_t nNode)
+	{
+		tfg::net::message<GameMsg> msg;
+		msg.header.id = GameMsg::Client_Redirect;
+		msg << m_cluster.Address(nNode);
+		MessageClient(client, msg);
+	}
+
+	// A client resuming a session that moved to another node while it was away is sent on
+	bool RedirectMoved(std::shared_ptr<tfg::net::connection<GameMsg>> client, uint32_t nUniqueID, uint64_t nToken)
+	{
+		auto it = m_mapMoved.find(nUniqueID);
+		if (it == m_mapMoved.end() || !tfg::net::secrets_match(nToken, it->second.nToken))
+			return false;
+
+		std::cout << "[" << client->GetID() << "] Session moved to node " << it->second.nNode << ", redirecting\n";
+		Redirect(client, it->second.nNode);
+		return true;
+	}
+
+protected:
+	bool OnClientConnect(std::shared_ptr<tfg::net::connection<GameMsg>> client) override
+	{
+		// Allow all 
+		return true;
+	}
+
+	void OnClientValidated(std::shared_ptr<tfg::net::connection<GameMsg>> client) override
+	{
+		// Client passed validation check, so send them a message informing them they can continue to communicate
+		// Tell the client what we can do, it answers with what it supports when it registers
+		tfg::net::message<GameMsg> msg;
+		msg.header.id = GameMsg::Client_Accepted;
+		msg << uint32_t(IsCompressionOffered() ? tfg::net::CAPABILITY_COMPRESSION : 0);
+		client->Send(msg);
+	}
+
+	void OnClientDisconnect(std::shared_ptr<tfg::net::connection<GameMsg>> client) override
+	{
+		if (client)
+		{
+			m_mapPeers.erase(client);
+
+			auto it = m_mapSessions.find(client->GetID());
+			if (it == m_mapSessions.end() || it->second.client != client)
+			{
+				// Client never added to roster, or its player was resumed by another connection, so just let it disappear
+			}
+			else
+			{
+				// Keep the player around for a while in case the client comes back, see SweepSessions()
+				std::cout << "[SUSPENDED]:" + std::to_string(it->first) + "\n";
+				it->second.client.reset();
+				it->second.tSuspended = std::chrono::steady_clock::now();
+			}
+		}
+	}
+
+	void OnMessage(std::shared_ptr<tfg::net::connection<GameMsg>> client, tfg::net::message<GameMsg>& msg) override
+	{
+		// Checked against the payloads in common.h first, messages we don't handle or of the wrong size never reach a handler
+		m_statsDispatch.record(Dispatcher::dispatch(*this, msg, client));
+	}
+
+	// Message handlers, picked by Dispatcher
+	using Client = std::shared_ptr<tfg::net::connection<GameMsg>>;
+	using Dispatcher = tfg::net::message_dispatcher<GameMsg, Server, const Client&>;
+	friend Dispatcher;
+
+	void Handle(GameMsgID<GameMsg::Client_RegisterWithServer>, const Client& client, tfg::net::message<GameMsg>& msg)
+	{
+		RegisterPlayer(client, msg);
+	}
+
+	void Handle(GameMsgID<GameMsg::Client_ResumeSession>, const Client& client, tfg::net::message<GameMsg>& msg)
+	{
+		uint32_t nUniqueID = 0;
+		uint64_t nToken = 0;
+		msg >> nUniqueID >> nToken;
+		if (!ResumePlayer(client, nUniqueID, nToken, msg) && !RedirectMoved(client, nUniqueID, nToken) &&
+			!RestorePlayer(client, nUniqueID, nToken, msg))
+		{
+			std::cout << "[" << client->GetID() << "] Session not resumable, registering\n";
+			RegisterPlayer(client, msg);
+		}
+	}
+
+	void Handle(GameMsgID<GameMsg::Client_UnregisterWithServer>, const Client& client)
+	{
+		// Leaving for good, so don't keep the slot
+		auto it = m_mapSessions.find(client->GetID());
+		if (it != m_mapSessions.end() && it->second.client == client)
+		{
+			m_mapSessions.erase(it);
+			RemovePlayer(client->GetID());
+		}
+	}
+
+	// Echoed back by clients once they have applied everything we sent before it. Versions from before a resume or a
+	// hot restart may still arrive, but are never ahead of what the client has
+	void Handle(GameMsgID<GameMsg::Game_RosterVersion>, const Client& client, const uint64_t& nVersion)
+	{
+		auto it = m_mapSessions.find(client->GetID());
+		if (it != m_mapSessions.end() && it->second.client == client)
+			it->second.nSeenVersion = std::max(it->second.nSeenVersion, std::min(nVersion, m_rosterChanges.Version()));
+	}
+
+	// Echoed back by clients, they only keep the connection from timing out
+	void Handle(GameMsgID<GameMsg::Server_Heartbeat>, const Client& client)
+	{
+	}
+
+	void Handle(GameMsgID<GameMsg::Game_UpdatePlayer>, const Client& client, const sPlayerDescription& desc)
+	{
+		// Everything below would pass a NaN or infinite position on to everyone, and to the world and cluster maths
+		if (!std::isfinite(desc.vPos.x) || !std::isfinite(desc.vPos.y) || !std::isfinite(desc.vVel.x) || !std::isfinite(desc.vVel.y))
+			return;
+
+		// Keep our copy of the player's progress, so the leaderboard only moves when an ore count changes
+		auto it = m_mapPlayerRoster.find(client->GetID());
+		if (it == m_mapPlayerRoster.end())
+			return;
+
+		if (it->second.nOreCount != desc.nOreCount)
+			m_bLeaderboardDirty |= m_leaderboard.Update(it->first, desc.nOreCount, LEADERBOARD_SIZE);
+
+		// Only progress is saved, movement alone never reaches the log
+		if (it->second.nOreCount != desc.nOreCount || it->second.fMiningSpeed != desc.fMiningSpeed)
+			SaveProgress(it->first, m_mapSavedProgress[it->first].nToken, desc.nOreCount, desc.fMiningSpeed);
+
+		it->second.nOreCount = desc.nOreCount;
+		it->second.fMiningSpeed = desc.fMiningSpeed;
+		it->second.vPos = desc.vPos;
+		it->second.vVel = desc.vVel;
+		m_rosterSnapshot.Set(it->second);
+		m_rosterChanges.Changed(it->first);
+
+		// Bounce update to everyone except incoming client, as much of it as their links take and only if the player is in
+		// a chunk they may hold, see world.h. Players we don't have, like ones just handed off to another node, aren't bounced
+		auto itSession = m_mapSessions.find(it->first);
+		uint64_t nSequence = itSession != m_mapSessions.end() ? itSession->second.nStateUpdates++ : 0;
+		if (itSession != m_mapSessions.end() && itSession->second.client == client)
+			StreamWorld(client, itSession->second, desc.vPos, false);
+
+		// Our copy, so the ID, color and size are the player's own whatever the client put in its description
+		tfg::net::message<GameMsg> msg;
+		msg.header.id = GameMsg::Game_UpdatePlayer;
+		msg << it->second;
+		sChunkCoord chunk = m_world.ChunkAt(desc.vPos);
+		MessageAllClientsState(msg, it->first, nSequence, client,
+			[&](const Client& receiver)
+			{
+				auto itReceiver = m_mapPlayerRoster.find(receiver->GetID());
+				if (itReceiver == m_mapPlayerRoster.end())
+					return uint32_t(1);
+				if (ChunkDistance(m_world.ChunkAt(itReceiver->second.vPos), chunk) > EVICT_RADIUS)
+					return uint32_t(0);
+
+				float dx = itReceiver->second.vPos.x - desc.vPos.x, dy = itReceiver->second.vPos.y - desc.vPos.y;
+				return dx * dx + dy * dy > FAR_DISTANCE * FAR_DISTANCE ? FAR_STRIDE : uint32_t(1);
+			});
+
+		if (m_cluster.IsClustered())
+			HandOffIfMoved(it->second);
+	}
+
+	void Handle(GameMsgID<GameMsg::Node_Hello>, const Client& client, tfg::net::message<GameMsg>& msg)
+	{
+		uint32_t nNode = 0;
+		uint64_t nKey = 0;
+		msg >> nNode >> nKey;
+		if (!m_cluster.IsClustered() || !m_cluster.KeyMatches(nKey) || nNode >= m_cluster.vNodes.size() || nNode == m_cluster.nSelf)
+		{
+			std::cout << "[" << client->GetID() << "] Rejected as a cluster node\n";
+			client->Disconnect();
+			return;
+		}
+
+		// Nodes are not players, so they don't get what is sent to everyone. They carry the hand-offs of every player
+		// crossing into our strip, which must not be dropped or held back like a flooding client's messages
+		client->SetBroadcastTarget(false);
+		client->ClearRateLimits();
+		client->ClearFlowControl();
+		m_mapPeers[client] = nNode;
+		std::cout << "[CLUSTER] Node " << nNode << " linked to us\n";
+	}
+
+	void Handle(GameMsgID<GameMsg::Node_HandOff>, const Client& client, tfg::net::message<GameMsg>& msg)
+	{
+		auto it = m_mapPeers.find(client);
+		if (it == m_mapPeers.end())
+		{
+			client->Disconnect();
+			return;
+		}
+		AcceptHandOff(client, msg, it->second);
+	}
+
+	// Hot restart, see restart.h. What a successor needs to carry on with our players as if it had been us all along.
+	// Progress goes to disk first, the successor recovers it from there like after any restart
+	void OnSaveRestartState(tfg::net::message<GameMsg>& state) override
+	{
+		m_store.Stop();
+
+		for (auto nRemovedID : m_vGarbageIDs)
+			state << nRemovedID;
+		state << uint32_t(m_vGarbageIDs.size());
+
+		for (const auto& color : m_vAvailableColors)
+			state << color;
+		state << uint32_t(m_vAvailableColors.size());
+
+		for (const auto& player : m_mapPlayerRoster)
+			state << player.second;
+		state << uint32_t(m_mapPlayerRoster.size());
+		state << m_rosterChanges.Version();
+
+		// Connections that weren't handed over have been removed by now, so only handed over clients are still attached.
+		// Suspended sessions keep what is left of their grace period
+		auto tNow = std::chrono::steady_clock::now();
+		for (const auto& entry : m_mapSessions)
+		{
+			const sSession& session = entry.second;
+			for (uint64_t nKey : session.chunks.HeldKeys())
+				state << nKey;
+			state << uint32_t(session.chunks.Held());
+			state << session.nStateUpdates;
+			state << int64_t(session.client ? -1 : std::chrono::duration_cast<std::chrono::milliseconds>(tNow - session.tSuspended).count());
+			state << session.nToken;
+			state << entry.first;
+		}
+		state << uint32_t(m_mapSessions.size());
+
+		state << m_world.Info();
+		state << RESTART_STATE_VERSION;
+	}
+
+	bool OnRestoreRestartState(tfg::net::message<GameMsg>& state) override
+	{
+		uint32_t nVersion = 0;
+		sWorldInfo world;
+		if (!Holds(state, 1, sizeof(nVersion)))
+			return MalformedRestartState();
+		state >> nVersion;
+		if (nVersion != RESTART_STATE_VERSION)
+		{
+			std::cerr << "[RESTART] Players were saved with version " << nVersion << ", we restore version " << RESTART_STATE_VERSION << "\n";
+			return false;
+		}
+
+		// Clients hold chunks of the old world, and would end up with a mix of both
+		if (!Holds(state, 1, sizeof(world)))
+			return MalformedRestartState();
+		state >> world;
+		if (world.nChunksX != m_world.Info().nChunksX || world.nChunksY != m_world.Info().nChunksY || world.nSeed != m_world.Info().nSeed)
+		{
+			std::cerr << "[RESTART] The running server has a " << world.nChunksX << "x" << world.nChunksY << " world with seed " << world.nSeed
+				<< ", start with the same --world and --world-seed\n";
+			return false;
+		}
+
+		std::unordered_map<uint32_t, Client> mapClients;
+		for (const auto& client : m_deqConnections)
+			mapClients[client->GetID()] = client;
+
+		auto tNow = std::chrono::steady_clock::now();
+		uint32_t nSessions = 0;
+		size_t nAttached = 0;
+		if (!Holds(state, 1, sizeof(nSessions)))
+			return MalformedRestartState();
+		state >> nSessions;
+		for (uint32_t i = 0; i < nSessions; i++)
+		{
+			uint32_t nUniqueID = 0, nHeld = 0;
+			int64_t nSuspendedMs = 0;
+			sSession session;
+			if (!Holds(state, 1, sizeof(nUniqueID) + sizeof(session.nToken) + sizeof(nSuspendedMs) + sizeof(session.nStateUpdates) + sizeof(nHeld)))
+				return MalformedRestartState();
+			state >> nUniqueID >> session.nToken >> nSuspendedMs >> session.nStateUpdates >> nHeld;
+
+			std::unordered_set<uint64_t> setHeld;
+			if (!Holds(state, nHeld, sizeof(uint64_t)))
+				return MalformedRestartState();
+			for (uint32_t j = 0; j < nHeld; j++)
+			{
+				uint64_t nKey = 0;
+				state >> nKey;
+				setHeld.insert(nKey);
+			}
+
+			auto itClient = mapClients.find(nUniqueID);
+			if (nSuspendedMs < 0 && itClient != mapClients.end())
+			{
+				session.client = itClient->second;
+				session.chunks.Restore(std::move(setHeld));
+				nAttached++;
+			}
+			else
+			{
+				session.tSuspended = tNow - std::chrono::milliseconds(std::max<int64_t>(nSuspendedMs, 0));
+			}
+			m_mapSessions[nUniqueID] = std::move(session);
+		}
+
+		// Our roster versions carry on from the old server's, so the versions clients echo back still mean the same
+		uint64_t nRosterVersion = 0;
+		uint32_t nPlayers = 0;
+		if (!Holds(state, 1, sizeof(nRosterVersion) + sizeof(nPlayers)))
+			return MalformedRestartState();
+		state >> nRosterVersion;
+		m_rosterChanges.Continue(nRosterVersion);
+
+		state >> nPlayers;
+		if (!Holds(state, nPlayers, sizeof(sPlayerDescription)))
+			return MalformedRestartState();
+		for (uint32_t i = 0; i < nPlayers; i++)
+		{
+			sPlayerDescription desc;
+			state >> desc;
+			m_mapPlayerRoster.insert_or_assign(desc.nUniqueID, desc);
+			m_rosterSnapshot.Set(desc);
+			m_rosterChanges.Changed(desc.nUniqueID);
+			m_leaderboard.Update(desc.nUniqueID, desc.nOreCount, LEADERBOARD_SIZE);
+		}
+		m_bLeaderboardDirty = true;
+
+		uint32_t nColors = 0;
+		if (!Holds(state, 1, sizeof(nColors)))
+			return MalformedRestartState();
+		state >> nColors;
+		if (!Holds(state, nColors, sizeof(m_vAvailableColors[0])))
+			return MalformedRestartState();
+		m_vAvailableColors.resize(nColors);
+		for (auto& color : m_vAvailableColors)
+			state >> color;
+
+		uint32_t nRemoved = 0;
+		if (!Holds(state, 1, sizeof(nRemoved)))
+			return MalformedRestartState();
+		state >> nRemoved;
+		if (!Holds(state, nRemoved, sizeof(m_vGarbageIDs[0])))
+			return MalformedRestartState();
+		m_vGarbageIDs.resize(nRemoved);
+		for (auto& nRemovedID : m_vGarbageIDs)
+			state >> nRemovedID;
+
+		std::cout << "[RESTART] Restored " << m_mapPlayerRoster.size() << " players and " << m_mapSessions.size() << " sessions, "
+			<< nAttached << " of them attached\n";
+		return true;
+	}
+
+	// Whether nCount values of nSize bytes are left to pop, so a corrupt count can't read past the start of the body
+	static bool Holds(const tfg::net::message<GameMsg>& state, uint64_t nCount, size_t nSize)
+	{
+		return nCount <= state.body.size() / nSize;
+	}
+
+	static bool MalformedRestartState()
+	{
+		std::cerr << "[RESTART] Malformed state\n";
+		return false;
+	}
+
+	// The successor never took over, so keep saving progress ourselves
+	void OnRestartAborted() override
+	{
+		m_store.Start();
+	}
+
+	// Runs after every batch of messages and whenever dead connections were reaped, even without traffic
+	void OnMaintenance() override
+	{
+		BroadcastRemovals();
+	}
+
+	// Tell everyone about players removed since the last batch, either reaped, found dead while sending or expired
+	void BroadcastRemovals()
+	{
+		while (!m_vGarbageIDs.empty())
+		{
+			// Broadcasting can find more dead clients, which adds to the list, so take the current ones first
+			std::vector<uint32_t> vRemoved;
+			vRemoved.swap(m_vGarbageIDs);
+			for (auto pid : vRemoved)
+			{
+				tfg::net::message<GameMsg> m;
+				m.header.id = GameMsg::Game_RemovePlayer;
+				m << pid;
+				std::cout << "Removing " << pid << "\n";
+				MessageAllClients(m);
+			}
+		}
+	}
+};
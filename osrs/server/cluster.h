@@ -0,0 +1,127 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "common.h"
+
+/// <summary>
+/// Cluster mode: several server processes, each owning a vertical strip of the world. Nodes are listed in the same
+/// order on every node, and node i owns the i-th of equally wide strips. Every node keeps a link to each of the others,
+/// a plain client connection to the other node's game port that identifies itself with Node_Hello and the cluster key.
+/// When a player moves into another node's strip, its node hands the player off: the new owner gets the player's
+/// state and session token in Node_HandOff, adds the player as a suspended session and acknowledges. Only then is the
+/// client redirected, and it reconnects and resumes its session on the new node exactly like after a dropped connection,
+/// so it keeps its ID and never registers again.
+/// Players only see the players on their own node, and each node keeps its own leaderboard and progress log.
+/// </summary>
+
+// A player has to be this far into another node's strip before it is handed off, so one walking along the border
+// doesn't bounce between nodes
+constexpr float HANDOFF_MARGIN = 8.0f;
+
+// Every node hands out player IDs from a range of its own, so IDs stay unique as players move between nodes
+constexpr uint32_t NODE_ID_BASE = 10000;
+constexpr uint32_t NODE_ID_RANGE = 100000000;
+constexpr size_t MAX_CLUSTER_NODES = (UINT32_MAX - NODE_ID_BASE) / NODE_ID_RANGE;
+
+struct sClusterNode
+{
+	std::string sHost;
+	uint16_t nPort = 0;
+};
+
+struct sClusterConfig
+{
+	std::vector<sClusterNode> vNodes;
+	size_t nSelf = 0;
+
+	// Shared secret peers prove themselves with, so clients can't send Node_* messages. Must not be 0 in a cluster
+	uint64_t nKey = 0;
+
+	// Width of the world the strips divide, set from the world the server runs, see world.h
+	float fWorldWidth = float(CLASSIC_CHUNKS_X * CHUNK_SIZE);
+
+	bool IsClustered() const
+	{
+		return vNodes.size() > 1;
+	}
+
+	// "host:port,host:port,..." into vNodes. Returns false if any entry doesn't parse
+	bool ParseNodes(const std::string& sList)
+	{
+		vNodes.clear();
+		size_t nStart = 0;
+		while (nStart <= sList.size())
+		{
+			size_t nEnd = sList.find(',', nStart);
+			if (nEnd == std::string::npos)
+				nEnd = sList.size();
+
+			std::string sEntry = sList.substr(nStart, nEnd - nStart);
+			size_t nColon = sEntry.rfind(':');
+			if (nColon == std::string::npos || nColon == 0 || nColon + 1 == sEntry.size())
+				return false;
+
+			sClusterNode node;
+			node.sHost = sEntry.substr(0, nColon);
+			node.nPort = uint16_t(std::stoi(sEntry.substr(nColon + 1)));
+			vNodes.push_back(node);
+			nStart = nEnd + 1;
+		}
+		return !vNodes.empty();
+	}
+
+	float StripWidth() const
+	{
+		return fWorldWidth / float(vNodes.size());
+	}
+
+	// The node whose strip contains x
+	size_t OwnerOf(float x) const
+	{
+		// Clamped as a float, see WorldMap::ChunkAt(). NaN fails the first test
+		float fOwner = x / StripWidth();
+		if (!(fOwner >= 0.0f))
+			return 0;
+		return fOwner >= float(vNodes.size() - 1) ? vNodes.size() - 1 : size_t(fOwner);
+	}
+
+	// Whether x is far enough outside our own strip to hand the player off
+	bool ShouldHandOff(float x) const
+	{
+		float fMin = StripWidth() * float(nSelf);
+		float fMax = fMin + StripWidth();
+		return (x < fMin - HANDOFF_MARGIN && nSelf > 0) || (x >= fMax + HANDOFF_MARGIN && nSelf + 1 < vNodes.size());
+	}
+
+	uint32_t FirstID() const
+	{
+		return NODE_ID_BASE + uint32_t(nSelf) * NODE_ID_RANGE;
+	}
+
+	bool OwnsID(uint32_t nUniqueID) const
+	{
+		return nUniqueID >= FirstID() && nUniqueID - FirstID() < NODE_ID_RANGE;
+	}
+
+	// The node whose range the ID was handed out from, or vNodes.size() if it is in nobody's
+	size_t HomeOf(uint32_t nUniqueID) const
+	{
+		if (nUniqueID < NODE_ID_BASE)
+			return vNodes.size();
+		return std::min<size_t>((nUniqueID - NODE_ID_BASE) / NODE_ID_RANGE, vNodes.size());
+	}
+
+	// In constant time, see secret.h, so how long a Node_Hello takes to be turned away says nothing about how close its key was
+	bool KeyMatches(uint64_t nPresented) const
+	{
+		return nKey != 0 && tfg::net::secrets_match(nPresented, nKey);
+	}
+
+	sNodeAddress Address(size_t nNode) const
+	{
+		sNodeAddress address;
+		snprintf(address.sHost, sizeof(address.sHost), "%s", vNodes[nNode].sHost.c_str());
+		address.nPort = vNodes[nNode].nPort;
+		return address;
+	}
+};
@@ -1,5 +1,10 @@
 #pragma once
+#include <array>
 #include <cstdint>
+#include <cstring>
+#include <deque>
+#include <set>
+#include <unordered_map>
 #include "../networking/net.h"
 
 /// <summary>
@@ -127,8 +132,80 @@ enum class GameMsg : uint32_t
 	Game_AddPlayer,
 	Game_RemovePlayer,
 	Game_UpdatePlayer,
+	Game_Leaderboard,
+	Game_RosterSnapshot,
+
+	// Sent to clients we haven't sent anything to for a while. Clients echo it back, which keeps them from timing out
+	Server_Heartbeat,
+
+	// A reconnecting client presenting the token it got with Client_AssignID, answered with the changes it missed
+	Client_ResumeSession,
+	Game_RosterDelta,
+
+	// Cluster mode, see cluster.h. A client whose player moved to another node is told where to resume its session
+	Client_Redirect,
+	Node_Hello,
+	Node_HandOff,
+	Node_HandOffAccepted,
+
+	// Gateways in front of the server, see gateway.h. Frames carry one client's message between gateway and server
+	Gateway_Hello,
+	Gateway_Connected,
+	Gateway_Disconnected,
+	Gateway_Forward,
+	Gateway_Deliver,
+	Gateway_Broadcast,
+	Gateway_Close,
+
+	// The world is streamed to clients in chunks around their player, see world.h. World info starts the stream
+	// over, and chunks are only evicted when the server says so
+	Game_WorldInfo,
+	Game_ChunkData,
+	Game_ChunkEvict,
+
+	// Sent to clients behind everything else we sent them, and echoed back once they have applied all of it. The
+	// echo tells us which roster version the client is at, so a resumed session is sent only what changed after it
+	Game_RosterVersion,
+
+	// Not a message, the number of message types. Stays last
+	Count,
 };
 
+// Outgoing priority lanes, see lanes.h. Player state is sent continuously and can back up behind a slow client,
+// so it gets a lane of its own below everything else. Roster snapshots and deltas stay with control: they must
+// not be overtaken by the Game_RemovePlayer messages that follow them, or removed players would come back. Roster
+// versions go with state, the lane that is sent last, so one never reaches a client ahead of the changes it covers
+template<>
+struct tfg::net::message_lanes<GameMsg>
+{
+	static constexpr size_t CONTROL = 0;
+	static constexpr size_t STATE = 1;
+	static constexpr size_t count = 2;
+
+	static constexpr size_t lane(GameMsg id)
+	{
+		switch (id)
+		{
+		case GameMsg::Game_UpdatePlayer:
+		case GameMsg::Game_Leaderboard:
+		case GameMsg::Game_RosterVersion:
+			return STATE;
+		default:
+			return CONTROL;
+		}
+	}
+
+	static constexpr const char* name(size_t nLane)
+	{
+		return nLane == STATE ? "state" : "control";
+	}
+};
+
+static_assert(tfg::net::message_lanes<GameMsg>::lane(GameMsg::Game_RemovePlayer) == tfg::net::message_lanes<GameMsg>::CONTROL);
+static_assert(tfg::net::message_lanes<GameMsg>::lane(GameMsg::Game_RosterSnapshot) == tfg::net::message_lanes<GameMsg>::CONTROL);
+static_assert(tfg::net::message_lanes<GameMsg>::lane(GameMsg::Game_UpdatePlayer) == tfg::net::message_lanes<GameMsg>::STATE);
+static_assert(tfg::net::message_lanes<GameMsg>::lane(GameMsg::Game_RosterVersion) == tfg::net::message_lanes<GameMsg>::STATE);
+
 struct sPlayerDescription
 {
 	uint32_t nUniqueID = 0;
@@ -140,4 +217,404 @@ struct sPlayerDescription
 
 	sVector2 vPos;
 	sVector2 vVel;
-};
\ No newline at end of file
+};
+
+// The world is a grid of tiles, split into square chunks of CHUNK_TILES by CHUNK_TILES, see world.h
+constexpr int TILE_SIZE = 20;
+constexpr int CHUNK_TILES = 8;
+constexpr int CHUNK_SIZE = TILE_SIZE * CHUNK_TILES;
+constexpr size_t MAX_CHUNK_OBJECTS = 16;
+
+// The original one screen world, 640x480
+constexpr int32_t CLASSIC_CHUNKS_X = 4;
+constexpr int32_t CLASSIC_CHUNKS_Y = 3;
+
+enum class TileType : uint8_t
+{
+	Floor,
+	Wall,
+};
+
+enum class WorldObjectType : uint8_t
+{
+	Rock,
+	Shop,
+};
+
+struct sWorldInfo
+{
+	int32_t nChunksX = CLASSIC_CHUNKS_X;
+	int32_t nChunksY = CLASSIC_CHUNKS_Y;
+	uint32_t nSeed = 0;
+};
+
+struct sChunkCoord
+{
+	int32_t x = 0;
+	int32_t y = 0;
+
+	bool operator==(const sChunkCoord& other) const
+	{
+		return x == other.x && y == other.y;
+	}
+
+	uint64_t Key() const
+	{
+		return uint64_t(uint32_t(x)) << 32 | uint32_t(y);
+	}
+
+	static sChunkCoord FromKey(uint64_t nKey)
+	{
+		return { int32_t(uint32_t(nKey >> 32)), int32_t(uint32_t(nKey)) };
+	}
+};
+
+// Something players collide with, in world pixels. It belongs to the chunk its top left corner is in
+struct sWorldObject
+{
+	WorldObjectType nType = WorldObjectType::Rock;
+	int32_t x = 0;
+	int32_t y = 0;
+	int32_t w = 0;
+	int32_t h = 0;
+};
+
+using ChunkTiles = std::array<TileType, CHUNK_TILES * CHUNK_TILES>;
+
+// Where a client should reconnect to, sent with Client_Redirect
+struct sNodeAddress
+{
+	char sHost[64] = {};
+	uint16_t nPort = 0;
+};
+
+// Message bodies, see dispatch.h. Bodies of several values list them in the order they are pushed. Values
+// added to a message later are optional, since older peers leave them out
+template<>
+constexpr size_t tfg::net::message_type_count<GameMsg> = size_t(GameMsg::Count);
+
+// Selects a handler overload, see dispatch.h
+template<GameMsg ID>
+using GameMsgID = tfg::net::message_id<GameMsg, ID>;
+
+constexpr size_t PLAYER_BODY_SIZE = sizeof(sPlayerDescription);
+
+template<> struct tfg::net::message_payload<GameMsg, GameMsg::Server_Heartbeat> : tfg::net::empty_payload {};
+
+// Capabilities
+template<> struct tfg::net::message_payload<GameMsg, GameMsg::Client_Accepted> : tfg::net::variable_payload<0, sizeof(uint32_t)> {};
+
+// Session token, ID
+template<> struct tfg::net::message_payload<GameMsg, GameMsg::Client_AssignID> : tfg::net::variable_payload<sizeof(uint32_t), sizeof(uint64_t) + sizeof(uint32_t)> {};
+
+// Capabilities, player. A registration without capabilities is turned away as the wrong size
+template<> struct tfg::net::message_payload<GameMsg, GameMsg::Client_RegisterWithServer> : tfg::net::variable_payload<sizeof(uint32_t) + PLAYER_BODY_SIZE, sizeof(uint32_t) + PLAYER_BODY_SIZE> {};
+
+// Capabilities, player, session token, ID
+template<> struct tfg::net::message_payload<GameMsg, GameMsg::Client_ResumeSession> : tfg::net::variable_payload<sizeof(uint32_t) + PLAYER_BODY_SIZE + sizeof(uint64_t) + sizeof(uint32_t), sizeof(uint32_t) + PLAYER_BODY_SIZE + sizeof(uint64_t) + sizeof(uint32_t)> {};
+template<> struct tfg::net::message_payload<GameMsg, GameMsg::Client_UnregisterWithServer> : tfg::net::empty_payload {};
+template<> struct tfg::net::message_payload<GameMsg, GameMsg::Client_Redirect> : tfg::net::fixed_payload<sNodeAddress> {};
+
+template<> struct tfg::net::message_payload<GameMsg, GameMsg::Game_AddPlayer> : tfg::net::fixed_payload<sPlayerDescription> {};
+template<> struct tfg::net::message_payload<GameMsg, GameMsg::Game_UpdatePlayer> : tfg::net::fixed_payload<sPlayerDescription> {};
+template<> struct tfg::net::message_payload<GameMsg, GameMsg::Game_RemovePlayer> : tfg::net::fixed_payload<uint32_t> {};
+
+// Entries or players, then their count
+template<> struct tfg::net::message_payload<GameMsg, GameMsg::Game_Leaderboard> : tfg::net::variable_payload<sizeof(uint32_t)> {};
+template<> struct tfg::net::message_payload<GameMsg, GameMsg::Game_RosterSnapshot> : tfg::net::variable_payload<sizeof(uint32_t)> {};
+
+// Removed IDs and their count, changed players and their count, reset flag
+template<> struct tfg::net::message_payload<GameMsg, GameMsg::Game_RosterDelta> : tfg::net::variable_payload<sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint8_t)> {};
+
+template<> struct tfg::net::message_payload<GameMsg, GameMsg::Game_WorldInfo> : tfg::net::fixed_payload<sWorldInfo> {};
+
+// Tiles, objects, their count, chunk
+template<> struct tfg::net::message_payload<GameMsg, GameMsg::Game_ChunkData> : tfg::net::variable_payload<sizeof(ChunkTiles) + sizeof(uint32_t) + sizeof(sChunkCoord),
+	sizeof(ChunkTiles) + MAX_CHUNK_OBJECTS * sizeof(sWorldObject) + sizeof(uint32_t) + sizeof(sChunkCoord)> {};
+template<> struct tfg::net::message_payload<GameMsg, GameMsg::Game_ChunkEvict> : tfg::net::fixed_payload<sChunkCoord> {};
+template<> struct tfg::net::message_payload<GameMsg, GameMsg::Game_RosterVersion> : tfg::net::fixed_payload<uint64_t> {};
+
+// Cluster key, node
+template<> struct tfg::net::message_payload<GameMsg, GameMsg::Node_Hello> : tfg::net::variable_payload<sizeof(uint64_t) + sizeof(uint32_t), sizeof(uint64_t) + sizeof(uint32_t)> {};
+
+// Player, session token
+template<> struct tfg::net::message_payload<GameMsg, GameMsg::Node_HandOff> : tfg::net::variable_payload<PLAYER_BODY_SIZE + sizeof(uint64_t), PLAYER_BODY_SIZE + sizeof(uint64_t)> {};
+template<> struct tfg::net::message_payload<GameMsg, GameMsg::Node_HandOffAccepted> : tfg::net::fixed_payload<uint32_t> {};
+
+// The frames of the gateway protocol, with the key gateways have to present
+inline tfg::net::gateway_protocol<GameMsg> GatewayProtocol(uint64_t nKey)
+{
+	tfg::net::gateway_protocol<GameMsg> protocol;
+	protocol.hello = GameMsg::Gateway_Hello;
+	protocol.connected = GameMsg::Gateway_Connected;
+	protocol.disconnected = GameMsg::Gateway_Disconnected;
+	protocol.forward = GameMsg::Gateway_Forward;
+	protocol.deliver = GameMsg::Gateway_Deliver;
+	protocol.broadcast = GameMsg::Gateway_Broadcast;
+	protocol.close = GameMsg::Gateway_Close;
+	protocol.nKey = nKey;
+	return protocol;
+}
+
+// How game clients are supervised and limited, by the server or by the gateway they connect to.
+// Clients send an update every frame, so a few seconds of silence means the connection is gone
+inline void ConfigureClientTimeouts(tfg::net::server_interface<GameMsg>& server)
+{
+	server.SetHeartbeat(GameMsg::Server_Heartbeat, std::chrono::seconds(2));
+	server.SetTimeouts(std::chrono::seconds(5), std::chrono::seconds(10));
+}
+
+// Clients only ever send small messages: an update per frame, a registration, and heartbeat echoes
+inline tfg::net::rate_limits<GameMsg> ClientRateLimits()
+{
+	tfg::net::rate_limits<GameMsg> limits;
+	limits.nMaxMessageSize = 4096;
+	limits.defaults = { 20.0, 20.0, 16384.0, 16384.0, tfg::net::rate_policy::drop };
+
+	// Updates are state, not events, so a client sending too many is simply slowed down
+	limits.mapPerType[GameMsg::Game_UpdatePlayer] = { 240.0, 60.0, 32768.0, 8192.0, tfg::net::rate_policy::throttle };
+
+	// Registering over and over is never legitimate
+	limits.mapPerType[GameMsg::Client_RegisterWithServer] = { 1.0, 3.0, 0.0, 0.0, tfg::net::rate_policy::disconnect };
+	limits.mapPerType[GameMsg::Client_ResumeSession] = { 1.0, 3.0, 0.0, 0.0, tfg::net::rate_policy::disconnect };
+	return limits;
+}
+
+// One row of the scoreboard, as pushed by the server in Game_Leaderboard messages
+struct sLeaderboardEntry
+{
+	uint32_t nUniqueID = 0;
+	uint32_t nOreCount = 0;
+	Color nColor;
+};
+
+/// Ranking of players by ore count (highest first, ties broken by lowest ID), maintained incrementally.
+/// Updates cost O(log N) and only happen when a player's ore count actually changes, so the top K
+/// can be read in O(K) at any time instead of sorting every player.
+class Leaderboard
+{
+public:
+	// Insert or move a player. Returns true if the change is visible in the top nWatched entries
+	bool Update(uint32_t nUniqueID, uint32_t nOreCount, size_t nWatched)
+	{
+		bool bWasTop = false;
+		auto it = m_mapOreCounts.find(nUniqueID);
+		if (it != m_mapOreCounts.end())
+		{
+			if (it->second == nOreCount)
+				return false;
+
+			bWasTop = IsTop({ it->second, nUniqueID }, nWatched);
+			m_setRanking.erase({ it->second, nUniqueID });
+			it->second = nOreCount;
+		}
+		else
+		{
+			m_mapOreCounts.emplace(nUniqueID, nOreCount);
+		}
+
+		m_setRanking.insert({ nOreCount, nUniqueID });
+		return bWasTop || IsTop({ nOreCount, nUniqueID }, nWatched);
+	}
+
+	// Returns true if the removed player was in the top nWatched entries
+	bool Remove(uint32_t nUniqueID, size_t nWatched)
+	{
+		auto it = m_mapOreCounts.find(nUniqueID);
+		if (it == m_mapOreCounts.end())
+			return false;
+
+		bool bWasTop = IsTop({ it->second, nUniqueID }, nWatched);
+		m_setRanking.erase({ it->second, nUniqueID });
+		m_mapOreCounts.erase(it);
+		return bWasTop;
+	}
+
+	// The first k players as (ID, ore count) pairs
+	std::vector<std::pair<uint32_t, uint32_t>> Top(size_t k) const
+	{
+		std::vector<std::pair<uint32_t, uint32_t>> vTop;
+		for (auto it = m_setRanking.begin(); it != m_setRanking.end() && vTop.size() < k; ++it)
+			vTop.emplace_back(it->nUniqueID, it->nOreCount);
+		return vTop;
+	}
+
+	size_t Size() const
+	{
+		return m_mapOreCounts.size();
+	}
+
+private:
+	struct sRank
+	{
+		uint32_t nOreCount;
+		uint32_t nUniqueID;
+
+		bool operator<(const sRank& other) const
+		{
+			if (nOreCount == other.nOreCount)
+				return nUniqueID < other.nUniqueID;
+			return nOreCount > other.nOreCount;
+		}
+	};
+
+	bool IsTop(const sRank& rank, size_t k) const
+	{
+		size_t i = 0;
+		for (auto it = m_setRanking.begin(); it != m_setRanking.end() && i < k; ++it, ++i)
+			if (!(*it < rank) && !(rank < *it))
+				return true;
+		return false;
+	}
+
+private:
+	std::set<sRank> m_setRanking;
+	std::unordered_map<uint32_t, uint32_t> m_mapOreCounts;
+};
+
+/// Every player in the room, kept serialized in a ready-to-send Game_RosterSnapshot message.
+/// The body is an array of sPlayerDescription followed by the number of players, so the client pops the
+/// count first and then the players. Changes patch their slot in place and removals move the last slot into
+/// the hole, so keeping the snapshot current costs a copy of one description, and a join costs one send.
+class RosterSnapshot
+{
+public:
+	RosterSnapshot()
+	{
+		m_msg.header.id = GameMsg::Game_RosterSnapshot;
+		WriteCount();
+	}
+
+	// Insert a player or overwrite their slot
+	void Set(const sPlayerDescription& desc)
+	{
+		auto it = m_mapSlots.find(desc.nUniqueID);
+		if (it != m_mapSlots.end())
+		{
+			std::memcpy(m_msg.body.data() + it->second * sizeof(sPlayerDescription), &desc, sizeof(sPlayerDescription));
+			return;
+		}
+
+		size_t nSlot = m_vSlotIDs.size();
+		m_mapSlots.emplace(desc.nUniqueID, nSlot);
+		m_vSlotIDs.push_back(desc.nUniqueID);
+		m_msg.body.resize(m_vSlotIDs.size() * sizeof(sPlayerDescription) + sizeof(uint32_t));
+		std::memcpy(m_msg.body.data() + nSlot * sizeof(sPlayerDescription), &desc, sizeof(sPlayerDescription));
+		WriteCount();
+	}
+
+	void Remove(uint32_t nUniqueID)
+	{
+		auto it = m_mapSlots.find(nUniqueID);
+		if (it == m_mapSlots.end())
+			return;
+
+		size_t nSlot = it->second, nLast = m_vSlotIDs.size() - 1;
+		m_mapSlots.erase(it);
+		if (nSlot != nLast)
+		{
+			std::memcpy(m_msg.body.data() + nSlot * sizeof(sPlayerDescription), m_msg.body.data() + nLast * sizeof(sPlayerDescription), sizeof(sPlayerDescription));
+			m_vSlotIDs[nSlot] = m_vSlotIDs[nLast];
+			m_mapSlots[m_vSlotIDs[nSlot]] = nSlot;
+		}
+		m_vSlotIDs.pop_back();
+		m_msg.body.resize(m_vSlotIDs.size() * sizeof(sPlayerDescription) + sizeof(uint32_t));
+		WriteCount();
+	}
+
+	const tfg::net::message<GameMsg>& Message() const
+	{
+		return m_msg;
+	}
+
+	size_t Size() const
+	{
+		return m_vSlotIDs.size();
+	}
+
+private:
+	void WriteCount()
+	{
+		uint32_t nCount = uint32_t(m_vSlotIDs.size());
+		m_msg.body.resize(nCount * sizeof(sPlayerDescription) + sizeof(uint32_t));
+		std::memcpy(m_msg.body.data() + nCount * sizeof(sPlayerDescription), &nCount, sizeof(nCount));
+		m_msg.header.size = uint32_t(m_msg.size());
+	}
+
+private:
+	tfg::net::message<GameMsg> m_msg;
+	std::unordered_map<uint32_t, size_t> m_mapSlots;
+	std::vector<uint32_t> m_vSlotIDs;
+};
+
+/// Versioned history of the roster, so a client that missed some messages can be sent only what changed.
+/// Every change takes the next version: players remember the version of their last change and removals are
+/// kept in order, until Forget() is told that nobody can be behind a version anymore.
+class RosterChangeLog
+{
+public:
+	uint64_t Version() const
+	{
+		return m_nVersion;
+	}
+
+	void Changed(uint32_t nUniqueID)
+	{
+		m_mapChangedAt[nUniqueID] = ++m_nVersion;
+	}
+
+	void Removed(uint32_t nUniqueID)
+	{
+		m_mapChangedAt.erase(nUniqueID);
+		m_deqRemovals.push_back({ ++m_nVersion, nUniqueID });
+	}
+
+	// Whether the changes after nVersion are all still known
+	bool Covers(uint64_t nVersion) const
+	{
+		return nVersion >= m_nForgotten;
+	}
+
+	// Carry on numbering from nVersion, the version of another server's log we took over from. Nothing before it is known
+	void Continue(uint64_t nVersion)
+	{
+		m_nVersion = std::max(m_nVersion, nVersion);
+		m_nForgotten = std::max(m_nForgotten, nVersion);
+	}
+
+	// Drop removals up to nVersion, nobody will ask for them anymore
+	void Forget(uint64_t nVersion)
+	{
+		while (!m_deqRemovals.empty() && m_deqRemovals.front().first <= nVersion)
+			m_deqRemovals.pop_front();
+		m_nForgotten = std::max(m_nForgotten, nVersion);
+	}
+
+	// Players changed after nVersion, as IDs
+	std::vector<uint32_t> ChangedSince(uint64_t nVersion) const
+	{
+		std::vector<uint32_t> vChanged;
+		for (const auto& changed : m_mapChangedAt)
+			if (changed.second > nVersion)
+				vChanged.push_back(changed.first);
+		return vChanged;
+	}
+
+	// Players removed after nVersion
+	std::vector<uint32_t> RemovedSince(uint64_t nVersion) const
+	{
+		auto it = std::upper_bound(m_deqRemovals.begin(), m_deqRemovals.end(), nVersion,
+			[](uint64_t v, const std::pair<uint64_t, uint32_t>& removal) { return v < removal.first; });
+
+		std::vector<uint32_t> vRemoved;
+		for (; it != m_deqRemovals.end(); ++it)
+			vRemoved.push_back(it->second);
+		return vRemoved;
+	}
+
+private:
+	uint64_t m_nVersion = 0;
+	uint64_t m_nForgotten = 0;
+	std::unordered_map<uint32_t, uint64_t> m_mapChangedAt;
+	std::deque<std::pair<uint64_t, uint32_t>> m_deqRemovals;
+};
@@ -0,0 +1,306 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include "common.h"
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/// <summary>
+/// Persists player progress (ore count and mining speed) so a server restart doesn't wipe it. Each record also keeps
+/// the player's session token, so a client that comes back with its ID and token after a restart can be given its progress.
+/// Changes are queued by the game thread and written by a background thread to an append-only log, so
+/// saving never blocks the message loop. Changes queued between two writes are coalesced per player.
+/// Every so often the writer compacts everything it knows into a snapshot, written to a temporary file and
+/// renamed over the old one, and starts a fresh log. The temporary file is synced before the rename and the
+/// directory after it, and the log is only reset once both are on disk, so a power loss never leaves an empty
+/// snapshot without its log. On startup the snapshot is loaded and the log replayed on top of it. Replaying is
+/// idempotent, so a crash between the rename and the log reset is harmless.
+/// Every record carries a checksum, so a torn write at the end of the log is detected and ignored.
+/// </summary>
+
+struct sProgressRecord
+{
+	uint64_t nToken = 0;
+	uint32_t nUniqueID = 0;
+	uint32_t nOreCount = 0;
+	float fMiningSpeed = 1.0f;
+	uint32_t nChecksum = 0;
+};
+
+class ProgressStore
+{
+public:
+	ProgressStore(const std::string& sDirectory, std::chrono::seconds snapshotInterval = std::chrono::seconds(30))
+		: m_pathSnapshot(std::filesystem::path(sDirectory) / "progress.snap"), m_pathLog(std::filesystem::path(sDirectory) / "progress.wal"),
+		m_snapshotInterval(snapshotInterval)
+	{
+		std::error_code ec;
+		std::filesystem::create_directories(sDirectory, ec);
+	}
+
+	virtual ~ProgressStore()
+	{
+		Stop();
+	}
+
+public:
+	// Load the last snapshot and replay the log on top of it. Must be called before Start()
+	std::unordered_map<uint32_t, sProgressRecord> Recover()
+	{
+		auto tStart = std::chrono::steady_clock::now();
+		size_t nSnapshotRecords = 0, nLogRecords = 0, nCorrupt = 0;
+
+		m_mapProgress.clear();
+
+		std::ifstream snapshot(m_pathSnapshot, std::ios::binary);
+		uint32_t nMagic = 0, nCount = 0;
+		if (snapshot.read(reinterpret_cast<char*>(&nMagic), sizeof(nMagic)) && nMagic == SNAPSHOT_MAGIC &&
+			snapshot.read(reinterpret_cast<char*>(&nCount), sizeof(nCount)))
+		{
+			sProgressRecord record;
+			while (nSnapshotRecords < nCount && snapshot.read(reinterpret_cast<char*>(&record), sizeof(record)))
+			{
+				if (record.nChecksum == Checksum(record))
+					m_mapProgress[record.nUniqueID] = record;
+				else
+					nCorrupt++;
+				nSnapshotRecords++;
+			}
+		}
+
+		std::ifstream log(m_pathLog, std::ios::binary);
+		sProgressRecord record;
+		while (log.read(reinterpret_cast<char*>(&record), sizeof(record)))
+		{
+			// Anything after a bad record was never completely written, so stop there
+			if (record.nChecksum != Checksum(record))
+			{
+				nCorrupt++;
+				break;
+			}
+			m_mapProgress[record.nUniqueID] = record;
+			nLogRecords++;
+		}
+
+		double fMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - tStart).count();
+		std::cout << "[PERSIST] Recovered " << m_mapProgress.size() << " players from " << nSnapshotRecords << " snapshot and "
+			<< nLogRecords << " log records in " << fMs << " ms";
+		if (nCorrupt > 0)
+			std::cout << " (" << nCorrupt << " corrupt records skipped)";
+		std::cout << "\n";
+
+		return m_mapProgress;
+	}
+
+	// Start the background writer
+	void Start()
+	{
+		// Compact straight away so the log only ever holds changes made by this process
+		WriteSnapshot();
+
+		m_bRunning = true;
+		m_threadWriter = std::thread([this]() { WriterThread(); });
+	}
+
+	// Write out everything still queued, take a final snapshot and stop the writer
+	void Stop()
+	{
+		if (!m_bRunning)
+			return;
+
+		m_bRunning = false;
+		if (m_threadWriter.joinable())
+			m_threadWriter.join();
+	}
+
+	// Queue a change. Only takes the queue lock, never touches the disk on the calling thread
+	void Record(uint32_t nUniqueID, uint64_t nToken, uint32_t nOreCount, float fMiningSpeed)
+	{
+		sProgressRecord record;
+		record.nToken = nToken;
+		record.nUniqueID = nUniqueID;
+		record.nOreCount = nOreCount;
+		record.fMiningSpeed = fMiningSpeed;
+		m_qPending.push_back(record);
+	}
+
+private:
+	void WriterThread()
+	{
+		auto tLastSnapshot = std::chrono::steady_clock::now();
+		std::unordered_map<uint32_t, sProgressRecord> mapBatch;
+
+		while (true)
+		{
+			bool bRunning = m_bRunning;
+
+			// Let changes pile up for a moment, so a player mining every frame costs one record per batch
+			if (m_qPending.wait_for(BATCH_INTERVAL))
+				std::this_thread::sleep_for(BATCH_INTERVAL);
+
+			while (!m_qPending.empty())
+			{
+				sProgressRecord record = m_qPending.pop_front();
+				mapBatch[record.nUniqueID] = record;
+				m_nLogicalBytes += sizeof(sProgressRecord);
+			}
+
+			if (!mapBatch.empty())
+			{
+				AppendToLog(mapBatch);
+				mapBatch.clear();
+			}
+
+			if (!bRunning || std::chrono::steady_clock::now() - tLastSnapshot >= m_snapshotInterval)
+			{
+				WriteSnapshot();
+				tLastSnapshot = std::chrono::steady_clock::now();
+			}
+
+			if (!bRunning)
+				break;
+		}
+	}
+
+	void AppendToLog(const std::unordered_map<uint32_t, sProgressRecord>& mapBatch)
+	{
+		std::vector<sProgressRecord> vRecords;
+		vRecords.reserve(mapBatch.size());
+		for (const auto& entry : mapBatch)
+		{
+			sProgressRecord record = entry.second;
+			record.nChecksum = Checksum(record);
+			m_mapProgress[record.nUniqueID] = record;
+			vRecords.push_back(record);
+		}
+
+		std::ofstream log(m_pathLog, std::ios::binary | std::ios::app);
+		log.write(reinterpret_cast<const char*>(vRecords.data()), vRecords.size() * sizeof(sProgressRecord));
+		log.flush();
+		if (!log)
+			std::cerr << "[PERSIST] Failed to append to " << m_pathLog << "\n";
+
+		m_nPhysicalBytes += vRecords.size() * sizeof(sProgressRecord);
+	}
+
+	void WriteSnapshot()
+	{
+		auto tStart = std::chrono::steady_clock::now();
+		std::filesystem::path pathTemp = m_pathSnapshot;
+		pathTemp += ".tmp";
+
+		{
+			std::ofstream snapshot(pathTemp, std::ios::binary | std::ios::trunc);
+			uint32_t nCount = uint32_t(m_mapProgress.size());
+			snapshot.write(reinterpret_cast<const char*>(&SNAPSHOT_MAGIC), sizeof(SNAPSHOT_MAGIC));
+			snapshot.write(reinterpret_cast<const char*>(&nCount), sizeof(nCount));
+			for (auto& entry : m_mapProgress)
+			{
+				entry.second.nChecksum = Checksum(entry.second);
+				snapshot.write(reinterpret_cast<const char*>(&entry.second), sizeof(sProgressRecord));
+			}
+			snapshot.flush();
+			if (!snapshot)
+			{
+				std::cerr << "[PERSIST] Failed to write snapshot " << pathTemp << "\n";
+				return;
+			}
+			m_nPhysicalBytes += sizeof(SNAPSHOT_MAGIC) + sizeof(nCount) + nCount * sizeof(sProgressRecord);
+		}
+
+		// The contents must be on disk before the rename makes them the snapshot
+		if (!SyncToDisk(pathTemp, false))
+		{
+			std::cerr << "[PERSIST] Failed to sync snapshot " << pathTemp << "\n";
+			return;
+		}
+
+		// The rename is atomic, so a crash leaves either the old or the new snapshot in place
+		std::error_code ec;
+		std::filesystem::rename(pathTemp, m_pathSnapshot, ec);
+		if (ec)
+		{
+			std::cerr << "[PERSIST] Failed to replace snapshot: " << ec.message() << "\n";
+			return;
+		}
+
+		// And the rename itself before the log it replaces is gone
+		if (!SyncToDisk(m_pathSnapshot.parent_path(), true))
+		{
+			std::cerr << "[PERSIST] Failed to sync " << m_pathSnapshot.parent_path() << ", keeping the log\n";
+			return;
+		}
+
+		// Everything in the log is now part of the snapshot
+		std::ofstream log(m_pathLog, std::ios::binary | std::ios::trunc);
+
+		double fMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - tStart).count();
+		std::cout << "[PERSIST] Snapshot of " << m_mapProgress.size() << " players in " << fMs << " ms, write amplification "
+			<< (m_nLogicalBytes > 0 ? double(m_nPhysicalBytes) / m_nLogicalBytes : 0.0)
+			<< " (" << m_nPhysicalBytes << " bytes written for " << m_nLogicalBytes << " bytes of changes)\n";
+	}
+
+	// Flush a file or directory from the OS's caches to the disk. Windows can't open directories to flush them, and
+	// doesn't need to for a rename
+	static bool SyncToDisk(const std::filesystem::path& path, bool bDirectory)
+	{
+#ifdef _WIN32
+		if (bDirectory)
+			return true;
+		int fd = _wopen(path.c_str(), _O_WRONLY | _O_BINARY);
+		if (fd < 0)
+			return false;
+		bool bSynced = _commit(fd) == 0;
+		_close(fd);
+		return bSynced;
+#else
+		int fd = ::open(path.empty() ? "." : path.c_str(), bDirectory ? O_RDONLY | O_DIRECTORY : O_RDONLY);
+		if (fd < 0)
+			return false;
+		bool bSynced = ::fsync(fd) == 0;
+		::close(fd);
+		return bSynced;
+#endif
+	}
+
+	// FNV-1a over the payload of a record
+	static uint32_t Checksum(const sProgressRecord& record)
+	{
+		const uint8_t* pData = reinterpret_cast<const uint8_t*>(&record);
+		uint32_t nHash = 2166136261u;
+		for (size_t i = 0; i < offsetof(sProgressRecord, nChecksum); i++)
+			nHash = (nHash ^ pData[i]) * 16777619u;
+		return nHash;
+	}
+
+private:
+	static constexpr uint32_t SNAPSHOT_MAGIC = 0x50525332; // "PRS2"
+	static constexpr std::chrono::milliseconds BATCH_INTERVAL{ 100 };
+
+	std::filesystem::path m_pathSnapshot;
+	std::filesystem::path m_pathLog;
+	std::chrono::seconds m_snapshotInterval;
+
+	// Changes handed over by the game thread
+	tfg::net::tsqueue<sProgressRecord> m_qPending;
+
+	// Owned by the writer thread once it has started
+	std::unordered_map<uint32_t, sProgressRecord> m_mapProgress;
+	uint64_t m_nLogicalBytes = 0;
+	uint64_t m_nPhysicalBytes = 0;
+
+	std::thread m_threadWriter;
+	std::atomic<bool> m_bRunning = false;
+};
@@ -0,0 +1,238 @@
+#pragma once
+#include <cmath>
+#include <unordered_set>
+#include <vector>
+#include "common.h"
+
+/// <summary>
+/// The world is a grid of tiles split into chunks of CHUNK_TILES by CHUNK_TILES, nChunksX by nChunksY of them.
+/// The server generates chunks from the world's size and seed whenever it needs one, and streams them to each
+/// client as its player comes within STREAM_RADIUS chunks. A client keeps what it was sent until told to evict
+/// it, which the server does once the player is more than EVICT_RADIUS chunks away, so what a client holds
+/// and what it costs to send depends on how far it sees and not on how big the world is.
+/// The classic world is the original single screen: a wall around the edge, a shop and a rock. Bigger worlds
+/// keep it in their top left corner, and scatter rocks and the odd shop over the chunks beyond.
+/// </summary>
+
+// Chebyshev distances in chunks. Evicting further out than streaming keeps a player walking along a chunk
+// border from having the same chunks evicted and sent again
+constexpr int32_t STREAM_RADIUS = 3;
+constexpr int32_t EVICT_RADIUS = 4;
+
+// Largest world in chunks either way, 655360 pixels
+constexpr int32_t MAX_WORLD_CHUNKS = 4096;
+
+// Where the objects of the classic world are
+constexpr sWorldObject CLASSIC_SHOP = { WorldObjectType::Shop, 70, 30, 100, 20 };
+constexpr sWorldObject CLASSIC_ROCK = { WorldObjectType::Rock, 310, 230, 20, 20 };
+
+inline int32_t ChunkDistance(const sChunkCoord& a, const sChunkCoord& b)
+{
+	return std::max(std::abs(a.x - b.x), std::abs(a.y - b.y));
+}
+
+struct sChunk
+{
+	sChunkCoord coord;
+	ChunkTiles tiles{};
+	std::vector<sWorldObject> objects;
+
+	// Tile at tx, ty within the chunk
+	TileType Tile(int tx, int ty) const
+	{
+		return tiles[size_t(ty) * CHUNK_TILES + size_t(tx)];
+	}
+};
+
+inline tfg::net::message<GameMsg> ChunkMessage(const sChunk& chunk)
+{
+	tfg::net::message<GameMsg> msg;
+	msg.header.id = GameMsg::Game_ChunkData;
+	msg << chunk.tiles;
+	for (auto it = chunk.objects.rbegin(); it != chunk.objects.rend(); ++it)
+		msg << *it;
+	msg << uint32_t(chunk.objects.size());
+	msg << chunk.coord;
+	return msg;
+}
+
+// The reverse of ChunkMessage(). Returns false if the object count doesn't match the body
+inline bool ReadChunk(tfg::net::message<GameMsg>& msg, sChunk& chunk)
+{
+	uint32_t nObjects = 0;
+	msg >> chunk.coord >> nObjects;
+	if (nObjects > MAX_CHUNK_OBJECTS || msg.body.size() != sizeof(ChunkTiles) + nObjects * sizeof(sWorldObject))
+		return false;
+
+	chunk.objects.resize(nObjects);
+	for (auto& object : chunk.objects)
+		msg >> object;
+	msg >> chunk.tiles;
+	return true;
+}
+
+class WorldMap
+{
+public:
+	explicit WorldMap(const sWorldInfo& info = {}) : m_info(info)
+	{
+	}
+
+	const sWorldInfo& Info() const
+	{
+		return m_info;
+	}
+
+	float Width() const
+	{
+		return float(m_info.nChunksX * CHUNK_SIZE);
+	}
+
+	float Height() const
+	{
+		return float(m_info.nChunksY * CHUNK_SIZE);
+	}
+
+	bool Contains(const sChunkCoord& coord) const
+	{
+		return coord.x >= 0 && coord.y >= 0 && coord.x < m_info.nChunksX && coord.y < m_info.nChunksY;
+	}
+
+	// The chunk vPos is in, or the nearest one if it is outside the world. Positions come from clients, so they are
+	// clamped while still floats, as converting a NaN or a float past the range of an int is undefined
+	sChunkCoord ChunkAt(const sVector2& vPos) const
+	{
+		return { ClampToChunk(vPos.x, m_info.nChunksX), ClampToChunk(vPos.y, m_info.nChunksY) };
+	}
+
+	sChunk Generate(const sChunkCoord& coord) const
+	{
+		sChunk chunk;
+		chunk.coord = coord;
+
+		// A wall around the edge of the world
+		int32_t nTilesX = m_info.nChunksX * CHUNK_TILES, nTilesY = m_info.nChunksY * CHUNK_TILES;
+		for (int ty = 0; ty < CHUNK_TILES; ty++)
+		{
+			for (int tx = 0; tx < CHUNK_TILES; tx++)
+			{
+				int32_t gx = coord.x * CHUNK_TILES + tx, gy = coord.y * CHUNK_TILES + ty;
+				bool bEdge = gx == 0 || gy == 0 || gx == nTilesX - 1 || gy == nTilesY - 1;
+				chunk.tiles[size_t(ty) * CHUNK_TILES + size_t(tx)] = bEdge ? TileType::Wall : TileType::Floor;
+			}
+		}
+
+		if (coord.x < CLASSIC_CHUNKS_X && coord.y < CLASSIC_CHUNKS_Y)
+		{
+			for (const sWorldObject& object : { CLASSIC_SHOP, CLASSIC_ROCK })
+			{
+				if (object.x / CHUNK_SIZE == coord.x && object.y / CHUNK_SIZE == coord.y)
+					chunk.objects.push_back(object);
+			}
+			return chunk;
+		}
+
+		// Objects stay off the outer ring of tiles, so they never overlap the wall or another chunk's objects.
+		// A shop takes the second row, and a rock somewhere below it
+		uint64_t nHash = Hash(coord);
+		int32_t x0 = coord.x * CHUNK_SIZE, y0 = coord.y * CHUNK_SIZE;
+		if (nHash % 16 == 0)
+			chunk.objects.push_back({ WorldObjectType::Shop, x0 + TILE_SIZE * int32_t(1 + (nHash >> 8) % 2), y0 + TILE_SIZE, 100, 20 });
+		if ((nHash >> 16) % 2 == 0)
+			chunk.objects.push_back({ WorldObjectType::Rock, x0 + TILE_SIZE * int32_t(1 + (nHash >> 24) % 6), y0 + TILE_SIZE * int32_t(3 + (nHash >> 32) % 4), TILE_SIZE, TILE_SIZE });
+		return chunk;
+	}
+
+private:
+	// NaN and everything below the first chunk fail the first test
+	static int32_t ClampToChunk(float fPos, int32_t nChunks)
+	{
+		float fChunk = std::floor(fPos / CHUNK_SIZE);
+		if (!(fChunk >= 0.0f))
+			return 0;
+		return fChunk >= float(nChunks - 1) ? nChunks - 1 : int32_t(fChunk);
+	}
+
+	// splitmix64 of the seed and coordinates
+	uint64_t Hash(const sChunkCoord& coord) const
+	{
+		uint64_t z = (uint64_t(m_info.nSeed) << 32 ^ coord.Key()) + 0x9E3779B97F4A7C15ull;
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		return z ^ (z >> 31);
+	}
+
+	sWorldInfo m_info;
+};
+
+// The chunks one client holds, and what to send and evict as its player moves
+class ChunkInterest
+{
+public:
+	// The client starts over with nothing
+	void Reset()
+	{
+		m_setHeld.clear();
+		m_bCentered = false;
+	}
+
+	// Chunks to send, nearest first, and to evict now that the player is at vPos. Returns false if nothing
+	// changed, which is always the case while the player stays in the same chunk
+	bool Move(const WorldMap& world, const sVector2& vPos, std::vector<sChunkCoord>& vSend, std::vector<sChunkCoord>& vEvict)
+	{
+		sChunkCoord center = world.ChunkAt(vPos);
+		if (m_bCentered && center == m_center)
+			return false;
+
+		m_center = center;
+		m_bCentered = true;
+
+		for (auto it = m_setHeld.begin(); it != m_setHeld.end();)
+		{
+			sChunkCoord coord = sChunkCoord::FromKey(*it);
+			if (ChunkDistance(coord, center) > EVICT_RADIUS)
+			{
+				vEvict.push_back(coord);
+				it = m_setHeld.erase(it);
+			}
+			else
+				++it;
+		}
+
+		for (int32_t nRing = 0; nRing <= STREAM_RADIUS; nRing++)
+		{
+			for (int32_t dy = -nRing; dy <= nRing; dy++)
+			{
+				for (int32_t dx = -nRing; dx <= nRing; dx++)
+				{
+					sChunkCoord coord = { center.x + dx, center.y + dy };
+					if (std::max(std::abs(dx), std::abs(dy)) == nRing && world.Contains(coord) && m_setHeld.insert(coord.Key()).second)
+						vSend.push_back(coord);
+				}
+			}
+		}
+		return !vSend.empty() || !vEvict.empty();
+	}
+
+	size_t Held() const
+	{
+		return m_setHeld.size();
+	}
+
+	// Chunk keys, see sChunkCoord::Key(). Restoring them has the next Move() send only the chunks missing from them
+	const std::unordered_set<uint64_t>& HeldKeys() const
+	{
+		return m_setHeld;
+	}
+
+	void Restore(std::unordered_set<uint64_t> setHeld)
+	{
+		m_setHeld = std::move(setHeld);
+		m_bCentered = false;
+	}
+
+private:
+	std::unordered_set<uint64_t> m_setHeld;
+	sChunkCoord m_center;
+	bool m_bCentered = false;
+};
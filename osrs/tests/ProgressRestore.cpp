@@ -0,0 +1,149 @@
+#include "../server/Server.h"
+
+/// <summary>
+/// Checks that saved progress survives a server restart. A player registers with a Server that has no sockets and
+/// mines some ore, the server is shut down, and a new one started on the same data directory. A client resuming
+/// with the player's ID and token must get the same player back with its ore and mining speed, and one with a wrong
+/// token must not. Everything the server sends is captured through a relay on the null transport connection.
+/// Exits with 0 if every check passed.
+/// </summary>
+
+static const char* DATA_DIRECTORY = "progress_test_data";
+
+struct sTestClient
+{
+	std::shared_ptr<tfg::net::connection<GameMsg>> connection;
+	std::vector<tfg::net::message<GameMsg>> vReceived;
+
+	sTestClient(Server& server, uint32_t nConnectionID)
+	{
+		connection = server.AddNullConnection(nConnectionID);
+		connection->SetRelay([this](const tfg::net::message<GameMsg>& msg) { vReceived.push_back(msg); }, []() {});
+	}
+
+	// The ID and token of the last Client_AssignID we were sent
+	bool AssignedID(uint32_t& nID, uint64_t& nToken) const
+	{
+		for (auto it = vReceived.rbegin(); it != vReceived.rend(); ++it)
+		{
+			if (it->header.id != GameMsg::Client_AssignID)
+				continue;
+			tfg::net::message<GameMsg> msg = *it;
+			msg >> nID >> nToken;
+			return true;
+		}
+		return false;
+	}
+
+	// The player with that ID as the last roster snapshot we were sent has it
+	bool RosterPlayer(uint32_t nID, sPlayerDescription& desc) const
+	{
+		for (auto it = vReceived.rbegin(); it != vReceived.rend(); ++it)
+		{
+			if (it->header.id != GameMsg::Game_RosterSnapshot)
+				continue;
+			tfg::net::message<GameMsg> msg = *it;
+			uint32_t nCount = 0;
+			msg >> nCount;
+			for (uint32_t i = 0; i < nCount; i++)
+			{
+				msg >> desc;
+				if (desc.nUniqueID == nID)
+					return true;
+			}
+			return false;
+		}
+		return false;
+	}
+};
+
+static int nFailures = 0;
+
+static void Check(bool bPassed, const std::string& sWhat)
+{
+	std::cout << (bPassed ? "[PASS] " : "[FAIL] ") << sWhat << "\n";
+	if (!bPassed)
+		nFailures++;
+}
+
+static tfg::net::message<GameMsg> Registration(const sPlayerDescription& desc)
+{
+	tfg::net::message<GameMsg> msg;
+	msg.header.id = GameMsg::Client_RegisterWithServer;
+	msg << uint32_t(0);
+	msg << desc;
+	return msg;
+}
+
+static tfg::net::message<GameMsg> Resumption(const sPlayerDescription& desc, uint32_t nID, uint64_t nToken)
+{
+	tfg::net::message<GameMsg> msg = Registration(desc);
+	msg.header.id = GameMsg::Client_ResumeSession;
+	msg << nToken;
+	msg << nID;
+	return msg;
+}
+
+int main()
+{
+	std::error_code ec;
+	std::filesystem::remove_all(DATA_DIRECTORY, ec);
+
+	sPlayerDescription desc;
+	desc.vPos = { 60.0f, 200.0f };
+	desc.fMiningSpeed = 1.0f;
+	desc.nOreCount = 0;
+
+	uint32_t nID = 0;
+	uint64_t nToken = 0;
+	{
+		Server server(DATA_DIRECTORY);
+		sTestClient client(server, 10000);
+		server.InjectMessage(client.connection, Registration(desc));
+		server.Update();
+		Check(client.AssignedID(nID, nToken) && nToken != 0, "registered player is assigned an ID and token");
+
+		sPlayerDescription descMined = desc;
+		descMined.nUniqueID = nID;
+		descMined.nOreCount = 42;
+		descMined.fMiningSpeed = 1.5f;
+		tfg::net::message<GameMsg> msgUpdate;
+		msgUpdate.header.id = GameMsg::Game_UpdatePlayer;
+		msgUpdate << descMined;
+		server.InjectMessage(client.connection, msgUpdate);
+		server.Update();
+
+		// Shutting down writes the final snapshot
+	}
+
+	{
+		Server server(DATA_DIRECTORY);
+
+		sTestClient stranger(server, 20000);
+		server.InjectMessage(stranger.connection, Resumption(desc, nID, nToken + 1));
+		server.Update();
+		uint32_t nStrangerID = 0;
+		uint64_t nStrangerToken = 0;
+		Check(stranger.AssignedID(nStrangerID, nStrangerToken) && nStrangerID != nID, "wrong token registers a new player");
+
+		sTestClient client(server, 20001);
+		server.InjectMessage(client.connection, Resumption(desc, nID, nToken));
+		server.Update();
+
+		uint32_t nRestoredID = 0;
+		uint64_t nRestoredToken = 0;
+		Check(client.AssignedID(nRestoredID, nRestoredToken) && nRestoredID == nID && nRestoredToken == nToken,
+			"player resuming after the restart gets its ID and token back");
+
+		sPlayerDescription descRestored;
+		Check(client.RosterPlayer(nID, descRestored) && descRestored.nOreCount == 42 && descRestored.fMiningSpeed == 1.5f,
+			"client is sent the player with its saved ore and mining speed");
+
+		auto it = server.m_mapPlayerRoster.find(nID);
+		Check(it != server.m_mapPlayerRoster.end() && it->second.nOreCount == 42, "server roster has the saved ore");
+	}
+
+	std::filesystem::remove_all(DATA_DIRECTORY, ec);
+	std::cout << (nFailures == 0 ? "All checks passed\n" : std::to_string(nFailures) + " checks failed\n");
+	return nFailures == 0 ? 0 : 1;
+}